@@ -0,0 +1,387 @@
+#pragma once
+
+#include <stdint.h>
+
+// Keeps calibration up to date while racing.
+//
+// Two things are tracked from the smoothed rssi: the noise floor, the median
+// of the samples outside of crossings, and the distribution of pass peaks,
+// their median and a low quantile. From those suggestTriggers() places the
+// enter and leave triggers between the floor and the weaker passes, so a
+// pilot swapping VTX power or antenna doesn't have to recalibrate by hand.
+//
+// Quantiles are streamed with the P² algorithm (Jain and Chlamtac, 1985),
+// five markers each whatever the number of observations. Heights are Q8
+// fixed point, no floats as the ESP32-C3 has no FPU. P² never forgets, so
+// every estimator starts over each window and answers from the previous
+// window until the current one has seen half of it, a drift shows after at
+// most one and a half windows.
+//
+// Passes the detector misses because their peak dropped below the enter
+// trigger still count: outside of crossings, an excursion of at least
+// ADAPTIVE_MIN_SPAN above the noise floor that gets ADAPTIVE_MISSED_MIN_PERCENT
+// of the way up to the median peak is taken as a missed pass, so lower peaks
+// pull the triggers down instead of going unnoticed.
+
+// Samples skipped between two noise floor observations, 250Hz at 2kHz.
+#ifndef ADAPTIVE_NOISE_DECIMATION
+#define ADAPTIVE_NOISE_DECIMATION 8
+#endif
+
+// Noise floor observations per window, 16s at 250Hz.
+#ifndef ADAPTIVE_NOISE_WINDOW
+#define ADAPTIVE_NOISE_WINDOW 4096
+#endif
+
+// Passes per window.
+#ifndef ADAPTIVE_PEAK_WINDOW
+#define ADAPTIVE_PEAK_WINDOW 16
+#endif
+
+// Passes before anything is suggested.
+#ifndef ADAPTIVE_MIN_PASSES
+#define ADAPTIVE_MIN_PASSES 4
+#endif
+
+// The weaker passes, in 1/1000.
+#ifndef ADAPTIVE_LOW_PEAK_PER_MILLE
+#define ADAPTIVE_LOW_PEAK_PER_MILLE 100
+#endif
+
+// Triggers, in percent of the way from the noise floor to the low peak.
+#ifndef ADAPTIVE_ENTER_PERCENT
+#define ADAPTIVE_ENTER_PERCENT 75
+#endif
+
+#ifndef ADAPTIVE_LEAVE_PERCENT
+#define ADAPTIVE_LEAVE_PERCENT 45
+#endif
+
+// Passes have to stand out this much from the noise floor.
+#ifndef ADAPTIVE_MIN_SPAN
+#define ADAPTIVE_MIN_SPAN 16
+#endif
+
+// Excursions lower than this, in percent of the way from the noise floor to
+// the median peak, aren't missed passes, e.g. a quad flying by.
+#ifndef ADAPTIVE_MISSED_MIN_PERCENT
+#define ADAPTIVE_MISSED_MIN_PERCENT 30
+#endif
+
+// Suggestions closer than this to the current triggers, in percent of the
+// peak, aren't worth applying.
+#ifndef ADAPTIVE_APPLY_TOLERANCE_PERCENT
+#define ADAPTIVE_APPLY_TOLERANCE_PERCENT 3
+#endif
+
+enum AdaptiveMode : uint8_t {
+  ADAPTIVE_OFF,
+  // Estimate and suggest, settings are only changed on request.
+  ADAPTIVE_SUGGEST,
+  // Apply suggestions by itself between heats.
+  ADAPTIVE_AUTO,
+};
+
+// One quantile of a stream by P². Observations per estimator are limited to
+// 65535, see WindowedQuantile.
+class P2Quantile {
+ public:
+  explicit P2Quantile(uint16_t perMille = 500) : perMille_(perMille) {}
+
+  void reset() { count_ = 0; }
+
+  void add(uint16_t value) {
+    int32_t x = (int32_t)value << 8;
+
+    // The first five are kept sorted, they become the markers.
+    if (count_ < 5) {
+      uint8_t i = count_;
+      while (i > 0 && height_[i - 1] > x) {
+        height_[i] = height_[i - 1];
+        i--;
+      }
+      height_[i] = x;
+      count_++;
+      for (uint8_t j = 0; j < 5; j++) {
+        pos_[j] = j;
+      }
+      return;
+    }
+
+    uint8_t k;
+    if (x < height_[0]) {
+      height_[0] = x;
+      k = 0;
+    } else if (x >= height_[4]) {
+      height_[4] = x;
+      k = 3;
+    } else {
+      k = 0;
+      while (x >= height_[k + 1]) {
+        k++;
+      }
+    }
+    for (uint8_t i = k + 1; i < 5; i++) {
+      pos_[i]++;
+    }
+    count_++;
+
+    // Desired marker positions are (count - 1) * {0, p/2, p, (1+p)/2, 1},
+    // kept in 1/2000 so they stay integers.
+    const int32_t desired[5] = {0, perMille_, 2 * perMille_,
+                                1000 + perMille_, 2000};
+    for (uint8_t i = 1; i < 4; i++) {
+      int32_t d = (int32_t)(count_ - 1) * desired[i] - pos_[i] * 2000;
+      if ((d >= 2000 && pos_[i + 1] - pos_[i] > 1) ||
+          (d <= -2000 && pos_[i - 1] - pos_[i] < -1)) {
+        int8_t s = d > 0 ? 1 : -1;
+        int32_t height = parabolic(i, s);
+        if (height <= height_[i - 1] || height >= height_[i + 1]) {
+          height = linear(i, s);
+        }
+        height_[i] = height;
+        pos_[i] += s;
+      }
+    }
+  }
+
+  // The estimate, 0 before the first observation.
+  uint16_t value() const {
+    if (count_ == 0) {
+      return 0;
+    }
+    // Exact while the markers are still the observations themselves.
+    uint8_t i = count_ < 5 ? ((count_ - 1) * perMille_ + 500) / 1000 : 2;
+    return (uint16_t)((height_[i] + 128) >> 8);
+  }
+
+  uint32_t count() const { return count_; }
+
+ private:
+  int32_t parabolic(uint8_t i, int8_t s) const {
+    int64_t left = pos_[i] - pos_[i - 1];
+    int64_t right = pos_[i + 1] - pos_[i];
+    int64_t a = (left + s) * (height_[i + 1] - height_[i]) / right;
+    int64_t b = (right - s) * (height_[i] - height_[i - 1]) / left;
+    return height_[i] + (int32_t)(s * (a + b) / (left + right));
+  }
+
+  int32_t linear(uint8_t i, int8_t s) const {
+    return height_[i] +
+           s * (height_[i + s] - height_[i]) / (pos_[i + s] - pos_[i]);
+  }
+
+  // Marker heights in Q8, and their positions, 0 based.
+  int32_t height_[5] = {};
+  int32_t pos_[5] = {};
+  uint32_t count_ = 0;
+  uint16_t perMille_;
+};
+
+// A P2Quantile that follows drift, see the top of this file.
+class WindowedQuantile {
+ public:
+  WindowedQuantile(uint16_t perMille, uint16_t window)
+      : current_(perMille), previous_(perMille), window_(window) {}
+
+  void reset() {
+    current_.reset();
+    previous_.reset();
+  }
+
+  void add(uint16_t value) {
+    if (current_.count() >= window_) {
+      previous_ = current_;
+      current_.reset();
+    }
+    current_.add(value);
+  }
+
+  uint16_t value() const {
+    return current_.count() >= window_ / 2 || previous_.count() == 0
+               ? current_.value()
+               : previous_.value();
+  }
+
+  // Observations the estimate is based on.
+  uint32_t count() const {
+    return current_.count() >= window_ / 2
+               ? current_.count()
+               : current_.count() + previous_.count();
+  }
+
+ private:
+  P2Quantile current_;
+  P2Quantile previous_;
+  uint16_t window_;
+};
+
+struct AdaptiveEstimate {
+  uint16_t noiseFloor = 0;
+  // Median pass peak.
+  uint16_t peak = 0;
+  // ADAPTIVE_LOW_PEAK_PER_MILLE quantile of the pass peaks.
+  uint16_t lowPeak = 0;
+  uint32_t samples = 0;
+  uint32_t passes = 0;
+  // Excursions taken as missed passes, since the last reset.
+  uint32_t missedPasses = 0;
+};
+
+// Settings as the /api/v1/settings fields.
+struct AdaptiveSuggestion {
+  uint16_t rssiPeak = 0;
+  uint16_t enterRssiOffset = 0;
+  uint16_t leaveRssiOffset = 0;
+};
+
+class AdaptiveCalibration {
+ public:
+  AdaptiveCalibration()
+      : noiseFloor_(500, ADAPTIVE_NOISE_WINDOW),
+        peak_(500, ADAPTIVE_PEAK_WINDOW),
+        lowPeak_(ADAPTIVE_LOW_PEAK_PER_MILLE, ADAPTIVE_PEAK_WINDOW) {}
+
+  void reset() {
+    noiseFloor_.reset();
+    peak_.reset();
+    lowPeak_.reset();
+    skipped_ = 0;
+    floor_ = 0;
+    excursion_ = EXCURSION_NONE;
+    missedPasses_ = 0;
+  }
+
+  // Every smoothed sample, crossing as the detector sees it.
+  void addSample(uint16_t rssi, bool crossing) {
+    if (crossing) {
+      // The detector has it, the peak comes through addPass().
+      excursion_ = EXCURSION_DETECTED;
+      return;
+    }
+
+    if (++skipped_ >= ADAPTIVE_NOISE_DECIMATION) {
+      skipped_ = 0;
+      noiseFloor_.add(rssi);
+      floor_ = noiseFloor_.value();
+    }
+    if (noiseFloor_.count() < 5) {
+      return;
+    }
+
+    // Excursions end halfway down, so noise doesn't split them.
+    switch (excursion_) {
+      case EXCURSION_NONE:
+        if (rssi >= floor_ + ADAPTIVE_MIN_SPAN) {
+          excursion_ = EXCURSION_MISSED;
+          excursionPeak_ = rssi;
+        }
+        break;
+
+      case EXCURSION_MISSED:
+        if (rssi > excursionPeak_) {
+          excursionPeak_ = rssi;
+        }
+        if (rssi < floor_ + ADAPTIVE_MIN_SPAN / 2) {
+          excursion_ = EXCURSION_NONE;
+          addMissedPass(excursionPeak_);
+        }
+        break;
+
+      case EXCURSION_DETECTED:
+        if (rssi < floor_ + ADAPTIVE_MIN_SPAN / 2) {
+          excursion_ = EXCURSION_NONE;
+        }
+        break;
+    }
+  }
+
+  // The smoothed peak of every detected pass.
+  void addPass(uint16_t rssiPeak) {
+    peak_.add(rssiPeak);
+    lowPeak_.add(rssiPeak);
+  }
+
+  AdaptiveEstimate estimate() const {
+    AdaptiveEstimate estimate;
+    estimate.noiseFloor = noiseFloor_.value();
+    estimate.peak = peak_.value();
+    estimate.lowPeak = lowPeak_.value();
+    estimate.samples = noiseFloor_.count();
+    estimate.passes = peak_.count();
+    estimate.missedPasses = missedPasses_;
+    return estimate;
+  }
+
+ private:
+  enum Excursion : uint8_t {
+    EXCURSION_NONE,
+    // Above the noise floor without the detector crossing.
+    EXCURSION_MISSED,
+    // What is left of a detected pass.
+    EXCURSION_DETECTED,
+  };
+
+  void addMissedPass(uint16_t rssiPeak) {
+    if (peak_.count() == 0) {
+      return;
+    }
+    uint16_t peak = peak_.value();
+    if (peak <= floor_ || rssiPeak < floor_ + (uint32_t)(peak - floor_) *
+                                                   ADAPTIVE_MISSED_MIN_PERCENT /
+                                                   100) {
+      return;
+    }
+    missedPasses_++;
+    addPass(rssiPeak);
+  }
+
+  WindowedQuantile noiseFloor_;
+  WindowedQuantile peak_;
+  WindowedQuantile lowPeak_;
+  uint8_t skipped_ = 0;
+  uint16_t floor_ = 0;
+  Excursion excursion_ = EXCURSION_NONE;
+  uint16_t excursionPeak_ = 0;
+  uint32_t missedPasses_ = 0;
+};
+
+// Offset, in percent of peak, that puts the trigger at trigger. Rounded, the
+// way updateRssiTrigger() turns it back into a trigger.
+inline uint16_t adaptiveOffset(uint16_t peak, uint16_t trigger) {
+  return trigger >= peak ? 0 : ((peak - trigger) * 100 + peak / 2) / peak;
+}
+
+// Returns false if there isn't enough to go on yet.
+inline bool suggestTriggers(const AdaptiveEstimate &estimate,
+                            AdaptiveSuggestion &suggestion) {
+  if (estimate.passes < ADAPTIVE_MIN_PASSES || estimate.samples < 5 ||
+      estimate.lowPeak < estimate.noiseFloor + ADAPTIVE_MIN_SPAN) {
+    return false;
+  }
+
+  uint32_t span = estimate.lowPeak - estimate.noiseFloor;
+  uint16_t enter = estimate.noiseFloor + span * ADAPTIVE_ENTER_PERCENT / 100;
+  uint16_t leave = estimate.noiseFloor + span * ADAPTIVE_LEAVE_PERCENT / 100;
+
+  suggestion.rssiPeak = estimate.peak;
+  suggestion.enterRssiOffset = adaptiveOffset(estimate.peak, enter);
+  suggestion.leaveRssiOffset = adaptiveOffset(estimate.peak, leave);
+  return true;
+}
+
+// Whether the suggestion moves a trigger by more than
+// ADAPTIVE_APPLY_TOLERANCE_PERCENT of the peak.
+inline bool adaptiveSuggestionDiffers(uint16_t enterRssiTrigger,
+                                      uint16_t leaveRssiTrigger,
+                                      const AdaptiveSuggestion &suggestion) {
+  int32_t peak = suggestion.rssiPeak;
+  int32_t enter = peak - peak * suggestion.enterRssiOffset / 100;
+  int32_t leave = peak - peak * suggestion.leaveRssiOffset / 100;
+  int32_t tolerance = peak * ADAPTIVE_APPLY_TOLERANCE_PERCENT / 100;
+
+  int32_t enterDelta = enter - enterRssiTrigger;
+  int32_t leaveDelta = leave - leaveRssiTrigger;
+  return enterDelta > tolerance || enterDelta < -tolerance ||
+         leaveDelta > tolerance || leaveDelta < -tolerance;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+// Time-division schedule for one receiver shared by several pilots.
+//
+// The receiver stays on each channel for dwellMicros, then moves to the next
+// one round-robin. With a single channel it never hops. The hopper only
+// decides when and where to tune; the caller tunes the receiver and throws
+// away samples taken while it settles. Deterministic given the timestamps
+// passed in, so it can be driven by a simulated receiver on the host.
+//
+// Each pilot gets roughly
+//   sampleRate * (dwellMicros - settleMicros) / dwellMicros / count
+// samples per second, in bursts every count * dwellMicros.
+
+#define RX_MAX_CHANNELS 8
+
+// Default time on each channel when hopping.
+#ifndef RX_HOP_DWELL_MICROS
+#define RX_HOP_DWELL_MICROS 15000
+#endif
+
+// Default settle time after each hop. Lower than RX5808_SETTLE_MICROS, as
+// hopping can't afford it, the rssi filter on the module decides how low
+// this can go.
+#ifndef RX_HOP_SETTLE_MICROS
+#define RX_HOP_SETTLE_MICROS 5000
+#endif
+
+struct ChannelConfig {
+  uint16_t frequencies[RX_MAX_CHANNELS] = {0};
+  uint8_t count = 0;
+  uint32_t dwellMicros = RX_HOP_DWELL_MICROS;
+  uint32_t settleMicros = RX_HOP_SETTLE_MICROS;
+};
+
+class ChannelHopper {
+ public:
+  // Takes effect at the next due() check, starting from channel 0.
+  void configure(const ChannelConfig &config) {
+    config_ = config;
+    if (config_.count > RX_MAX_CHANNELS) {
+      config_.count = RX_MAX_CHANNELS;
+    }
+    channel_ = 0;
+    retunePending_ = config_.count > 0;
+  }
+
+  // True when the receiver has to be tuned to the next frequency now.
+  bool due(uint64_t now) const {
+    return retunePending_ || (config_.count > 1 && now >= hopAt_);
+  }
+
+  // Moves to the channel that is due and returns its frequency.
+  uint16_t advance(uint64_t now) {
+    if (!retunePending_) {
+      channel_ = (channel_ + 1) % config_.count;
+    }
+    retunePending_ = false;
+    hopAt_ = now + config_.dwellMicros;
+    return config_.frequencies[channel_];
+  }
+
+  // The channel the receiver is on, index into the configured frequencies.
+  uint8_t channel() const { return channel_; }
+  uint16_t frequency() const { return config_.frequencies[channel_]; }
+
+  uint8_t count() const { return config_.count; }
+  bool hopping() const { return config_.count > 1; }
+  const ChannelConfig &config() const { return config_; }
+
+ private:
+  ChannelConfig config_;
+  uint8_t channel_ = 0;
+  bool retunePending_ = false;
+  uint64_t hopAt_ = 0;
+};
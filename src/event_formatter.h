@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gate_sync.h"
+#include "heat_session.h"
+#include "pass_history.h"
+
+// Event payloads built in a buffer the caller owns, on the stack or
+// preallocated, never on the heap: no String, no printf. Integers are
+// written in decimal by hand.
+//
+// What doesn't fit is dropped whole, a number is never cut in half, and
+// truncated() tells. The buffer is always terminated.
+//
+// No Arduino dependency, so this builds on the host as well.
+
+// Writes value in decimal without a terminator, returns its length. out
+// needs 20 bytes.
+inline size_t writeDecimal(char *out, uint64_t value) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  for (size_t i = 0; i < n; i++) {
+    out[i] = digits[n - 1 - i];
+  }
+  return n;
+}
+
+class EventWriter {
+ public:
+  // size includes the terminator, at least 1.
+  EventWriter(char *out, size_t size) : out_(out), size_(size) { out_[0] = 0; }
+
+  EventWriter &text(const char *s) { return text(s, strlen(s)); }
+
+  EventWriter &text(const char *s, size_t len) {
+    if (reserve(len)) {
+      memcpy(out_ + length_, s, len);
+      commit(len);
+    }
+    return *this;
+  }
+
+  EventWriter &put(char c) {
+    if (reserve(1)) {
+      out_[length_] = c;
+      commit(1);
+    }
+    return *this;
+  }
+
+  EventWriter &decimal(uint64_t value) {
+    char digits[20];
+    return text(digits, writeDecimal(digits, value));
+  }
+
+  // A space separated field, the space left out at the start. Dropped with
+  // its space if it doesn't fit.
+  EventWriter &field(uint64_t value) {
+    char digits[21];
+    size_t n = 0;
+    if (length_ > 0) {
+      digits[n++] = ' ';
+    }
+    n += writeDecimal(digits + n, value);
+    return text(digits, n);
+  }
+
+  const char *c_str() const { return out_; }
+  size_t length() const { return length_; }
+  bool truncated() const { return truncated_; }
+
+ private:
+  bool reserve(size_t len) {
+    if (truncated_ || len >= size_ - length_) {
+      truncated_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  void commit(size_t len) {
+    length_ += len;
+    out_[length_] = 0;
+  }
+
+  char *out_;
+  size_t size_;
+  size_t length_ = 0;
+  bool truncated_ = false;
+};
+
+// Longest newtime message, without terminator.
+#define PASS_MESSAGE_SIZE 112
+
+// The newtime message:
+// "<lap> <interval ms> <peak> <ts ms> <detected ts us> <ts us> [channel]"
+// Appended to out, which needs PASS_MESSAGE_SIZE more bytes.
+inline EventWriter &formatPassMessage(EventWriter &out,
+                                      const PassRecord &record) {
+  const PassEvent &pass = record.pass;
+  out.decimal(pass.lap);
+  out.put(' ').decimal(pass.interval / 1000);
+  out.put(' ').decimal(pass.rssiPeak);
+  // The peak timestamp will be the initial timestamp of next timing round.
+  out.put(' ').decimal(pass.timeStamp / 1000);
+  out.put(' ').decimal(pass.detectedTimeStamp);
+  // Same as the ms timestamp, with microsecond resolution.
+  out.put(' ').decimal(pass.timeStamp);
+
+  // Older clients only read the first five fields.
+  if (record.channelCount > 1) {
+    out.put(' ').decimal(record.channel);
+  }
+  return out;
+}
+
+// A pass of any timer taking part in gate sync, ours included:
+// "<timer id> <lap> <ts us> <detected ts us> <peak> <channel> <synced>"
+// Times in micros of the shared clock when synced.
+inline EventWriter &formatGatePass(EventWriter &out, const GatePass &pass) {
+  return out.field(pass.id)
+      .field(pass.lap)
+      .field(pass.timeStamp)
+      .field(pass.detectedTimeStamp)
+      .field(pass.rssiPeak)
+      .field(pass.channel)
+      .field(pass.synced);
+}
+
+// A lap of the running heat, with the pilot's statistics after it:
+// "<heat> <channel> <lap> <lap us> <best us> <best lap> <mean us>
+// <stddev us> <best consecutive us>"
+// Lap 0 is the holeshot, its time is from the start.
+inline EventWriter &formatHeatLap(EventWriter &out, uint32_t heat,
+                                  uint8_t channel, uint32_t lap,
+                                  uint32_t lapTime, const LapStats &stats) {
+  return out.field(heat)
+      .field(channel)
+      .field(lap)
+      .field(lapTime)
+      .field(stats.best())
+      .field(stats.bestLap())
+      .field(stats.mean())
+      .field(stats.stddev())
+      .field(stats.bestConsecutive());
+}
@@ -2,33 +2,1353 @@
 
 AsyncWebServer server(80);
 AsyncEventSource events("/events");
+// Binary frames, see ws_protocol.h. /events stays for older clients.
+AsyncWebSocket ws("/ws");
 
-void commitEeprom() {
+// Sends to every /events client, id 0 takes the next event id.
+void sendEvent(const char *message, const char *event, uint32_t id = 0) {
+  MetricTimer timer(metrics.eventsSend);
+  events.send(message, event, id ? id : nextEventId());
+}
+
+// Settings are written later, after they stopped changing, so callers in
+// the timing path never wait on flash.
+void saveSettings() { settingsStore.markDirty(millis()); }
+
+void flushSettings() {
+#ifdef DEV_MODE
+  Serial.println("Write settings.");
+#endif
+
+  MetricTimer timer(metrics.settingsFlush);
+  if (!settingsStore.save(settings)) {
+    Serial.println("Failed to write settings.");
+  }
+}
+
+volatile bool settingsUpdated = false;
+volatile uint64_t lastSettingsUpdateTime = 0;
+
+// Hands the current settings and state to detection in one piece, call after
+// changing anything in DetectionConfig.
+void publishDetectionConfig() {
+  detectionConfigLock.lock();
+
+  DetectionConfig config;
+  config.detector.enterRssiTrigger = state.enterRssiTrigger;
+  config.detector.leaveRssiTrigger = state.leaveRssiTrigger;
+  config.detector.filterRatio = settings.filterRatio;
+  config.detector.minLapTimeMicros = MIN_LAP_TIME_MICROS;
+  // Use lower trigger for leave when in calibration mode.
+  config.calibrationLeaveRssiTrigger =
+      state.leaveRssiTrigger -
+      (CALIBRATION_LEAVE_RSSI_FACTOR - 1) * settings.leaveRssiOffset;
+  config.calibrationMode = state.calibrationMode;
+  config.calibrationStartMicros = state.calibrationStartMicros;
+  config.logRssi = settings.logRssi;
+  config.adaptiveMode = settings.adaptiveMode;
+  // Other timers may be looking.
+  config.running = state.clientConnected || settings.gateSync;
+  detectionConfig.store(config);
+
+  detectionConfigLock.unlock();
+}
+
+// Detection starts with the first client.
+void setClientConnected() {
+  if (!state.clientConnected) {
+    state.clientConnected = true;
+    publishDetectionConfig();
+  }
+}
+
+void updateRssiTrigger() {
+  state.enterRssiTrigger =
+      settings.rssiPeak * (1.0 - settings.enterRssiOffset / 100.0);
+  state.leaveRssiTrigger =
+      settings.rssiPeak * (1.0 - settings.leaveRssiOffset / 100.0);
+
+#ifdef DEV_MODE
+  // NOTE: have to use %d instead of %s here to avoid crashing.
+  Serial.printf_P("peak: %d, enter: %d, leave: %d, filter: %d \n", settings.rssiPeak,
+                  state.enterRssiTrigger, state.leaveRssiTrigger, settings.filterRatio);
+#endif
+
+  invalidateSettingsJson();
+  settingsUpdated = true;
+  publishDetectionConfig();
+}
+
+// A buffer that is sent to every /ws client, NULL if nobody is listening.
+AsyncWebSocketMessageBuffer *wsFrameBuffer(size_t len) {
+  if (ws.count() == 0) {
+    return NULL;
+  }
+  return ws.makeBuffer(len);
+}
+
+// Copies a frame once into a buffer shared by all /ws clients.
+void wsBroadcast(const uint8_t *frame, size_t len) {
+  AsyncWebSocketMessageBuffer *buffer = wsFrameBuffer(len);
+  if (!buffer) {
+    return;
+  }
+
+  memcpy(buffer->get(), frame, len);
+  ws.binaryAll(buffer);
+}
+
+void wsSendPass(const PassEvent &pass, uint8_t channel) {
+  WsPass frame;
+  frame.channel = channel;
+  frame.lap = pass.lap;
+  frame.timeStamp = pass.timeStamp;
+  frame.interval = pass.interval;
+  frame.rssiPeak = pass.rssiPeak;
+  frame.rssiPeakRaw = pass.rssiPeakRaw;
+  frame.detectedTimeStamp = pass.detectedTimeStamp;
+
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  wsBroadcast(buffer, encodeWsPass(buffer, frame));
+}
+
+size_t encodeWsSettingsFrame(uint8_t *out) {
+  WsSettings frame;
+  frame.vtxFreq = settings.vtxFreq;
+  frame.rssiPeak = settings.rssiPeak;
+  frame.enterRssiOffset = settings.enterRssiOffset;
+  frame.leaveRssiOffset = settings.leaveRssiOffset;
+  frame.filterRatio = settings.filterRatio;
+  frame.logRssi = settings.logRssi;
+  frame.id = settings.id;
+  frame.channelCount = state.channelCount;
+  return encodeWsSettings(out, frame);
+}
+
+void wsSendSettings() {
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  wsBroadcast(buffer, encodeWsSettingsFrame(buffer));
+}
+
+void wsSendCalibration(bool calibrating, uint64_t timeStamp) {
+  WsCalibration frame;
+  frame.calibrating = calibrating;
+  frame.timeStamp = timeStamp;
+
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  wsBroadcast(buffer, encodeWsCalibration(buffer, frame));
+}
+
+// batch is the binary rssi log, see rssi_telemetry.h.
+void wsSendRssi(uint16_t rssi, uint64_t timeStamp, const uint8_t *batch,
+                size_t batchSize) {
+  AsyncWebSocketMessageBuffer *buffer =
+      wsFrameBuffer(WS_RSSI_HEADER_SIZE + batchSize);
+  if (!buffer) {
+    return;
+  }
+
+  encodeWsRssiHeader(buffer->get(), timeStamp, rssiLogInterval, rssi);
+  memcpy(buffer->get() + WS_RSSI_HEADER_SIZE, batch, batchSize);
+  ws.binaryAll(buffer);
+}
+
+// Detection side, runs in the detection task, or in loop() on single core
+// chips. Touches the detectors and the rssi log, and hands everything to be
+// sent to loop() through detectionEvents and rssiReports.
+
+// The config detection runs with, and the version it was published as.
+DetectionConfig detection;
+uint32_t detectionConfigVersion = 0;
+
+// Whether calibrating, detection ends it without waiting on loop().
+bool calibrating = false;
+// How many passes has done in calibration mode.
+uint8_t calibrationPasses = 0;
+// The highest rssi seen in calibration, and how much of it loop() knows.
+uint16_t calibrationPeak = 0;
+uint16_t reportedCalibrationPeak = 0;
+uint64_t calibrationStartSeen = 0;
+
+uint32_t channelsGenerationSeen = 0;
+
+// Channels with a quad in or close to the gate, a bit each.
+uint8_t nearChannels = 0;
+// Whether there is any, loop() holds off flash writes meanwhile.
+volatile bool quadNear = false;
+
+// Flash writes stall both cores, the sampler too. They wait while a quad is
+// near or detection is behind on samples.
+bool detectionBusy() {
+  return quadNear || rssiSamples.size() > RSSI_SAMPLE_BUFFER_SIZE / 4;
+}
+
+uint64_t lastAdaptivePublishTime = 0;
+
+void applyDetectorConfig() {
+  LapDetectorConfig config = detection.detector;
+  if (calibrating) {
+    config.leaveRssiTrigger = detection.calibrationLeaveRssiTrigger;
+  }
+  for (uint8_t i = 0; i < RX_MAX_CHANNELS; i++) {
+    lapDetectors[i].setConfig(config);
+  }
+}
+
+// Picks up what was published since the last call. One caught in the middle
+// of being published is picked up next time.
+void loadDetectionConfig() {
+  uint32_t version = detectionConfig.version();
+  if (version == detectionConfigVersion ||
+      !detectionConfig.tryLoad(detection)) {
+    return;
+  }
+  detectionConfigVersion = version;
+
+  if (detection.calibrationStartMicros != calibrationStartSeen) {
+    calibrationStartSeen = detection.calibrationStartMicros;
+    calibrating = detection.calibrationMode;
+    calibrationPasses = 0;
+    calibrationPeak = 0;
+    reportedCalibrationPeak = 0;
+  }
+  applyDetectorConfig();
+}
+
+void pushDetectionEvent(DetectionEventType type, uint8_t channel,
+                        uint64_t timeStamp) {
+  DetectionEvent event;
+  event.type = type;
+  event.channel = channel;
+  event.rssiPeak = calibrationPeak;
+  event.timeStamp = timeStamp;
+  detectionEvents.push(event);
+}
+
+void publishAdaptiveEstimate(uint64_t timeStamp) {
+  DetectionEvent event;
+  event.type = DETECTION_ADAPTIVE;
+  event.timeStamp = timeStamp;
+  event.adaptive = adaptiveCalibration.estimate();
+  if (detectionEvents.push(event)) {
+    lastAdaptivePublishTime = timeStamp;
+  }
+}
+
+// Raw trace, the block being filled and the capture state detection acts on.
+RawTraceBlock rawTraceBlock;
+RawTraceBlockWriter rawTraceWriter;
+RawTraceState rawTraceStateSeen = TRACE_IDLE;
+// Set once the last block of a stopped capture is handed over.
+volatile bool rawTraceFlushed = false;
+
+void traceRssiSample(const RssiSample &sample) {
+  if (rawTraceWriter.add(sample.timeStamp, sample.rssiRaw, sample.channel)) {
+    return;
+  }
+
+  // Full, a block lost to a busy loop() only leaves a gap.
+  rawTraceBlocks.push(rawTraceBlock);
+  rawTraceWriter.begin(rawTraceBlock.data);
+  rawTraceWriter.add(sample.timeStamp, sample.rssiRaw, sample.channel);
+}
+
+// Runs the filter, calibration, logging and crossing detection on one sample.
+void processRssiSample(const RssiSample &sample) {
+  if (rawTraceStateSeen == TRACE_CAPTURING) {
+    traceRssiSample(sample);
+  }
+
+  uint64_t previousLoopTimestamp = state.lastLoopTimeStamp;
+  state.lastLoopTimeStamp = sample.timeStamp;
+  state.loopTime = state.lastLoopTimeStamp - previousLoopTimestamp;
+
+  LapDetector &detector = lapDetectors[sample.channel];
+  bool wasCrossing = detector.crossing();
+  PassEvent pass;
+  bool passed = detector.addSample(sample.timeStamp, sample.rssiRaw, pass);
+  uint16_t rssi = detector.rssi();
+
+  if (detector.crossing() || rssi > detector.config().leaveRssiTrigger) {
+    nearChannels |= 1 << sample.channel;
+  } else {
+    nearChannels &= ~(1 << sample.channel);
+  }
+
+  // Measure peaks, only measure when in calibration mode. loop() stores the
+  // peak, until it got it the report is retried on every sample. Settings
+  // hold one rssiPeak for all channels, so calibration, manual or adaptive,
+  // follows the first channel when hopping, like the rssi log.
+  if (calibrating && sample.channel == 0) {
+    if (rssi > calibrationPeak) {
+      calibrationPeak = rssi;
+    }
+    if (calibrationPeak > reportedCalibrationPeak) {
+      DetectionEvent event;
+      event.type = DETECTION_CALIBRATION_PEAK;
+      event.channel = sample.channel;
+      event.rssiPeak = calibrationPeak;
+      event.timeStamp = sample.timeStamp;
+      if (detectionEvents.push(event)) {
+        reportedCalibrationPeak = calibrationPeak;
+      }
+    }
+  }
+  // Measure end.
+
+  if (detection.adaptiveMode != ADAPTIVE_OFF && sample.channel == 0) {
+    adaptiveCalibration.addSample(rssi, detector.crossing());
+    if (passed) {
+      adaptiveCalibration.addPass(pass.rssiPeak);
+    }
+    if (passed || sample.timeStamp - lastAdaptivePublishTime >
+                      ADAPTIVE_PUBLISH_INTERVAL_MICROS) {
+      publishAdaptiveEstimate(sample.timeStamp);
+    }
+  }
+
+
+  // START: RSSI logging, of the first channel when hopping.
+  if (sample.channel == 0) {
+    if (detection.logRssi && state.lastLoopTimeStamp - lastRssiLogTime > rssiLogInterval) {
+      state.rssiLog.add(rssi);
+      lastRssiLogTime = state.lastLoopTimeStamp;
+    }
+
+    if (state.lastLoopTimeStamp - lastRssiSendTime > rssiSendInterval) {
+      RssiReport report;
+      report.timeStamp = state.lastLoopTimeStamp;
+      report.rssi = rssi;
+      report.sampleInterval = state.loopTime;
+      report.log = state.rssiLog;
+
+      // If loop() is behind, the log keeps growing until the next try.
+      if (rssiReports.push(report)) {
+        state.rssiLog.clear();
+      }
+      lastRssiSendTime = state.lastLoopTimeStamp;
+    }
+  }
+  // END: RSSI logging.
+
+
+  if (!wasCrossing && detector.crossing()) {
+    pushDetectionEvent(DETECTION_CROSSING, sample.channel, sample.timeStamp);
+  }
+
+  if (!passed) {
+    return;
+  }
+
+  DetectionEvent event;
+  event.type = DETECTION_PASS;
+  event.channel = sample.channel;
+  event.timeStamp = sample.timeStamp;
+  event.pass = pass;
+  detectionEvents.push(event);
+
+  if (calibrating && sample.channel == 0) {
+    calibrationPasses += 1;
+
+    if (calibrationPasses >= CALIBRATION_PASSES &&
+        (state.lastLoopTimeStamp - calibrationStartSeen >
+         CALIBRATION_MIN_TIME_MICROS)) {
+      calibrating = false;
+      applyDetectorConfig();
+      pushDetectionEvent(DETECTION_CALIBRATION_ENDED, sample.channel,
+                         state.lastLoopTimeStamp);
+    }
+  }
+}
+
+// Drains everything the sampler queued since the last call.
+void runDetection() {
+  // Settings may have changed from a request handler, pick them up between
+  // batches.
+  loadDetectionConfig();
+
+  // If no client has connected, drop samples nobody is going to look at.
+  if (!detection.running) {
+    rssiSamples.clear();
+    quadNear = false;
+    return;
+  }
+
+  uint32_t generation = channelsGeneration;
+  if (generation != channelsGenerationSeen) {
+    channelsGenerationSeen = generation;
+    for (uint8_t i = 0; i < RX_MAX_CHANNELS; i++) {
+      lapDetectors[i].reset();
+    }
+    nearChannels = 0;
+    // Other frequencies, other noise floor and peaks.
+    adaptiveCalibration.reset();
+  }
+
+  RawTraceState traceState = rawTraceState;
+  if (traceState != rawTraceStateSeen) {
+    rawTraceStateSeen = traceState;
+    if (traceState == TRACE_CAPTURING) {
+      rawTraceWriter.begin(rawTraceBlock.data);
+    } else if (traceState == TRACE_STOPPING) {
+      if (rawTraceWriter.count() > 0) {
+        rawTraceBlocks.push(rawTraceBlock);
+      }
+      rawTraceFlushed = true;
+    }
+  }
+
+  RssiSample batch[RSSI_SAMPLE_BATCH_SIZE];
+  size_t count;
+  while ((count = rssiSamples.popBatch(batch, RSSI_SAMPLE_BATCH_SIZE)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      processRssiSample(batch[i]);
+    }
+  }
+  quadNear = nearChannels != 0;
+}
+
+#if DETECTION_TASK
+TaskHandle_t detectionTask = NULL;
+
+void detectionTaskMain(void *arg) {
+  startRssiSampler();
+
+  for (;;) {
+    waitRssiSampler();
+    sampleRssi();
+
+    if (rssiSamples.size() >= DETECTION_TASK_BATCH_SIZE) {
+      runDetection();
+    }
+  }
+}
+
+// Sampling and detection get a core of their own.
+void startDetection() {
+  xTaskCreatePinnedToCore(detectionTaskMain, "detection",
+                          DETECTION_TASK_STACK_SIZE, NULL,
+                          DETECTION_TASK_PRIORITY, &detectionTask,
+                          DETECTION_CORE);
+}
+#else
+void startDetection() { startRssiSampler(); }
+#endif
+
+
+// Network side, loop().
+
+unsigned long lastMetricsSendMillis = 0;
+bool firstSampleReported = false;
+
+uint32_t minFreeHeap() {
+#if defined(ESP8266)
+  return metrics.minFreeHeap;
+#else
+  return ESP.getMinFreeHeap();
+#endif
+}
+
+// Histograms in /api/v1/metrics, by JSON and Prometheus name.
+struct HistogramMetric {
+  const char *name;
+  const char *promName;
+  const Histogram &histogram;
+};
+
+const HistogramMetric histogramMetrics[] = {
+    {"sampleInterval", "fpvsim_sample_interval_micros", metrics.sampleInterval},
+    {"eventsSend", "fpvsim_events_send_micros", metrics.eventsSend},
+    {"settingsFlush", "fpvsim_settings_flush_micros", metrics.settingsFlush},
+    {"setRxModule", "fpvsim_set_rx_module_micros", metrics.setRxModule},
+    {"settingsJson", "fpvsim_settings_json_micros", metrics.settingsJson},
+    {"gatePassLatency", "fpvsim_gate_pass_latency_micros",
+     metrics.gatePassLatency},
+};
+
+// Gauges and counters in /api/v1/metrics.
+struct ValueMetric {
+  const char *name;
+  const char *promName;
+  const char *promType;
+  uint32_t value;
+};
+
+// Returns how many were written into out.
+size_t readValueMetrics(ValueMetric *out) {
+  size_t n = 0;
+  out[n++] = {"missedSamples", "fpvsim_missed_samples_total", "counter",
+              metrics.missedSamples.value()};
+  out[n++] = {"droppedSamples", "fpvsim_dropped_samples_total", "counter",
+              rssiSamples.dropped()};
+  out[n++] = {"droppedDetectionEvents", "fpvsim_dropped_detection_events_total",
+              "counter", detectionEvents.dropped()};
+  out[n++] = {"freeHeap", "fpvsim_free_heap_bytes", "gauge", ESP.getFreeHeap()};
+  out[n++] = {"minFreeHeap", "fpvsim_min_free_heap_bytes", "gauge",
+              minFreeHeap()};
+  out[n++] = {"bootToFirstSampleMicros", "fpvsim_boot_to_first_sample_micros",
+              "gauge", (uint32_t)firstSampleMicros};
+  out[n++] = {"wifiAttempts", "fpvsim_wifi_attempts_total", "counter",
+              wifiConnection.attempts()};
+  out[n++] = {"sseClients", "fpvsim_sse_clients", "gauge",
+              (uint32_t)events.count()};
+  out[n++] = {"sseQueueDepth", "fpvsim_sse_queue_depth", "gauge",
+              (uint32_t)events.avgPacketsWaiting()};
+  out[n++] = {"sampleQueueDepth", "fpvsim_sample_queue_depth", "gauge",
+              (uint32_t)rssiSamples.size()};
+  GateSyncStatus gate = gateSync.status(micros64());
+  out[n++] = {"gateSyncErrorMicros", "fpvsim_gate_sync_error_micros", "gauge",
+              gate.errorMicros};
+  out[n++] = {"gatePassesLost", "fpvsim_gate_passes_lost_total", "counter",
+              gate.passesLost};
+#if DETECTION_TASK
+  out[n++] = {"detectionStackFree", "fpvsim_detection_stack_free_bytes",
+              "gauge", (uint32_t)uxTaskGetStackHighWaterMark(detectionTask)};
+#endif
+  return n;
+}
+
+#define VALUE_METRICS_MAX 14
+
+// One for loop(), one for request handlers.
+char metricsEventJson[1024];
+char metricsResponseJson[1024];
+
+// Compact JSON, for the endpoint and the metrics event.
+const char *metricsToJson(char *out, size_t size) {
+  size_t n = 0;
+  n += snprintf(out + n, size - n, "{");
+
+  for (size_t i = 0;
+       i < sizeof(histogramMetrics) / sizeof(histogramMetrics[0]); i++) {
+    const Histogram &h = histogramMetrics[i].histogram;
+    n += snprintf(out + n, size - n,
+                  "\"%s\":{\"count\":%u,\"sum\":%u,\"p50\":%u,\"p99\":%u,"
+                  "\"max\":%u},",
+                  histogramMetrics[i].name, (unsigned)h.count(),
+                  (unsigned)h.sum(), (unsigned)h.percentile(500),
+                  (unsigned)h.percentile(990), (unsigned)h.max());
+  }
+
+  ValueMetric values[VALUE_METRICS_MAX];
+  size_t count = readValueMetrics(values);
+  for (size_t i = 0; i < count; i++) {
+    n += snprintf(out + n, size - n, "\"%s\":%u%s", values[i].name,
+                  (unsigned)values[i].value, i + 1 < count ? "," : "}");
+  }
+
+  return out;
+}
+
+// Prometheus text format, histograms as summaries.
+void metricsToPrometheus(AsyncResponseStream *response) {
+  for (size_t i = 0;
+       i < sizeof(histogramMetrics) / sizeof(histogramMetrics[0]); i++) {
+    const char *name = histogramMetrics[i].promName;
+    const Histogram &h = histogramMetrics[i].histogram;
+    response->printf("# TYPE %s summary\n", name);
+    response->printf("%s{quantile=\"0.5\"} %u\n", name,
+                     (unsigned)h.percentile(500));
+    response->printf("%s{quantile=\"0.99\"} %u\n", name,
+                     (unsigned)h.percentile(990));
+    response->printf("%s{quantile=\"1\"} %u\n", name, (unsigned)h.max());
+    response->printf("%s_sum %u\n", name, (unsigned)h.sum());
+    response->printf("%s_count %u\n", name, (unsigned)h.count());
+  }
+
+  ValueMetric values[VALUE_METRICS_MAX];
+  size_t count = readValueMetrics(values);
+  for (size_t i = 0; i < count; i++) {
+    response->printf("# TYPE %s %s\n%s %u\n", values[i].promName,
+                     values[i].promType, values[i].promName,
+                     (unsigned)values[i].value);
+  }
+}
+
+void sendRssiReport(const RssiReport &report) {
+  // "<rssi> <timestamp> <log interval micros> <base64 rssi log>"
+  EventWriter msg(rssiMsg, sizeof(rssiMsg));
+  msg.field(report.rssi).field(report.timeStamp).field(rssiLogInterval);
+  msg.put(' ');
+  size_t batchSize = encodeRssiBatchBinary(report.log, rssiBatchScratch);
+  base64Encode(rssiBatchScratch, batchSize, rssiMsg + msg.length());
+
+#ifdef DEV_MODE
+  Serial.print("RSSI:");
+  Serial.println(rssiMsg);
+  Serial.print("Sample interval micros: ");
+  Serial.println(report.sampleInterval);
+#endif
+  sendEvent(rssiMsg, "rssi");
+  wsSendRssi(report.rssi, report.timeStamp, rssiBatchScratch, batchSize);
+}
+
+// See formatGatePass().
+void sendGatePass(const GatePass &pass) {
+  char buffer[96];
+  EventWriter msg(buffer, sizeof(buffer));
+  sendEvent(formatGatePass(msg, pass).c_str(), "gatepass");
+}
+
+// See formatHeatLap().
+void sendHeatLap(uint32_t heat, uint8_t channel, uint32_t lap,
+                 uint32_t lapTime, const LapStats &stats) {
+  char buffer[128];
+  EventWriter msg(buffer, sizeof(buffer));
+  formatHeatLap(msg, heat, channel, lap, lapTime, stats);
+  sendEvent(msg.c_str(), "heatlap");
+}
+
+// "started|stopped <heat> <ts us>"
+void sendHeatEvent(const char *what, uint32_t heat, uint64_t timeStamp) {
+  char buffer[48];
+  EventWriter msg(buffer, sizeof(buffer));
+  msg.text(what).field(heat).field(timeStamp);
+  Serial.print(">>>> Heat ");
+  Serial.println(buffer);
+  sendEvent(buffer, "heat");
+}
+
+// Counts the pass towards the running heat, if any.
+void addHeatPass(const PassEvent &pass, uint8_t channel) {
+  uint32_t lap = 0;
+  uint32_t heat = 0;
+  uint32_t lapTime = 0;
+  LapStats stats;
+
+  heatLock.lock();
+  bool added = heatSession.addPass(channel, pass.timeStamp, lap);
+  if (added) {
+    // Copied, the event goes out without holding the lock.
+    const HeatPilot<HEAT_MAX_LAPS> &pilot = heatSession.pilot(channel);
+    heat = heatSession.heat();
+    lapTime = lap == 0 ? pilot.holeshot() : pilot.stats().last();
+    stats = pilot.stats();
+  }
+  heatLock.unlock();
+
+  if (added) {
+    sendHeatLap(heat, channel, lap, lapTime, stats);
+  }
+}
+
+void sendPass(const PassEvent &pass, uint8_t channel) {
+  PassRecord record;
+  record.id = nextEventId();
+  record.channel = channel;
+  record.channelCount = state.channelCount;
+  record.pass = pass;
+  passHistory.append(record);
+
+  char buffer[PASS_MESSAGE_SIZE + 1];
+  EventWriter msg(buffer, sizeof(buffer));
+  formatPassMessage(msg, record);
+
+#if DETECTION_SERIAL_ECHO
+  // Not printf, which takes the heap for long lines.
+  Serial.print("Crossing = False >>>>>> ");
+  Serial.println(buffer);
+#endif
+  sendEvent(buffer, "newtime", record.id);
+  wsSendPass(pass, channel);
+
+  if (gateSyncRunning) {
+    GatePass gatePass;
+    gatePass.channel = channel;
+    gatePass.lap = pass.lap;
+    gatePass.rssiPeak = pass.rssiPeak;
+    gatePass.timeStamp = pass.timeStamp;
+    gatePass.detectedTimeStamp = pass.detectedTimeStamp;
+    sendGatePass(gateSync.sendPass(gatePass, micros64()));
+  }
+
+  addHeatPass(pass, channel);
+}
+
+// Sized for a replay of the whole history.
+char passReplay[PASS_HISTORY_CAPACITY * (PASS_MESSAGE_SIZE + 48)];
+PassRecord passReplayRecords[PASS_HISTORY_CAPACITY];
+
+// Sends the passes a reconnecting client missed as one write, formatted as
+// AsyncEventSource would have.
+void replayPasses(AsyncEventSourceClient *client, uint32_t lastId) {
+  // Ids start over after a reboot, everything kept is new to the client.
+  if (lastId > lastEventId) {
+    lastId = 0;
+  }
+
+  size_t count =
+      passHistory.since(lastId, passReplayRecords, PASS_HISTORY_CAPACITY);
+  if (count == 0) {
+    return;
+  }
+
+  EventWriter replay(passReplay, sizeof(passReplay));
+  for (size_t i = 0; i < count; i++) {
+    replay.text("id: ").decimal(passReplayRecords[i].id);
+    replay.text("\r\nevent: newtime\r\ndata: ");
+    formatPassMessage(replay, passReplayRecords[i]);
+    replay.text("\r\n\r\n");
+  }
+
+  Serial.print("Replayed passes: ");
+  Serial.println(count);
+
+  client->write(passReplay, replay.length());
+}
+
+// Adaptive calibration, see adaptive_calibration.h. The latest estimate
+// from detection, and when a quad was last seen.
+AdaptiveEstimate adaptiveEstimate;
+uint64_t lastQuadSeenTime = 0;
+// Set once auto mode has had its look at the current quiet spell.
+bool adaptiveQuietHandled = true;
+// Suggestions applied since boot.
+uint32_t adaptiveApplied = 0;
+
+#define ADAPTIVE_JSON_SIZE 320
+
+// Returns out, which needs ADAPTIVE_JSON_SIZE bytes.
+const char *adaptiveToJson(char *out) {
+  AdaptiveEstimate estimate = adaptiveEstimate;
+  size_t n = snprintf(
+      out, ADAPTIVE_JSON_SIZE,
+      "{\"mode\":\"%s\",\"noiseFloor\":%u,\"peak\":%u,\"lowPeak\":%u,"
+      "\"samples\":%u,\"passes\":%u,\"missedPasses\":%u,\"applied\":%u,"
+      "\"suggestion\":",
+      adaptiveModeNames[settings.adaptiveMode], (unsigned)estimate.noiseFloor,
+      (unsigned)estimate.peak, (unsigned)estimate.lowPeak,
+      (unsigned)estimate.samples, (unsigned)estimate.passes,
+      (unsigned)estimate.missedPasses, (unsigned)adaptiveApplied);
+
+  AdaptiveSuggestion suggestion;
+  if (suggestTriggers(estimate, suggestion)) {
+    snprintf(out + n, ADAPTIVE_JSON_SIZE - n,
+             "{\"rssiPeak\":%u,\"enterRssiOffset\":%u,"
+             "\"leaveRssiOffset\":%u}}",
+             (unsigned)suggestion.rssiPeak,
+             (unsigned)suggestion.enterRssiOffset,
+             (unsigned)suggestion.leaveRssiOffset);
+  } else {
+    snprintf(out + n, ADAPTIVE_JSON_SIZE - n, "null}");
+  }
+  return out;
+}
+
+void applyAdaptiveSuggestion(const AdaptiveSuggestion &suggestion) {
+  settings.rssiPeak = suggestion.rssiPeak;
+  settings.enterRssiOffset = suggestion.enterRssiOffset;
+  settings.leaveRssiOffset = suggestion.leaveRssiOffset;
+  updateRssiTrigger();
+  saveSettings();
+  adaptiveApplied++;
+
+  char json[ADAPTIVE_JSON_SIZE];
+  adaptiveToJson(json);
+  Serial.print("Applied adaptive calibration: ");
+  Serial.println(json);
+  sendEvent(json, "adaptive");
+}
+
+// In auto mode, applies the suggestion once per quiet spell, if it moves the
+// triggers enough. Never during a manual calibration.
+void runAdaptiveCalibration() {
+  if (settings.adaptiveMode != ADAPTIVE_AUTO || state.calibrationMode ||
+      adaptiveQuietHandled ||
+      micros64() - lastQuadSeenTime < ADAPTIVE_APPLY_QUIET_MICROS) {
+    return;
+  }
+  adaptiveQuietHandled = true;
+
+  AdaptiveSuggestion suggestion;
+  if (suggestTriggers(adaptiveEstimate, suggestion) &&
+      adaptiveSuggestionDiffers(state.enterRssiTrigger,
+                                state.leaveRssiTrigger, suggestion)) {
+    applyAdaptiveSuggestion(suggestion);
+  }
+}
+
+void handleDetectionEvent(const DetectionEvent &event) {
+  switch (event.type) {
+    case DETECTION_CROSSING:
+#if DETECTION_SERIAL_ECHO
+      Serial.println("Crossing = True");
+#endif
+      lastQuadSeenTime = event.timeStamp;
+      adaptiveQuietHandled = false;
+      break;
+
+    case DETECTION_PASS:
+      sendPass(event.pass, event.channel);
+      lastQuadSeenTime = event.timeStamp;
+      adaptiveQuietHandled = false;
+      break;
+
+    case DETECTION_ADAPTIVE:
+      adaptiveEstimate = event.adaptive;
+      break;
+
+    case DETECTION_CALIBRATION_PEAK:
+      // Calibration may have been restarted since.
+      if (state.calibrationMode && event.rssiPeak > settings.rssiPeak) {
+        settings.rssiPeak = event.rssiPeak;
+        updateRssiTrigger();
+        saveSettings();
+      }
+      break;
+
+    case DETECTION_CALIBRATION_ENDED:
+      state.calibrationMode = false;
+      publishDetectionConfig();
+      sendEvent("ended", "calibration");
+      wsSendCalibration(false, event.timeStamp);
+
+#ifdef DEV_MODE
+      Serial.println(">>>> Calibration done");
+#endif
+      break;
+  }
+}
+
+RawTraceBlock rawTraceWriteBlock;
+
+// Writes the trace blocks detection filled, and finishes a stopped capture.
+void writeRawTrace() {
+  while (rawTraceBlocks.pop(rawTraceWriteBlock)) {
+    if (!rawTrace.append(rawTraceWriteBlock.data)) {
+      Serial.println("Failed to write trace block.");
+    }
+  }
+
+  if (rawTraceState == TRACE_STOPPING && rawTraceFlushed &&
+      rawTraceBlocks.size() == 0) {
+    rawTraceState = TRACE_IDLE;
+
+    Serial.print("Trace captured, blocks: ");
+    Serial.println(rawTrace.blockCount());
+  }
+}
+
+// Downloads in progress, a new capture waits for them. Handlers only.
+uint8_t rawTraceDownloads = 0;
+
+// Where one download is, owned by its response.
+struct RawTraceDownload {
+  RawTraceDownload() { rawTraceDownloads++; }
+  ~RawTraceDownload() { rawTraceDownloads--; }
+
+  uint8_t block[RAW_TRACE_BLOCK_SIZE];
+  uint32_t blockIndex = UINT32_MAX;
+};
+
+// Fills out with the download from byte index on, returns how many bytes,
+// 0 at the end.
+size_t readRawTrace(RawTraceDownload &download, uint8_t *out, size_t maxLen,
+                    size_t index) {
+  if (index >= rawTrace.downloadSize()) {
+    return 0;
+  }
+
+  if (index < RAW_TRACE_HEADER_SIZE) {
+    RawTraceFileHeader header;
+    header.magic = RAW_TRACE_MAGIC;
+    header.version = RAW_TRACE_VERSION;
+    header.blockSize = RAW_TRACE_BLOCK_SIZE;
+    header.blockCount = rawTrace.blockCount();
+    header.sampleRateHz = RSSI_SAMPLE_RATE_HZ;
+
+    uint8_t encoded[RAW_TRACE_HEADER_SIZE];
+    encodeRawTraceHeader(encoded, header);
+    size_t n = min(maxLen, (size_t)RAW_TRACE_HEADER_SIZE - index);
+    memcpy(out, encoded + index, n);
+    return n;
+  }
+
+  size_t offset = index - RAW_TRACE_HEADER_SIZE;
+  uint32_t block = offset / RAW_TRACE_BLOCK_SIZE;
+  size_t within = offset % RAW_TRACE_BLOCK_SIZE;
+  if (block != download.blockIndex) {
+    if (!rawTrace.readBlock(block, download.block)) {
+      return 0;
+    }
+    download.blockIndex = block;
+  }
+
+  size_t n = min(maxLen, (size_t)RAW_TRACE_BLOCK_SIZE - within);
+  memcpy(out, download.block + within, n);
+  return n;
+}
+
+const char *rawTraceStatusJson() {
+  static const char *kStates[] = {"idle", "capturing", "stopping"};
+  static char json[96];
+  snprintf(json, sizeof(json),
+           "{\"state\":\"%s\",\"blocks\":%u,\"capacity\":%u}",
+           kStates[rawTraceState], (unsigned)rawTrace.blockCount(),
+           (unsigned)rawTrace.capacity());
+  return json;
+}
+
+// Sends out whatever detection queued.
+void sendDetections() {
+  DetectionEvent event;
+  while (detectionEvents.pop(event)) {
+    handleDetectionEvent(event);
+  }
+
+  RssiReport report;
+  while (rssiReports.pop(report)) {
+    sendRssiReport(report);
+  }
+}
+
+// " <mhz> <rssi>" per frequency, after the header.
+#define SPECTRUM_MESSAGE_SIZE (48 + SPECTRUM_MAX_POINTS * 11)
+
+char spectrumMsg[SPECTRUM_MESSAGE_SIZE];
+
+// Sends a finished sweep, all of it in one event:
+// "<start ts us> <sweep us> <retunes> <count> <mhz> <rssi> <mhz> <rssi> ..."
+void sendSpectrum() {
+  if (spectrumScanRefused) {
+    spectrumScanRefused = false;
+    state.scanning = false;
+    Serial.println("Spectrum scan refused, no frequencies.");
+  }
+
+  SpectrumResult result;
+  if (!spectrumResults.pop(result)) {
+    return;
+  }
+
+  EventWriter msg(spectrumMsg, sizeof(spectrumMsg));
+  msg.field(result.startTime)
+      .field(result.sweepMicros)
+      .field(result.retunes)
+      .field(result.count);
+  for (uint16_t i = 0; i < result.count; i++) {
+    msg.field(result.points[i].frequency).field(result.points[i].rssi);
+  }
+  sendEvent(spectrumMsg, "spectrum");
+
+  spectrumLock.lock();
+  lastSpectrum = result;
+  spectrumLock.unlock();
+  state.scanning = false;
+
+  Serial.print("Spectrum scanned, micros: ");
+  Serial.println(result.sweepMicros);
+}
+
+// Tells us from another timer with the same id, never 0.
+uint32_t gateSyncNonce() { return 1 + random(0x7FFFFFFF); }
+
+// Starts and stops with the setting and the router connection, and handles
+// whatever other timers sent.
+void runGateSync() {
+  bool wanted = settings.gateSync && wifiConnection.state() == WIFI_CONNECTED;
+  if (wanted != gateSyncRunning) {
+    gateSyncRunning = wanted;
+    if (wanted) {
+      gateTransport.udp.begin(GATE_SYNC_PORT);
+      gateSync.begin(settings.id, micros64(), gateSyncNonce());
+      // Modem sleep holds packets back until the next beacon.
+      WiFi.setSleep(false);
+      Serial.println("Gate sync started.");
+    } else {
+      gateTransport.udp.stop();
+      Serial.println("Gate sync stopped.");
+    }
+  }
+  if (!gateSyncRunning) {
+    return;
+  }
+
+  while (gateTransport.udp.parsePacket() > 0) {
+    uint8_t packet[GATE_SYNC_MAX_PACKET_SIZE];
+    int len = gateTransport.udp.read(packet, sizeof(packet));
+    uint64_t now = micros64();
+    GatePass pass;
+    if (len <= 0 ||
+        !gateSync.receive(packet, len, (uint32_t)gateTransport.udp.remoteIP(),
+                          now, pass)) {
+      continue;
+    }
+
+    if (pass.synced && gateSync.synced()) {
+      // Below 0 if the clocks are off by more than the network delay.
+      int64_t latency = (int64_t)(gateSync.toShared(now) - pass.sentTimeStamp);
+      metrics.gatePassLatency.record(latency > 0 ? (uint32_t)latency : 0);
+    }
+    sendGatePass(pass);
+  }
+
+  if (gateSync.idCollision()) {
+    // Another timer has our id, neither would hear the other.
+    settings.id = gateSync.freeId(random(GATE_MAX_TIMERS));
+    saveSettings();
+    invalidateSettingsJson();
+    settingsUpdated = true;
+    gateSync.begin(settings.id, micros64(), gateSyncNonce());
+
+    Serial.print("Timer id taken, now: ");
+    Serial.println(settings.id);
+  }
+
+  gateSync.update(micros64());
+}
+
+#if OTA_THROTTLED
+const char *otaStateNames[] = {"idle", "receiving", "writing", "done",
+                               "failed"};
+
+unsigned long lastOtaEventMillis = 0;
+// When the upload last made progress.
+unsigned long lastOtaDataMillis = 0;
+uint32_t lastOtaReceived = 0;
+
+// Progress of the last upload. The sample gap is the longest since it
+// started, the flash operation the longest it took.
+const char *otaToJson() {
+  static char json[192];
+  snprintf(json, sizeof(json),
+           "{\"state\":\"%s\",\"written\":%u,\"received\":%u,"
+           "\"size\":%u,\"longestFlashMicros\":%u,"
+           "\"longestSampleGapMicros\":%u}",
+           otaStateNames[otaPipeline.state()], (unsigned)otaPipeline.written(),
+           (unsigned)otaPipeline.received(), (unsigned)otaUploadSize,
+           (unsigned)otaThrottle.longestMicros(),
+           (unsigned)sampleIntervalPeak);
+  return json;
+}
+
+// Queues as much of data as fits, returns how much. Under otaLock.
+size_t queueOta(const uint8_t *data, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    size_t n = len - pos < OTA_CHUNK_SIZE ? len - pos : OTA_CHUNK_SIZE;
+    if (!otaPipeline.push(data + pos, n)) {
+      break;
+    }
+    pos += n;
+  }
+  return pos;
+}
+
+// Under otaLock.
+void respondOta() {
+  bool ok = otaPipeline.state() == OTA_DONE;
+  AsyncWebServerResponse *response = otaRequest->beginResponse(
+      ok ? 200 : 500, "text/plain", ok ? "OK" : "FAIL");
+  response->addHeader("Connection", "close");
+  otaRequest->send(response);
+
+  otaRequest = NULL;
+  otaResponsePending = false;
+}
+
+// Moves the backlog on as the queue drains, lets TCP go on once it is
+// gone, and answers the request once the upload is written.
+void feedOta() {
+  otaLock.lock();
+
+  if (otaPipeline.state() == OTA_RECEIVING) {
+    otaBacklogStart += queueOta(otaBacklog + otaBacklogStart,
+                                otaBacklogEnd - otaBacklogStart);
+  }
+  if (otaBacklogStart == otaBacklogEnd ||
+      otaPipeline.state() != OTA_RECEIVING) {
+    otaBacklogStart = otaBacklogEnd = 0;
+    if (otaAcksHeld && otaRequest) {
+      // Acks at most what was held back.
+      otaRequest->client()->ack(0xFFFF);
+    }
+    otaAcksHeld = false;
+    if (otaEndPending) {
+      otaEndPending = false;
+      otaPipeline.end(otaEndOk);
+    }
+  }
+
+  if (otaResponsePending && otaRequest && !otaPipeline.busy()) {
+    respondOta();
+  }
+
+  otaLock.unlock();
+}
+
+// Writes the upload a slice at a time, when detection can spare it: not
+// while a quad is near the gate, not while detection is catching up.
+void runOta() {
+  feedOta();
+  if (!otaPipeline.busy()) {
+    return;
+  }
+
+  uint32_t received = otaPipeline.received();
+  if (received != lastOtaReceived || lastOtaDataMillis == 0) {
+    lastOtaReceived = received;
+    lastOtaDataMillis = millis();
+  } else if (otaPipeline.state() == OTA_RECEIVING &&
+             millis() - lastOtaDataMillis > OTA_STALL_TIMEOUT_MILLIS) {
+    Serial.println("OTA upload stalled.");
+    otaLock.lock();
+    otaEndPending = false;
+    otaPipeline.end(false);
+    otaLock.unlock();
+  }
+
+  uint64_t now = micros64();
+  if (otaThrottle.due(now, detectionBusy()) && otaPipeline.step()) {
+    otaThrottle.ran(now, micros64());
+  }
+
+  bool finished = !otaPipeline.busy();
+  if (finished || millis() - lastOtaEventMillis > 1000) {
+    lastOtaEventMillis = millis();
+    sendEvent(otaToJson(), "ota");
+  }
+  if (finished) {
+    lastOtaDataMillis = 0;
+    Serial.print("OTA finished: ");
+    Serial.println(otaToJson());
+    if (otaPipeline.state() == OTA_DONE) {
+      // Boot the new image, or remount the new filesystem, once the
+      // request is answered.
+      shutdownMillis = millis();
+    }
+  }
+}
+
+// Queues the upload for runOta(). What doesn't fit waits in the backlog,
+// and TCP isn't acked meanwhile: the client holds off until flash caught
+// up, without the server waiting for it.
+void handleOtaUpload(AsyncWebServerRequest *request, const String &filename,
+                     size_t index, uint8_t *data, size_t len, bool final) {
+  otaLock.lock();
+
+  if (index == 0 && !otaPipeline.busy() &&
+      otaFlash.begin(filename == "filesystem") && otaPipeline.begin()) {
+    otaRequest = request;
+    otaBacklogStart = otaBacklogEnd = 0;
+    otaAcksHeld = false;
+    otaEndPending = false;
+    otaResponsePending = false;
+    otaUploadSize = request->contentLength();
+    otaExpectedMd5[0] = 0;
+    if (request->hasParam("MD5", true)) {
+      strncpy(otaExpectedMd5, request->getParam("MD5", true)->value().c_str(),
+              sizeof(otaExpectedMd5) - 1);
+      otaExpectedMd5[sizeof(otaExpectedMd5) - 1] = 0;
+    }
+    otaMd5.begin();
+    otaThrottle.reset();
+    sampleIntervalPeak = 0;
+
+    request->onDisconnect([request]() {
+      otaLock.lock();
+      if (request == otaRequest) {
+        otaRequest = NULL;
+        otaAcksHeld = false;
+        otaResponsePending = false;
+        // Cut off halfway. A complete upload is still written.
+        if (!otaEndPending) {
+          otaPipeline.end(false);
+        }
+      }
+      otaLock.unlock();
+    });
+
+    Serial.print(">>>> OTA upload of ");
+    Serial.println(filename);
+  }
+
+  if (request != otaRequest || otaPipeline.state() != OTA_RECEIVING ||
+      otaEndPending) {
+    otaLock.unlock();
+    return;
+  }
+
+  otaMd5.add(data, len);
+  size_t queued = otaBacklogStart == otaBacklogEnd ? queueOta(data, len) : 0;
+  if (queued < len) {
+    if (otaBacklogEnd + len - queued > OTA_BACKLOG_SIZE) {
+      Serial.println("OTA backlog overflowed.");
+      otaPipeline.end(false);
+      otaLock.unlock();
+      return;
+    }
+    memcpy(otaBacklog + otaBacklogEnd, data + queued, len - queued);
+    otaBacklogEnd += len - queued;
+    request->client()->ackLater();
+    otaAcksHeld = true;
+  }
+
+  if (final) {
+    otaMd5.calculate();
+    otaEndOk = otaExpectedMd5[0] == 0 ||
+               strcasecmp(otaExpectedMd5, otaMd5.toString().c_str()) == 0;
+    if (otaBacklogStart == otaBacklogEnd) {
+      otaPipeline.end(otaEndOk);
+    } else {
+      otaEndPending = true;
+    }
+  }
+
+  otaLock.unlock();
+}
+
+// After the upload. loop() answers once the last slices are written.
+void handleOtaRequest(AsyncWebServerRequest *request) {
+  otaLock.lock();
+  if (request == otaRequest) {
+    if (otaPipeline.busy()) {
+      otaResponsePending = true;
+    } else {
+      respondOta();
+    }
+    otaLock.unlock();
+    return;
+  }
+  otaLock.unlock();
+
+  AsyncWebServerResponse *response =
+      request->beginResponse(500, "text/plain", "FAIL");
+  response->addHeader("Connection", "close");
+  request->send(response);
+}
+#else
+void runOta() {}
+#endif
+
+void runNetwork() {
+  // // Necessary for ElegantOTA to handle reboot after OTA update.
+  // AsyncElegantOTA.loop();
+  
+  // Shutdown after 1s.
+  if (shutdownMillis != 0 && millis() - shutdownMillis > 1000) {
+    // Don't lose settings that are still waiting to be written.
+    if (settingsStore.dirty()) {
+      flushSettings();
+    }
+
+    // Restart the server.
+    ESP.restart();
+  }
+
+  // Writing flash stalls the sampler as well, so a due flush waits for
+  // detection to be idle, see SETTINGS_FLUSH_MAX_HOLD_MILLIS.
+  if (settingsStore.flushDue(millis(), detectionBusy())) {
+    flushSettings();
+  }
+
+  switch (wifiConnection.update(millis())) {
+    case WIFI_EVENT_CONNECTED:
+      strcpy(settings.localIp, WiFi.localIP().toString().c_str());
+      invalidateSettingsJson();
+      settingsUpdated = true;
+
+      Serial.println("Wifi is connected.");
+      printWifiInfo();
+      break;
+
+    case WIFI_EVENT_LOST:
 #ifdef DEV_MODE
-  Serial.println("Write EEPROM.");
+      Serial.println("Reconnecting to WiFi...");
 #endif
+      break;
 
-  EEPROM.put(0, settings);
-  EEPROM.commit();
-}
+    case WIFI_EVENT_FAILED:
+      Serial.print("Failed to connect to router, retrying in ms: ");
+      Serial.println(wifiConnection.backoffMillis());
+      break;
 
-volatile bool settingsUpdated = false;
-volatile uint64_t lastSettingsUpdateTime = 0;
+    case WIFI_EVENT_NONE:
+      break;
+  }
 
-void updateRssiTrigger() {
-  state.enterRssiTrigger =
-      settings.rssiPeak * (1.0 - settings.enterRssiOffset / 100.0);
-  state.leaveRssiTrigger =
-      settings.rssiPeak * (1.0 - settings.leaveRssiOffset / 100.0);
-  state.filterRatioFloat = settings.filterRatio / 1000.0f;
+  if (firstSampleMicros != 0 && !firstSampleReported) {
+    firstSampleReported = true;
+    Serial.print("Boot to first sample micros: ");
+    Serial.println((uint32_t)firstSampleMicros);
+  }
 
-#ifdef DEV_MODE
-  // NOTE: have to use %d instead of %s here to avoid crashing.
-  Serial.printf_P("peak: %d, enter: %d, leave: %d, filter: %d \n", settings.rssiPeak,
-                  state.enterRssiTrigger, state.leaveRssiTrigger, settings.filterRatio);
+  // Drops /ws clients that went away without closing.
+  ws.cleanupClients();
+
+  writeRawTrace();
+
+  runOta();
+
+  runGateSync();
+
+  // Sweeps don't need a client, they are for setting up.
+  if (state.scanRequested) {
+    state.scanRequested = false;
+    SpectrumScanConfig config = state.newScanConfig;
+    if (!spectrumRequests.push(config)) {
+      state.scanning = false;
+    }
+  }
+  sendSpectrum();
+
+#if defined(ESP8266)
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < metrics.minFreeHeap) {
+    metrics.minFreeHeap = freeHeap;
+  }
 #endif
 
-  settingsUpdated = true;
+  // If no client has connected, no need to loop.
+  if (!state.clientConnected) {
+    return;
+  }
+
+  if (state.channelsRequested) {
+    state.channelsRequested = false;
+
+    bool handedOver;
+    if (state.newChannelCount > 1) {
+      ChannelConfig config;
+      config.count = state.newChannelCount;
+      for (uint8_t i = 0; i < config.count; i++) {
+        config.frequencies[i] = state.newFrequencies[i];
+      }
+      config.dwellMicros = state.newDwellMicros;
+      config.settleMicros = state.newSettleMicros;
+      handedOver = setRxChannels(config);
+    } else {
+      handedOver = setRxModule(state.newVtxFreq);
+      if (handedOver) {
+        saveSettings();
+      }
+    }
+
+    // The sampler's queue is full, try again on the next loop(). A newer
+    // request in the meantime replaces this one.
+    if (!handedOver) {
+      state.channelsRequested = true;
+    }
+  }
+
+  uint64_t now = micros64();
+
+  // Two settings update has to be larger than 1s interval.
+  if (settingsUpdated && now - lastSettingsUpdateTime > 1000 * 1000) {
+    char json[SETTINGS_JSON_SIZE];
+    sendEvent(settingsToJson(json), "settings");
+    wsSendSettings();
+    lastSettingsUpdateTime = now;
+    settingsUpdated = false;
+  }
+
+  if (millis() - lastMetricsSendMillis >= METRICS_SEND_INTERVAL_MILLIS) {
+    sendEvent(metricsToJson(metricsEventJson, sizeof(metricsEventJson)),
+              "metrics");
+    lastMetricsSendMillis = millis();
+  }
+
+  runAdaptiveCalibration();
 }
 
 void initApSsidIfNeeded() {
@@ -40,8 +1360,65 @@ void initApSsidIfNeeded() {
   strcpy(settings.apSsid, "fpvsim- \0");
   settings.apSsid[7] = char('a' + settings.id); 
   settings.apPwd[0] = 0;
+  invalidateSettingsJson();
+
+  saveSettings();
+}
+
+const char *gateSyncToJson() {
+  static char json[320];
+  GateSyncStatus status = gateSync.status(micros64());
+  snprintf(json, sizeof(json),
+           "{\"enabled\":%s,\"running\":%s,\"id\":%u,\"leaderId\":%u,"
+           "\"synced\":%s,\"offsetMicros\":%lld,\"driftPpb\":%d,"
+           "\"errorMicros\":%u,\"exchanges\":%u,\"peers\":%u,"
+           "\"passesReceived\":%u,\"passesLost\":%u}",
+           settings.gateSync ? "true" : "false",
+           gateSyncRunning ? "true" : "false", (unsigned)settings.id,
+           (unsigned)status.leaderId, status.synced ? "true" : "false",
+           (long long)status.offsetMicros, (int)status.driftPpb,
+           (unsigned)status.errorMicros, (unsigned)status.exchanges,
+           (unsigned)status.peers, (unsigned)status.passesReceived,
+           (unsigned)status.passesLost);
+  return json;
+}
+
+// The current or last heat, so a display that joins late needs no history.
+// Lap times are of the last HEAT_MAX_LAPS laps, from firstKeptLap on.
+void heatToJson(AsyncResponseStream *response) {
+  heatLock.lock();
+  response->printf(
+      "{\n\"heat\":%u,\n\"running\":%s,\n\"startTime\":%llu,\n"
+      "\"stopTime\":%llu,\n\"consecutiveLaps\":%u,\n\"pilots\":[",
+      (unsigned)heatSession.heat(), heatSession.running() ? "true" : "false",
+      (unsigned long long)heatSession.startTime(),
+      (unsigned long long)heatSession.stopTime(),
+      (unsigned)HEAT_CONSECUTIVE_LAPS);
+
+  for (uint8_t i = 0; i < heatSession.pilotCount(); i++) {
+    const HeatPilot<HEAT_MAX_LAPS> &pilot = heatSession.pilot(i);
+    const LapStats &stats = pilot.stats();
+    response->printf(
+        "%s\n{\"channel\":%u,\"passes\":%u,\"holeshot\":%u,\"laps\":%u,"
+        "\"last\":%u,\"best\":%u,\"bestLap\":%u,\"mean\":%u,"
+        "\"stddev\":%u,\"bestConsecutive\":%llu,"
+        "\"bestConsecutiveLap\":%u,\"firstKeptLap\":%u,\"lapTimes\":[",
+        i > 0 ? "," : "", (unsigned)i, (unsigned)pilot.passes(),
+        (unsigned)pilot.holeshot(), (unsigned)stats.count(),
+        (unsigned)stats.last(), (unsigned)stats.best(),
+        (unsigned)stats.bestLap(), (unsigned)stats.mean(),
+        (unsigned)stats.stddev(),
+        (unsigned long long)stats.bestConsecutive(),
+        (unsigned)stats.bestConsecutiveLap(), (unsigned)pilot.firstKeptLap());
+    for (uint32_t lap = pilot.firstKeptLap(); lap <= stats.count(); lap++) {
+      response->printf("%s%u", lap > pilot.firstKeptLap() ? "," : "",
+                       (unsigned)pilot.lap(lap));
+    }
+    response->print("]}");
+  }
+  heatLock.unlock();
 
-  commitEeprom();
+  response->print("\n]\n}");
 }
 
 void setupServer() {
@@ -55,46 +1432,28 @@ void setupServer() {
     WiFi.softAP(settings.apSsid);
   }
 
-  // Begin WiFi
+  // Begin WiFi, connects in the background, see runNetwork().
   if (strlen(settings.routerSsid) > 0) {
-    WiFi.begin(settings.routerSsid, settings.routerPwd);
-
-    // Connecting to WiFi...
-    previousReconnectMillis = millis();
     Serial.print("Connecting to ");
-    Serial.print(settings.routerSsid);
-    int counter = 0;
-    while (WiFi.status() != WL_CONNECTED)
-    {
-      counter += 1;
-      delay(100);
-      Serial.print(".");
-      if (counter > 70) {
-        Serial.println("Failed to connect to router. Skipping.");
-        // This seems to improve network stability when WIFI failed.
-        WiFi.disconnect();
-        break;
-      }
-    }
+    Serial.println(settings.routerSsid);
+    wifiConnection.start(millis());
   }
 
-  // Connected to WiFi
-  Serial.println();
-  Serial.println("Connected!");
-  printWifiInfo();
-
-  // Dump network settings.
+  // Dump network settings, localIp is set once connected.
   strcpy(settings.localIp, WiFi.localIP().toString().c_str());
   strcpy(settings.apIp, WiFi.softAPIP().toString().c_str());
+  invalidateSettingsJson();
+  printWifiInfo();
 
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Private-Network", "*");
 
   // Settings.
   server.on("/api/v1/settings", HTTP_GET, [](AsyncWebServerRequest *request) {
-    state.clientConnected = true;
+    setClientConnected();
 
-    request->send(200, "text/json", settingsToJson().c_str());
+    char json[SETTINGS_JSON_SIZE];
+    request->send(200, "text/json", settingsToJson(json));
   });
 
   updateRssiTrigger();
@@ -127,12 +1486,14 @@ void setupServer() {
     }
 
     updateRssiTrigger();
-    commitEeprom();
+    saveSettings();
 
+    char json[SETTINGS_JSON_SIZE];
+    settingsToJson(json);
     Serial.print("Updated settings:");
-    Serial.println(settingsToJson().c_str());
+    Serial.println(json);
 
-    request->send(200, "text/json", settingsToJson().c_str());
+    request->send(200, "text/json", json);
   });
 
   server.on("/api/v1/wifisettings", HTTP_POST, [](AsyncWebServerRequest *request) {
@@ -149,13 +1510,16 @@ void setupServer() {
     strcpy(settings.routerPwd, request->getParam("routerPwd")->value().c_str());
     strcpy(settings.apSsid, request->getParam("apSsid")->value().c_str());
     strcpy(settings.apPwd, request->getParam("apPwd")->value().c_str());
+    invalidateSettingsJson();
 
-    commitEeprom();
+    saveSettings();
 
+    char json[SETTINGS_JSON_SIZE];
+    settingsToJson(json);
     Serial.print("Updated settings:");
-    Serial.println(settingsToJson().c_str());
+    Serial.println(json);
 
-    request->send(200, "text/json", settingsToJson().c_str());
+    request->send(200, "text/json", json);
 
     shutdownMillis = millis();
   });
@@ -165,17 +1529,128 @@ void setupServer() {
   // Somehow, PUT fails with CORS, POST works.
   server.on("/api/v1/start", HTTP_POST, [](AsyncWebServerRequest *request) {
     settings.rssiPeak = 0;
+    invalidateSettingsJson();
     state.calibrationMode = true;
-    state.calibrationPasses = 0;
-    state.calibrationStartMicros = micros();
+    state.calibrationStartMicros = micros64();
+    publishDetectionConfig();
 
     Serial.println(">>>> Start calibration");
 
-    events.send("started", "calibration", state.calibrationStartMicros);
-    request->send(200, "text/json", settingsToJson().c_str());
+    sendEvent("started", "calibration");
+    wsSendCalibration(true, state.calibrationStartMicros);
+    char json[SETTINGS_JSON_SIZE];
+    request->send(200, "text/json", settingsToJson(json));
+  });
+
+
+  // Adaptive calibration state and suggestion, see adaptive_calibration.h.
+  server.on("/api/v1/adaptive", HTTP_GET, [](AsyncWebServerRequest *request) {
+    char json[ADAPTIVE_JSON_SIZE];
+    request->send(200, "text/json", adaptiveToJson(json));
+  });
+
+  // mode=off|suggest|auto, persisted. apply=true applies the current
+  // suggestion right away.
+  server.on("/api/v1/adaptive", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (request->hasParam("mode")) {
+      const char *mode = request->getParam("mode")->value().c_str();
+      uint8_t i = 0;
+      while (i <= ADAPTIVE_AUTO && strcmp(mode, adaptiveModeNames[i]) != 0) {
+        i++;
+      }
+      if (i > ADAPTIVE_AUTO) {
+        request->send(400, "text/plain", "Invalid mode");
+        return;
+      }
+      settings.adaptiveMode = i;
+      invalidateSettingsJson();
+      saveSettings();
+      publishDetectionConfig();
+    }
+
+    if (request->hasParam("apply") &&
+        request->getParam("apply")->value() == "true") {
+      AdaptiveSuggestion suggestion;
+      if (!suggestTriggers(adaptiveEstimate, suggestion)) {
+        request->send(409, "text/plain", "No suggestion yet");
+        return;
+      }
+      applyAdaptiveSuggestion(suggestion);
+    }
+
+    char json[ADAPTIVE_JSON_SIZE];
+    request->send(200, "text/json", adaptiveToJson(json));
+  });
+
+
+  // Gate sync with other timers, see gate_sync.h. enabled=true|false,
+  // persisted.
+  server.on("/api/v1/gatesync", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/json", gateSyncToJson());
+  });
+
+  server.on("/api/v1/gatesync", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("enabled")) {
+      request->send(400, "text/plain", "Invalid params");
+      return;
+    }
+
+    settings.gateSync =
+        strcmp(request->getParam("enabled")->value().c_str(), "true") == 0;
+    invalidateSettingsJson();
+    saveSettings();
+    publishDetectionConfig();
+
+    request->send(200, "text/json", gateSyncToJson());
   });
 
 
+  // Heats, see heat_session.h. Every channel is a pilot.
+  server.on("/api/v1/heat", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("text/json");
+    heatToJson(response);
+    request->send(response);
+  });
+
+  // Starts a new heat now, the last one is dropped.
+  server.on("/api/v1/heat/start", HTTP_POST,
+            [](AsyncWebServerRequest *request) {
+              uint64_t now = micros64();
+              heatLock.lock();
+              heatSession.start(now, state.channelCount);
+              uint32_t heat = heatSession.heat();
+              heatLock.unlock();
+              // Passes only come with detection running.
+              setClientConnected();
+
+              sendHeatEvent("started", heat, now);
+
+              AsyncResponseStream *response =
+                  request->beginResponseStream("text/json");
+              heatToJson(response);
+              request->send(response);
+            });
+
+  server.on("/api/v1/heat/stop", HTTP_POST,
+            [](AsyncWebServerRequest *request) {
+              uint64_t now = micros64();
+              heatLock.lock();
+              bool running = heatSession.running();
+              heatSession.stop(now);
+              uint32_t heat = heatSession.heat();
+              heatLock.unlock();
+
+              if (running) {
+                sendHeatEvent("stopped", heat, now);
+              }
+
+              AsyncResponseStream *response =
+                  request->beginResponseStream("text/json");
+              heatToJson(response);
+              request->send(response);
+            });
+
+
   // Frequency.
   server.on("/api/v1/setFrequency", HTTP_POST,
             [](AsyncWebServerRequest *request) {
@@ -188,22 +1663,335 @@ void setupServer() {
               int frequency = std::atoi(p->value().c_str());
 
               state.newVtxFreq = frequency;
+              // Stops hopping, if it was.
+              state.newChannelCount = 1;
+              state.channelsRequested = true;
+
+              char json[SETTINGS_JSON_SIZE];
+              request->send(200, "text/json", settingsToJson(json));
+            });
+
+  // Hop across several frequencies, one pilot each, e.g.
+  // frequencies=5658,5695,5760,5800. Not persisted.
+  server.on("/api/v1/setFrequencies", HTTP_POST,
+            [](AsyncWebServerRequest *request) {
+              if (!request->hasParam("frequencies")) {
+                request->send(400, "text/plain", "No frequencies");
+                return;
+              }
+
+              // Checked in full before anything is handed to loop(), a
+              // refused request mustn't change one still pending.
+              uint16_t frequencies[RX_MAX_CHANNELS];
+              const char *p =
+                  request->getParam("frequencies")->value().c_str();
+              uint8_t count = 0;
+              while (*p) {
+                if (count == RX_MAX_CHANNELS) {
+                  request->send(400, "text/plain", "Too many frequencies");
+                  return;
+                }
+                // Outside of the band freqMhzToRegVal() gives garbage.
+                int frequency = std::atoi(p);
+                if (frequency < SPECTRUM_MIN_MHZ ||
+                    frequency > SPECTRUM_MAX_MHZ) {
+                  request->send(400, "text/plain", "Invalid frequencies");
+                  return;
+                }
+                frequencies[count++] = frequency;
+
+                p = strchr(p, ',');
+                if (!p) {
+                  break;
+                }
+                p++;
+              }
+
+              if (count == 0) {
+                request->send(400, "text/plain", "No frequencies");
+                return;
+              }
+
+              uint32_t dwellMicros =
+                  request->hasParam("dwellMicros")
+                      ? std::atoi(request->getParam("dwellMicros")->value().c_str())
+                      : RX_HOP_DWELL_MICROS;
+              uint32_t settleMicros =
+                  request->hasParam("settleMicros")
+                      ? std::atoi(request->getParam("settleMicros")->value().c_str())
+                      : RX_HOP_SETTLE_MICROS;
+
+              if (settleMicros >= dwellMicros) {
+                request->send(400, "text/plain", "Settle has to be below dwell");
+                return;
+              }
+
+              for (uint8_t i = 0; i < count; i++) {
+                state.newFrequencies[i] = frequencies[i];
+              }
+              state.newDwellMicros = dwellMicros;
+              state.newSettleMicros = settleMicros;
+              // A single frequency is the same as setFrequency.
+              state.newVtxFreq = frequencies[0];
+              state.newChannelCount = count;
+              state.channelsRequested = true;
+
+              char json[SETTINGS_JSON_SIZE];
+              request->send(200, "text/json", settingsToJson(json));
+            });
+
+  // Sweeps the receiver and sends the rssi per frequency as the "spectrum"
+  // event, then goes back to timing. Either bands, e.g. bands=RF, all if
+  // none, or min=5600&max=5950&step=5 in MHz. samples and settleMicros
+  // per frequency are optional. No passes are seen while it runs, so not
+  // during a heat.
+  server.on("/api/v1/scan", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (state.scanning) {
+      request->send(409, "text/plain", "Scan running");
+      return;
+    }
+    heatLock.lock();
+    bool heatRunning = heatSession.running();
+    heatLock.unlock();
+    if (heatRunning) {
+      request->send(409, "text/plain", "Heat running");
+      return;
+    }
+
+    SpectrumScanConfig config;
+    if (request->hasParam("min") || request->hasParam("max")) {
+      config.bands = 0;
+      config.minMhz =
+          request->hasParam("min")
+              ? std::atoi(request->getParam("min")->value().c_str())
+              : SPECTRUM_MIN_MHZ;
+      config.maxMhz =
+          request->hasParam("max")
+              ? std::atoi(request->getParam("max")->value().c_str())
+              : SPECTRUM_MAX_MHZ;
+      if (request->hasParam("step")) {
+        config.stepMhz = std::atoi(request->getParam("step")->value().c_str());
+      }
+      if (config.minMhz < SPECTRUM_MIN_MHZ ||
+          config.maxMhz > SPECTRUM_MAX_MHZ || config.minMhz > config.maxMhz ||
+          config.stepMhz < 1) {
+        request->send(400, "text/plain", "Invalid range");
+        return;
+      }
+      if ((config.maxMhz - config.minMhz) / config.stepMhz + 1 >
+          SPECTRUM_MAX_POINTS) {
+        request->send(400, "text/plain", "Too many points, raise step");
+        return;
+      }
+    } else if (request->hasParam("bands")) {
+      config.bands =
+          spectrumBandMask(request->getParam("bands")->value().c_str());
+      if (config.bands == 0) {
+        request->send(400, "text/plain", "Invalid bands");
+        return;
+      }
+    }
+    if (request->hasParam("samples")) {
+      int samples = std::atoi(request->getParam("samples")->value().c_str());
+      if (samples < 1 || samples > 64) {
+        request->send(400, "text/plain", "Samples has to be 1 to 64");
+        return;
+      }
+      config.samples = samples;
+    }
+    if (request->hasParam("settleMicros")) {
+      int settleMicros =
+          std::atoi(request->getParam("settleMicros")->value().c_str());
+      if (settleMicros < 1 || settleMicros > 50000) {
+        request->send(400, "text/plain", "Settle micros has to be 1 to 50000");
+        return;
+      }
+      config.settleMicros = settleMicros;
+    }
+
+    uint16_t frequencies[SPECTRUM_MAX_POINTS];
+    size_t count =
+        spectrumFrequencies(config, frequencies, SPECTRUM_MAX_POINTS);
+    // SpectrumScan::start() would refuse it.
+    if (count == 0) {
+      request->send(400, "text/plain", "No frequencies to scan");
+      return;
+    }
+
+    state.newScanConfig = config;
+    state.scanning = true;
+    state.scanRequested = true;
+
+    char json[64];
+    snprintf(json, sizeof(json), "{\"points\":%u,\"estimatedMicros\":%u}",
+             (unsigned)count,
+             (unsigned)SpectrumScan::estimateMicros(
+                 config, count, RSSI_SAMPLE_PERIOD_MICROS));
+    request->send(200, "text/json", json);
+  });
+
+  // The last sweep, points as [mhz, rssi].
+  server.on("/api/v1/scan", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("text/json");
+    spectrumLock.lock();
+    response->printf(
+        "{\n\"scanning\":%s,\n\"startTime\":%llu,\n\"sweepMicros\":%u,\n"
+        "\"retunes\":%u,\n\"points\":[",
+        state.scanning ? "true" : "false",
+        (unsigned long long)lastSpectrum.startTime,
+        (unsigned)lastSpectrum.sweepMicros, (unsigned)lastSpectrum.retunes);
+    for (uint16_t i = 0; i < lastSpectrum.count; i++) {
+      response->printf("%s[%u,%u]", i > 0 ? "," : "",
+                       (unsigned)lastSpectrum.points[i].frequency,
+                       (unsigned)lastSpectrum.points[i].rssi);
+    }
+    spectrumLock.unlock();
+    response->print("]\n}");
+    request->send(response);
+  });
+
+  // Passes after the given event id, e.g. since=1234, all kept if none.
+  // Times in micros.
+  server.on("/api/v1/passes", HTTP_GET, [](AsyncWebServerRequest *request) {
+    uint32_t since =
+        request->hasParam("since")
+            ? strtoul(request->getParam("since")->value().c_str(), NULL, 10)
+            : 0;
+    size_t count =
+        passHistory.since(since, passReplayRecords, PASS_HISTORY_CAPACITY);
+
+    AsyncResponseStream *response = request->beginResponseStream("text/json");
+    response->printf("{\n\"lastId\":%u,\n\"passes\":[", (unsigned)lastEventId);
+    for (size_t i = 0; i < count; i++) {
+      const PassRecord &record = passReplayRecords[i];
+      response->printf(
+          "%s\n{\"id\":%u,\"channel\":%u,\"lap\":%u,\"timeStamp\":%llu,"
+          "\"interval\":%llu,\"rssiPeak\":%u,\"detectedTimeStamp\":%llu}",
+          i > 0 ? "," : "", (unsigned)record.id, (unsigned)record.channel,
+          (unsigned)record.pass.lap,
+          (unsigned long long)record.pass.timeStamp,
+          (unsigned long long)record.pass.interval,
+          (unsigned)record.pass.rssiPeak,
+          (unsigned long long)record.pass.detectedTimeStamp);
+    }
+    response->print("\n]\n}");
+    request->send(response);
+  });
+
+  // Raw trace capture, see raw_trace.h. Capture until stopped, then
+  // download.
+  server.on("/api/v1/trace/start", HTTP_POST,
+            [](AsyncWebServerRequest *request) {
+              if (rawTraceState != TRACE_IDLE) {
+                request->send(409, "text/plain", "Already capturing");
+                return;
+              }
+              // It would overwrite what they are reading.
+              if (rawTraceDownloads > 0) {
+                request->send(409, "text/plain", "Download in progress");
+                return;
+              }
+              if (!beginRawTrace()) {
+                request->send(503, "text/plain", "No trace storage");
+                return;
+              }
+
+              rawTraceFlushed = false;
+              // Detection only runs with a client.
+              setClientConnected();
+              rawTraceState = TRACE_CAPTURING;
 
-              request->send(200, "text/json", settingsToJson().c_str());
+              Serial.println(">>>> Start trace");
+
+              request->send(200, "text/json", rawTraceStatusJson());
+            });
+
+  server.on("/api/v1/trace/stop", HTTP_POST,
+            [](AsyncWebServerRequest *request) {
+              if (rawTraceState == TRACE_CAPTURING) {
+                rawTraceState = TRACE_STOPPING;
+              }
+              request->send(200, "text/json", rawTraceStatusJson());
             });
 
+  // Streamed block by block, nothing is buffered beyond one block.
+  server.on("/api/v1/trace", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (rawTraceState != TRACE_IDLE) {
+      request->send(409, "text/plain", "Stop the capture first");
+      return;
+    }
+    if (!rawTrace.ready()) {
+      request->send(404, "text/plain", "No trace");
+      return;
+    }
+
+    // Goes with the response, whenever that is freed.
+    std::shared_ptr<RawTraceDownload> download(new RawTraceDownload());
+    AsyncWebServerResponse *response = request->beginChunkedResponse(
+        "application/octet-stream",
+        [download](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          return readRawTrace(*download, buffer, maxLen, index);
+        });
+    response->addHeader("Content-Disposition",
+                        "attachment; filename=\"trace.bin\"");
+    request->send(response);
+  });
+
+  // Performance counters, JSON or with format=prometheus the Prometheus
+  // text format.
+  server.on("/api/v1/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (request->hasParam("format") &&
+        request->getParam("format")->value() == "prometheus") {
+      AsyncResponseStream *response =
+          request->beginResponseStream("text/plain; version=0.0.4");
+      metricsToPrometheus(response);
+      request->send(response);
+      return;
+    }
+
+    request->send(200, "text/json",
+                  metricsToJson(metricsResponseJson,
+                                sizeof(metricsResponseJson)));
+  });
+
   // Setup events.
   events.onConnect([](AsyncEventSourceClient *client) {
     if (client->lastId()) {
       Serial.printf("Client reconnected! Last message ID that it gat is: %u\n",
                     client->lastId());
+      replayPasses(client, client->lastId());
     }
-    // Send event with message "hello!", id current millis
-    // and set reconnect delay to 1 second.
-    client->send("hello!", NULL, millis(), 1000);
+    // Send event with message "hello!", without an id so the client keeps
+    // its last one, and set reconnect delay to 1 second.
+    client->send("hello!", NULL, 0, 1000);
   });
   server.addHandler(&events);
 
+  ws.onEvent([](AsyncWebSocket * /*server*/, AsyncWebSocketClient *client,
+                AwsEventType type, void * /*arg*/, uint8_t * /*data*/,
+                size_t /*len*/) {
+    if (type != WS_EVT_CONNECT) {
+      return;
+    }
+
+    setClientConnected();
+
+    // Start the client off with the current settings.
+    uint8_t frame[WS_MAX_FIXED_FRAME_SIZE];
+    client->binary(frame, encodeWsSettingsFrame(frame));
+  });
+  server.addHandler(&ws);
+
+#if OTA_THROTTLED
+  // Uploads from the ElegantOTA page, handled before its own handler gets
+  // them. See ota_pipeline.h.
+  server.on("/update", HTTP_POST, handleOtaRequest, handleOtaUpload);
+
+  server.on("/api/v1/ota", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/json", otaToJson());
+  });
+#endif
+
   // Inject ElegantOTA routes and logic into the web server.
   AsyncElegantOTA.begin(&server);
 
@@ -218,23 +2006,39 @@ void setup() {
   Serial.println();
   Serial.println();
 
+  settingsStorage.begin();
+
   // commit 256 bytes of ESP8266 flash (for "EEPROM" emulation)
   // this step actually loads the content (256 bytes) of flash into
   // a 256-byte-array cache in RAM
-  EEPROM.begin(256);
-
-  // read bytes (i.e. sizeof(data) from "EEPROM"),
-  // in reality, reads from byte-array cache
-  // cast bytes into structure called data
-  SettingsType settingsPref;
-  EEPROM.get(0, settingsPref);
-
-  // A heuristics to check EEPROM has been set, since this var is never changed.
-  if (settingsPref.version == 42
-      // Old default.
-      || settingsPref.filterRatio == 10) {
-    Serial.println("Loading from EEPROM.");
-    settings = settingsPref;
+  EEPROM.begin(SETTINGS_EEPROM_SIZE);
+
+  bool loaded = settingsStore.load(settings);
+  if (loaded) {
+    Serial.println("Loading settings.");
+  } else {
+    // Settings of firmware before 2.4 are at EEPROM offset 0.
+    SettingsType settingsPref;
+    EEPROM.get(0, settingsPref);
+
+    // A heuristics to check EEPROM has been set, since this var is never changed.
+    if (settingsPref.version == 42
+        // Old default.
+        || settingsPref.filterRatio == 10) {
+      Serial.println("Migrating settings from EEPROM.");
+      settings = settingsPref;
+      // Those settings end at apPwd, the rest is whatever was in EEPROM.
+      SettingsType defaults;
+      settings.adaptiveMode = defaults.adaptiveMode;
+      settings.gateSync = defaults.gateSync;
+      loaded = true;
+      flushSettings();
+    } else {
+      Serial.println("Settings not set.");
+    }
+  }
+
+  if (loaded) {
     // So we don't accidentally reset the vtx freq.
     state.newVtxFreq = settings.vtxFreq;
 
@@ -252,227 +2056,38 @@ void setup() {
 
     Serial.print("Router pwd: ");
     Serial.println(settings.routerPwd);
-  } else {
-    Serial.println("EEPROM not set.");
   }
 
   // If no existing id, generate one.
-  if (settings.id < 0 || settings.id > 25) {
+  if (settings.id >= GATE_MAX_TIMERS) {
     // Get a number from 0 to 25.
     settings.id = random(26);
-    commitEeprom();
+    saveSettings();
   }
 
   Serial.print("Timer id: ");
   Serial.println(settings.id);
 
   // RX5808 comms.
-  // SPI.begin();
-  pinMode(slaveSelectPin, OUTPUT);
-  pinMode(spiDataPin, OUTPUT);
-  pinMode(spiClockPin, OUTPUT);
-
-  digitalWrite(slaveSelectPin, HIGH);
-
-  while (!Serial) {
-  }; // Wait for the Serial port to initialise
-  Serial.println("Serial ready...");
+  rx5808.begin();
+  beginRssiAdc();
 
   setRxModule(settings.vtxFreq);
 
+  startDetection();
+
   setupServer();
 }
 
 void loop() {
-  // // Necessary for ElegantOTA to handle reboot after OTA update.
-  // AsyncElegantOTA.loop();
-  
-  // Shutdown after 1s.
-  if (shutdownMillis != 0 && millis() - shutdownMillis > 1000) {
-    // Restart the server.
-    ESP.restart();
-  }
-
-  // If WiFi is down, try reconnecting every reconnectInterval.
-  if (WiFi.status() != WL_CONNECTED) {
-    unsigned long currentMillis = millis();
-
-    if (currentMillis - previousReconnectMillis >= reconnectInterval
-        && strlen(settings.routerSsid) > 0) {
-#ifdef DEV_MODE
-      Serial.println("Reconnecting to WiFi...");
-#endif
-      isWifiConnected = false;
-      WiFi.disconnect();
-      WiFi.reconnect();
-      previousReconnectMillis = currentMillis;
-    }
-  } else if (!isWifiConnected) {
-    isWifiConnected = true;
-    strcpy(settings.localIp, WiFi.localIP().toString().c_str());
-
-#ifdef DEV_MODE
-    Serial.println("Wifi is connected.");
-    printWifiInfo();
-#endif
-  }
-
-  // If no client has connected, no need to loop.
-  if (!state.clientConnected) {
-    return;
-  }
-
-  if (state.newVtxFreq != settings.vtxFreq) {
-    setRxModule(state.newVtxFreq);
-
-    commitEeprom();
-  }
-
-  uint32_t previousLoopTimestamp = state.lastLoopTimeStamp;
-  state.lastLoopTimeStamp = micros();
-  state.loopTime = state.lastLoopTimeStamp - previousLoopTimestamp;
-
-  // Two settings update has to be larger than 1s interval.
-  if (settingsUpdated &&
-      state.lastLoopTimeStamp - lastSettingsUpdateTime > 1000 * 1000) {
-    events.send(settingsToJson().c_str(), "settings", millis());
-    lastSettingsUpdateTime = state.lastLoopTimeStamp;
-    settingsUpdated = false;
-  }
-
-  state.rssiRaw = rssiRead();
-
-  state.rssiSmoothed = (state.filterRatioFloat * (float)state.rssiRaw) +
-                       ((1.0f - state.filterRatioFloat) * state.rssiSmoothed);
-  state.rssi = (int)state.rssiSmoothed;
-
-  // Measure peaks, only measure when in calibration mode.
-  if (state.calibrationMode && state.rssi > settings.rssiPeak) {
-    settings.rssiPeak = state.rssi;
-    updateRssiTrigger();
-    commitEeprom();
-  }
-  // Measure end.
-
-
-  // START: RSSI logging and monitoring.
-  if (settings.logRssi && state.lastLoopTimeStamp - lastRssiLogTime > rssiLogInterval) {
-    state.rssiLogStream << state.rssi << " ";
-    lastRssiLogTime = state.lastLoopTimeStamp;
-  }
-
-  if (state.lastLoopTimeStamp - lastRssiSendTime > rssiSendInterval) {
-    String rssiMsg =
-      String(state.rssi) + " " + int64String(state.lastLoopTimeStamp) + " "
-        + String(state.rssiLogStream.str().c_str());
-
-    // Reset the rssi log stream.
-    state.rssiLogStream = std::stringstream();
+  runNetwork();
 
-#ifdef DEV_MODE
-    Serial.print("RSSI:");
-    Serial.println(rssiMsg);
-    Serial.print("Loop time micros: ");
-    Serial.println(state.loopTime);
-#endif
-    events.send(rssiMsg.c_str(), "rssi", state.lastLoopTimeStamp);
-
-    lastRssiSendTime = state.lastLoopTimeStamp;
-  }
-  // END: RSSI logging and monitoring.
-
-
-  if (!state.crossing &&
-      state.rssi > state.enterRssiTrigger
-      /**
-       * Make sure the next crossing only happens after MIN lap time.
-       *
-       * To avoid the following cases:
-       * 0. Last passed
-       * 1. Within MIN_LAP_TIME_MILLIS RSSI jump high, crossing again
-       * 2. What if that crossing rssi is too high, and no later RSSI passes
-       *    that?
-       *
-       * So what we should check here is the next crossing should not happen
-       * until MIN_LAP_TIME_MILLIS, instead of checking the leave.
-       *
-       * This also makes sure we don't get hang by an overly large crossing
-       * RSSI.
-       * */
-      && (state.lastLoopTimeStamp - lastPass.timeStamp * 1000 >
-          MIN_LAP_TIME_MICROS)) {
-    state.crossing = true; // Quad is going through the gate
-    Serial.println("Crossing = True");
-  }
-
-  if (state.crossing) {
-    state.rssiPeak = max(state.rssiPeak, state.rssi);
-
-    // Find the peak rssi and the time it occured during a crossing event
-    // Use the raw value to account for the delay in smoothing.
-    if (state.rssiRaw > state.rssiPeakRaw) {
-      state.rssiPeakRaw = state.rssiRaw;
-      state.rssiPeakRawTimeStamp = state.lastLoopTimeStamp / 1000;
-    }
-
-    uint16_t leaveRssiTrigger = state.leaveRssiTrigger;
-    if (state.calibrationMode) {
-      // Use lower trigger for leave when in calibration mode.
-      leaveRssiTrigger -=
-          (CALIBRATION_LEAVE_RSSI_FACTOR - 1) * settings.leaveRssiOffset;
-    }
-
-    // See if we have left the gate.
-    if (state.rssi < leaveRssiTrigger) {
-      uint64_t lastPassTimestamp = lastPass.timeStamp;
-
-      lastPass.rssiPeakRaw = state.rssiPeakRaw;
-      lastPass.rssiPeak = state.rssiPeak;
-      lastPass.timeStamp = state.rssiPeakRawTimeStamp;
-      lastPass.lap = lastPass.lap + 1;
-
-      uint64_t interval = lastPass.timeStamp - lastPassTimestamp;
-
-      // In case some weird overflow happens.
-      if (lastPass.timeStamp < lastPassTimestamp) {
-        interval = 0;
-      }
-
-      String msg = String(lastPass.lap) + " " +
-                   int64String(interval) + " " +
-                   String(lastPass.rssiPeak) + " " +
-                   // The peak timestamp will be the initial timestamp of next
-                   // timing round.
-                   int64String(lastPass.timeStamp) + " " +
-                   int64String(state.lastLoopTimeStamp);
-
-      Serial.printf_P("Crossing = False >>>>>> %s\n", msg.c_str());
-      events.send(msg.c_str(), "newtime", state.lastLoopTimeStamp);
-
-      state.crossing = false;
-      state.rssiPeakRaw = 0;
-      state.rssiPeak = 0;
-
-      if (state.calibrationMode) {
-        state.calibrationPasses += 1;
-
-#ifdef DEV_MODE
-        Serial.println(">>>> Calibration pass");
+#if !DETECTION_TASK
+  pollRssiSampler();
+  runDetection();
 #endif
 
-        if (state.calibrationPasses >= CALIBRATION_PASSES &&
-            (state.lastLoopTimeStamp - state.calibrationStartMicros >
-             CALIBRATION_MIN_TIME_MICROS)) {
-          state.calibrationMode = false;
-          events.send("ended", "calibration", state.lastLoopTimeStamp);
-
-#ifdef DEV_MODE
-          Serial.println(">>>> Calibration done");
-#endif
-        }
-      }
-    }
-  }
+  sendDetections();
 
 #if defined(ESP8266)
   delay(8);
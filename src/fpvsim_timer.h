@@ -5,6 +5,8 @@
 #elif defined(ESP32C3)
 #include "WiFi.h"
 #define RSSI_PIN 3
+// GPIO3 is ADC1 channel 3.
+#define RSSI_ADC_CHANNEL 3
 
 #elif defined(ESP32S3)
 #include "WiFi.h"
@@ -15,26 +17,92 @@
 #define RSSI_PIN 34
 #endif
 
-#include <sstream>
+#if !defined(ESP8266)
+#include "esp_timer.h"
+#include <mutex>
+#endif
+
+// Continuous ADC by DMA, oversampled, see rssi_decimator.h. IDF 4.4 only
+// has the continuous read API for the C3 here: the S3 rssi pin is on ADC2
+// and the classic ESP32 lacks it. Everything else uses analogRead().
+#ifndef RSSI_ADC_DMA
+#if defined(ESP32C3)
+#define RSSI_ADC_DMA 1
+#else
+#define RSSI_ADC_DMA 0
+#endif
+#endif
+
+#if RSSI_ADC_DMA
+#include "driver/adc.h"
+#endif
+
+// Firmware uploads go through ota_pipeline.h, written from loop() in slices
+// that leave timing alone. ESP8266 has no partition API for it and keeps
+// AsyncElegantOTA writing as data comes in.
+#ifndef OTA_THROTTLED
+#if defined(ESP8266)
+#define OTA_THROTTLED 0
+#else
+#define OTA_THROTTLED 1
+#endif
+#endif
+
+#if OTA_THROTTLED
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include <MD5Builder.h>
+#endif
+
+// Upload bytes that didn't fit the queue. Their TCP ack is held back until
+// loop() queued them, so on top come at most a TCP window and the server's
+// multipart buffer, about 7KB.
+#define OTA_BACKLOG_SIZE 8192
+
+// An upload that got no data for this long is dropped, the client went
+// away.
+#define OTA_STALL_TIMEOUT_MILLIS 30000
+
+#include <memory>
+
 #include <SPI.h>
 #include <EEPROM.h>
+#if !defined(ESP8266)
+#include <Preferences.h>
+#endif
+#include <LittleFS.h>
+#include <WiFiUdp.h>
 #include <ESPAsyncWebServer.h>
-#include <Int64String.h>
 #include <AsyncElegantOTA.h>
 
+#include "adaptive_calibration.h"
+#include "channel_hopper.h"
+#include "event_formatter.h"
+#include "gate_sync.h"
+#include "heat_session.h"
+#include "lap_detector.h"
+#include "metrics.h"
+#include "ota_pipeline.h"
+#include "pass_history.h"
+#include "raw_trace.h"
+#include "rssi_decimator.h"
+#include "rssi_telemetry.h"
+#include "rx5808.h"
+#include "seqlock.h"
+#include "settings_json.h"
+#include "settings_store.h"
+#include "spectrum_scan.h"
+#include "spsc_ring_buffer.h"
+#include "wifi_connection.h"
+#include "ws_protocol.h"
+
 // Incompatible with 2.1 or earlier version of the client software.
-#define FW_VERSION "2.3.0"
+// 2.4 sends the rssi log as a base64 batch, see rssi_telemetry.h.
+#define FW_VERSION "2.4.0"
 
 // Time set to shutdown.
 unsigned long shutdownMillis = 0;
 
-// Reconnect timestamp millis.
-unsigned long previousReconnectMillis = 0;
-// Reconnection interval.
-unsigned long reconnectInterval = 1000 * 5;
-// Used to bookkeep whether connected to router.
-bool isWifiConnected = false;
-
 // Setup data pins for rx5808 comms
 const int spiDataPin = MOSI;   // CH1
 const int slaveSelectPin = SS; // CH2
@@ -42,6 +110,13 @@ const int spiClockPin = SCK;   // CH3
 
 #define DEV_MODE
 
+// Whether crossings and passes are echoed on serial as loop() hands them
+// out. Printing waits once the UART buffer is full, 0 keeps it off the pass
+// path.
+#ifndef DETECTION_SERIAL_ECHO
+#define DETECTION_SERIAL_ECHO 1
+#endif
+
 uint8_t INITIAL_RSSI_FILTER = 30;
 
 // Leave offset will multiply this factor when in calibration mode.
@@ -53,26 +128,79 @@ uint32_t CALIBRATION_MIN_TIME_MICROS = 30 * 1000 * 1000;
 // Each lap has to take at least 4 seconds.
 uint32_t MIN_LAP_TIME_MICROS = 4 * 1000 * 1000;
 
+// How often detection hands the adaptive calibration estimate to loop().
+#define ADAPTIVE_PUBLISH_INTERVAL_MICROS (1000 * 1000)
+
+// Auto mode applies its suggestion once no quad has been seen for this
+// long, i.e. between heats.
+#ifndef ADAPTIVE_APPLY_QUIET_MICROS
+#define ADAPTIVE_APPLY_QUIET_MICROS (20 * 1000 * 1000)
+#endif
+
+// How often the RSSI is sampled, independent of how busy loop() is.
+#ifndef RSSI_SAMPLE_RATE_HZ
+#define RSSI_SAMPLE_RATE_HZ 2000
+#endif
+
+// Samples buffered between the sampler and loop(), must be a power of two.
+// 512 samples is 256ms at 2kHz, enough to ride out a blocking flash write.
+#ifndef RSSI_SAMPLE_BUFFER_SIZE
+#define RSSI_SAMPLE_BUFFER_SIZE 512
+#endif
+
+#define RSSI_SAMPLE_PERIOD_MICROS (1000 * 1000 / RSSI_SAMPLE_RATE_HZ)
+
+// Max samples drained from the buffer at once.
+#define RSSI_SAMPLE_BATCH_SIZE 32
+
+// On dual core chips sampling and detection run in their own task, pinned
+// away from WiFi and lwIP which live on core 0. loop() only does networking.
+// The C3 and ESP8266 have a single core, there loop() does both.
+#ifndef DETECTION_TASK
+#if defined(ESP8266) || defined(ESP32C3) || defined(CONFIG_FREERTOS_UNICORE)
+#define DETECTION_TASK 0
+#else
+#define DETECTION_TASK 1
+#endif
+#endif
+
+#ifndef DETECTION_CORE
+#define DETECTION_CORE 1
+#endif
+
+// Above loop() and the async TCP task, below the WiFi and esp_timer tasks.
+#ifndef DETECTION_TASK_PRIORITY
+#define DETECTION_TASK_PRIORITY 10
+#endif
+
+#define DETECTION_TASK_STACK_SIZE 4096
+
+// The detection task drains samples once this many are queued, 4ms at 2kHz.
+#define DETECTION_TASK_BATCH_SIZE 8
+
 uint64_t lastRssiSendTime = 0;
 const uint32_t rssiSendInterval = 2000 * 1000; // 2000ms.
 
 uint64_t lastRssiLogTime = 0;
-const uint32_t rssiLogInterval = 50 * 1000; // 50ms.
+const uint32_t rssiLogInterval = 10 * 1000; // 10ms.
+
+// Logged rssi kept between two rssi events, 2s at 10ms.
+#define RSSI_LOG_CAPACITY 256
 
 struct SettingsType {
-  uint16_t volatile vtxFreq = 5732;
+  uint16_t vtxFreq = 5732;
 
-  uint8_t volatile filterRatio = INITIAL_RSSI_FILTER;
+  uint8_t filterRatio = INITIAL_RSSI_FILTER;
 
   // The RSSI when quad is close.
-  uint16_t volatile rssiPeak = 270;
-  uint16_t volatile enterRssiOffset = 6;
-  uint16_t volatile leaveRssiOffset = 27;
+  uint16_t rssiPeak = 270;
+  uint16_t enterRssiOffset = 6;
+  uint16_t leaveRssiOffset = 27;
   // When true, logs the rssi from last rssi update.
-  bool volatile logRssi = true;
+  bool logRssi = true;
 
   // Id of the timer, 0 - 25.
-  uint8_t volatile id = -1;
+  uint8_t id = -1;
 
   char apIp[20];
   char localIp[20];
@@ -82,203 +210,680 @@ struct SettingsType {
   char routerSsid[32];
   char routerPwd[32];
 
+  // Only used to recognize settings that firmware before 2.4 wrote at
+  // EEPROM offset 0, see SETTINGS_SCHEMA_VERSION instead.
   uint8_t version = 42;
 
   // AP ssid and password.
   char apPwd[30] = {0};
+
+  // AdaptiveMode, see adaptive_calibration.h.
+  uint8_t adaptiveMode = ADAPTIVE_SUGGEST;
+
+  // Share passes and sync clocks with other timers, see gate_sync.h.
+  bool gateSync = false;
+
+  // New fields go here, and bump SETTINGS_SCHEMA_VERSION.
 } settings;
 
-struct {
-  // True when the quad is going through the gate
-  bool volatile crossing = false;
+// Schema of the persisted SettingsType, see settings_store.h.
+#define SETTINGS_SCHEMA_VERSION 3
 
-  // Current unsmoothed rssi
-  uint16_t volatile rssiRaw = 0;
-  // Smoothed rssi value, needs to be a float for smoothing to work
-  float volatile rssiSmoothed = 0;
-  // int representation of the smoothed rssi value
-  uint16_t volatile rssi = 0;
+#if defined(ESP8266)
+// No NVS, records go after the legacy settings at EEPROM offset 0.
+#define SETTINGS_EEPROM_SLOT_OFFSET 256
+#define SETTINGS_EEPROM_SLOT_SIZE 256
+#define SETTINGS_EEPROM_SIZE \
+  (SETTINGS_EEPROM_SLOT_OFFSET + 2 * SETTINGS_EEPROM_SLOT_SIZE)
 
-  // Rssi has to be above the enter rssi to count as crossing.
-  uint16_t volatile enterRssiTrigger = 0;
-  // Rssi has to fall below the leave rssi to count as leaving.
-  uint16_t volatile leaveRssiTrigger = 0;
+struct SettingsStorage {
+  void begin() {}
 
-  // The peak raw rssi seen the current pass
-  uint16_t volatile rssiPeakRaw = 0;
-  // The peak smoothed rssi seen the current pass
-  uint16_t volatile rssiPeak = 0;
-  // The time of the peak raw rssi for the current pass
-  uint64_t volatile rssiPeakRawTimeStamp = 0;
+  bool read(uint8_t slot, uint8_t *data, size_t len) {
+    memcpy(data, EEPROM.getDataPtr() + slotOffset(slot), len);
+    return true;
+  }
+
+  bool write(uint8_t slot, const uint8_t *data, size_t len) {
+    memcpy(EEPROM.getDataPtr() + slotOffset(slot), data, len);
+    return EEPROM.commit();
+  }
+
+  size_t slotOffset(uint8_t slot) {
+    return SETTINGS_EEPROM_SLOT_OFFSET + slot * SETTINGS_EEPROM_SLOT_SIZE;
+  }
+};
+#else
+#define SETTINGS_EEPROM_SIZE 256
+
+// NVS already spreads writes over its pages and checksums entries, each
+// slot is a key.
+struct SettingsStorage {
+  Preferences preferences;
+
+  void begin() { preferences.begin("fpvsim", false); }
 
-  // variables to track the loop time
-  uint32_t volatile loopTime = 0;
-  uint64_t volatile lastLoopTimeStamp = 0;
+  bool read(uint8_t slot, uint8_t *data, size_t len) {
+    char key[] = {'s', char('0' + slot), 0};
+    return preferences.getBytes(key, data, len) == len;
+  }
+
+  bool write(uint8_t slot, const uint8_t *data, size_t len) {
+    char key[] = {'s', char('0' + slot), 0};
+    return preferences.putBytes(key, data, len) == len;
+  }
+};
+#endif
 
-  // The float version of settings.filterRatio.
-  float volatile filterRatioFloat = 0.0f;
+SettingsStorage settingsStorage;
+SettingsStore<SettingsType, SettingsStorage> settingsStore(
+    settingsStorage, SETTINGS_SCHEMA_VERSION);
+
+#if defined(ESP8266)
+static_assert(SettingsStore<SettingsType, SettingsStorage>::kRecordSize <=
+                  SETTINGS_EEPROM_SLOT_SIZE,
+              "Settings record doesn't fit its EEPROM slot");
+#endif
+
+// Request handlers and loop() change settings and state, detection only
+// sees them through detectionConfig.
+struct {
+  // Rssi has to be above the enter rssi to count as crossing.
+  uint16_t enterRssiTrigger = 0;
+  // Rssi has to fall below the leave rssi to count as leaving.
+  uint16_t leaveRssiTrigger = 0;
+
+  // variables to track the loop time, only touched from detection.
+  uint32_t loopTime = 0;
+  uint64_t lastLoopTimeStamp = 0;
 
   // The new vtx freq updated from user.
   uint16_t volatile newVtxFreq = 5732;
 
-  // Whether in calibration mode right now, detecting peak rssi.
-  bool volatile calibrationMode = false;
+  // Set by the frequency handlers, picked up by loop(). More than one
+  // frequency means hopping.
+  bool volatile channelsRequested = false;
+  uint16_t volatile newFrequencies[RX_MAX_CHANNELS] = {0};
+  uint8_t volatile newChannelCount = 0;
+  uint32_t volatile newDwellMicros = RX_HOP_DWELL_MICROS;
+  uint32_t volatile newSettleMicros = RX_HOP_SETTLE_MICROS;
+
+  // Set by the scan handler, picked up by loop(). Scanning until loop() has
+  // sent the result.
+  bool volatile scanRequested = false;
+  bool volatile scanning = false;
+  SpectrumScanConfig newScanConfig;
 
-  uint32_t volatile calibrationStartMicros = 0;
+  // How many channels the receiver is hopping across, 1 when not hopping.
+  uint8_t volatile channelCount = 1;
 
-  // How many passes has done in calibration mode.
-  uint8_t volatile calibrationPasses = 0;
+  // Whether in calibration mode right now, detecting peak rssi. Detection
+  // ends it, loop() clears this once told.
+  bool calibrationMode = false;
+
+  uint64_t calibrationStartMicros = 0;
 
   // Whether a client has connected.
-  bool volatile clientConnected = false;
+  bool clientConnected = false;
 
-  // RSSI log.
-  std::stringstream rssiLogStream;
+  // RSSI log, only touched from detection.
+  RssiLog<RSSI_LOG_CAPACITY> rssiLog;
 } state;
 
+// Preallocated buffers for the rssi event.
+uint8_t rssiBatchScratch[RSSI_BATCH_MAX_BINARY(RSSI_LOG_CAPACITY)];
+char rssiMsg[64 + RSSI_BATCH_MAX_BASE64(RSSI_LOG_CAPACITY) + 1];
+
+// Performance counters, see metrics.h and /api/v1/metrics. Durations in
+// micros.
 struct {
-  uint16_t volatile rssiPeakRaw;
-  uint16_t volatile rssiPeak;
-  uint64_t volatile timeStamp;
-  uint8_t volatile lap;
-} lastPass;
+  // Between two sampler ticks.
+  Histogram sampleInterval;
+  // Sampler ticks that came too late to be taken.
+  Counter missedSamples;
 
-std::string settingsToJson() {
-  std::stringstream ss;
-  ss << "{" << std::endl;
+  Histogram eventsSend;
+  Histogram settingsFlush;
+  Histogram setRxModule;
+  Histogram settingsJson;
+  // From another timer sending a pass to it arriving here, shared clock.
+  Histogram gatePassLatency;
 
-  ss << "\"vtxFreq\":" << settings.vtxFreq << "," << std::endl;
+#if defined(ESP8266)
+  // No low-water mark from the SDK, loop() keeps one.
+  uint32_t minFreeHeap = UINT32_MAX;
+#endif
+} metrics;
+
+// How often the metrics event is sent.
+#ifndef METRICS_SEND_INTERVAL_MILLIS
+#define METRICS_SEND_INTERVAL_MILLIS 10000
+#endif
+
+// Records how long the enclosing scope took.
+class MetricTimer {
+ public:
+  explicit MetricTimer(Histogram &histogram)
+      : histogram_(histogram), start_(micros()) {}
+  ~MetricTimer() { histogram_.record(micros() - start_); }
+
+ private:
+  Histogram &histogram_;
+  uint32_t start_;
+};
+
+// Ids of the /events events. One counter for all of them, a reconnecting
+// client sends the id of the last event it got, whatever its type.
+std::atomic<uint32_t> lastEventId{0};
+
+uint32_t nextEventId() { return lastEventId.fetch_add(1) + 1; }
+
+// Passes kept for clients that reconnect, see pass_history.h.
+#ifndef PASS_HISTORY_CAPACITY
+#define PASS_HISTORY_CAPACITY 32
+#endif
 
-  ss << "\"rssiPeak\":" << settings.rssiPeak << "," << std::endl;
-  ss << "\"enterRssiOffset\":" << settings.enterRssiOffset << "," << std::endl;
-  ss << "\"leaveRssiOffset\":" << settings.leaveRssiOffset << "," << std::endl;
-  // Convert to int so it won't be treated as ASCII code.
-  ss << "\"filterRatio\":" << (int) settings.filterRatio << "," << std::endl;
-  ss << "\"logRssi\":" << (settings.logRssi ? "true" : "false") << "," << std::endl;
+PassHistory<PASS_HISTORY_CAPACITY> passHistory;
 
-  ss << "\"apSsid\":\"" << settings.apSsid << "\"," << std::endl;
-  ss << "\"apPwd\":\"" << settings.apPwd << "\"," << std::endl;
-  ss << "\"apIp\":\"" << settings.apIp << "\"," << std::endl;
+// Crossing and lap detection, one per channel, only touched from detection.
+LapDetector lapDetectors[RX_MAX_CHANNELS];
 
-  ss << "\"localIp\":\"" << settings.localIp << "\"," << std::endl;
-  ss << "\"routerSsid\":\"" << settings.routerSsid << "\"," << std::endl;
-  ss << "\"routerPwd\":\"" << settings.routerPwd << "\"," << std::endl;
+// Fed by every channel, the triggers are shared. Only touched from
+// detection.
+AdaptiveCalibration adaptiveCalibration;
 
-  ss << "\"version\":\"" << FW_VERSION << "\"" << std::endl;
+const char *adaptiveModeNames[] = {"off", "suggest", "auto"};
 
-  ss << "}";
+// Everything detection needs from settings and state, published as a whole
+// by publishDetectionConfig() and picked up by detection between batches.
+struct DetectionConfig {
+  LapDetectorConfig detector;
+  // The lower leave trigger used while calibrating.
+  uint16_t calibrationLeaveRssiTrigger = 0;
+  bool calibrationMode = false;
+  // A new value starts a new calibration.
+  uint64_t calibrationStartMicros = 0;
+  bool logRssi = true;
+  uint8_t adaptiveMode = ADAPTIVE_SUGGEST;
+  // Whether anyone looks at the passes, a client or other timers.
+  bool running = false;
+};
 
-  return ss.str();
+Seqlock<DetectionConfig> detectionConfig;
+
+// For what request handlers and loop() both change, never taken by
+// detection. On ESP8266 handlers run between two loop() calls, never during
+// one.
+#if defined(ESP8266)
+struct TaskLock {
+  void lock() {}
+  void unlock() {}
+};
+#else
+typedef std::mutex TaskLock;
+#endif
+
+// Handlers and loop() publish detectionConfig one at a time.
+TaskLock detectionConfigLock;
+
+// Lap times kept per pilot of a heat, the statistics cover all laps.
+#ifndef HEAT_MAX_LAPS
+#define HEAT_MAX_LAPS 64
+#endif
+
+// The current or last heat, see heat_session.h. Passes are added by loop(),
+// start, stop and the snapshot come from handlers, all under heatLock.
+HeatSession<RX_MAX_CHANNELS, HEAT_MAX_LAPS> heatSession;
+TaskLock heatLock;
+
+// The last spectrum sweep, see spectrum_scan.h. Written by loop(), read by
+// handlers, under spectrumLock.
+SpectrumResult lastSpectrum;
+TaskLock spectrumLock;
+
+// Bumped whenever a field of the settings JSON changes.
+volatile uint32_t settingsVersion = 1;
+
+// The serialized settings, and the settingsVersion it was built from.
+// Handlers and loop() both rebuild and copy it, under settingsJsonLock.
+char settingsJson[SETTINGS_JSON_SIZE];
+uint32_t settingsJsonVersion = 0;
+TaskLock settingsJsonLock;
+
+void invalidateSettingsJson() { settingsVersion = settingsVersion + 1; }
+
+// Rebuilds settingsJson, under settingsJsonLock.
+void buildSettingsJson() {
+  MetricTimer timer(metrics.settingsJson);
+
+  SettingsJsonFields fields;
+  fields.vtxFreq = settings.vtxFreq;
+  fields.rssiPeak = settings.rssiPeak;
+  fields.enterRssiOffset = settings.enterRssiOffset;
+  fields.leaveRssiOffset = settings.leaveRssiOffset;
+  fields.filterRatio = settings.filterRatio;
+  fields.logRssi = settings.logRssi;
+  fields.apSsid = settings.apSsid;
+  fields.apPwd = settings.apPwd;
+  fields.apIp = settings.apIp;
+  fields.localIp = settings.localIp;
+  fields.routerSsid = settings.routerSsid;
+  fields.routerPwd = settings.routerPwd;
+  fields.adaptiveMode = adaptiveModeNames[settings.adaptiveMode];
+  fields.gateSync = settings.gateSync;
+  fields.version = FW_VERSION;
+  formatSettingsJson(settingsJson, sizeof(settingsJson), fields);
 }
 
-// Calculate rx5808 register hex value for given frequency in MHz
-uint16_t freqMhzToRegVal(uint16_t freqInMhz) {
-  uint16_t tf, N, A;
-  tf = (freqInMhz - 479) / 2;
-  N = tf / 32;
-  A = tf % 32;
-  return (N << 7) + A;
+// The settings as JSON, copied into out of SETTINGS_JSON_SIZE bytes, which is
+// returned. Only rebuilt after invalidateSettingsJson().
+const char *settingsToJson(char *out) {
+  settingsJsonLock.lock();
+
+  uint32_t version = settingsVersion;
+  if (settingsJsonVersion != version) {
+    buildSettingsJson();
+    settingsJsonVersion = version;
+  }
+  memcpy(out, settingsJson, SETTINGS_JSON_SIZE);
+
+  settingsJsonLock.unlock();
+  return out;
 }
 
-// Functions for the rx5808 module
-void SERIAL_SENDBIT1() {
-  digitalWrite(spiClockPin, LOW);
-  delayMicroseconds(300);
-  digitalWrite(spiDataPin, HIGH);
-  delayMicroseconds(300);
-  digitalWrite(spiClockPin, HIGH);
-  delayMicroseconds(300);
-  digitalWrite(spiClockPin, LOW);
-  delayMicroseconds(300);
+#if RSSI_ADC_DMA
+// Bytes handed over by the driver at once, 4 per reading. One sample's worth
+// of readings, so every sample gets fresh ones.
+#define RSSI_ADC_FRAME_SIZE \
+  (RSSI_OVERSAMPLING * sizeof(adc_digi_output_data_t))
+// Buffered by the driver between two reads, about 8ms at 2kHz.
+#define RSSI_ADC_BUFFER_SIZE 1024
+
+RssiDecimator rssiDecimator;
+uint8_t rssiAdcFrame[RSSI_ADC_FRAME_SIZE];
+
+void startRssiAdc() {
+  adc_digi_init_config_t init = {};
+  init.max_store_buf_size = RSSI_ADC_BUFFER_SIZE;
+  init.conv_num_each_intr = RSSI_ADC_FRAME_SIZE;
+  init.adc1_chan_mask = 1 << RSSI_ADC_CHANNEL;
+  adc_digi_initialize(&init);
+
+  adc_digi_pattern_config_t pattern = {};
+  pattern.atten = ADC_ATTEN_DB_11;
+  pattern.channel = RSSI_ADC_CHANNEL;
+  pattern.unit = 0; // ADC1
+  pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+
+  adc_digi_configuration_t config = {};
+  config.conv_limit_en = false;
+  config.conv_limit_num = 250;
+  config.pattern_num = 1;
+  config.adc_pattern = &pattern;
+  config.sample_freq_hz = RSSI_SAMPLE_RATE_HZ * RSSI_OVERSAMPLING;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE2;
+  adc_digi_controller_configure(&config);
+
+  adc_digi_start();
 }
-void SERIAL_SENDBIT0() {
-  digitalWrite(spiClockPin, LOW);
-  delayMicroseconds(300);
-  digitalWrite(spiDataPin, LOW);
-  delayMicroseconds(300);
-  digitalWrite(spiClockPin, HIGH);
-  delayMicroseconds(300);
-  digitalWrite(spiClockPin, LOW);
-  delayMicroseconds(300);
+
+// Starts converting continuously at RSSI_OVERSAMPLING times the sample rate.
+void beginRssiAdc() {
+  startRssiAdc();
+
+  Serial.print("RSSI ADC started at Hz: ");
+  Serial.println(RSSI_SAMPLE_RATE_HZ * RSSI_OVERSAMPLING);
 }
-void SERIAL_ENABLE_LOW() {
-  delayMicroseconds(100);
-  digitalWrite(slaveSelectPin, LOW);
-  delayMicroseconds(100);
+
+// Moves what the DMA buffered into the decimator, without waiting. Call
+// while the module settles too, so the buffer doesn't overflow meanwhile.
+void rssiDrain() {
+  bool overflowed = false;
+  for (;;) {
+    uint32_t length = 0;
+    esp_err_t result =
+        adc_digi_read_bytes(rssiAdcFrame, RSSI_ADC_FRAME_SIZE, &length, 0);
+    if (result == ESP_ERR_INVALID_STATE) {
+      // The buffer overflowed since the last read, what it still holds is
+      // old, maybe of the channel before. Drop it all.
+      overflowed = true;
+      if (length > 0) {
+        continue;
+      }
+      break;
+    }
+    if (result != ESP_OK || length == 0) {
+      break;
+    }
+
+    for (uint32_t i = 0; i + sizeof(adc_digi_output_data_t) <= length;
+         i += sizeof(adc_digi_output_data_t)) {
+      const adc_digi_output_data_t *data =
+          (const adc_digi_output_data_t *)&rssiAdcFrame[i];
+      if (data->type2.unit == 0 && data->type2.channel == RSSI_ADC_CHANNEL) {
+        rssiDecimator.add(data->type2.data);
+      }
+    }
+  }
+
+  if (overflowed) {
+    // The driver only forgets an overflow when set up again. The next
+    // frame, a sample period later, refills the decimator.
+    adc_digi_stop();
+    adc_digi_deinitialize();
+    startRssiAdc();
+  }
 }
-void SERIAL_ENABLE_HIGH() {
-  delayMicroseconds(100);
-  digitalWrite(slaveSelectPin, HIGH);
-  delayMicroseconds(100);
+
+int rssiRead() {
+  rssiDrain();
+  return rssiDecimator.value();
 }
+#else
+void beginRssiAdc() {}
+void rssiDrain() {}
 
-// Set the frequency given on the rx5808 module
-void setRxModule(int frequency) {
-  Serial.print("Setup rx5808 frequency to: ");
-  Serial.println(frequency);
+// Read the RSSI value for the current channel
+int rssiRead() { return analogRead(RSSI_PIN); }
+#endif
+
+#if !defined(ESP8266)
+// 64 bit micros, as micros() wraps after ~71 minutes.
+uint64_t micros64() { return esp_timer_get_time(); }
+#endif
+
+// Clock for the RX5808 when RX5808_HW_SPI is set.
+#ifndef RX5808_SPI_HZ
+#define RX5808_SPI_HZ 1000000
+#endif
+
+#if defined(RX5808_HW_SPI) && !defined(ESP8266)
+// Hardware SPI, the 25 bit frame goes out in one transfer.
+class Rx5808SpiBus : public Rx5808Bus {
+ public:
+  void begin() override {
+    SPI.begin();
+    pinMode(slaveSelectPin, OUTPUT);
+    digitalWrite(slaveSelectPin, HIGH);
+  }
+
+  void writeFrame(uint32_t frame) override {
+    SPI.beginTransaction(SPISettings(RX5808_SPI_HZ, LSBFIRST, SPI_MODE0));
+    digitalWrite(slaveSelectPin, LOW);
+    SPI.transferBits(frame, NULL, RX5808_FRAME_BITS);
+    // Clock the data in.
+    digitalWrite(slaveSelectPin, HIGH);
+    SPI.endTransaction();
+  }
+};
 
-  uint8_t i; // Used in the for loops
-
-  // Get the hex value to send to the rx module
-  uint16_t vtxHex = freqMhzToRegVal(frequency);
-
-  // bit bash out 25 bits of data / Order: A0-3, !R/W, D0-D19 / A0=0, A1=0,
-  // A2=0, A3=1, RW=0, D0-19=0
-  SERIAL_ENABLE_HIGH();
-  delay(2);
-  SERIAL_ENABLE_LOW();
-  SERIAL_SENDBIT0();
-  SERIAL_SENDBIT0();
-  SERIAL_SENDBIT0();
-  SERIAL_SENDBIT1();
-  SERIAL_SENDBIT0();
-
-  for (i = 20; i > 0; i--)
-    SERIAL_SENDBIT0(); // Remaining zeros
-
-  SERIAL_ENABLE_HIGH(); // Clock the data in
-  delay(2);
-  SERIAL_ENABLE_LOW();
-
-  // Second is the channel data from the lookup table, 20 bytes of register data
-  // are sent, but the MSB 4 bits are zeros register address = 0x1, write,
-  // data0-15=vtxHex data15-19=0x0
-  SERIAL_ENABLE_HIGH();
-  SERIAL_ENABLE_LOW();
-
-  SERIAL_SENDBIT1(); // Register 0x1
-  SERIAL_SENDBIT0();
-  SERIAL_SENDBIT0();
-  SERIAL_SENDBIT0();
-
-  SERIAL_SENDBIT1(); // Write to register
-
-  // D0-D15, note: loop runs backwards as more efficent on AVR
-  for (i = 16; i > 0; i--) {
-    if (vtxHex & 0x1) { // Is bit high or low?
-      SERIAL_SENDBIT1();
-    } else {
-      SERIAL_SENDBIT0();
+Rx5808SpiBus rx5808Bus;
+#else
+struct ArduinoGpio {
+  void write(int pin, bool level) { digitalWrite(pin, level ? HIGH : LOW); }
+  void output(int pin) { pinMode(pin, OUTPUT); }
+  void delayMicros(uint32_t micros) { delayMicroseconds(micros); }
+};
+
+ArduinoGpio rx5808Gpio;
+Rx5808BitBangBus<ArduinoGpio> rx5808Bus(rx5808Gpio, spiDataPin, slaveSelectPin,
+                                        spiClockPin);
+#endif
+
+// Only touched from the sampler once it has started.
+Rx5808 rx5808(rx5808Bus);
+
+// A raw RSSI reading and when it was taken.
+struct RssiSample {
+  uint64_t timeStamp; // micros
+  uint16_t rssiRaw;
+  // Index into the hopped frequencies, 0 when not hopping.
+  uint8_t channel;
+};
+
+// Filled by the sampler, drained by detection.
+SpscRingBuffer<RssiSample, RSSI_SAMPLE_BUFFER_SIZE> rssiSamples;
+
+// Frequencies requested by loop(), applied by the sampler.
+SpscRingBuffer<ChannelConfig, 4> channelRequests;
+
+// Only touched from the sampler.
+ChannelHopper channelHopper;
+
+// Sweeps requested by loop(), run by the sampler in place of the hopper,
+// see spectrum_scan.h.
+SpscRingBuffer<SpectrumScanConfig, 2> spectrumRequests;
+SpscRingBuffer<SpectrumResult, 2> spectrumResults;
+// A request start() refused, without frequencies. loop() clears scanning.
+volatile bool spectrumScanRefused = false;
+
+// Only touched from the sampler.
+SpectrumScan spectrumScan;
+
+// Bumped by loop() on every channel change, detection resets its detectors
+// when it sees a new value.
+volatile uint32_t channelsGeneration = 0;
+
+enum DetectionEventType : uint8_t {
+  DETECTION_CROSSING,
+  DETECTION_PASS,
+  // Calibration saw a new rssi peak, in rssiPeak.
+  DETECTION_CALIBRATION_PEAK,
+  DETECTION_CALIBRATION_ENDED,
+  // The latest adaptive calibration estimate, in adaptive.
+  DETECTION_ADAPTIVE,
+};
+
+// What detection found, for loop() to send out.
+struct DetectionEvent {
+  DetectionEventType type;
+  uint8_t channel;
+  uint16_t rssiPeak;
+  uint64_t timeStamp;
+  PassEvent pass;
+  AdaptiveEstimate adaptive;
+};
+
+// The rssi log of the last rssiSendInterval, for the rssi event.
+struct RssiReport {
+  uint64_t timeStamp;
+  uint16_t rssi;
+  uint32_t sampleInterval;
+  RssiLog<RSSI_LOG_CAPACITY> log;
+};
+
+// Filled by detection, drained by loop(). Neither side waits on the other.
+SpscRingBuffer<DetectionEvent, 32> detectionEvents;
+SpscRingBuffer<RssiReport, 2> rssiReports;
+
+// Retunes when the hopper says so, and only keeps samples once the module
+// has settled on the channel.
+uint64_t lastSamplerTick = 0;
+
+// Boot to the first sample taken, 0 until then.
+volatile uint64_t firstSampleMicros = 0;
+
+// Longest between two sampler ticks since loop() last cleared it.
+volatile uint32_t sampleIntervalPeak = 0;
+
+void sampleRssi() {
+  uint64_t now = micros64();
+  if (lastSamplerTick != 0) {
+    uint32_t interval = now - lastSamplerTick;
+    metrics.sampleInterval.record(interval);
+    if (interval > sampleIntervalPeak) {
+      sampleIntervalPeak = interval;
+    }
+    if (interval > RSSI_SAMPLE_PERIOD_MICROS * 3 / 2) {
+      metrics.missedSamples.add(
+          (interval + RSSI_SAMPLE_PERIOD_MICROS / 2) / RSSI_SAMPLE_PERIOD_MICROS - 1);
+    }
+  }
+  lastSamplerTick = now;
+
+  ChannelConfig config;
+  bool configured = false;
+  while (channelRequests.pop(config)) {
+    configured = true;
+  }
+  if (configured) {
+    channelHopper.configure(config);
+    rx5808.setSettleMicros(config.settleMicros);
+  }
+
+  SpectrumScanConfig scanConfig;
+  if (!spectrumScan.active() && spectrumRequests.pop(scanConfig) &&
+      !spectrumScan.start(scanConfig, now)) {
+    spectrumScanRefused = true;
+  }
+  // No samples for detection while sweeping.
+  if (spectrumScan.active()) {
+    if (spectrumScan.tick(now, rx5808, rssiRead)) {
+      spectrumResults.push(spectrumScan.result());
+      // Back to the timing channels.
+      channelHopper.configure(channelHopper.config());
+      rx5808.setSettleMicros(channelHopper.config().settleMicros);
     }
-    vtxHex >>= 1; // Shift bits along to check the next one
+    return;
+  }
+
+  if (channelHopper.due(now)) {
+    rx5808.tune(channelHopper.advance(now), now);
+    return;
+  }
+
+  if (!rx5808.isSettled(now)) {
+    rssiDrain();
+    return;
   }
 
-  for (i = 4; i > 0; i--) // Remaining D16-D19
-    SERIAL_SENDBIT0();
+  RssiSample sample;
+  sample.timeStamp = now;
+  sample.rssiRaw = rssiRead();
+  sample.channel = channelHopper.channel();
+  rssiSamples.push(sample);
 
-  SERIAL_ENABLE_HIGH(); // Finished clocking data in
-  delay(2);
+  if (firstSampleMicros == 0) {
+    firstSampleMicros = now;
+  }
+}
 
-  digitalWrite(slaveSelectPin, LOW);
-  digitalWrite(spiClockPin, LOW);
-  digitalWrite(spiDataPin, LOW);
+#if defined(ESP8266)
+uint64_t lastRssiSampleTime = 0;
+
+// No esp_timer on ESP8266, so sample from loop() as close to the rate as
+// loop() allows.
+void startRssiSampler() {}
+
+void pollRssiSampler() {
+  uint64_t now = micros64();
+  if (now - lastRssiSampleTime >= RSSI_SAMPLE_PERIOD_MICROS) {
+    lastRssiSampleTime = now;
+    sampleRssi();
+  }
+}
+#elif DETECTION_TASK
+hw_timer_t *rssiSamplerTimer = NULL;
+TaskHandle_t rssiSamplerTask = NULL;
+
+void IRAM_ATTR rssiSamplerIsr() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(rssiSamplerTask, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Wakes the calling task at the sample rate, see waitRssiSampler(). The
+// interrupt goes to the core of the caller, so call it from the task.
+void startRssiSampler() {
+  rssiSamplerTask = xTaskGetCurrentTaskHandle();
+
+  // 1MHz ticks.
+  rssiSamplerTimer = timerBegin(0, 80, true);
+  timerAttachInterrupt(rssiSamplerTimer, &rssiSamplerIsr, true);
+  timerAlarmWrite(rssiSamplerTimer, RSSI_SAMPLE_PERIOD_MICROS, true);
+  timerAlarmEnable(rssiSamplerTimer);
+
+  Serial.print("RSSI sampler started at Hz: ");
+  Serial.println(RSSI_SAMPLE_RATE_HZ);
+}
+
+// Blocks until the next sample is due. Ticks missed while busy collapse
+// into one.
+void waitRssiSampler() { ulTaskNotifyTake(pdTRUE, portMAX_DELAY); }
+
+void pollRssiSampler() {}
+#else
+esp_timer_handle_t rssiSamplerTimer = NULL;
+
+void rssiSamplerCallback(void * /*arg*/) { sampleRssi(); }
+
+// Samples from the esp_timer task, so the rate doesn't depend on loop().
+void startRssiSampler() {
+  esp_timer_create_args_t args = {};
+  args.callback = &rssiSamplerCallback;
+  args.dispatch_method = ESP_TIMER_TASK;
+  args.name = "rssi";
+
+  esp_timer_create(&args, &rssiSamplerTimer);
+  esp_timer_start_periodic(rssiSamplerTimer, RSSI_SAMPLE_PERIOD_MICROS);
+
+  Serial.print("RSSI sampler started at Hz: ");
+  Serial.println(RSSI_SAMPLE_RATE_HZ);
+}
+
+void pollRssiSampler() {}
+#endif
+
+// Hands the channels to the sampler, returns false if it is still busy with
+// earlier requests.
+bool requestChannels(const ChannelConfig &config) {
+  if (!channelRequests.push(config)) {
+    return false;
+  }
+
+  state.channelCount = config.count;
+  // Passes of the old channels don't carry over.
+  channelsGeneration = channelsGeneration + 1;
+  return true;
+}
+
+// Set the frequency given on the rx5808 module, and stop hopping. Returns
+// right away, the sampler retunes and discards samples until the module has
+// settled. Returns false, and leaves settings alone, if the sampler is still
+// busy with earlier requests.
+bool setRxModule(int frequency) {
+  MetricTimer timer(metrics.setRxModule);
+
+  ChannelConfig config;
+  config.frequencies[0] = frequency;
+  config.count = 1;
+  config.settleMicros = RX5808_SETTLE_MICROS;
+  if (!requestChannels(config)) {
+    return false;
+  }
 
   settings.vtxFreq = frequency;
-  Serial.println("rx5808 set.");
+  invalidateSettingsJson();
+
+  Serial.print("Setup rx5808 frequency to: ");
+  Serial.println(frequency);
+  return true;
 }
 
-// Read the RSSI value for the current channel
-int rssiRead() { return analogRead(RSSI_PIN); }
+// Hop across several frequencies, one pilot each. Not persisted. Returns
+// false if the sampler is still busy with earlier requests.
+bool setRxChannels(const ChannelConfig &config) {
+  if (!requestChannels(config)) {
+    return false;
+  }
+
+  Serial.print("Setup rx5808 hopping across channels: ");
+  Serial.println(config.count);
+  return true;
+}
 
 void printWifiInfo() {
   Serial.print("IP address for network ");
@@ -293,3 +898,207 @@ void printWifiInfo() {
   Serial.print("Password: ");
   Serial.println(settings.apPwd);
 }
+
+struct ArduinoWifiDriver {
+  bool connected() { return WiFi.status() == WL_CONNECTED; }
+  void begin() { WiFi.begin(settings.routerSsid, settings.routerPwd); }
+  void disconnect() { WiFi.disconnect(); }
+};
+
+ArduinoWifiDriver wifiDriver;
+// The router connection, polled from loop(). See wifi_connection.h.
+WifiConnection<ArduinoWifiDriver> wifiConnection(wifiDriver);
+
+struct ArduinoGateTransport {
+  WiFiUDP udp;
+
+  void broadcast(const uint8_t *data, size_t len) {
+    // 255.255.255.255
+    sendTo(0xFFFFFFFF, data, len);
+  }
+
+  void sendTo(uint32_t address, const uint8_t *data, size_t len) {
+    udp.beginPacket(IPAddress(address), GATE_SYNC_PORT);
+    udp.write(data, len);
+    udp.endPacket();
+  }
+};
+
+#if OTA_THROTTLED
+// The partition an upload goes to, the next app slot or the filesystem.
+struct EspOtaFlash {
+  const esp_partition_t *partition = NULL;
+  bool firmware = true;
+
+  bool begin(bool filesystem) {
+    firmware = !filesystem;
+    partition = filesystem
+                    ? esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                               ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+                                               NULL)
+                    : esp_ota_get_next_update_partition(NULL);
+    return partition != NULL;
+  }
+
+  bool eraseSector(uint32_t index) {
+    uint32_t offset = index * OTA_SECTOR_SIZE;
+    return offset + OTA_SECTOR_SIZE <= partition->size &&
+           esp_partition_erase_range(partition, offset, OTA_SECTOR_SIZE) ==
+               ESP_OK;
+  }
+
+  bool write(uint32_t offset, const uint8_t *data, size_t len) {
+    return offset + len <= partition->size &&
+           esp_partition_write(partition, offset, data, len) == ESP_OK;
+  }
+
+  // Booting from it checks the image, a broken one is refused.
+  bool finish(uint32_t size) {
+    return !firmware || esp_ota_set_boot_partition(partition) == ESP_OK;
+  }
+};
+
+EspOtaFlash otaFlash;
+// Filled by the upload handler, written by loop().
+OtaPipeline<EspOtaFlash> otaPipeline(otaFlash);
+// Only touched from loop().
+OtaThrottle otaThrottle;
+
+// The upload being written, NULL if none or its client went away. Others
+// are refused meanwhile. This and the backlog are shared by the upload
+// handler and loop(), under otaLock; either pushes to otaPipeline.
+AsyncWebServerRequest *otaRequest = NULL;
+TaskLock otaLock;
+uint8_t otaBacklog[OTA_BACKLOG_SIZE];
+size_t otaBacklogStart = 0;
+size_t otaBacklogEnd = 0;
+// Whether TCP acks are held back until the backlog is queued.
+bool otaAcksHeld = false;
+// The upload is complete but its backlog isn't queued yet, loop() ends it.
+bool otaEndPending = false;
+bool otaEndOk = false;
+// The request handler came before the upload was written, loop() answers.
+bool otaResponsePending = false;
+MD5Builder otaMd5;
+char otaExpectedMd5[33];
+// The request's size, multipart framing included.
+uint32_t otaUploadSize = 0;
+#endif
+
+ArduinoGateTransport gateTransport;
+// Only touched from loop(), runs while settings.gateSync is on and the
+// router is connected.
+GateSync<ArduinoGateTransport> gateSync(gateTransport);
+bool gateSyncRunning = false;
+
+#if defined(ESP32S3)
+// Raw trace in PSRAM, for boards that have it.
+#ifndef RAW_TRACE_PSRAM_BYTES
+#define RAW_TRACE_PSRAM_BYTES (2 * 1024 * 1024)
+#endif
+
+class PsramTraceStorage : public RawTraceStorage {
+ public:
+  bool begin() override {
+    if (!blocks_ && psramFound()) {
+      blocks_ = (uint8_t *)ps_malloc(RAW_TRACE_PSRAM_BYTES);
+    }
+    return blocks_ != NULL;
+  }
+
+  uint32_t capacity() override {
+    return RAW_TRACE_PSRAM_BYTES / RAW_TRACE_BLOCK_SIZE;
+  }
+
+  bool writeBlock(uint32_t index, const uint8_t *block) override {
+    memcpy(blocks_ + index * RAW_TRACE_BLOCK_SIZE, block, RAW_TRACE_BLOCK_SIZE);
+    return true;
+  }
+
+  bool readBlock(uint32_t index, uint8_t *block) override {
+    memcpy(block, blocks_ + index * RAW_TRACE_BLOCK_SIZE, RAW_TRACE_BLOCK_SIZE);
+    return true;
+  }
+
+ private:
+  uint8_t *blocks_ = NULL;
+};
+
+PsramTraceStorage psramTraceStorage;
+#endif
+
+#define RAW_TRACE_FILE "/trace.bin"
+
+// 256KB, about 30s at 2kHz.
+#ifndef RAW_TRACE_FILE_BLOCKS
+#define RAW_TRACE_FILE_BLOCKS 512
+#endif
+
+// Raw trace in a LittleFS file, overwritten in place once full. Flash
+// writes stall the sampler now and then, PSRAM doesn't.
+class FileTraceStorage : public RawTraceStorage {
+ public:
+  bool begin() override {
+#if defined(ESP8266)
+    bool mounted = LittleFS.begin();
+#else
+    bool mounted = LittleFS.begin(true);
+#endif
+    if (!mounted) {
+      return false;
+    }
+
+    // Every capture starts a new file, open until the next one.
+    if (file_) {
+      file_.close();
+    }
+    file_ = LittleFS.open(RAW_TRACE_FILE, "w+");
+    return (bool)file_;
+  }
+
+  uint32_t capacity() override { return RAW_TRACE_FILE_BLOCKS; }
+
+  bool writeBlock(uint32_t index, const uint8_t *block) override {
+    return file_.seek(index * RAW_TRACE_BLOCK_SIZE) &&
+           file_.write(block, RAW_TRACE_BLOCK_SIZE) == RAW_TRACE_BLOCK_SIZE;
+  }
+
+  bool readBlock(uint32_t index, uint8_t *block) override {
+    return file_.seek(index * RAW_TRACE_BLOCK_SIZE) &&
+           file_.read(block, RAW_TRACE_BLOCK_SIZE) == RAW_TRACE_BLOCK_SIZE;
+  }
+
+ private:
+  File file_;
+};
+
+FileTraceStorage fileTraceStorage;
+
+// Blocks written by loop(), read by the download handler once stopped.
+RawTraceRing rawTrace;
+
+enum RawTraceState : uint8_t {
+  TRACE_IDLE,
+  TRACE_CAPTURING,
+  // Detection hands over the last block, then loop() goes idle.
+  TRACE_STOPPING,
+};
+
+volatile RawTraceState rawTraceState = TRACE_IDLE;
+
+struct RawTraceBlock {
+  uint8_t data[RAW_TRACE_BLOCK_SIZE];
+};
+
+// Full blocks, from detection to loop().
+SpscRingBuffer<RawTraceBlock, 4> rawTraceBlocks;
+
+// Starts a new trace, in PSRAM if there is some.
+bool beginRawTrace() {
+#if defined(ESP32S3)
+  if (rawTrace.begin(&psramTraceStorage)) {
+    return true;
+  }
+#endif
+  return rawTrace.begin(&fileTraceStorage);
+}
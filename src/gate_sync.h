@@ -0,0 +1,555 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Passes shared between timers on the same network, in one timebase.
+//
+// The timer with the lowest id is the leader, its micros are the shared
+// clock. Every timer announces itself by broadcast, so all of them agree on
+// who leads, and followers sync to the leader NTP style: a request carries
+// the follower's send time t1, the leader answers with its receive time t2
+// and send time t3, and the follower notes t4 on arrival.
+//   offset = ((t2 - t1) + (t3 - t4)) / 2    leader clock minus ours
+//   delay  = (t4 - t1) - (t3 - t2)          round trip on the network
+// An exchange is only as good as its delay is symmetric, so of every
+// GATE_SYNC_WINDOW exchanges only the one with the lowest delay is kept, as
+// an anchor. A least squares line through the last GATE_SYNC_ANCHORS
+// anchors gives the offset and its drift, crystals are off by tens of ppm.
+// Until the first anchor the best exchange so far is used, without drift.
+//
+// Passes go to every known peer by unicast, GATE_PASS_SENDS times as UDP
+// may drop them, with a per timer sequence number to drop the copies and
+// count the lost. A timer that rebooted announces a new nonce, and its
+// sequence starts over. Unicast as WiFi holds broadcasts back until the
+// next DTIM beacon when a station sleeps, 100ms or more.
+//
+// Ids are picked at random, so two timers may end up with the same one and
+// would ignore each other. Announcements carry a random nonce as well: one
+// with our id but another nonce is a second timer, and the one with the
+// lower nonce reports idCollision() to take an id nobody uses, freeId().
+//
+// All packets: u8 GATE_SYNC_VERSION, u8 GatePacketType, u8 sender id, then
+// the payload, integers little endian.
+//   GATE_ANNOUNCE (1)
+//     u32 nonce
+//   GATE_SYNC_REQUEST (2)
+//     u32 seq, u64 t1
+//   GATE_SYNC_RESPONSE (3)
+//     u8 requester id, u32 seq, u64 t1, u64 t2, u64 t3
+//   GATE_PASS (4)
+//     u32 seq, u8 channel, u32 lap, u8 synced, u16 rssiPeak,
+//     u64 timeStamp, u64 detectedTimeStamp, u64 sentTimeStamp
+//     Times in micros of the shared clock if synced, of the sender if not.
+//
+// Transport provides:
+//   void broadcast(const uint8_t *data, size_t len);
+//   void sendTo(uint32_t address, const uint8_t *data, size_t len);
+// Addresses are whatever the transport passes to receive(), e.g. IPv4.
+
+#define GATE_SYNC_VERSION 1
+
+#ifndef GATE_SYNC_PORT
+#define GATE_SYNC_PORT 5808
+#endif
+
+// Timer ids are 0 - 25.
+#define GATE_MAX_TIMERS 26
+
+#define GATE_SYNC_MAX_PACKET_SIZE 48
+
+#ifndef GATE_ANNOUNCE_INTERVAL_MICROS
+#define GATE_ANNOUNCE_INTERVAL_MICROS (2 * 1000 * 1000)
+#endif
+
+// Timers not heard from for this long are gone.
+#ifndef GATE_PEER_TIMEOUT_MICROS
+#define GATE_PEER_TIMEOUT_MICROS (3 * GATE_ANNOUNCE_INTERVAL_MICROS)
+#endif
+
+#ifndef GATE_SYNC_INTERVAL_MICROS
+#define GATE_SYNC_INTERVAL_MICROS (250 * 1000)
+#endif
+
+// Exchanges per anchor, 4s at 250ms.
+#ifndef GATE_SYNC_WINDOW
+#define GATE_SYNC_WINDOW 16
+#endif
+
+// Anchors the drift is fitted over, about a minute at 4s. WiFi jitter
+// needs the span to tell drift from noise.
+#ifndef GATE_SYNC_ANCHORS
+#define GATE_SYNC_ANCHORS 16
+#endif
+
+// Exchanges slower than this are dropped, the answer may be to an older
+// request.
+#ifndef GATE_SYNC_MAX_DELAY_MICROS
+#define GATE_SYNC_MAX_DELAY_MICROS (100 * 1000)
+#endif
+
+#ifndef GATE_PASS_SENDS
+#define GATE_PASS_SENDS 2
+#endif
+
+enum GatePacketType : uint8_t {
+  GATE_ANNOUNCE = 1,
+  GATE_SYNC_REQUEST = 2,
+  GATE_SYNC_RESPONSE = 3,
+  GATE_PASS = 4,
+};
+
+struct GatePass {
+  // Timer that saw the pass.
+  uint8_t id = 0;
+  uint32_t seq = 0;
+  uint8_t channel = 0;
+  uint32_t lap = 0;
+  // Whether the times are of the shared clock.
+  bool synced = false;
+  uint16_t rssiPeak = 0;
+  uint64_t timeStamp = 0;
+  uint64_t detectedTimeStamp = 0;
+  uint64_t sentTimeStamp = 0;
+};
+
+struct GateSyncStatus {
+  uint8_t leaderId = 0;
+  bool synced = false;
+  // Leader clock minus ours, now.
+  int64_t offsetMicros = 0;
+  // Leader clock rate relative to ours, in parts per billion.
+  int32_t driftPpb = 0;
+  // Half the delay of the newest anchor, what the offset may be off by.
+  uint32_t errorMicros = 0;
+  uint32_t exchanges = 0;
+  uint8_t peers = 0;
+  uint32_t passesReceived = 0;
+  uint32_t passesLost = 0;
+};
+
+inline void gatePut(uint8_t *out, uint64_t value, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+inline uint64_t gateGet(const uint8_t *in, uint8_t bytes) {
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+// Packet sizes, header included.
+#define GATE_HEADER_SIZE 3
+#define GATE_ANNOUNCE_SIZE (GATE_HEADER_SIZE + 4)
+#define GATE_SYNC_REQUEST_SIZE (GATE_HEADER_SIZE + 4 + 8)
+#define GATE_SYNC_RESPONSE_SIZE (GATE_HEADER_SIZE + 1 + 4 + 3 * 8)
+#define GATE_PASS_SIZE (GATE_HEADER_SIZE + 4 + 1 + 4 + 1 + 2 + 3 * 8)
+
+inline size_t encodeGatePass(uint8_t *out, const GatePass &pass) {
+  out[0] = GATE_SYNC_VERSION;
+  out[1] = GATE_PASS;
+  out[2] = pass.id;
+  gatePut(out + 3, pass.seq, 4);
+  out[7] = pass.channel;
+  gatePut(out + 8, pass.lap, 4);
+  out[12] = pass.synced;
+  gatePut(out + 13, pass.rssiPeak, 2);
+  gatePut(out + 15, pass.timeStamp, 8);
+  gatePut(out + 23, pass.detectedTimeStamp, 8);
+  gatePut(out + 31, pass.sentTimeStamp, 8);
+  return GATE_PASS_SIZE;
+}
+
+inline bool decodeGatePass(const uint8_t *in, size_t len, GatePass &pass) {
+  if (len < GATE_PASS_SIZE || in[0] != GATE_SYNC_VERSION ||
+      in[1] != GATE_PASS || in[2] >= GATE_MAX_TIMERS) {
+    return false;
+  }
+  pass.id = in[2];
+  pass.seq = gateGet(in + 3, 4);
+  pass.channel = in[7];
+  pass.lap = gateGet(in + 8, 4);
+  pass.synced = in[12] != 0;
+  pass.rssiPeak = gateGet(in + 13, 2);
+  pass.timeStamp = gateGet(in + 15, 8);
+  pass.detectedTimeStamp = gateGet(in + 23, 8);
+  pass.sentTimeStamp = gateGet(in + 31, 8);
+  return true;
+}
+
+// Offset and drift to the leader from sync exchanges, see the top of this
+// file. Integer math only.
+class GateClock {
+ public:
+  void reset() {
+    exchanges_ = 0;
+    windowCount_ = 0;
+    anchorCount_ = 0;
+    nextAnchor_ = 0;
+    synced_ = false;
+    driftPpb_ = 0;
+  }
+
+  // One exchange, all times in micros of the clock that took them.
+  void addExchange(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+    int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+    if (delay < 0 || delay > GATE_SYNC_MAX_DELAY_MICROS) {
+      return;
+    }
+    int64_t offset = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+    exchanges_++;
+
+    if (windowCount_ == 0 || delay < windowBest_.delay) {
+      windowBest_.localTime = t4;
+      windowBest_.offset = offset;
+      windowBest_.delay = (uint32_t)delay;
+    }
+    windowCount_++;
+
+    if (windowCount_ >= GATE_SYNC_WINDOW) {
+      anchors_[nextAnchor_] = windowBest_;
+      nextAnchor_ = (nextAnchor_ + 1) % GATE_SYNC_ANCHORS;
+      if (anchorCount_ < GATE_SYNC_ANCHORS) {
+        anchorCount_++;
+      }
+      windowCount_ = 0;
+      fit();
+    } else if (anchorCount_ == 0) {
+      base_ = windowBest_;
+      driftPpb_ = 0;
+      synced_ = true;
+    }
+  }
+
+  bool synced() const { return synced_; }
+
+  // Leader clock minus ours at local.
+  int64_t offsetAt(uint64_t local) const {
+    return base_.offset +
+           (int64_t)(local - base_.localTime) * driftPpb_ / 1000000000;
+  }
+
+  uint64_t toLeader(uint64_t local) const { return local + offsetAt(local); }
+
+  int32_t driftPpb() const { return driftPpb_; }
+  uint32_t errorMicros() const { return base_.delay / 2; }
+  uint32_t exchanges() const { return exchanges_; }
+
+ private:
+  struct Anchor {
+    uint64_t localTime = 0;
+    int64_t offset = 0;
+    uint32_t delay = 0;
+  };
+
+  // Least squares over the anchors, relative to the newest one, x in millis
+  // and y in micros so the sums fit.
+  void fit() {
+    const Anchor &newest =
+        anchors_[(nextAnchor_ + GATE_SYNC_ANCHORS - 1) % GATE_SYNC_ANCHORS];
+    int64_t n = anchorCount_;
+    int64_t sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (uint8_t i = 0; i < anchorCount_; i++) {
+      int64_t x = ((int64_t)(anchors_[i].localTime - newest.localTime)) / 1000;
+      int64_t y = anchors_[i].offset - newest.offset;
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+    }
+
+    int64_t den = n * sxx - sx * sx;
+    int64_t num = n * sxy - sx * sy;
+    int64_t slopeScaled = den > 0 ? num * 1000000 / den : 0; // ppb
+    // Line at the newest anchor: mean y - slope * mean x.
+    int64_t intercept = den > 0 ? (sy * den - num * sx) / (n * den) : 0;
+
+    base_.localTime = newest.localTime;
+    base_.offset = newest.offset + intercept;
+    base_.delay = newest.delay;
+    driftPpb_ = (int32_t)slopeScaled;
+    synced_ = true;
+  }
+
+  Anchor windowBest_;
+  uint8_t windowCount_ = 0;
+  Anchor anchors_[GATE_SYNC_ANCHORS];
+  uint8_t anchorCount_ = 0;
+  uint8_t nextAnchor_ = 0;
+
+  Anchor base_;
+  int32_t driftPpb_ = 0;
+  bool synced_ = false;
+  uint32_t exchanges_ = 0;
+};
+
+template <typename Transport>
+class GateSync {
+ public:
+  explicit GateSync(Transport &transport) : transport_(transport) {}
+
+  // nonce tells us from another timer with the same id, random and not 0;
+  // 0 never reports a collision.
+  void begin(uint8_t id, uint64_t now, uint32_t nonce = 0) {
+    id_ = id;
+    nonce_ = nonce;
+    idCollision_ = false;
+    memset(peers_, 0, sizeof(peers_));
+    leaderId_ = id;
+    clock_.reset();
+    nextAnnounce_ = now;
+    nextRequest_ = now;
+    passSeq_ = 0;
+    passesReceived_ = 0;
+    passesLost_ = 0;
+  }
+
+  // Polled, announces and syncs when due.
+  void update(uint64_t now) {
+    electLeader(now);
+
+    if ((int64_t)(now - nextAnnounce_) >= 0) {
+      nextAnnounce_ = now + GATE_ANNOUNCE_INTERVAL_MICROS;
+      uint8_t packet[GATE_ANNOUNCE_SIZE];
+      header(packet, GATE_ANNOUNCE);
+      gatePut(packet + 3, nonce_, 4);
+      transport_.broadcast(packet, sizeof(packet));
+    }
+
+    if (leaderId_ != id_ && (int64_t)(now - nextRequest_) >= 0) {
+      nextRequest_ = now + GATE_SYNC_INTERVAL_MICROS;
+      requestSeq_++;
+      requestTime_ = now;
+      uint8_t packet[GATE_SYNC_REQUEST_SIZE];
+      header(packet, GATE_SYNC_REQUEST);
+      gatePut(packet + 3, requestSeq_, 4);
+      gatePut(packet + 7, now, 8);
+      transport_.sendTo(peers_[leaderId_].address, packet, sizeof(packet));
+    }
+  }
+
+  // Handles a packet from address, received at now. Returns true and fills
+  // pass for a pass not seen before.
+  bool receive(const uint8_t *data, size_t len, uint32_t address,
+               uint64_t now, GatePass &pass) {
+    if (len < GATE_HEADER_SIZE || data[0] != GATE_SYNC_VERSION ||
+        data[2] >= GATE_MAX_TIMERS) {
+      return false;
+    }
+    uint8_t sender = data[2];
+    if (sender == id_) {
+      // Our own broadcast, or another timer with our id.
+      if (data[1] == GATE_ANNOUNCE && len >= GATE_ANNOUNCE_SIZE) {
+        uint32_t nonce = gateGet(data + 3, 4);
+        if (nonce_ != 0 && nonce != 0 && nonce > nonce_) {
+          idCollision_ = true;
+        }
+      }
+      return false;
+    }
+    Peer &peer = peers_[sender];
+    if (!peer.heard) {
+      // New, or back after a reboot, sequences start over.
+      peer.lastPassSeq = 0;
+      peer.nonce = 0;
+    }
+    peer.heard = true;
+    peer.lastSeen = now;
+    peer.address = address;
+
+    switch (data[1]) {
+      case GATE_ANNOUNCE: {
+        if (len < GATE_ANNOUNCE_SIZE) {
+          return false;
+        }
+        // A new nonce is a reboot, even if its first passes got lost and
+        // seq 1 never arrives.
+        uint32_t nonce = gateGet(data + 3, 4);
+        if (peer.nonce != 0 && nonce != peer.nonce) {
+          peer.lastPassSeq = 0;
+        }
+        peer.nonce = nonce;
+        electLeader(now);
+        return false;
+      }
+
+      case GATE_SYNC_REQUEST:
+        if (len < GATE_SYNC_REQUEST_SIZE || leaderId_ != id_) {
+          return false;
+        }
+        respond(sender, address, gateGet(data + 3, 4), gateGet(data + 7, 8),
+                now);
+        return false;
+
+      case GATE_SYNC_RESPONSE: {
+        if (len < GATE_SYNC_RESPONSE_SIZE || data[3] != id_ ||
+            sender != leaderId_ || gateGet(data + 4, 4) != requestSeq_) {
+          return false;
+        }
+        uint64_t t1 = gateGet(data + 8, 8);
+        if (t1 != requestTime_) {
+          return false;
+        }
+        clock_.addExchange(t1, gateGet(data + 16, 8), gateGet(data + 24, 8),
+                           now);
+        return false;
+      }
+
+      case GATE_PASS:
+        if (!decodeGatePass(data, len, pass)) {
+          return false;
+        }
+        if (pass.seq <= peer.lastPassSeq) {
+          // A copy, unless the sender rebooted.
+          if (pass.seq != 1 || peer.lastPassSeq == 1) {
+            return false;
+          }
+        } else if (peer.lastPassSeq != 0) {
+          passesLost_ += pass.seq - peer.lastPassSeq - 1;
+        }
+        peer.lastPassSeq = pass.seq;
+        passesReceived_++;
+        return true;
+    }
+    return false;
+  }
+
+  // Sends a pass seen here, times in micros of our clock. Returns it as
+  // sent.
+  GatePass sendPass(GatePass pass, uint64_t now) {
+    pass.id = id_;
+    pass.seq = ++passSeq_;
+    pass.synced = synced();
+    pass.timeStamp = toShared(pass.timeStamp);
+    pass.detectedTimeStamp = toShared(pass.detectedTimeStamp);
+    pass.sentTimeStamp = toShared(now);
+
+    uint8_t packet[GATE_PASS_SIZE];
+    encodeGatePass(packet, pass);
+    for (uint8_t send = 0; send < GATE_PASS_SENDS; send++) {
+      for (uint8_t i = 0; i < GATE_MAX_TIMERS; i++) {
+        if (peers_[i].heard) {
+          transport_.sendTo(peers_[i].address, packet, sizeof(packet));
+        }
+      }
+    }
+    return pass;
+  }
+
+  // Whether another timer has our id and we should give it up, for
+  // freeId() and begin() again.
+  bool idCollision() const { return idCollision_; }
+
+  // The first id from start on that no timer we heard of has, ours if all
+  // are taken.
+  uint8_t freeId(uint8_t start) const {
+    for (uint8_t i = 0; i < GATE_MAX_TIMERS; i++) {
+      uint8_t id = (start + i) % GATE_MAX_TIMERS;
+      if (id != id_ && !peers_[id].heard) {
+        return id;
+      }
+    }
+    return id_;
+  }
+
+  bool leader() const { return leaderId_ == id_; }
+  bool synced() const { return leader() || clock_.synced(); }
+
+  // Our micros in the shared clock, unchanged until synced.
+  uint64_t toShared(uint64_t local) const {
+    return leader() ? local : clock_.toLeader(local);
+  }
+
+  GateSyncStatus status(uint64_t now) const {
+    GateSyncStatus status;
+    status.leaderId = leaderId_;
+    status.synced = synced();
+    status.offsetMicros = leader() ? 0 : clock_.offsetAt(now);
+    status.driftPpb = leader() ? 0 : clock_.driftPpb();
+    status.errorMicros = leader() ? 0 : clock_.errorMicros();
+    status.exchanges = clock_.exchanges();
+    for (uint8_t i = 0; i < GATE_MAX_TIMERS; i++) {
+      if (peers_[i].heard) {
+        status.peers++;
+      }
+    }
+    status.passesReceived = passesReceived_;
+    status.passesLost = passesLost_;
+    return status;
+  }
+
+ private:
+  struct Peer {
+    bool heard;
+    uint64_t lastSeen;
+    uint32_t address;
+    // Of its last announce, 0 if none yet.
+    uint32_t nonce;
+    uint32_t lastPassSeq;
+  };
+
+  void header(uint8_t *packet, GatePacketType type) {
+    packet[0] = GATE_SYNC_VERSION;
+    packet[1] = type;
+    packet[2] = id_;
+  }
+
+  void respond(uint8_t requester, uint32_t address, uint32_t seq, uint64_t t1,
+               uint64_t t2) {
+    uint8_t packet[GATE_SYNC_RESPONSE_SIZE];
+    header(packet, GATE_SYNC_RESPONSE);
+    packet[3] = requester;
+    gatePut(packet + 4, seq, 4);
+    gatePut(packet + 8, t1, 8);
+    gatePut(packet + 16, t2, 8);
+    // Answered right away, no clock read in between.
+    gatePut(packet + 24, t2, 8);
+    transport_.sendTo(address, packet, sizeof(packet));
+  }
+
+  // Forgets timers that went quiet, the lowest id left leads.
+  void electLeader(uint64_t now) {
+    uint8_t leader = id_;
+    for (uint8_t i = 0; i < GATE_MAX_TIMERS; i++) {
+      Peer &peer = peers_[i];
+      if (!peer.heard) {
+        continue;
+      }
+      if ((int64_t)(now - peer.lastSeen) > GATE_PEER_TIMEOUT_MICROS) {
+        peer.heard = false;
+        continue;
+      }
+      if (i < leader) {
+        leader = i;
+      }
+    }
+
+    if (leader != leaderId_) {
+      leaderId_ = leader;
+      clock_.reset();
+      nextRequest_ = now;
+    }
+  }
+
+  Transport &transport_;
+  uint8_t id_ = 0;
+  uint32_t nonce_ = 0;
+  bool idCollision_ = false;
+  uint8_t leaderId_ = 0;
+  Peer peers_[GATE_MAX_TIMERS] = {};
+  GateClock clock_;
+
+  uint64_t nextAnnounce_ = 0;
+  uint64_t nextRequest_ = 0;
+  uint32_t requestSeq_ = 0;
+  uint64_t requestTime_ = 0;
+
+  uint32_t passSeq_ = 0;
+  uint32_t passesReceived_ = 0;
+  uint32_t passesLost_ = 0;
+};
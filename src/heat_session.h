@@ -0,0 +1,178 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A heat: from its start, every pilot's holeshot, laps and lap statistics.
+//
+// A pilot is a channel, one when not hopping. The first pass after the start
+// is the holeshot, every pass after that ends a lap. Statistics are updated
+// in O(1) per lap, so they cover the whole heat; only the last MaxLaps lap
+// times are kept.
+//
+// Times are micros, a lap longer than 71 minutes is clamped. The mean and
+// deviation use Welford's method in doubles, that is once per lap in loop(),
+// never per sample.
+//
+// Not thread safe. No Arduino dependency, so this builds on the host as well.
+
+// Best run of this many consecutive laps.
+#ifndef HEAT_CONSECUTIVE_LAPS
+#define HEAT_CONSECUTIVE_LAPS 3
+#endif
+
+class LapStats {
+ public:
+  void add(uint32_t lap) {
+    count_++;
+    last_ = lap;
+    if (best_ == 0 || lap < best_) {
+      best_ = lap;
+      bestLap_ = count_;
+    }
+
+    double delta = lap - mean_;
+    mean_ += delta / count_;
+    m2_ += delta * (lap - mean_);
+
+    // Sum of the last HEAT_CONSECUTIVE_LAPS laps.
+    uint32_t &slot = recent_[count_ % HEAT_CONSECUTIVE_LAPS];
+    recentSum_ += lap - (uint64_t)slot;
+    slot = lap;
+    if (count_ >= HEAT_CONSECUTIVE_LAPS &&
+        (bestConsecutive_ == 0 || recentSum_ < bestConsecutive_)) {
+      bestConsecutive_ = recentSum_;
+      bestConsecutiveLap_ = count_ - HEAT_CONSECUTIVE_LAPS + 1;
+    }
+  }
+
+  // Laps so far, the holeshot is not one.
+  uint32_t count() const { return count_; }
+  uint32_t last() const { return last_; }
+  // 0 until there is a lap.
+  uint32_t best() const { return best_; }
+  // Lap number of the best lap, from 1.
+  uint32_t bestLap() const { return bestLap_; }
+  uint32_t mean() const { return (uint32_t)(mean_ + 0.5); }
+  // Sample standard deviation, 0 until there are two laps.
+  uint32_t stddev() const {
+    return count_ < 2 ? 0 : (uint32_t)(sqrt(m2_ / (count_ - 1)) + 0.5);
+  }
+  // Best sum of HEAT_CONSECUTIVE_LAPS laps in a row, 0 until there are that
+  // many.
+  uint64_t bestConsecutive() const { return bestConsecutive_; }
+  // Lap number the best consecutive run starts at, from 1.
+  uint32_t bestConsecutiveLap() const { return bestConsecutiveLap_; }
+
+ private:
+  uint32_t count_ = 0;
+  uint32_t last_ = 0;
+  uint32_t best_ = 0;
+  uint32_t bestLap_ = 0;
+  double mean_ = 0;
+  double m2_ = 0;
+  uint32_t recent_[HEAT_CONSECUTIVE_LAPS] = {0};
+  uint64_t recentSum_ = 0;
+  uint64_t bestConsecutive_ = 0;
+  uint32_t bestConsecutiveLap_ = 0;
+};
+
+template <size_t MaxLaps>
+class HeatPilot {
+  static_assert(MaxLaps > 0, "MaxLaps must not be 0");
+
+ public:
+  // Returns the lap the pass ended, 0 for the holeshot.
+  uint32_t addPass(uint64_t heatStart, uint64_t timeStamp) {
+    if (passes_++ == 0) {
+      holeshot_ = clamp(timeStamp - heatStart);
+    } else {
+      uint32_t lap = clamp(timeStamp - lastPass_);
+      laps_[stats_.count() % MaxLaps] = lap;
+      stats_.add(lap);
+    }
+    lastPass_ = timeStamp;
+    return stats_.count();
+  }
+
+  // Passes so far, holeshot included.
+  uint32_t passes() const { return passes_; }
+  // From the start to the first pass, 0 until then.
+  uint32_t holeshot() const { return holeshot_; }
+  uint64_t lastPass() const { return lastPass_; }
+  const LapStats &stats() const { return stats_; }
+
+  // Lap numbers, from 1, whose times are still kept.
+  uint32_t firstKeptLap() const {
+    return stats_.count() > MaxLaps ? stats_.count() - MaxLaps + 1 : 1;
+  }
+  // Time of a kept lap, see firstKeptLap().
+  uint32_t lap(uint32_t number) const { return laps_[(number - 1) % MaxLaps]; }
+
+ private:
+  static uint32_t clamp(uint64_t micros) {
+    return micros > UINT32_MAX ? UINT32_MAX : (uint32_t)micros;
+  }
+
+  uint32_t passes_ = 0;
+  uint32_t holeshot_ = 0;
+  uint64_t lastPass_ = 0;
+  LapStats stats_;
+  uint32_t laps_[MaxLaps];
+};
+
+template <size_t MaxPilots, size_t MaxLaps>
+class HeatSession {
+  static_assert(MaxPilots > 0, "MaxPilots must not be 0");
+
+ public:
+  typedef HeatPilot<MaxLaps> Pilot;
+
+  // Starts a new heat, forgetting the last one.
+  void start(uint64_t now, uint8_t pilots) {
+    heat_++;
+    running_ = true;
+    startTime_ = now;
+    stopTime_ = 0;
+    pilotCount_ = pilots < 1 ? 1 : pilots > MaxPilots ? MaxPilots : pilots;
+    for (size_t i = 0; i < MaxPilots; i++) {
+      pilots_[i] = Pilot();
+    }
+  }
+
+  // Passes after this don't count, the results stay until the next start.
+  void stop(uint64_t now) {
+    if (running_) {
+      running_ = false;
+      stopTime_ = now;
+    }
+  }
+
+  // Returns false if the pass doesn't belong to the heat: none running, the
+  // quad passed before the start, or not a pilot of it.
+  bool addPass(uint8_t pilot, uint64_t timeStamp, uint32_t &lap) {
+    if (!running_ || timeStamp < startTime_ || pilot >= pilotCount_) {
+      return false;
+    }
+    lap = pilots_[pilot].addPass(startTime_, timeStamp);
+    return true;
+  }
+
+  // Heats started since boot, 0 if none.
+  uint32_t heat() const { return heat_; }
+  bool running() const { return running_; }
+  uint64_t startTime() const { return startTime_; }
+  // 0 while running.
+  uint64_t stopTime() const { return stopTime_; }
+  uint8_t pilotCount() const { return pilotCount_; }
+  const Pilot &pilot(uint8_t i) const { return pilots_[i]; }
+
+ private:
+  uint32_t heat_ = 0;
+  bool running_ = false;
+  uint64_t startTime_ = 0;
+  uint64_t stopTime_ = 0;
+  uint8_t pilotCount_ = 0;
+  Pilot pilots_[MaxPilots];
+};
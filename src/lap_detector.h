@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "peak_interpolator.h"
+#include "rssi_filter.h"
+
+// Hardware-independent crossing/lap detection.
+//
+// Takes timestamped raw RSSI samples, smooths them and runs the
+// enter/peak/leave state machine. No Arduino dependency, so traces can be
+// replayed through it on the host.
+
+struct LapDetectorConfig {
+  // Smoothed rssi has to be above this to count as crossing.
+  uint16_t enterRssiTrigger = 0;
+  // Smoothed rssi has to fall below this to count as leaving.
+  uint16_t leaveRssiTrigger = 0;
+  // Smoothing factor in 1/1000, same unit as settings.filterRatio.
+  uint8_t filterRatio = 30;
+  // Each lap has to take at least this long.
+  uint32_t minLapTimeMicros = 4 * 1000 * 1000;
+};
+
+struct PassEvent {
+  // Passes since the last reset, see HeatSession for laps of a heat.
+  uint32_t lap = 0;
+  // When the rssi peaked, this is the pass time. Interpolated when possible,
+  // otherwise the time of the highest raw sample.
+  uint64_t timeStamp = 0;
+  // Time since the previous pass' peak, 0 if the clock went backwards.
+  uint64_t interval = 0;
+  // The peak smoothed rssi of the pass.
+  uint16_t rssiPeak = 0;
+  // The peak raw rssi of the pass.
+  uint16_t rssiPeakRaw = 0;
+  // Time of the sample at which the quad was considered gone.
+  uint64_t detectedTimeStamp = 0;
+};
+
+class LapDetector {
+ public:
+  void setConfig(const LapDetectorConfig &config) {
+    config_ = config;
+    filter_.setFilterRatio(config.filterRatio);
+  }
+
+  const LapDetectorConfig &config() const { return config_; }
+
+  // Forgets the current crossing and all passes.
+  void reset() {
+    crossing_ = false;
+    rssiPeak_ = 0;
+    rssiPeakRaw_ = 0;
+    rssiPeakRawTimeStamp_ = 0;
+    lastPass_ = PassEvent();
+  }
+
+  // Feeds one raw sample. Returns true and fills pass when the quad has left
+  // the gate.
+  bool addSample(uint64_t timeStamp, uint16_t rssiRaw, PassEvent &pass) {
+    rssiRaw_ = rssiRaw;
+    rssi_ = filter_.update(rssiRaw);
+    peak_.addSample(timeStamp, rssiRaw);
+
+    if (!crossing_ && rssi_ > config_.enterRssiTrigger
+        /**
+         * Make sure the next crossing only happens after MIN lap time.
+         *
+         * To avoid the following cases:
+         * 0. Last passed
+         * 1. Within MIN_LAP_TIME_MILLIS RSSI jump high, crossing again
+         * 2. What if that crossing rssi is too high, and no later RSSI passes
+         *    that?
+         *
+         * So what we should check here is the next crossing should not
+         * happen until MIN_LAP_TIME_MILLIS, instead of checking the leave.
+         *
+         * This also makes sure we don't get hang by an overly large crossing
+         * RSSI.
+         * */
+        && (timeStamp - lastPass_.timeStamp > config_.minLapTimeMicros)) {
+      crossing_ = true; // Quad is going through the gate
+      peak_.beginPass();
+    }
+
+    if (!crossing_) {
+      return false;
+    }
+
+    if (rssi_ > rssiPeak_) {
+      rssiPeak_ = rssi_;
+    }
+
+    // Find the peak rssi and the time it occured during a crossing event
+    // Use the raw value to account for the delay in smoothing.
+    if (rssiRaw > rssiPeakRaw_) {
+      rssiPeakRaw_ = rssiRaw;
+      rssiPeakRawTimeStamp_ = timeStamp;
+    }
+
+    // See if we have left the gate.
+    if (rssi_ >= config_.leaveRssiTrigger) {
+      return false;
+    }
+
+    uint64_t lastPassTimeStamp = lastPass_.timeStamp;
+
+    lastPass_.lap = lastPass_.lap + 1;
+    lastPass_.timeStamp = rssiPeakRawTimeStamp_;
+    peak_.estimate(lastPass_.timeStamp);
+    lastPass_.rssiPeak = rssiPeak_;
+    lastPass_.rssiPeakRaw = rssiPeakRaw_;
+    lastPass_.detectedTimeStamp = timeStamp;
+
+    // In case some weird overflow happens.
+    lastPass_.interval = lastPass_.timeStamp < lastPassTimeStamp
+                             ? 0
+                             : lastPass_.timeStamp - lastPassTimeStamp;
+
+    crossing_ = false;
+    rssiPeakRaw_ = 0;
+    rssiPeak_ = 0;
+
+    pass = lastPass_;
+    return true;
+  }
+
+  // True when the quad is going through the gate.
+  bool crossing() const { return crossing_; }
+  // Latest smoothed rssi.
+  uint16_t rssi() const { return rssi_; }
+  // Latest unsmoothed rssi.
+  uint16_t rssiRaw() const { return rssiRaw_; }
+  // The most recent pass, lap 0 if there hasn't been one.
+  const PassEvent &lastPass() const { return lastPass_; }
+
+ private:
+  LapDetectorConfig config_;
+  RssiFilter filter_;
+  PeakInterpolator peak_;
+
+  bool crossing_ = false;
+
+  uint16_t rssiRaw_ = 0;
+  uint16_t rssi_ = 0;
+
+  // Peaks of the current pass.
+  uint16_t rssiPeak_ = 0;
+  uint16_t rssiPeakRaw_ = 0;
+  uint64_t rssiPeakRawTimeStamp_ = 0;
+
+  PassEvent lastPass_;
+};
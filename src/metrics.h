@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Always-on counters, cheap enough for the sampling path.
+//
+// Everything is a relaxed 32 bit atomic: any context may record, any may
+// read, nothing locks. A reading taken while values are recorded may miss
+// the ones in flight, which is fine for monitoring.
+//
+// Histogram buckets are log-linear: values below 2 * kSubBuckets get a
+// bucket each, above that every power of two is split into kSubBuckets.
+// Percentiles are the upper bound of their bucket, at most 1/8 above the
+// real value.
+
+#define METRICS_SUB_BUCKET_BITS 3
+
+class Counter {
+ public:
+  void add(uint32_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint32_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint32_t> value_{0};
+};
+
+class Histogram {
+ public:
+  static const uint32_t kSubBuckets = 1 << METRICS_SUB_BUCKET_BITS;
+  static const uint16_t kBuckets =
+      2 * kSubBuckets + (32 - METRICS_SUB_BUCKET_BITS - 1) * kSubBuckets;
+
+  void record(uint32_t value) {
+    buckets_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    uint32_t max = max_.load(std::memory_order_relaxed);
+    while (value > max &&
+           !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  uint32_t count() const { return count_.load(std::memory_order_relaxed); }
+  // Wraps at 2^32, e.g. after 71 minutes worth of micros.
+  uint32_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint32_t max() const { return max_.load(std::memory_order_relaxed); }
+
+  // The value perMille of the recorded values are at or below, 0 if none.
+  uint32_t percentile(uint16_t perMille) const {
+    uint32_t counts[kBuckets];
+    uint64_t total = 0;
+    for (uint16_t i = 0; i < kBuckets; i++) {
+      counts[i] = buckets_[i].load(std::memory_order_relaxed);
+      total += counts[i];
+    }
+    if (total == 0) {
+      return 0;
+    }
+
+    uint64_t target = (total * perMille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint16_t i = 0; i < kBuckets; i++) {
+      seen += counts[i];
+      if (seen >= target && counts[i] > 0) {
+        uint32_t upper = bucketUpper(i);
+        uint32_t max = this->max();
+        return upper < max ? upper : max;
+      }
+    }
+    return max();
+  }
+
+  static uint16_t bucketOf(uint32_t value) {
+    if (value < 2 * kSubBuckets) {
+      return value;
+    }
+    uint8_t exponent = 31 - __builtin_clz(value);
+    return 2 * kSubBuckets +
+           (exponent - METRICS_SUB_BUCKET_BITS - 1) * kSubBuckets +
+           ((value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (kSubBuckets - 1));
+  }
+
+  // Largest value that lands in bucket.
+  static uint32_t bucketUpper(uint16_t bucket) {
+    if (bucket < 2 * kSubBuckets) {
+      return bucket;
+    }
+    uint8_t exponent =
+        (bucket - 2 * kSubBuckets) / kSubBuckets + METRICS_SUB_BUCKET_BITS + 1;
+    uint32_t sub = (bucket - 2 * kSubBuckets) % kSubBuckets;
+    return (uint32_t)(((uint64_t)(kSubBuckets + sub + 1)
+                       << (exponent - METRICS_SUB_BUCKET_BITS)) - 1);
+  }
+
+ private:
+  std::atomic<uint32_t> buckets_[kBuckets] = {};
+  std::atomic<uint32_t> count_{0};
+  std::atomic<uint32_t> sum_{0};
+  std::atomic<uint32_t> max_{0};
+};
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spsc_ring_buffer.h"
+
+// Firmware uploads that leave timing alone.
+//
+// Erasing and writing flash stalls both cores on the ESP32, the sampler
+// included, so a pass in the gate during an upload could be lost. Instead of
+// writing from the web server as data comes in, the upload handler queues
+// it in OtaPipeline and loop() writes it one sector erase or OTA_WRITE_SIZE
+// write at a time, whenever OtaThrottle says so. While the queue is full
+// the handler holds back TCP acks, so the client waits for flash and memory
+// stays bounded.
+//
+// The first OTA_HEADER_SIZE bytes, the image magic among them, are written
+// last: an upload that fails halfway never looks like an image.
+//
+// One context at a time uploads (begin(), push(), end()), one writes
+// (step()). No Arduino dependency, so this builds on the host as well.
+
+#define OTA_SECTOR_SIZE 4096
+#define OTA_HEADER_SIZE 16
+
+// Bytes per flash write, each takes about a millisecond.
+#ifndef OTA_WRITE_SIZE
+#define OTA_WRITE_SIZE 256
+#endif
+
+// Queued between the upload and the writer, OTA_CHUNKS * OTA_CHUNK_SIZE
+// bytes. OTA_CHUNKS must be a power of two.
+#define OTA_CHUNK_SIZE 512
+#ifndef OTA_CHUNKS
+#define OTA_CHUNKS 16
+#endif
+
+// Share of the time flash may be busy while an upload is written.
+#ifndef OTA_DUTY_PERCENT
+#define OTA_DUTY_PERCENT 25
+#endif
+
+// Free time after every flash operation, however short it was.
+#ifndef OTA_MIN_GAP_MICROS
+#define OTA_MIN_GAP_MICROS 2000
+#endif
+
+// The longest flash waits for detection, e.g. for a quad that stays in the
+// gate.
+#ifndef OTA_MAX_HOLD_MICROS
+#define OTA_MAX_HOLD_MICROS (2 * 1000 * 1000)
+#endif
+
+// When the next flash operation may start. After one that took T nothing
+// starts for T * (100 - dutyPercent) / dutyPercent, at least minGapMicros,
+// so detection always gets the rest of the time. While detection is busy
+// operations are held off, for maxHoldMicros at most.
+class OtaThrottle {
+ public:
+  explicit OtaThrottle(uint8_t dutyPercent = OTA_DUTY_PERCENT,
+                       uint32_t minGapMicros = OTA_MIN_GAP_MICROS,
+                       uint32_t maxHoldMicros = OTA_MAX_HOLD_MICROS)
+      : dutyPercent_(dutyPercent < 1     ? 1
+                     : dutyPercent > 100 ? 100
+                                         : dutyPercent),
+        minGapMicros_(minGapMicros),
+        maxHoldMicros_(maxHoldMicros) {}
+
+  void reset() {
+    next_ = 0;
+    heldSince_ = 0;
+    holding_ = false;
+    longest_ = 0;
+    busyMicros_ = 0;
+  }
+
+  // Whether a flash operation may start now.
+  bool due(uint64_t now, bool detectionBusy) {
+    if (now < next_) {
+      return false;
+    }
+    if (!detectionBusy) {
+      holding_ = false;
+      return true;
+    }
+    if (!holding_) {
+      holding_ = true;
+      heldSince_ = now;
+    }
+    return now - heldSince_ >= maxHoldMicros_;
+  }
+
+  // Call after every flash operation, with when it started and ended.
+  void ran(uint64_t start, uint64_t end) {
+    uint64_t took = end > start ? end - start : 0;
+    if (took > longest_) {
+      longest_ = took;
+    }
+    busyMicros_ += took;
+
+    uint64_t rest = took * (100 - dutyPercent_) / dutyPercent_;
+    next_ = end + (rest < minGapMicros_ ? minGapMicros_ : rest);
+    holding_ = false;
+  }
+
+  // Longest operation so far, what the sampler may have missed at once.
+  uint32_t longestMicros() const { return longest_; }
+  uint64_t busyMicros() const { return busyMicros_; }
+
+ private:
+  uint8_t dutyPercent_;
+  uint32_t minGapMicros_;
+  uint32_t maxHoldMicros_;
+
+  uint64_t next_ = 0;
+  uint64_t heldSince_ = 0;
+  bool holding_ = false;
+  uint32_t longest_ = 0;
+  uint64_t busyMicros_ = 0;
+};
+
+enum OtaState : uint8_t {
+  OTA_IDLE,
+  // The upload is coming in.
+  OTA_RECEIVING,
+  // All of it is queued, the writer catches up.
+  OTA_WRITING,
+  OTA_DONE,
+  OTA_FAILED,
+};
+
+struct OtaChunk {
+  uint16_t len;
+  uint8_t data[OTA_CHUNK_SIZE];
+};
+
+// Flash provides:
+//   bool eraseSector(uint32_t index)
+//   bool write(uint32_t offset, const uint8_t *data, size_t len)
+//   bool finish(uint32_t size)  the image is complete, e.g. boot it next
+// Sector index * OTA_SECTOR_SIZE is erased before anything is written to it.
+template <typename Flash, size_t Chunks = OTA_CHUNKS>
+class OtaPipeline {
+ public:
+  explicit OtaPipeline(Flash &flash) : flash_(flash) {}
+
+  // Upload side. Returns false if an upload is still being written.
+  bool begin() {
+    if (busy()) {
+      return false;
+    }
+
+    // The writer leaves everything alone until the state says otherwise.
+    chunks_.clear();
+    received_.store(0, std::memory_order_relaxed);
+    written_.store(0, std::memory_order_relaxed);
+    uploadOk_ = false;
+    haveChunk_ = false;
+    offset_ = 0;
+    erasedSectors_ = 0;
+    headerWritten_ = false;
+    state_.store(OTA_RECEIVING, std::memory_order_release);
+    return true;
+  }
+
+  // Upload side. Queues up to OTA_CHUNK_SIZE bytes, returns false if the
+  // queue is full; try again once the writer made room.
+  bool push(const uint8_t *data, size_t len) {
+    if (len > OTA_CHUNK_SIZE) {
+      return false;
+    }
+    OtaChunk &chunk = pushChunk_;
+    chunk.len = len;
+    memcpy(chunk.data, data, len);
+    if (!chunks_.push(chunk)) {
+      return false;
+    }
+    received_.store(received_.load(std::memory_order_relaxed) + len,
+                    std::memory_order_relaxed);
+    return true;
+  }
+
+  // Upload side, after the last push(). An upload that isn't ok fails on
+  // the writer's next step(), nothing more of it is written and the image is
+  // not booted. An upload the writer failed already stays failed.
+  void end(bool ok) {
+    uploadOk_ = ok;
+    OtaState receiving = OTA_RECEIVING;
+    state_.compare_exchange_strong(receiving, OTA_WRITING,
+                                   std::memory_order_acq_rel);
+  }
+
+  // Writer side. Does at most one flash operation, returns true if it did.
+  // Call when OtaThrottle says so.
+  bool step() {
+    OtaState state = state_.load(std::memory_order_acquire);
+    if (state != OTA_RECEIVING && state != OTA_WRITING) {
+      return false;
+    }
+    if (state == OTA_WRITING && !uploadOk_) {
+      return fail();
+    }
+
+    if (!haveChunk_) {
+      if (chunks_.pop(chunk_)) {
+        haveChunk_ = true;
+        chunkPos_ = 0;
+      } else if (state == OTA_WRITING) {
+        // Loaded before the pop, so everything pushed has been written.
+        return finish();
+      } else {
+        return false;
+      }
+    }
+
+    // Held back until the end.
+    if (offset_ < OTA_HEADER_SIZE) {
+      size_t n = take(OTA_HEADER_SIZE - offset_);
+      memcpy(header_ + offset_, chunk_.data + chunkPos_, n);
+      advance(n);
+      return false;
+    }
+
+    if (offset_ / OTA_SECTOR_SIZE >= erasedSectors_) {
+      if (!flash_.eraseSector(erasedSectors_)) {
+        return fail();
+      }
+      erasedSectors_++;
+      return true;
+    }
+
+    size_t n = take(OTA_SECTOR_SIZE - offset_ % OTA_SECTOR_SIZE);
+    if (!flash_.write(offset_, chunk_.data + chunkPos_, n)) {
+      return fail();
+    }
+    advance(n);
+    return true;
+  }
+
+  OtaState state() const { return state_.load(std::memory_order_acquire); }
+  bool busy() const {
+    OtaState state = this->state();
+    return state == OTA_RECEIVING || state == OTA_WRITING;
+  }
+  // Bytes queued by the upload, and written to flash.
+  uint32_t received() const {
+    return received_.load(std::memory_order_relaxed);
+  }
+  uint32_t written() const { return written_.load(std::memory_order_relaxed); }
+
+ private:
+  // How much of the current chunk goes into the next operation.
+  size_t take(size_t max) const {
+    size_t n = chunk_.len - chunkPos_;
+    if (n > max) {
+      n = max;
+    }
+    return n > OTA_WRITE_SIZE ? OTA_WRITE_SIZE : n;
+  }
+
+  void advance(size_t n) {
+    offset_ += n;
+    chunkPos_ += n;
+    if (chunkPos_ >= chunk_.len) {
+      haveChunk_ = false;
+    }
+    written_.store(offset_, std::memory_order_relaxed);
+  }
+
+  // The header, then the image is handed over, one operation each.
+  bool finish() {
+    if (offset_ <= OTA_HEADER_SIZE) {
+      return fail();
+    }
+    if (!headerWritten_) {
+      if (!flash_.write(0, header_, OTA_HEADER_SIZE)) {
+        return fail();
+      }
+      headerWritten_ = true;
+      return true;
+    }
+    state_.store(flash_.finish(offset_) ? OTA_DONE : OTA_FAILED,
+                 std::memory_order_release);
+    return true;
+  }
+
+  bool fail() {
+    state_.store(OTA_FAILED, std::memory_order_release);
+    return false;
+  }
+
+  Flash &flash_;
+  SpscRingBuffer<OtaChunk, Chunks> chunks_;
+  std::atomic<OtaState> state_{OTA_IDLE};
+  std::atomic<uint32_t> received_{0};
+  std::atomic<uint32_t> written_{0};
+  bool uploadOk_ = false;
+
+  // Upload side.
+  OtaChunk pushChunk_;
+
+  // Writer side.
+  OtaChunk chunk_;
+  bool haveChunk_ = false;
+  size_t chunkPos_ = 0;
+  uint32_t offset_ = 0;
+  uint32_t erasedSectors_ = 0;
+  uint8_t header_[OTA_HEADER_SIZE];
+  bool headerWritten_ = false;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lap_detector.h"
+#include "seqlock.h"
+
+// Recent passes, so clients that dropped off WiFi can catch up.
+//
+// Every pass is kept with the id of the event it was sent with. Ids only
+// increase, a client asks for everything after the last id it saw.
+//
+// One context appends (loop()), any number may read concurrently (request
+// handlers). Each slot is a Seqlock, and its version tells which record it
+// holds; a reader that raced a write, or finds the slot already reused,
+// skips that record, it was overwritten by a newer one anyway. Nothing
+// blocks, nothing allocates.
+
+struct PassRecord {
+  // Id of the newtime event.
+  uint32_t id;
+  uint8_t channel;
+  // Channels hopped when it was detected, the channel is only sent when
+  // hopping.
+  uint8_t channelCount;
+  PassEvent pass;
+};
+
+template <size_t Capacity>
+class PassHistory {
+  static_assert(Capacity > 0, "Capacity must not be 0");
+
+ public:
+  // Writer side. record.id has to be above every earlier one.
+  void append(const PassRecord &record) {
+    uint32_t appended = appended_.load(std::memory_order_relaxed);
+    slots_[appended % Capacity].store(record);
+
+    lastId_.store(record.id, std::memory_order_relaxed);
+    appended_.store(appended + 1, std::memory_order_release);
+  }
+
+  // Copies the records with an id above lastId into out, oldest first, up to
+  // maxRecords. Returns how many.
+  size_t since(uint32_t lastId, PassRecord *out, size_t maxRecords) const {
+    uint32_t appended = appended_.load(std::memory_order_acquire);
+    uint32_t first = appended > Capacity ? appended - Capacity : 0;
+
+    size_t count = 0;
+    for (uint32_t i = first; i < appended && count < maxRecords; i++) {
+      const Seqlock<PassRecord> &slot = slots_[i % Capacity];
+
+      // Record i is the slot's (i / Capacity + 1)th store, after the one
+      // of the Seqlock constructor. A version that changed during the copy
+      // means the copy may be of a newer record.
+      uint32_t version = i / Capacity + 2;
+      PassRecord record;
+      if (slot.version() != version || !slot.tryLoad(record) ||
+          slot.version() != version) {
+        continue;
+      }
+
+      if (record.id > lastId) {
+        out[count++] = record;
+      }
+    }
+    return count;
+  }
+
+  // Id of the newest record, 0 if none.
+  uint32_t lastId() const { return lastId_.load(std::memory_order_relaxed); }
+
+  // Records appended since boot.
+  uint32_t appended() const {
+    return appended_.load(std::memory_order_relaxed);
+  }
+
+  static constexpr size_t capacity() { return Capacity; }
+
+ private:
+  Seqlock<PassRecord> slots_[Capacity];
+  std::atomic<uint32_t> appended_{0};
+  std::atomic<uint32_t> lastId_{0};
+};
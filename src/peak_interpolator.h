@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stdint.h>
+
+// Estimates when the rssi peaked with microsecond resolution.
+//
+// The highest raw sample is a poor pass time: it is quantized to the sample
+// period and mostly picks the loudest noise spike near the top. Instead raw
+// samples are averaged into PEAK_BIN_MICROS bins, and a parabola is least
+// squares fitted over the PEAK_FIT_HALF_BINS bins on either side of the
+// highest bin. The vertex is the pass time.
+//
+// Bins keep the mean timestamp of their samples, so gaps (e.g. while hopping
+// channels) only cost accuracy. Per sample cost is a few additions, the fit
+// runs once per pass.
+
+#ifndef PEAK_BIN_MICROS
+#define PEAK_BIN_MICROS 8000
+#endif
+
+#ifndef PEAK_FIT_HALF_BINS
+#define PEAK_FIT_HALF_BINS 8
+#endif
+
+class PeakInterpolator {
+ public:
+  // Starts looking for a new peak. Bins before it are kept, they are the
+  // rising side of the peak.
+  void beginPass() {
+    peakValue_ = 0;
+    windowSize_ = 0;
+    afterNeeded_ = 0;
+  }
+
+  void addSample(uint64_t timeStamp, uint16_t rssiRaw) {
+    if (binCount_ > 0 && timeStamp - binStart_ >= PEAK_BIN_MICROS) {
+      closeBin();
+    }
+    if (binCount_ == 0) {
+      binStart_ = timeStamp;
+      binTimeSum_ = 0;
+      binValueSum_ = 0;
+    }
+    binTimeSum_ += (uint32_t)(timeStamp - binStart_);
+    binValueSum_ += rssiRaw;
+    binCount_++;
+  }
+
+  // Fits the bins collected around the highest one. Returns false if there
+  // are too few or they don't look like a peak.
+  bool estimate(uint64_t &peakTimeStamp) const {
+    if (windowSize_ < 3) {
+      return false;
+    }
+
+    // Relative to the highest bin, in ms, keeps the sums small.
+    uint64_t origin = window_[peakIndex_].timeStamp;
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0, s4 = 0;
+    double y0 = 0, y1 = 0, y2 = 0;
+    for (uint8_t i = 0; i < windowSize_; i++) {
+      double t = ((int64_t)(window_[i].timeStamp - origin)) / 1000.0;
+      double y = window_[i].value;
+      double t2 = t * t;
+      s0 += 1;
+      s1 += t;
+      s2 += t2;
+      s3 += t2 * t;
+      s4 += t2 * t2;
+      y0 += y;
+      y1 += t * y;
+      y2 += t2 * y;
+    }
+
+    // Normal equations for y = a t^2 + b t + c, Cramer's rule.
+    double det = s4 * (s2 * s0 - s1 * s1) - s3 * (s3 * s0 - s1 * s2) +
+                 s2 * (s3 * s1 - s2 * s2);
+    if (det == 0) {
+      return false;
+    }
+    double a = (y2 * (s2 * s0 - s1 * s1) - s3 * (y1 * s0 - s1 * y0) +
+                s2 * (y1 * s1 - s2 * y0)) / det;
+    double b = (s4 * (y1 * s0 - s1 * y0) - y2 * (s3 * s0 - s1 * s2) +
+                s2 * (s3 * y0 - y1 * s2)) / det;
+
+    // Has to open downwards, with the top inside the window.
+    if (a >= 0) {
+      return false;
+    }
+    double vertex = -b / (2 * a);
+    double first = ((int64_t)(window_[0].timeStamp - origin)) / 1000.0;
+    double last =
+        ((int64_t)(window_[windowSize_ - 1].timeStamp - origin)) / 1000.0;
+    if (vertex < first || vertex > last) {
+      return false;
+    }
+
+    peakTimeStamp = origin + (int64_t)(vertex * 1000.0);
+    return true;
+  }
+
+ private:
+  struct Bin {
+    uint64_t timeStamp; // mean of the samples
+    uint16_t value;     // mean of the samples
+  };
+
+  static const uint8_t kHistorySize = PEAK_FIT_HALF_BINS + 1;
+  static const uint8_t kWindowSize = 2 * PEAK_FIT_HALF_BINS + 1;
+
+  void closeBin() {
+    Bin bin;
+    bin.timeStamp = binStart_ + binTimeSum_ / binCount_;
+    bin.value = binValueSum_ / binCount_;
+    binCount_ = 0;
+
+    history_[historyNext_] = bin;
+    historyNext_ = (historyNext_ + 1) % kHistorySize;
+    if (historySize_ < kHistorySize) {
+      historySize_++;
+    }
+
+    if (bin.value > peakValue_) {
+      // New highest bin, restart the window from the bins leading up to it.
+      peakValue_ = bin.value;
+      windowSize_ = 0;
+      for (uint8_t i = 0; i < historySize_; i++) {
+        window_[windowSize_++] =
+            history_[(historyNext_ + kHistorySize - historySize_ + i) %
+                     kHistorySize];
+      }
+      peakIndex_ = windowSize_ - 1;
+      afterNeeded_ = PEAK_FIT_HALF_BINS;
+    } else if (afterNeeded_ > 0) {
+      window_[windowSize_++] = bin;
+      afterNeeded_--;
+    }
+  }
+
+  // The bin being filled.
+  uint64_t binStart_ = 0;
+  uint32_t binTimeSum_ = 0;
+  uint32_t binValueSum_ = 0;
+  uint16_t binCount_ = 0;
+
+  // The last closed bins, to have the rising side when a new peak shows up.
+  Bin history_[kHistorySize];
+  uint8_t historyNext_ = 0;
+  uint8_t historySize_ = 0;
+
+  // Bins around the highest one of the current pass.
+  Bin window_[kWindowSize];
+  uint8_t windowSize_ = 0;
+  uint8_t peakIndex_ = 0;
+  uint8_t afterNeeded_ = 0;
+  uint16_t peakValue_ = 0;
+};
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Raw rssi trace, every sample the detectors saw, to diagnose missed or
+// doubled laps afterwards.
+//
+// Samples are packed into fixed size blocks, and blocks go round-robin into
+// a RawTraceStorage, the oldest are overwritten once it is full. A download
+// is a RawTraceFileHeader followed by the blocks oldest first. All integers
+// are little endian.
+//
+//   File header, RAW_TRACE_HEADER_SIZE bytes
+//     u32 magic RAW_TRACE_MAGIC, u8 version RAW_TRACE_VERSION, u8 reserved,
+//     u16 block size, u32 block count, u32 sample rate Hz
+//   Block, block size bytes
+//     u64 timeStamp of the first sample, micros
+//     u16 sample count, u16 bytes of samples used
+//     then per sample:
+//       timestamp delta to the previous sample in the block, micros, as an
+//       unsigned LEB128 varint, 0 for the first
+//       u16 value: raw rssi in bits 0-11, channel in bits 12-15
+//     then zeros up to the block size
+//
+// Blocks stand on their own, so losing one (or the oldest being
+// overwritten) doesn't affect the others. At 2kHz a sample takes about 4
+// bytes, 8KB a second.
+
+#define RAW_TRACE_MAGIC 0x54565046 // "FPVT"
+#define RAW_TRACE_VERSION 1
+#define RAW_TRACE_HEADER_SIZE 16
+#define RAW_TRACE_BLOCK_HEADER_SIZE 12
+
+#ifndef RAW_TRACE_BLOCK_SIZE
+#define RAW_TRACE_BLOCK_SIZE 512
+#endif
+
+struct RawTraceFileHeader {
+  uint32_t magic;
+  uint8_t version;
+  uint16_t blockSize;
+  uint32_t blockCount;
+  uint32_t sampleRateHz;
+};
+
+struct RawTraceSample {
+  uint64_t timeStamp; // micros
+  uint16_t rssiRaw;
+  uint8_t channel;
+};
+
+inline void rawTracePut(uint8_t *out, uint64_t value, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+inline uint64_t rawTraceGet(const uint8_t *in, uint8_t bytes) {
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+inline void encodeRawTraceHeader(uint8_t *out,
+                                 const RawTraceFileHeader &header) {
+  memset(out, 0, RAW_TRACE_HEADER_SIZE);
+  rawTracePut(out, header.magic, 4);
+  out[4] = header.version;
+  rawTracePut(out + 6, header.blockSize, 2);
+  rawTracePut(out + 8, header.blockCount, 4);
+  rawTracePut(out + 12, header.sampleRateHz, 4);
+}
+
+// Returns false if it isn't a trace of a version we can read.
+inline bool decodeRawTraceHeader(const uint8_t *in, size_t len,
+                                 RawTraceFileHeader &header) {
+  if (len < RAW_TRACE_HEADER_SIZE) {
+    return false;
+  }
+  header.magic = rawTraceGet(in, 4);
+  header.version = in[4];
+  header.blockSize = rawTraceGet(in + 6, 2);
+  header.blockCount = rawTraceGet(in + 8, 4);
+  header.sampleRateHz = rawTraceGet(in + 12, 4);
+  return header.magic == RAW_TRACE_MAGIC &&
+         header.version == RAW_TRACE_VERSION &&
+         header.blockSize > RAW_TRACE_BLOCK_HEADER_SIZE;
+}
+
+// Packs samples into one block.
+class RawTraceBlockWriter {
+ public:
+  void begin(uint8_t *block) {
+    block_ = block;
+    memset(block_, 0, RAW_TRACE_BLOCK_SIZE);
+    count_ = 0;
+    used_ = 0;
+  }
+
+  // Returns false if the block is full, the sample isn't added then.
+  bool add(uint64_t timeStamp, uint16_t rssiRaw, uint8_t channel) {
+    uint8_t sample[5 + 2];
+    size_t n = 0;
+
+    uint32_t delta = count_ == 0 ? 0 : (uint32_t)(timeStamp - last_);
+    while (delta >= 0x80) {
+      sample[n++] = (uint8_t)(delta | 0x80);
+      delta >>= 7;
+    }
+    sample[n++] = (uint8_t)delta;
+    rawTracePut(sample + n, (rssiRaw & 0x0FFF) | ((uint16_t)channel << 12), 2);
+    n += 2;
+
+    if (RAW_TRACE_BLOCK_HEADER_SIZE + used_ + n > RAW_TRACE_BLOCK_SIZE) {
+      return false;
+    }
+
+    if (count_ == 0) {
+      rawTracePut(block_, timeStamp, 8);
+    }
+    memcpy(block_ + RAW_TRACE_BLOCK_HEADER_SIZE + used_, sample, n);
+    used_ += n;
+    count_++;
+    last_ = timeStamp;
+    rawTracePut(block_ + 8, count_, 2);
+    rawTracePut(block_ + 10, used_, 2);
+    return true;
+  }
+
+  uint16_t count() const { return count_; }
+
+ private:
+  uint8_t *block_ = nullptr;
+  uint16_t count_ = 0;
+  uint16_t used_ = 0;
+  uint64_t last_ = 0;
+};
+
+// Decodes a block into out, returns how many samples, or -1 if malformed.
+inline int decodeRawTraceBlock(const uint8_t *block, size_t blockSize,
+                               RawTraceSample *out, size_t maxSamples) {
+  if (blockSize < RAW_TRACE_BLOCK_HEADER_SIZE) {
+    return -1;
+  }
+  uint64_t timeStamp = rawTraceGet(block, 8);
+  uint16_t count = rawTraceGet(block + 8, 2);
+  uint16_t used = rawTraceGet(block + 10, 2);
+  if ((size_t)RAW_TRACE_BLOCK_HEADER_SIZE + used > blockSize ||
+      count > maxSamples) {
+    return -1;
+  }
+
+  const uint8_t *in = block + RAW_TRACE_BLOCK_HEADER_SIZE;
+  size_t pos = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    uint32_t delta = 0;
+    uint8_t shift = 0;
+    while (true) {
+      if (pos >= used || shift > 28) {
+        return -1;
+      }
+      uint8_t byte = in[pos++];
+      delta |= (uint32_t)(byte & 0x7F) << shift;
+      shift += 7;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    if (pos + 2 > used) {
+      return -1;
+    }
+    uint16_t value = rawTraceGet(in + pos, 2);
+    pos += 2;
+
+    timeStamp += delta;
+    out[i].timeStamp = timeStamp;
+    out[i].rssiRaw = value & 0x0FFF;
+    out[i].channel = value >> 12;
+  }
+  return count;
+}
+
+// Where the blocks go, e.g. PSRAM or a file.
+class RawTraceStorage {
+ public:
+  virtual ~RawTraceStorage() {}
+  // Returns false if the storage isn't available.
+  virtual bool begin() = 0;
+  // How many blocks fit.
+  virtual uint32_t capacity() = 0;
+  virtual bool writeBlock(uint32_t index, const uint8_t *block) = 0;
+  virtual bool readBlock(uint32_t index, uint8_t *block) = 0;
+};
+
+// The ring of blocks. One context appends, another reads once appending has
+// stopped.
+class RawTraceRing {
+ public:
+  // Starts a new trace in storage, returns false if it isn't available.
+  bool begin(RawTraceStorage *storage) {
+    written_.store(0, std::memory_order_relaxed);
+    storage_ = storage->begin() ? storage : nullptr;
+    return storage_ != nullptr;
+  }
+
+  bool ready() const { return storage_ != nullptr; }
+
+  uint32_t capacity() const { return storage_ ? storage_->capacity() : 0; }
+
+  bool append(const uint8_t *block) {
+    uint32_t written = written_.load(std::memory_order_relaxed);
+    if (!storage_ || !storage_->writeBlock(written % capacity(), block)) {
+      return false;
+    }
+    written_.store(written + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Blocks that can be read, at most the capacity.
+  uint32_t blockCount() const {
+    uint32_t written = written_.load(std::memory_order_acquire);
+    return written < capacity() ? written : capacity();
+  }
+
+  // Reads the i-th block, 0 is the oldest.
+  bool readBlock(uint32_t i, uint8_t *block) {
+    if (!storage_) {
+      return false;
+    }
+    uint32_t written = written_.load(std::memory_order_acquire);
+    uint32_t first = written - blockCount();
+    return storage_->readBlock((first + i) % capacity(), block);
+  }
+
+  // Size of a download, header included.
+  size_t downloadSize() const {
+    return RAW_TRACE_HEADER_SIZE + (size_t)blockCount() * RAW_TRACE_BLOCK_SIZE;
+  }
+
+ private:
+  RawTraceStorage *storage_ = nullptr;
+  std::atomic<uint32_t> written_{0};
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+// Averages a fast stream of ADC readings down to the sample rate.
+//
+// The ADC runs continuously, RSSI_OVERSAMPLING times faster than rssi is
+// sampled. Every reading goes into add(), and value() is the mean of the
+// newest factor readings. Averaging N readings cuts uncorrelated noise by
+// sqrt(N), 4x at 16.
+//
+// Only the newest readings count, so readings from before a retune fall out
+// of the window by themselves once the module has settled. add() is O(1).
+
+// ADC readings per rssi sample.
+#ifndef RSSI_OVERSAMPLING
+#define RSSI_OVERSAMPLING 16
+#endif
+
+#define RSSI_DECIMATOR_MAX_FACTOR 64
+
+class RssiDecimator {
+ public:
+  explicit RssiDecimator(uint8_t factor = RSSI_OVERSAMPLING) {
+    setFactor(factor);
+  }
+
+  void setFactor(uint8_t factor) {
+    if (factor < 1) {
+      factor = 1;
+    } else if (factor > RSSI_DECIMATOR_MAX_FACTOR) {
+      factor = RSSI_DECIMATOR_MAX_FACTOR;
+    }
+    factor_ = factor;
+    reset();
+  }
+
+  uint8_t factor() const { return factor_; }
+
+  void add(uint16_t raw) {
+    if (count_ == factor_) {
+      sum_ -= window_[next_];
+    } else {
+      count_++;
+    }
+    window_[next_] = raw;
+    sum_ += raw;
+    next_ = (next_ + 1) % factor_;
+    readings_++;
+  }
+
+  // Mean of the newest readings, rounded, 0 before the first.
+  uint16_t value() const {
+    return count_ == 0 ? 0 : (sum_ + count_ / 2) / count_;
+  }
+
+  // Readings added since the last reset, to tell a stalled ADC.
+  uint32_t readings() const { return readings_; }
+
+  void reset() {
+    sum_ = 0;
+    count_ = 0;
+    next_ = 0;
+    readings_ = 0;
+  }
+
+ private:
+  uint16_t window_[RSSI_DECIMATOR_MAX_FACTOR];
+  uint32_t sum_ = 0;
+  uint8_t factor_ = 1;
+  uint8_t count_ = 0;
+  uint8_t next_ = 0;
+  uint32_t readings_ = 0;
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Integer RSSI filters, composable at compile time.
+//
+// Every stage has update(uint16_t) -> uint16_t and setFilterRatio(uint8_t),
+// which stages without a runtime coefficient ignore. FilterChain runs the
+// stages in order. No floats, as the ESP32-C3 has no FPU.
+
+// Exponential moving average in Q16 fixed point.
+//
+// ratio is in 1/1000, like settings.filterRatio, and is the weight of the new
+// sample: out = ratio * in + (1 - ratio) * out. Inputs up to 15 bits, the
+// ADC gives 12. The coefficient is Q24, a Q16 one is off by up to 0.8% at
+// low ratios, enough to lag the float EMA by several counts after a step.
+class EmaFilter {
+ public:
+  void setFilterRatio(uint8_t ratio) {
+    alpha_ = ((uint32_t)ratio << 24) / 1000;
+  }
+
+  uint16_t update(uint16_t value) {
+    int32_t delta = ((int32_t)value << 16) - acc_;
+    acc_ += (int32_t)(((int64_t)alpha_ * delta) >> 24);
+    return (uint16_t)(acc_ >> 16);
+  }
+
+ private:
+  uint32_t alpha_ = (30 << 24) / 1000;
+  int32_t acc_ = 0;
+};
+
+// Median of the last Size samples, drops single sample spikes with Size 3.
+template <size_t Size>
+class MedianFilter {
+  static_assert(Size % 2 == 1, "Median size must be odd");
+
+ public:
+  void setFilterRatio(uint8_t) {}
+
+  uint16_t update(uint16_t value) {
+    window_[next_] = value;
+    next_ = (next_ + 1) % Size;
+
+    // Insertion sort, Size is tiny.
+    uint16_t sorted[Size];
+    for (size_t i = 0; i < Size; i++) {
+      uint16_t v = window_[i];
+      size_t j = i;
+      while (j > 0 && sorted[j - 1] > v) {
+        sorted[j] = sorted[j - 1];
+        j--;
+      }
+      sorted[j] = v;
+    }
+    return sorted[Size / 2];
+  }
+
+ private:
+  uint16_t window_[Size] = {0};
+  size_t next_ = 0;
+};
+
+template <>
+class MedianFilter<1> {
+ public:
+  void setFilterRatio(uint8_t) {}
+  uint16_t update(uint16_t value) { return value; }
+};
+
+// Mean of the last Size samples.
+template <size_t Size>
+class MovingAverageFilter {
+ public:
+  void setFilterRatio(uint8_t) {}
+
+  uint16_t update(uint16_t value) {
+    sum_ += value;
+    sum_ -= window_[next_];
+    window_[next_] = value;
+    next_ = (next_ + 1) % Size;
+    return (uint16_t)(sum_ / Size);
+  }
+
+ private:
+  uint16_t window_[Size] = {0};
+  size_t next_ = 0;
+  uint32_t sum_ = 0;
+};
+
+template <>
+class MovingAverageFilter<1> {
+ public:
+  void setFilterRatio(uint8_t) {}
+  uint16_t update(uint16_t value) { return value; }
+};
+
+template <typename... Stages>
+class FilterChain;
+
+template <>
+class FilterChain<> {
+ public:
+  void setFilterRatio(uint8_t) {}
+  uint16_t update(uint16_t value) { return value; }
+};
+
+template <typename First, typename... Rest>
+class FilterChain<First, Rest...> {
+ public:
+  void setFilterRatio(uint8_t ratio) {
+    first_.setFilterRatio(ratio);
+    rest_.setFilterRatio(ratio);
+  }
+
+  uint16_t update(uint16_t value) { return rest_.update(first_.update(value)); }
+
+ private:
+  First first_;
+  FilterChain<Rest...> rest_;
+};
+
+// Median window before the EMA, 1 disables it.
+#ifndef RSSI_MEDIAN_SIZE
+#define RSSI_MEDIAN_SIZE 3
+#endif
+
+// Moving average after the EMA, 1 disables it.
+#ifndef RSSI_AVERAGE_SIZE
+#define RSSI_AVERAGE_SIZE 1
+#endif
+
+// The filter the lap detector smooths raw samples with.
+typedef FilterChain<MedianFilter<RSSI_MEDIAN_SIZE>, EmaFilter,
+                    MovingAverageFilter<RSSI_AVERAGE_SIZE> >
+    RssiFilter;
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact RSSI batches for the rssi event.
+//
+// Batch format, before base64:
+//   byte 0:  format version, RSSI_BATCH_VERSION
+//   then:    first value as an unsigned LEB128 varint
+//   then:    each following value as the zigzag varint of its delta to the
+//            previous one
+// Smoothed rssi moves slowly, so most samples take a single byte, a third of
+// the decimal text it replaces. The whole batch is base64 encoded (standard
+// alphabet, padded) so it fits in an SSE data line.
+//
+// Everything works on caller provided buffers, nothing allocates.
+
+#define RSSI_BATCH_VERSION 1
+
+// Worst case binary size of a batch of count values.
+#define RSSI_BATCH_MAX_BINARY(count) (1 + 3 * (count))
+// Worst case base64 size of a batch of count values, without terminator.
+#define RSSI_BATCH_MAX_BASE64(count) \
+  ((RSSI_BATCH_MAX_BINARY(count) + 2) / 3 * 4)
+
+// Preallocated ring of rssi values, the oldest are dropped when full.
+template <size_t Capacity>
+class RssiLog {
+ public:
+  void add(uint16_t value) {
+    values_[(start_ + size_) % Capacity] = value;
+    if (size_ < Capacity) {
+      size_++;
+    } else {
+      start_ = (start_ + 1) % Capacity;
+    }
+  }
+
+  size_t size() const { return size_; }
+  static constexpr size_t capacity() { return Capacity; }
+
+  // Oldest first.
+  uint16_t at(size_t i) const { return values_[(start_ + i) % Capacity]; }
+
+  void clear() {
+    start_ = 0;
+    size_ = 0;
+  }
+
+ private:
+  uint16_t values_[Capacity];
+  size_t start_ = 0;
+  size_t size_ = 0;
+};
+
+inline size_t writeVarint(uint8_t *out, uint32_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+// Returns bytes read, 0 if truncated.
+inline size_t readVarint(const uint8_t *in, size_t len, uint32_t &value) {
+  value = 0;
+  for (size_t i = 0; i < len && i < 5; i++) {
+    value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+inline uint32_t zigzagEncode(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t zigzagDecode(uint32_t value) {
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Returns the encoded length, out needs 4 * ceil(len / 3) + 1 bytes.
+inline size_t base64Encode(const uint8_t *in, size_t len, char *out) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t chunk = (uint32_t)in[i] << 16;
+    if (i + 1 < len) chunk |= (uint32_t)in[i + 1] << 8;
+    if (i + 2 < len) chunk |= in[i + 2];
+
+    out[n++] = kAlphabet[(chunk >> 18) & 0x3F];
+    out[n++] = kAlphabet[(chunk >> 12) & 0x3F];
+    out[n++] = i + 1 < len ? kAlphabet[(chunk >> 6) & 0x3F] : '=';
+    out[n++] = i + 2 < len ? kAlphabet[chunk & 0x3F] : '=';
+  }
+  out[n] = 0;
+  return n;
+}
+
+inline int base64Value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+// Returns the decoded length, or 0 if in isn't valid base64.
+inline size_t base64Decode(const char *in, size_t len, uint8_t *out,
+                           size_t outSize) {
+  if (len % 4 != 0) {
+    return 0;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += 4) {
+    uint32_t chunk = 0;
+    int bytes = 3;
+    for (size_t j = 0; j < 4; j++) {
+      int v = base64Value(in[i + j]);
+      if (in[i + j] == '=' && i + 4 == len && j >= 2) {
+        v = 0;
+        bytes = bytes < (int)j - 1 ? bytes : (int)j - 1;
+      } else if (v < 0) {
+        return 0;
+      }
+      chunk = (chunk << 6) | (uint32_t)v;
+    }
+    for (int j = 0; j < bytes; j++) {
+      if (n >= outSize) {
+        return 0;
+      }
+      out[n++] = (uint8_t)(chunk >> (16 - 8 * j));
+    }
+  }
+  return n;
+}
+
+// Encodes the logged values in the binary batch format, returns its length.
+// out has to hold RSSI_BATCH_MAX_BINARY(log.size()) bytes.
+template <size_t Capacity>
+size_t encodeRssiBatchBinary(const RssiLog<Capacity> &log, uint8_t *out) {
+  size_t n = 0;
+  out[n++] = RSSI_BATCH_VERSION;
+
+  uint16_t previous = 0;
+  for (size_t i = 0; i < log.size(); i++) {
+    uint16_t value = log.at(i);
+    n += i == 0 ? writeVarint(out + n, value)
+                : writeVarint(out + n, zigzagEncode((int32_t)value - previous));
+    previous = value;
+  }
+  return n;
+}
+
+// Encodes the logged values into out as base64, returns its length.
+// scratch has to hold RSSI_BATCH_MAX_BINARY(log.size()) bytes and out
+// RSSI_BATCH_MAX_BASE64(log.size()) + 1.
+template <size_t Capacity>
+size_t encodeRssiBatch(const RssiLog<Capacity> &log, uint8_t *scratch,
+                       char *out) {
+  return base64Encode(scratch, encodeRssiBatchBinary(log, scratch), out);
+}
+
+// Decodes a binary batch into values, returns how many, or -1 if malformed.
+inline int decodeRssiBatchBinary(const uint8_t *in, size_t len,
+                                 uint16_t *values, size_t maxValues) {
+  if (len < 1 || in[0] != RSSI_BATCH_VERSION) {
+    return -1;
+  }
+
+  size_t count = 0;
+  int32_t previous = 0;
+  for (size_t i = 1; i < len;) {
+    uint32_t raw;
+    size_t read = readVarint(in + i, len - i, raw);
+    if (read == 0 || count >= maxValues) {
+      return -1;
+    }
+    i += read;
+
+    previous = count == 0 ? (int32_t)raw : previous + zigzagDecode(raw);
+    values[count++] = (uint16_t)previous;
+  }
+  return (int)count;
+}
+
+// Decodes a base64 batch into values, returns how many, or -1 if malformed.
+// scratch has to hold the decoded binary, 3 / 4 of len.
+inline int decodeRssiBatch(const char *in, size_t len, uint8_t *scratch,
+                           size_t scratchSize, uint16_t *values,
+                           size_t maxValues) {
+  size_t binaryLen = base64Decode(in, len, scratch, scratchSize);
+  return decodeRssiBatchBinary(scratch, binaryLen, values, maxValues);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+
+// RX5808 (RTC6715) driver.
+//
+// The module takes 25 bit frames, LSB first: A0-A3, R/W, D0-D19, latched on
+// the rising edge of LE (CH2). Frames go out through an Rx5808Bus, so the
+// same driver runs on hardware SPI, bit-banged GPIO, or a recording bus on
+// the host. Tuning never waits for the PLL/RSSI to settle, callers ask
+// isSettled() instead and skip samples until then.
+
+// Time for the rssi to be usable after a retune.
+#ifndef RX5808_SETTLE_MICROS
+#define RX5808_SETTLE_MICROS 30000
+#endif
+
+// Calculate rx5808 register hex value for given frequency in MHz.
+inline uint16_t freqMhzToRegVal(uint16_t freqInMhz) {
+  uint16_t tf, N, A;
+  tf = (freqInMhz - 479) / 2;
+  N = tf / 32;
+  A = tf % 32;
+  return (N << 7) + A;
+}
+
+#define RX5808_FRAME_BITS 25
+
+// Register 0x1, synthesizer B, holds the frequency.
+#define RX5808_REG_SYNTH_B 0x1
+// Written before every retune, as the original firmware always did.
+#define RX5808_REG_STATE 0x8
+
+// Builds a frame, bit 0 is sent first.
+inline uint32_t rx5808Frame(uint8_t address, bool write, uint32_t data) {
+  return (uint32_t)(address & 0xF) | ((uint32_t)(write ? 1 : 0) << 4) |
+         ((data & 0xFFFFF) << 5);
+}
+
+class Rx5808Bus {
+ public:
+  virtual ~Rx5808Bus() {}
+  virtual void begin() = 0;
+  // Shifts out the low RX5808_FRAME_BITS of frame, LSB first, then latches.
+  virtual void writeFrame(uint32_t frame) = 0;
+};
+
+// Bit-banged bus over a GPIO policy providing:
+//   void write(int pin, bool level);
+//   void output(int pin);
+//   void delayMicros(uint32_t micros);
+// The module is fine with a clock in the MHz range, so bitDelayMicros can
+// stay at 1 and a frame takes ~100us.
+template <typename Gpio>
+class Rx5808BitBangBus : public Rx5808Bus {
+ public:
+  Rx5808BitBangBus(Gpio &gpio, int dataPin, int selectPin, int clockPin,
+                   uint32_t bitDelayMicros = 1)
+      : gpio_(gpio), dataPin_(dataPin), selectPin_(selectPin),
+        clockPin_(clockPin), bitDelayMicros_(bitDelayMicros) {}
+
+  void begin() override {
+    gpio_.output(selectPin_);
+    gpio_.output(dataPin_);
+    gpio_.output(clockPin_);
+    gpio_.write(selectPin_, true);
+    gpio_.write(clockPin_, false);
+  }
+
+  void writeFrame(uint32_t frame) override {
+    gpio_.write(selectPin_, false);
+    gpio_.delayMicros(bitDelayMicros_);
+
+    for (uint8_t i = 0; i < RX5808_FRAME_BITS; i++) {
+      gpio_.write(dataPin_, (frame >> i) & 0x1);
+      gpio_.delayMicros(bitDelayMicros_);
+      gpio_.write(clockPin_, true);
+      gpio_.delayMicros(bitDelayMicros_);
+      gpio_.write(clockPin_, false);
+    }
+
+    // Clock the data in.
+    gpio_.delayMicros(bitDelayMicros_);
+    gpio_.write(selectPin_, true);
+    gpio_.write(dataPin_, false);
+  }
+
+ private:
+  Gpio &gpio_;
+  int dataPin_;
+  int selectPin_;
+  int clockPin_;
+  uint32_t bitDelayMicros_;
+};
+
+class Rx5808 {
+ public:
+  explicit Rx5808(Rx5808Bus &bus, uint32_t settleMicros = RX5808_SETTLE_MICROS)
+      : bus_(bus), settleMicros_(settleMicros) {}
+
+  void begin() { bus_.begin(); }
+
+  // Sends the frequency to the module and returns immediately, the rssi is
+  // unusable until isSettled().
+  void tune(uint16_t freqMhz, uint64_t now) {
+    bus_.writeFrame(rx5808Frame(RX5808_REG_STATE, false, 0));
+    bus_.writeFrame(
+        rx5808Frame(RX5808_REG_SYNTH_B, true, freqMhzToRegVal(freqMhz)));
+
+    frequency_ = freqMhz;
+    settledAt_ = now + settleMicros_;
+  }
+
+  bool isSettled(uint64_t now) const { return now >= settledAt_; }
+
+  // Samples taken before this are from the previous channel or the PLL lock.
+  uint64_t settledAt() const { return settledAt_; }
+
+  uint16_t frequency() const { return frequency_; }
+
+  void setSettleMicros(uint32_t settleMicros) { settleMicros_ = settleMicros; }
+  uint32_t settleMicros() const { return settleMicros_; }
+
+ private:
+  Rx5808Bus &bus_;
+  uint32_t settleMicros_;
+  uint16_t frequency_ = 0;
+  uint64_t settledAt_ = 0;
+};
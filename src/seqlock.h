@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// A value that one context publishes as a whole and others copy out, without
+// locks and without seeing half of an update.
+//
+// The sequence number is odd while a store is in progress. A reader copies
+// the value between two reads of the sequence and only keeps the copy if
+// both were the same even number. The value is kept in 32 bit atomics with
+// relaxed ordering, plain loads and stores on the ESP chips, so a copy that
+// raced a store is only discarded, never undefined.
+//
+// One store at a time, callers serialize their stores. Readers never block
+// the writer. A reader must not spin on tryLoad() if it can preempt the
+// writer on the same core, it would never let the store finish; keep the
+// last copy and try again later instead.
+//
+// No Arduino dependency, so this builds on the host as well.
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T has to be copyable with memcpy");
+
+ public:
+  Seqlock() { store(T()); }
+
+  // Writer side.
+  void store(const T &value) {
+    uint32_t words[kWords] = {0};
+    memcpy(words, &value, sizeof(T));
+
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; i++) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Copies the value into out. Returns false and leaves out alone if a store
+  // was in progress.
+  bool tryLoad(T &out) const {
+    uint32_t seq = seq_.load(std::memory_order_acquire);
+    if (seq & 1) {
+      return false;
+    }
+
+    uint32_t words[kWords];
+    for (size_t i = 0; i < kWords; i++) {
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq_.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+
+    memcpy(&out, words, sizeof(T));
+    return true;
+  }
+
+  // Bumped by every store. A reader holding a copy of this version has
+  // nothing new to pick up.
+  uint32_t version() const {
+    return seq_.load(std::memory_order_acquire) / 2;
+  }
+
+ private:
+  static constexpr size_t kWords = (sizeof(T) + 3) / 4;
+
+  std::atomic<uint32_t> seq_{0};
+  std::atomic<uint32_t> words_[kWords];
+};
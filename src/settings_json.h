@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The settings as /api/v1/settings and the settings event send them,
+// formatted with one snprintf into a buffer the caller owns.
+//
+// No Arduino dependency, so this builds on the host as well.
+
+// Big enough for every field at its widest.
+#define SETTINGS_JSON_SIZE 512
+
+// What the JSON shows. The strings point into the settings, char arrays
+// that may fill their whole field without a terminator, so they are
+// bounded by those field sizes.
+struct SettingsJsonFields {
+  uint16_t vtxFreq;
+  uint16_t rssiPeak;
+  uint16_t enterRssiOffset;
+  uint16_t leaveRssiOffset;
+  uint8_t filterRatio;
+  bool logRssi;
+  const char *apSsid;
+  const char *apPwd;
+  const char *apIp;
+  const char *localIp;
+  const char *routerSsid;
+  const char *routerPwd;
+  const char *adaptiveMode;
+  bool gateSync;
+  const char *version;
+};
+
+// Writes the JSON into out of size bytes, always terminated. Returns its
+// length, at least size if it was cut.
+inline size_t formatSettingsJson(char *out, size_t size,
+                                 const SettingsJsonFields &fields) {
+  int len = snprintf(out, size,
+                     "{\n"
+                     "\"vtxFreq\":%u,\n"
+                     "\"rssiPeak\":%u,\n"
+                     "\"enterRssiOffset\":%u,\n"
+                     "\"leaveRssiOffset\":%u,\n"
+                     "\"filterRatio\":%u,\n"
+                     "\"logRssi\":%s,\n"
+                     "\"apSsid\":\"%.30s\",\n"
+                     "\"apPwd\":\"%.30s\",\n"
+                     "\"apIp\":\"%.20s\",\n"
+                     "\"localIp\":\"%.20s\",\n"
+                     "\"routerSsid\":\"%.32s\",\n"
+                     "\"routerPwd\":\"%.32s\",\n"
+                     "\"adaptiveMode\":\"%s\",\n"
+                     "\"gateSync\":%s,\n"
+                     "\"version\":\"%s\"\n"
+                     "}",
+                     (unsigned)fields.vtxFreq, (unsigned)fields.rssiPeak,
+                     (unsigned)fields.enterRssiOffset,
+                     (unsigned)fields.leaveRssiOffset,
+                     (unsigned)fields.filterRatio,
+                     fields.logRssi ? "true" : "false", fields.apSsid,
+                     fields.apPwd, fields.apIp, fields.localIp,
+                     fields.routerSsid, fields.routerPwd, fields.adaptiveMode,
+                     fields.gateSync ? "true" : "false", fields.version);
+  return len < 0 ? 0 : (size_t)len;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Deferred, CRC checked settings persistence.
+//
+// Settings are saved as records of
+//   u32 magic, u16 schema, u16 payload length, u32 sequence, u32 crc32
+// followed by the payload, the raw Settings struct. Records go round-robin
+// into Slots slots of a Storage backend, and load() takes the valid record
+// with the highest sequence. A write torn by a power cut only loses that
+// record, the previous one is still in another slot.
+//
+// Storage provides:
+//   bool read(uint8_t slot, uint8_t *data, size_t len);
+//   bool write(uint8_t slot, const uint8_t *data, size_t len);
+//
+// Fields may only be appended to Settings. A record of an older schema is
+// shorter, its payload is copied over the defaults so new fields keep their
+// default values. Bump the schema whenever a field is appended.
+//
+// Writes are debounced: markDirty() on every change, flush when flushDue().
+// A burst of changes (e.g. calibration finding a new peak every few
+// samples) then costs one write. Writing flash stalls both cores of the
+// ESP32, the sampler included, so a due flush is held off while detection
+// is busy.
+
+#define SETTINGS_RECORD_MAGIC 0x53565046 // "FPVS"
+
+// Flush once settings haven't changed for this long...
+#ifndef SETTINGS_FLUSH_DELAY_MILLIS
+#define SETTINGS_FLUSH_DELAY_MILLIS 2000
+#endif
+
+// ...or once they have been dirty for this long.
+#ifndef SETTINGS_FLUSH_MAX_DELAY_MILLIS
+#define SETTINGS_FLUSH_MAX_DELAY_MILLIS 10000
+#endif
+
+// The longest a due flush waits for detection, e.g. for a quad that stays
+// in the gate.
+#ifndef SETTINGS_FLUSH_MAX_HOLD_MILLIS
+#define SETTINGS_FLUSH_MAX_HOLD_MILLIS 2000
+#endif
+
+struct SettingsRecordHeader {
+  uint32_t magic;
+  uint16_t schema;
+  uint16_t length;
+  uint32_t sequence;
+  uint32_t crc;
+};
+
+// CRC-32 (IEEE), bitwise, settings are small and rarely written.
+inline uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc = 0) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+template <typename Settings, typename Storage, uint8_t Slots = 2>
+class SettingsStore {
+ public:
+  static const size_t kRecordSize = sizeof(SettingsRecordHeader) + sizeof(Settings);
+
+  SettingsStore(Storage &storage, uint16_t schema)
+      : storage_(storage), schema_(schema) {}
+
+  // Loads the newest valid record over settings, which should hold the
+  // defaults. Returns false if there is none.
+  bool load(Settings &settings) {
+    uint8_t record[kRecordSize];
+    bool found = false;
+
+    for (uint8_t slot = 0; slot < Slots; slot++) {
+      if (!storage_.read(slot, record, kRecordSize)) {
+        continue;
+      }
+
+      SettingsRecordHeader header;
+      memcpy(&header, record, sizeof(header));
+      if (header.magic != SETTINGS_RECORD_MAGIC ||
+          header.schema > schema_ || header.length > sizeof(Settings) ||
+          header.crc != crc32(record + sizeof(header), header.length)) {
+        continue;
+      }
+      if (found && header.sequence <= sequence_) {
+        continue;
+      }
+
+      found = true;
+      sequence_ = header.sequence;
+      nextSlot_ = (slot + 1) % Slots;
+      memcpy((void *)&settings, record + sizeof(header), header.length);
+    }
+
+    return found;
+  }
+
+  // Writes settings into the slot after the newest record.
+  bool save(const Settings &settings) {
+    uint8_t record[kRecordSize];
+
+    SettingsRecordHeader header;
+    header.magic = SETTINGS_RECORD_MAGIC;
+    header.schema = schema_;
+    header.length = sizeof(Settings);
+    header.sequence = sequence_ + 1;
+    memcpy(record + sizeof(header), (const void *)&settings, sizeof(Settings));
+    header.crc = crc32(record + sizeof(header), sizeof(Settings));
+    memcpy(record, &header, sizeof(header));
+
+    if (!storage_.write(nextSlot_, record, kRecordSize)) {
+      return false;
+    }
+
+    sequence_ = header.sequence;
+    nextSlot_ = (nextSlot_ + 1) % Slots;
+    dirty_ = false;
+    holding_ = false;
+    writes_++;
+    return true;
+  }
+
+  void markDirty(uint32_t nowMillis) {
+    if (!dirty_) {
+      dirtySince_ = nowMillis;
+    }
+    dirty_ = true;
+    lastChange_ = nowMillis;
+  }
+
+  bool dirty() const { return dirty_; }
+
+  // Whether to save now. Once due, waits while detectionBusy, for
+  // SETTINGS_FLUSH_MAX_HOLD_MILLIS at most.
+  bool flushDue(uint32_t nowMillis, bool detectionBusy = false) {
+    if (!dirty_ ||
+        (nowMillis - lastChange_ < SETTINGS_FLUSH_DELAY_MILLIS &&
+         nowMillis - dirtySince_ < SETTINGS_FLUSH_MAX_DELAY_MILLIS)) {
+      holding_ = false;
+      return false;
+    }
+    if (!detectionBusy) {
+      holding_ = false;
+      return true;
+    }
+    if (!holding_) {
+      holding_ = true;
+      heldSince_ = nowMillis;
+    }
+    return nowMillis - heldSince_ >= SETTINGS_FLUSH_MAX_HOLD_MILLIS;
+  }
+
+  // Records written since boot.
+  uint32_t writes() const { return writes_; }
+
+ private:
+  Storage &storage_;
+  uint16_t schema_;
+
+  uint32_t sequence_ = 0;
+  uint8_t nextSlot_ = 0;
+
+  bool dirty_ = false;
+  uint32_t dirtySince_ = 0;
+  uint32_t lastChange_ = 0;
+  bool holding_ = false;
+  uint32_t heldSince_ = 0;
+  uint32_t writes_ = 0;
+};
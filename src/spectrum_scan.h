@@ -0,0 +1,241 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rx5808.h"
+
+// A sweep of the receiver across many frequencies, the averaged rssi of
+// each, to see who is on which channel before a race.
+//
+// The sampler hands its ticks to the scan instead of the hopper while it
+// runs: one tick tunes, the ticks until the module has settled are
+// skipped, the next `samples` ticks are averaged. Frequencies are swept in
+// ascending order, so every retune is a small step and settles in
+// settleMicros; only the first one, away from the timing channel, gets
+// firstSettleMicros. Afterwards the hopper tunes back to its channels.
+//
+// At 2kHz with the defaults a frequency takes 7ms, all 6 bands about
+// 350ms.
+//
+// Not thread safe, only touched from the sampler. No Arduino dependency, so
+// this builds on the host as well.
+
+#define SPECTRUM_BAND_CHANNELS 8
+
+struct SpectrumBand {
+  char name;
+  uint16_t frequencies[SPECTRUM_BAND_CHANNELS];
+};
+
+// The common 5.8GHz bands, channel 1 to 8.
+const SpectrumBand spectrumBands[] = {
+    {'A', {5865, 5845, 5825, 5805, 5785, 5765, 5745, 5725}},
+    {'B', {5733, 5752, 5771, 5790, 5809, 5828, 5847, 5866}},
+    {'E', {5705, 5685, 5665, 5645, 5885, 5905, 5925, 5945}},
+    {'F', {5740, 5760, 5780, 5800, 5820, 5840, 5860, 5880}},
+    {'R', {5658, 5695, 5732, 5769, 5806, 5843, 5880, 5917}},
+    {'L', {5362, 5399, 5436, 5473, 5510, 5547, 5584, 5621}},
+};
+
+#define SPECTRUM_BANDS (sizeof(spectrumBands) / sizeof(spectrumBands[0]))
+#define SPECTRUM_ALL_BANDS ((1 << SPECTRUM_BANDS) - 1)
+
+// What the RX5808 tunes to, for a frequency range.
+#define SPECTRUM_MIN_MHZ 5300
+#define SPECTRUM_MAX_MHZ 6000
+
+// Frequencies in one sweep. All bands are 47 once shared ones are merged.
+#ifndef SPECTRUM_MAX_POINTS
+#define SPECTRUM_MAX_POINTS 128
+#endif
+
+// Settle time after a step to the next frequency.
+#ifndef SPECTRUM_SETTLE_MICROS
+#define SPECTRUM_SETTLE_MICROS 5000
+#endif
+
+// Samples averaged per frequency.
+#ifndef SPECTRUM_SAMPLES
+#define SPECTRUM_SAMPLES 4
+#endif
+
+// Returns the bands named in names, e.g. "ARF", as a mask of indexes into
+// spectrumBands, 0 if a name is unknown.
+inline uint8_t spectrumBandMask(const char *names) {
+  uint8_t mask = 0;
+  for (; *names; names++) {
+    char name = *names >= 'a' && *names <= 'z' ? *names - 'a' + 'A' : *names;
+    size_t band = 0;
+    while (band < SPECTRUM_BANDS && spectrumBands[band].name != name) {
+      band++;
+    }
+    if (band == SPECTRUM_BANDS) {
+      return 0;
+    }
+    mask |= 1 << band;
+  }
+  return mask;
+}
+
+struct SpectrumScanConfig {
+  // Mask of spectrumBands, see spectrumBandMask(). 0 sweeps the range
+  // instead.
+  uint8_t bands = SPECTRUM_ALL_BANDS;
+  uint16_t minMhz = SPECTRUM_MIN_MHZ;
+  uint16_t maxMhz = SPECTRUM_MAX_MHZ;
+  uint16_t stepMhz = 10;
+  uint8_t samples = SPECTRUM_SAMPLES;
+  uint32_t settleMicros = SPECTRUM_SETTLE_MICROS;
+  uint32_t firstSettleMicros = RX5808_SETTLE_MICROS;
+};
+
+// Writes the frequencies of a sweep to out, ascending, each once, at most
+// max of them. Returns how many.
+inline size_t spectrumFrequencies(const SpectrumScanConfig &config,
+                                  uint16_t *out, size_t max) {
+  size_t count = 0;
+  // Insertion into the sorted list, it is short.
+  auto add = [&](uint16_t frequency) {
+    size_t i = count;
+    while (i > 0 && out[i - 1] > frequency) {
+      i--;
+    }
+    if ((i > 0 && out[i - 1] == frequency) || count == max) {
+      return;
+    }
+    for (size_t j = count; j > i; j--) {
+      out[j] = out[j - 1];
+    }
+    out[i] = frequency;
+    count++;
+  };
+
+  if (config.bands) {
+    for (size_t band = 0; band < SPECTRUM_BANDS; band++) {
+      if (config.bands & (1 << band)) {
+        for (uint16_t frequency : spectrumBands[band].frequencies) {
+          add(frequency);
+        }
+      }
+    }
+  } else if (config.stepMhz > 0) {
+    for (uint32_t frequency = config.minMhz;
+         frequency <= config.maxMhz && count < max;
+         frequency += config.stepMhz) {
+      add(frequency);
+    }
+  }
+  return count;
+}
+
+struct SpectrumPoint {
+  uint16_t frequency;
+  // Averaged raw rssi.
+  uint16_t rssi;
+};
+
+struct SpectrumResult {
+  uint64_t startTime = 0;
+  // From the first retune to the last sample.
+  uint32_t sweepMicros = 0;
+  uint16_t retunes = 0;
+  uint16_t count = 0;
+  SpectrumPoint points[SPECTRUM_MAX_POINTS];
+};
+
+class SpectrumScan {
+ public:
+  // Returns false if the config has no frequencies.
+  bool start(const SpectrumScanConfig &config, uint64_t now) {
+    uint16_t frequencies[SPECTRUM_MAX_POINTS];
+    size_t count =
+        spectrumFrequencies(config, frequencies, SPECTRUM_MAX_POINTS);
+    if (count == 0) {
+      return false;
+    }
+
+    result_.startTime = now;
+    result_.sweepMicros = 0;
+    result_.retunes = 0;
+    result_.count = count;
+    for (size_t i = 0; i < count; i++) {
+      result_.points[i].frequency = frequencies[i];
+      result_.points[i].rssi = 0;
+    }
+    samples_ = config.samples > 0 ? config.samples : 1;
+    settleMicros_ = config.settleMicros;
+    firstSettleMicros_ = config.firstSettleMicros;
+    index_ = 0;
+    retunePending_ = true;
+    active_ = true;
+    return true;
+  }
+
+  // Call on every sampler tick while active(), instead of the hopper. Rx
+  // provides tune(frequency, now), isSettled(now) and setSettleMicros(), as
+  // Rx5808 does; readRssi() returns a raw reading. Returns true on the tick
+  // the sweep is done, see result().
+  template <typename Rx, typename ReadRssi>
+  bool tick(uint64_t now, Rx &rx, ReadRssi readRssi) {
+    if (!active_) {
+      return false;
+    }
+
+    if (retunePending_) {
+      rx.setSettleMicros(index_ == 0 ? firstSettleMicros_ : settleMicros_);
+      rx.tune(result_.points[index_].frequency, now);
+      result_.retunes++;
+      retunePending_ = false;
+      sum_ = 0;
+      taken_ = 0;
+      return false;
+    }
+
+    if (!rx.isSettled(now)) {
+      return false;
+    }
+
+    sum_ += readRssi();
+    if (++taken_ < samples_) {
+      return false;
+    }
+    result_.points[index_].rssi = (sum_ + taken_ / 2) / taken_;
+
+    if (++index_ < result_.count) {
+      retunePending_ = true;
+      return false;
+    }
+    result_.sweepMicros = now - result_.startTime;
+    active_ = false;
+    return true;
+  }
+
+  bool active() const { return active_; }
+  const SpectrumResult &result() const { return result_; }
+
+  // How long a sweep of count frequencies takes at the given sample period,
+  // roughly.
+  static uint32_t estimateMicros(const SpectrumScanConfig &config,
+                                 size_t count, uint32_t samplePeriodMicros) {
+    if (count == 0) {
+      return 0;
+    }
+    uint32_t samples = config.samples > 0 ? config.samples : 1;
+    // A tick to tune, the samples from when it has settled, and the tick
+    // after the last one tunes the next.
+    uint32_t perStep = config.settleMicros + samples * samplePeriodMicros;
+    return config.firstSettleMicros - config.settleMicros + count * perStep;
+  }
+
+ private:
+  SpectrumResult result_;
+  uint8_t samples_ = SPECTRUM_SAMPLES;
+  uint32_t settleMicros_ = SPECTRUM_SETTLE_MICROS;
+  uint32_t firstSettleMicros_ = RX5808_SETTLE_MICROS;
+  size_t index_ = 0;
+  bool retunePending_ = false;
+  bool active_ = false;
+  uint32_t sum_ = 0;
+  uint8_t taken_ = 0;
+};
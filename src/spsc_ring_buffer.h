@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring buffer.
+//
+// Exactly one context may call push() (e.g. the sampling timer) and exactly
+// one context may call pop()/popBatch()/clear() (e.g. loop()). Head and tail
+// are free-running counters, so Capacity has to be a power of two and all
+// Capacity slots are usable.
+//
+// No Arduino dependency, so this builds on the host as well.
+template <typename T, size_t Capacity>
+class SpscRingBuffer {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+ public:
+  // Producer side. Returns false and counts a drop when the buffer is full.
+  bool push(const T &item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Capacity) {
+      dropped_.store(dropped_.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+      return false;
+    }
+
+    items_[head & kMask] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.
+  bool pop(T &item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    item = items_[tail & kMask];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Copies up to maxItems into out, returns how many.
+  size_t popBatch(T *out, size_t maxItems) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t available = head_.load(std::memory_order_acquire) - tail;
+    size_t count = available < maxItems ? available : maxItems;
+
+    for (size_t i = 0; i < count; i++) {
+      out[i] = items_[(tail + i) & kMask];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer side. Discards everything currently queued.
+  void clear() {
+    tail_.store(head_.load(std::memory_order_acquire),
+                std::memory_order_release);
+  }
+
+  // Approximate when called from neither side.
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+  static constexpr size_t capacity() { return Capacity; }
+
+  // Number of items rejected by push() because the buffer was full.
+  uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  static constexpr size_t kMask = Capacity - 1;
+
+  T items_[Capacity];
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+  std::atomic<uint32_t> dropped_{0};
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+
+// Router connection that never blocks.
+//
+// update() is polled from loop() and only ever starts or drops a
+// connection attempt, the driver does the rest in the background. An
+// attempt that doesn't connect within WIFI_CONNECT_TIMEOUT_MILLIS is
+// dropped, and the next one waits out a backoff that doubles from
+// WIFI_BACKOFF_MIN_MILLIS up to WIFI_BACKOFF_MAX_MILLIS. A lost connection
+// is retried right away, the backoff starts over once connected.
+//
+// Driver provides:
+//   bool connected();
+//   void begin();      // start connecting to the router
+//   void disconnect();
+
+#ifndef WIFI_CONNECT_TIMEOUT_MILLIS
+#define WIFI_CONNECT_TIMEOUT_MILLIS 10000
+#endif
+
+#ifndef WIFI_BACKOFF_MIN_MILLIS
+#define WIFI_BACKOFF_MIN_MILLIS 1000
+#endif
+
+#ifndef WIFI_BACKOFF_MAX_MILLIS
+#define WIFI_BACKOFF_MAX_MILLIS 60000
+#endif
+
+enum WifiState : uint8_t {
+  // No router configured.
+  WIFI_IDLE,
+  WIFI_CONNECTING,
+  WIFI_CONNECTED,
+  // Waiting to try again.
+  WIFI_BACKOFF,
+};
+
+enum WifiEvent : uint8_t {
+  WIFI_EVENT_NONE,
+  WIFI_EVENT_CONNECTED,
+  WIFI_EVENT_LOST,
+  // An attempt timed out.
+  WIFI_EVENT_FAILED,
+};
+
+template <typename Driver>
+class WifiConnection {
+ public:
+  explicit WifiConnection(Driver &driver) : driver_(driver) {}
+
+  // Starts the first attempt.
+  void start(uint32_t nowMillis) {
+    backoffMillis_ = WIFI_BACKOFF_MIN_MILLIS;
+    connect(nowMillis);
+  }
+
+  WifiEvent update(uint32_t nowMillis) {
+    switch (state_) {
+      case WIFI_IDLE:
+        return WIFI_EVENT_NONE;
+
+      case WIFI_CONNECTING:
+        if (driver_.connected()) {
+          state_ = WIFI_CONNECTED;
+          backoffMillis_ = WIFI_BACKOFF_MIN_MILLIS;
+          return WIFI_EVENT_CONNECTED;
+        }
+        if (nowMillis - since_ >= WIFI_CONNECT_TIMEOUT_MILLIS) {
+          // This seems to improve network stability when WIFI failed.
+          driver_.disconnect();
+          state_ = WIFI_BACKOFF;
+          since_ = nowMillis;
+          return WIFI_EVENT_FAILED;
+        }
+        return WIFI_EVENT_NONE;
+
+      case WIFI_CONNECTED:
+        if (!driver_.connected()) {
+          connect(nowMillis);
+          return WIFI_EVENT_LOST;
+        }
+        return WIFI_EVENT_NONE;
+
+      case WIFI_BACKOFF:
+        if (nowMillis - since_ >= backoffMillis_) {
+          backoffMillis_ = backoffMillis_ * 2 < WIFI_BACKOFF_MAX_MILLIS
+                               ? backoffMillis_ * 2
+                               : WIFI_BACKOFF_MAX_MILLIS;
+          connect(nowMillis);
+        }
+        return WIFI_EVENT_NONE;
+    }
+    return WIFI_EVENT_NONE;
+  }
+
+  WifiState state() const { return state_; }
+  // Wait after the next failed attempt.
+  uint32_t backoffMillis() const { return backoffMillis_; }
+  // Attempts since boot.
+  uint32_t attempts() const { return attempts_; }
+
+ private:
+  void connect(uint32_t nowMillis) {
+    driver_.begin();
+    state_ = WIFI_CONNECTING;
+    since_ = nowMillis;
+    attempts_++;
+  }
+
+  Driver &driver_;
+  WifiState state_ = WIFI_IDLE;
+  uint32_t since_ = 0;
+  uint32_t backoffMillis_ = WIFI_BACKOFF_MIN_MILLIS;
+  uint32_t attempts_ = 0;
+};
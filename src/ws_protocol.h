@@ -0,0 +1,265 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Binary protocol of the /ws endpoint.
+//
+// Every frame is one binary WebSocket message:
+//   byte 0:  WS_PROTOCOL_VERSION
+//   byte 1:  WsFrameType
+//   then:    the payload of that type, integers little endian
+//
+// Clients should ignore frame types they don't know, and may append fields
+// to a type only with a new version.
+//
+//   WS_PASS (1)
+//     u8 channel, u32 lap, u64 timeStamp micros, u64 interval micros,
+//     u16 rssiPeak, u16 rssiPeakRaw, u64 detectedTimeStamp micros
+//   WS_RSSI (2)
+//     u64 timeStamp micros, u32 log interval micros, u16 rssi,
+//     then the binary rssi batch of rssi_telemetry.h up to the end
+//   WS_SETTINGS (3)
+//     u16 vtxFreq, u16 rssiPeak, u16 enterRssiOffset, u16 leaveRssiOffset,
+//     u8 filterRatio, u8 logRssi, u8 id, u8 channel count
+//   WS_CALIBRATION (4)
+//     u8 calibrating (1 started, 0 ended), u64 timeStamp micros
+//
+// The writer and reader only touch caller buffers, so a frame can be built
+// once and handed to every client.
+
+#define WS_PROTOCOL_VERSION 1
+
+// Big enough for every frame type except WS_RSSI, which is
+// WS_RSSI_HEADER_SIZE plus its batch.
+#define WS_MAX_FIXED_FRAME_SIZE 40
+#define WS_RSSI_HEADER_SIZE (2 + 8 + 4 + 2)
+
+enum WsFrameType : uint8_t {
+  WS_PASS = 1,
+  WS_RSSI = 2,
+  WS_SETTINGS = 3,
+  WS_CALIBRATION = 4,
+};
+
+struct WsPass {
+  uint8_t channel;
+  uint32_t lap;
+  uint64_t timeStamp;
+  uint64_t interval;
+  uint16_t rssiPeak;
+  uint16_t rssiPeakRaw;
+  uint64_t detectedTimeStamp;
+};
+
+struct WsRssi {
+  uint64_t timeStamp;
+  uint32_t logIntervalMicros;
+  uint16_t rssi;
+  // Points into the frame.
+  const uint8_t *batch;
+  size_t batchSize;
+};
+
+struct WsSettings {
+  uint16_t vtxFreq;
+  uint16_t rssiPeak;
+  uint16_t enterRssiOffset;
+  uint16_t leaveRssiOffset;
+  uint8_t filterRatio;
+  uint8_t logRssi;
+  uint8_t id;
+  uint8_t channelCount;
+};
+
+struct WsCalibration {
+  uint8_t calibrating;
+  uint64_t timeStamp;
+};
+
+class WsFrameWriter {
+ public:
+  WsFrameWriter(uint8_t *buffer, WsFrameType type) : buffer_(buffer) {
+    put8(WS_PROTOCOL_VERSION);
+    put8(type);
+  }
+
+  void put8(uint8_t value) { buffer_[size_++] = value; }
+
+  void put16(uint16_t value) {
+    put8(value);
+    put8(value >> 8);
+  }
+
+  void put32(uint32_t value) {
+    put16(value);
+    put16(value >> 16);
+  }
+
+  void put64(uint64_t value) {
+    put32(value);
+    put32(value >> 32);
+  }
+
+  void putBytes(const uint8_t *data, size_t len) {
+    memcpy(buffer_ + size_, data, len);
+    size_ += len;
+  }
+
+  uint8_t *end() { return buffer_ + size_; }
+  // For bytes written through end().
+  void advance(size_t len) { size_ += len; }
+
+  size_t size() const { return size_; }
+
+ private:
+  uint8_t *buffer_;
+  size_t size_ = 0;
+};
+
+class WsFrameReader {
+ public:
+  WsFrameReader(const uint8_t *data, size_t len) : data_(data), len_(len) {}
+
+  bool get8(uint8_t &value) {
+    if (pos_ + 1 > len_) {
+      return false;
+    }
+    value = data_[pos_++];
+    return true;
+  }
+
+  bool get16(uint16_t &value) {
+    uint8_t lo, hi;
+    if (!get8(lo) || !get8(hi)) {
+      return false;
+    }
+    value = lo | ((uint16_t)hi << 8);
+    return true;
+  }
+
+  bool get32(uint32_t &value) {
+    uint16_t lo, hi;
+    if (!get16(lo) || !get16(hi)) {
+      return false;
+    }
+    value = lo | ((uint32_t)hi << 16);
+    return true;
+  }
+
+  bool get64(uint64_t &value) {
+    uint32_t lo, hi;
+    if (!get32(lo) || !get32(hi)) {
+      return false;
+    }
+    value = lo | ((uint64_t)hi << 32);
+    return true;
+  }
+
+  const uint8_t *rest() const { return data_ + pos_; }
+  size_t remaining() const { return len_ - pos_; }
+
+ private:
+  const uint8_t *data_;
+  size_t len_;
+  size_t pos_ = 0;
+};
+
+inline size_t encodeWsPass(uint8_t *buffer, const WsPass &pass) {
+  WsFrameWriter w(buffer, WS_PASS);
+  w.put8(pass.channel);
+  w.put32(pass.lap);
+  w.put64(pass.timeStamp);
+  w.put64(pass.interval);
+  w.put16(pass.rssiPeak);
+  w.put16(pass.rssiPeakRaw);
+  w.put64(pass.detectedTimeStamp);
+  return w.size();
+}
+
+// Writes the header, the caller appends the batch at buffer +
+// WS_RSSI_HEADER_SIZE.
+inline size_t encodeWsRssiHeader(uint8_t *buffer, uint64_t timeStamp,
+                                 uint32_t logIntervalMicros, uint16_t rssi) {
+  WsFrameWriter w(buffer, WS_RSSI);
+  w.put64(timeStamp);
+  w.put32(logIntervalMicros);
+  w.put16(rssi);
+  return w.size();
+}
+
+inline size_t encodeWsSettings(uint8_t *buffer, const WsSettings &settings) {
+  WsFrameWriter w(buffer, WS_SETTINGS);
+  w.put16(settings.vtxFreq);
+  w.put16(settings.rssiPeak);
+  w.put16(settings.enterRssiOffset);
+  w.put16(settings.leaveRssiOffset);
+  w.put8(settings.filterRatio);
+  w.put8(settings.logRssi);
+  w.put8(settings.id);
+  w.put8(settings.channelCount);
+  return w.size();
+}
+
+inline size_t encodeWsCalibration(uint8_t *buffer,
+                                  const WsCalibration &calibration) {
+  WsFrameWriter w(buffer, WS_CALIBRATION);
+  w.put8(calibration.calibrating);
+  w.put64(calibration.timeStamp);
+  return w.size();
+}
+
+// Checks the version and returns the frame type, 0 if not a valid frame.
+inline uint8_t wsFrameType(const uint8_t *data, size_t len) {
+  if (len < 2 || data[0] != WS_PROTOCOL_VERSION) {
+    return 0;
+  }
+  return data[1];
+}
+
+inline bool decodeWsPass(const uint8_t *data, size_t len, WsPass &pass) {
+  if (wsFrameType(data, len) != WS_PASS) {
+    return false;
+  }
+  WsFrameReader r(data + 2, len - 2);
+  return r.get8(pass.channel) && r.get32(pass.lap) && r.get64(pass.timeStamp) &&
+         r.get64(pass.interval) && r.get16(pass.rssiPeak) &&
+         r.get16(pass.rssiPeakRaw) && r.get64(pass.detectedTimeStamp);
+}
+
+inline bool decodeWsRssi(const uint8_t *data, size_t len, WsRssi &rssi) {
+  if (wsFrameType(data, len) != WS_RSSI) {
+    return false;
+  }
+  WsFrameReader r(data + 2, len - 2);
+  if (!r.get64(rssi.timeStamp) || !r.get32(rssi.logIntervalMicros) ||
+      !r.get16(rssi.rssi)) {
+    return false;
+  }
+  rssi.batch = r.rest();
+  rssi.batchSize = r.remaining();
+  return true;
+}
+
+inline bool decodeWsSettings(const uint8_t *data, size_t len,
+                             WsSettings &settings) {
+  if (wsFrameType(data, len) != WS_SETTINGS) {
+    return false;
+  }
+  WsFrameReader r(data + 2, len - 2);
+  return r.get16(settings.vtxFreq) && r.get16(settings.rssiPeak) &&
+         r.get16(settings.enterRssiOffset) &&
+         r.get16(settings.leaveRssiOffset) && r.get8(settings.filterRatio) &&
+         r.get8(settings.logRssi) && r.get8(settings.id) &&
+         r.get8(settings.channelCount);
+}
+
+inline bool decodeWsCalibration(const uint8_t *data, size_t len,
+                                WsCalibration &calibration) {
+  if (wsFrameType(data, len) != WS_CALIBRATION) {
+    return false;
+  }
+  WsFrameReader r(data + 2, len - 2);
+  return r.get8(calibration.calibrating) && r.get64(calibration.timeStamp);
+}
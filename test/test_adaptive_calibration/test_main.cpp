@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <unity.h>
+
+#include "adaptive_calibration.h"
+
+static uint32_t noiseState;
+
+static uint16_t randomBelow(uint16_t limit) {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return (uint16_t)((noiseState >> 16) % limit);
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+void test_p2_is_exact_for_the_first_five() {
+  P2Quantile median;
+  TEST_ASSERT_EQUAL_UINT16(0, median.value());
+  median.add(30);
+  TEST_ASSERT_EQUAL_UINT16(30, median.value());
+  median.add(10);
+  median.add(20);
+  TEST_ASSERT_EQUAL_UINT16(20, median.value());
+  median.add(50);
+  median.add(40);
+  TEST_ASSERT_EQUAL_UINT16(30, median.value());
+}
+
+void test_p2_estimates_quantiles_of_a_stream() {
+  const uint16_t perMilles[] = {100, 500, 900};
+  for (size_t i = 0; i < 3; i++) {
+    P2Quantile quantile(perMilles[i]);
+    for (int n = 0; n < 20000; n++) {
+      quantile.add(randomBelow(4000));
+    }
+    // Uniform, so the quantile is perMille * 4.
+    TEST_ASSERT_INT_WITHIN(80, perMilles[i] * 4, quantile.value());
+  }
+}
+
+void test_windowed_quantile_follows_a_step() {
+  WindowedQuantile median(500, 64);
+  for (int n = 0; n < 200; n++) {
+    median.add(1000 + randomBelow(20));
+  }
+  TEST_ASSERT_INT_WITHIN(20, 1010, median.value());
+
+  // Within one and a half windows of the step.
+  for (int n = 0; n < 96; n++) {
+    median.add(600 + randomBelow(20));
+  }
+  TEST_ASSERT_INT_WITHIN(20, 610, median.value());
+}
+
+// A race where the pass peaks fade, e.g. a VTX in a low power mode, with
+// the triggers applied from every suggestion as ADAPTIVE_AUTO does.
+// Samples are the smoothed rssi; the crossing logic is the detector's
+// enter/leave hysteresis.
+struct Race {
+  AdaptiveCalibration calibration;
+  uint16_t enterTrigger;
+  uint16_t leaveTrigger;
+  bool crossing = false;
+  uint16_t crossingPeak = 0;
+  uint32_t detected = 0;
+
+  Race(uint16_t enter, uint16_t leave)
+      : enterTrigger(enter), leaveTrigger(leave) {}
+
+  void sample(uint16_t rssi) {
+    if (!crossing && rssi > enterTrigger) {
+      crossing = true;
+      crossingPeak = 0;
+    }
+    if (crossing && rssi > crossingPeak) {
+      crossingPeak = rssi;
+    }
+    calibration.addSample(rssi, crossing);
+    if (crossing && rssi < leaveTrigger) {
+      crossing = false;
+      calibration.addPass(crossingPeak);
+      detected++;
+    }
+  }
+
+  // A lap: floor noise, then a triangular pass up to peak.
+  void lap(uint16_t floor, uint16_t peak) {
+    for (int i = 0; i < 3000; i++) {
+      sample(floor + randomBelow(16));
+    }
+    for (int i = 0; i <= 100; i++) {
+      sample(floor + (uint32_t)(peak - floor) * (100 - abs(i - 50) * 2) / 100);
+    }
+  }
+
+  void apply() {
+    AdaptiveSuggestion suggestion;
+    if (!suggestTriggers(calibration.estimate(), suggestion)) {
+      return;
+    }
+    uint16_t peak = suggestion.rssiPeak;
+    enterTrigger = peak - peak * suggestion.enterRssiOffset / 100;
+    leaveTrigger = peak - peak * suggestion.leaveRssiOffset / 100;
+  }
+};
+
+void test_nothing_suggested_before_enough_passes() {
+  Race race(1000, 900);
+  for (int i = 0; i < ADAPTIVE_MIN_PASSES - 1; i++) {
+    race.lap(200, 1500);
+  }
+  AdaptiveSuggestion suggestion;
+  TEST_ASSERT_FALSE(suggestTriggers(race.calibration.estimate(), suggestion));
+  race.lap(200, 1500);
+  TEST_ASSERT_TRUE(suggestTriggers(race.calibration.estimate(), suggestion));
+}
+
+void test_estimates_floor_and_peaks() {
+  Race race(1000, 900);
+  for (int i = 0; i < 40; i++) {
+    race.lap(200, 1400 + randomBelow(200));
+  }
+  AdaptiveEstimate estimate = race.calibration.estimate();
+  TEST_ASSERT_INT_WITHIN(4, 207, estimate.noiseFloor);
+  TEST_ASSERT_INT_WITHIN(60, 1500, estimate.peak);
+  TEST_ASSERT_LESS_THAN(estimate.peak, estimate.lowPeak);
+  TEST_ASSERT_GREATER_THAN(1350, estimate.lowPeak);
+  TEST_ASSERT_EQUAL_UINT32(0, estimate.missedPasses);
+}
+
+void test_triggers_follow_fading_peaks() {
+  Race race(1000, 900);
+  uint16_t peak = 1600;
+  for (int i = 0; i < 20; i++) {
+    race.lap(200, peak);
+    race.apply();
+  }
+  TEST_ASSERT_EQUAL_UINT32(20, race.detected);
+
+  // Fades to well below where the enter trigger started.
+  for (int i = 0; i < 80; i++) {
+    peak -= 10;
+    race.lap(200, peak);
+    race.apply();
+  }
+  TEST_ASSERT_EQUAL_UINT16(800, peak);
+  TEST_ASSERT_LESS_THAN(peak, race.enterTrigger);
+  TEST_ASSERT_GREATER_THAN(200 + 16, race.leaveTrigger);
+  TEST_ASSERT_LESS_THAN(race.enterTrigger, race.leaveTrigger);
+
+  // Every pass was counted, by the detector or as missed.
+  AdaptiveEstimate estimate = race.calibration.estimate();
+  TEST_ASSERT_EQUAL_UINT32(100, race.detected + estimate.missedPasses);
+  TEST_ASSERT_INT_WITHIN(150, peak, estimate.peak);
+}
+
+void test_missed_passes_pull_the_triggers_down() {
+  // Fixed triggers, the passes drop below the enter trigger at once.
+  Race race(1000, 900);
+  for (int i = 0; i < 16; i++) {
+    race.lap(200, 1500);
+  }
+  for (int i = 0; i < 32; i++) {
+    race.lap(200, 900);
+  }
+  AdaptiveEstimate estimate = race.calibration.estimate();
+  TEST_ASSERT_EQUAL_UINT32(16, race.detected);
+  TEST_ASSERT_EQUAL_UINT32(32, estimate.missedPasses);
+
+  AdaptiveSuggestion suggestion;
+  TEST_ASSERT_TRUE(suggestTriggers(estimate, suggestion));
+  race.apply();
+  TEST_ASSERT_LESS_THAN(900, race.enterTrigger);
+
+  // Small bumps, e.g. a quad flying by, aren't passes.
+  uint32_t missed = estimate.missedPasses;
+  for (int i = 0; i < 8; i++) {
+    race.lap(200, 260);
+  }
+  TEST_ASSERT_EQUAL_UINT32(missed, race.calibration.estimate().missedPasses);
+}
+
+void test_offsets_and_tolerance() {
+  TEST_ASSERT_EQUAL_UINT16(0, adaptiveOffset(1000, 1200));
+  TEST_ASSERT_EQUAL_UINT16(25, adaptiveOffset(1000, 750));
+  TEST_ASSERT_EQUAL_UINT16(33, adaptiveOffset(3, 2));
+
+  AdaptiveSuggestion suggestion;
+  suggestion.rssiPeak = 1000;
+  suggestion.enterRssiOffset = 25;
+  suggestion.leaveRssiOffset = 40;
+  TEST_ASSERT_FALSE(adaptiveSuggestionDiffers(750, 600, suggestion));
+  TEST_ASSERT_FALSE(adaptiveSuggestionDiffers(780, 570, suggestion));
+  TEST_ASSERT_TRUE(adaptiveSuggestionDiffers(790, 600, suggestion));
+  TEST_ASSERT_TRUE(adaptiveSuggestionDiffers(750, 560, suggestion));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_p2_is_exact_for_the_first_five);
+  RUN_TEST(test_p2_estimates_quantiles_of_a_stream);
+  RUN_TEST(test_windowed_quantile_follows_a_step);
+  RUN_TEST(test_nothing_suggested_before_enough_passes);
+  RUN_TEST(test_estimates_floor_and_peaks);
+  RUN_TEST(test_triggers_follow_fading_peaks);
+  RUN_TEST(test_missed_passes_pull_the_triggers_down);
+  RUN_TEST(test_offsets_and_tolerance);
+  return UNITY_END();
+}
@@ -0,0 +1,146 @@
+#include <unity.h>
+
+#include "channel_hopper.h"
+#include "rx5808.h"
+
+// Counts retunes instead of sending them anywhere.
+class CountingBus : public Rx5808Bus {
+ public:
+  void begin() override {}
+  void writeFrame(uint32_t) override { frames++; }
+
+  uint32_t frames = 0;
+};
+
+static const uint64_t kSampleMicros = 100;
+
+struct RunResult {
+  uint32_t tunes = 0;
+  // Usable samples per channel, settled and on the right frequency.
+  uint32_t samples[RX_MAX_CHANNELS] = {0};
+  // Order of the first tunes, by channel.
+  uint8_t order[16];
+};
+
+// Drives the hopper and a receiver the way the sampler does, one sample every
+// kSampleMicros for durationMicros.
+static RunResult run(ChannelHopper &hopper, uint64_t durationMicros) {
+  CountingBus bus;
+  Rx5808 rx(bus, hopper.config().settleMicros);
+  RunResult result;
+
+  for (uint64_t now = 0; now < durationMicros; now += kSampleMicros) {
+    if (hopper.due(now)) {
+      rx.tune(hopper.advance(now), now);
+      if (result.tunes < 16) {
+        result.order[result.tunes] = hopper.channel();
+      }
+      result.tunes++;
+    }
+    if (rx.isSettled(now)) {
+      TEST_ASSERT_EQUAL_UINT16(hopper.frequency(), rx.frequency());
+      result.samples[hopper.channel()]++;
+    }
+  }
+
+  TEST_ASSERT_EQUAL(2 * result.tunes, bus.frames);
+  return result;
+}
+
+static ChannelConfig channels(uint8_t count) {
+  static const uint16_t kFrequencies[] = {5658, 5695, 5732, 5769,
+                                          5806, 5843, 5880, 5917};
+  ChannelConfig config;
+  for (uint8_t i = 0; i < count; i++) {
+    config.frequencies[i] = kFrequencies[i];
+  }
+  config.count = count;
+  return config;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_unconfigured_never_tunes() {
+  ChannelHopper hopper;
+  TEST_ASSERT_FALSE(hopper.due(0));
+  TEST_ASSERT_FALSE(hopper.due(1000 * 1000));
+  TEST_ASSERT_FALSE(hopper.hopping());
+}
+
+void test_single_channel_tunes_once() {
+  ChannelHopper hopper;
+  hopper.configure(channels(1));
+  RunResult result = run(hopper, 1000 * 1000);
+
+  TEST_ASSERT_EQUAL(1, result.tunes);
+  TEST_ASSERT_FALSE(hopper.hopping());
+  // Everything but the first settle time.
+  TEST_ASSERT_EQUAL((1000 * 1000 - RX_HOP_SETTLE_MICROS) / kSampleMicros,
+                    result.samples[0]);
+}
+
+void test_hops_round_robin_every_dwell() {
+  ChannelHopper hopper;
+  hopper.configure(channels(3));
+  RunResult result = run(hopper, 1000 * 1000);
+
+  // One tune per dwell, rounded up for the one in progress.
+  TEST_ASSERT_EQUAL((1000 * 1000 + RX_HOP_DWELL_MICROS - 1) /
+                        RX_HOP_DWELL_MICROS,
+                    result.tunes);
+  for (uint8_t i = 0; i < 16; i++) {
+    TEST_ASSERT_EQUAL(i % 3, result.order[i]);
+  }
+}
+
+void test_pilots_share_samples_evenly() {
+  ChannelHopper hopper;
+  ChannelConfig config = channels(4);
+  config.dwellMicros = 20000;
+  config.settleMicros = 5000;
+  hopper.configure(config);
+  // A whole number of rounds.
+  RunResult result = run(hopper, 50 * 4 * 20000);
+
+  // sampleRate * (dwell - settle) / dwell / count, per second.
+  uint32_t expected = 50 * (20000 - 5000) / kSampleMicros;
+  for (uint8_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL(expected, result.samples[i]);
+  }
+  TEST_ASSERT_EQUAL(0, result.samples[4]);
+}
+
+void test_configure_restarts_from_first_channel() {
+  ChannelHopper hopper;
+  hopper.configure(channels(3));
+  hopper.advance(0);
+  hopper.advance(15000);
+  TEST_ASSERT_EQUAL(1, hopper.channel());
+
+  hopper.configure(channels(2));
+  TEST_ASSERT_TRUE(hopper.due(15001));
+  TEST_ASSERT_EQUAL_UINT16(5658, hopper.advance(15001));
+  TEST_ASSERT_EQUAL(0, hopper.channel());
+  TEST_ASSERT_FALSE(hopper.due(15001 + RX_HOP_DWELL_MICROS - 1));
+  TEST_ASSERT_TRUE(hopper.due(15001 + RX_HOP_DWELL_MICROS));
+}
+
+void test_count_is_clamped() {
+  ChannelHopper hopper;
+  ChannelConfig config = channels(8);
+  config.count = RX_MAX_CHANNELS + 3;
+  hopper.configure(config);
+  TEST_ASSERT_EQUAL(RX_MAX_CHANNELS, hopper.count());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_unconfigured_never_tunes);
+  RUN_TEST(test_single_channel_tunes_once);
+  RUN_TEST(test_hops_round_robin_every_dwell);
+  RUN_TEST(test_pilots_share_samples_evenly);
+  RUN_TEST(test_configure_restarts_from_first_channel);
+  RUN_TEST(test_count_is_clamped);
+  return UNITY_END();
+}
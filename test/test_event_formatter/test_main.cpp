@@ -0,0 +1,202 @@
+#include <unity.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "event_formatter.h"
+
+static uint32_t noiseState;
+
+static uint64_t random64() {
+  uint64_t value = 0;
+  for (int i = 0; i < 2; i++) {
+    noiseState = noiseState * 1664525 + 1013904223;
+    value = value << 32 | noiseState;
+  }
+  // Every length, not only 20 digits.
+  return value >> (noiseState >> 26);
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+void test_decimal_matches_printf() {
+  const uint64_t values[] = {0, 7, 10, 99, 100, 4294967295ULL,
+                             4294967296ULL, UINT64_MAX};
+  char expected[24];
+  char out[24];
+  for (uint64_t value : values) {
+    snprintf(expected, sizeof(expected), "%" PRIu64, value);
+    out[writeDecimal(out, value)] = 0;
+    TEST_ASSERT_EQUAL_STRING(expected, out);
+  }
+  for (int i = 0; i < 10000; i++) {
+    uint64_t value = random64();
+    snprintf(expected, sizeof(expected), "%" PRIu64, value);
+    out[writeDecimal(out, value)] = 0;
+    TEST_ASSERT_EQUAL_STRING(expected, out);
+  }
+}
+
+void test_fields_are_space_separated() {
+  char buffer[32];
+  EventWriter out(buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("", out.c_str());
+  out.field(12).field(0).field(345);
+  TEST_ASSERT_EQUAL_STRING("12 0 345", out.c_str());
+  TEST_ASSERT_EQUAL(8, out.length());
+  TEST_ASSERT_FALSE(out.truncated());
+}
+
+// What doesn't fit is dropped whole, with its space, and nothing is written
+// after it. The buffer stays terminated.
+void test_truncation_drops_whole_field() {
+  char buffer[8];
+  memset(buffer, 'x', sizeof(buffer));
+  EventWriter out(buffer, sizeof(buffer));
+  out.field(123).field(4567).field(8);
+  TEST_ASSERT_EQUAL_STRING("123", out.c_str());
+  TEST_ASSERT_TRUE(out.truncated());
+
+  // 7 characters fit in 8 bytes, exactly.
+  EventWriter full(buffer, sizeof(buffer));
+  full.text("abc").put(' ').decimal(123);
+  TEST_ASSERT_EQUAL_STRING("abc 123", full.c_str());
+  TEST_ASSERT_FALSE(full.truncated());
+  full.put('!');
+  TEST_ASSERT_EQUAL_STRING("abc 123", full.c_str());
+  TEST_ASSERT_TRUE(full.truncated());
+}
+
+void test_one_byte_buffer_is_terminated() {
+  char buffer[1] = {'x'};
+  EventWriter out(buffer, sizeof(buffer));
+  out.decimal(5);
+  TEST_ASSERT_EQUAL(0, buffer[0]);
+  TEST_ASSERT_TRUE(out.truncated());
+}
+
+static PassRecord makeRecord() {
+  PassRecord record;
+  record.id = 9;
+  record.channel = 3;
+  record.channelCount = 1;
+  record.pass.lap = 17;
+  record.pass.interval = 21345678;
+  record.pass.rssiPeak = 412;
+  record.pass.timeStamp = 123456789012ULL;
+  record.pass.detectedTimeStamp = 123456901234ULL;
+  return record;
+}
+
+// As the firmware formatted it before EventWriter.
+static void snprintfPassMessage(char *out, size_t size,
+                                const PassRecord &record) {
+  const PassEvent &pass = record.pass;
+  int n = snprintf(out, size,
+                   "%u %" PRIu64 " %u %" PRIu64 " %" PRIu64 " %" PRIu64,
+                   (unsigned)pass.lap, pass.interval / 1000,
+                   (unsigned)pass.rssiPeak, pass.timeStamp / 1000,
+                   pass.detectedTimeStamp, pass.timeStamp);
+  if (record.channelCount > 1) {
+    snprintf(out + n, size - n, " %u", (unsigned)record.channel);
+  }
+}
+
+void test_pass_message() {
+  PassRecord record = makeRecord();
+  char buffer[PASS_MESSAGE_SIZE + 1];
+  EventWriter out(buffer, sizeof(buffer));
+  formatPassMessage(out, record);
+  TEST_ASSERT_EQUAL_STRING("17 21345 412 123456789 123456901234 123456789012",
+                           out.c_str());
+
+  // The channel only when hopping.
+  record.channelCount = 4;
+  EventWriter hopping(buffer, sizeof(buffer));
+  formatPassMessage(hopping, record);
+  TEST_ASSERT_EQUAL_STRING(
+      "17 21345 412 123456789 123456901234 123456789012 3", hopping.c_str());
+}
+
+// PASS_MESSAGE_SIZE holds the longest message there is.
+void test_longest_pass_message_fits() {
+  PassRecord record;
+  record.channel = 255;
+  record.channelCount = 8;
+  record.pass.lap = UINT32_MAX;
+  record.pass.interval = UINT64_MAX;
+  record.pass.rssiPeak = UINT16_MAX;
+  record.pass.timeStamp = UINT64_MAX;
+  record.pass.detectedTimeStamp = UINT64_MAX;
+
+  char expected[256];
+  snprintfPassMessage(expected, sizeof(expected), record);
+  char buffer[PASS_MESSAGE_SIZE + 1];
+  EventWriter out(buffer, sizeof(buffer));
+  formatPassMessage(out, record);
+  TEST_ASSERT_FALSE(out.truncated());
+  TEST_ASSERT_EQUAL_STRING(expected, out.c_str());
+}
+
+void test_pass_messages_match_snprintf() {
+  char expected[PASS_MESSAGE_SIZE + 1];
+  char buffer[PASS_MESSAGE_SIZE + 1];
+  for (int i = 0; i < 10000; i++) {
+    PassRecord record = makeRecord();
+    record.channel = random64() % 8;
+    record.channelCount = 1 + random64() % 8;
+    record.pass.lap = random64();
+    record.pass.interval = random64();
+    record.pass.rssiPeak = random64();
+    record.pass.timeStamp = random64();
+    record.pass.detectedTimeStamp = random64();
+
+    snprintfPassMessage(expected, sizeof(expected), record);
+    EventWriter out(buffer, sizeof(buffer));
+    formatPassMessage(out, record);
+    TEST_ASSERT_EQUAL_STRING(expected, out.c_str());
+  }
+}
+
+void test_gate_pass() {
+  GatePass pass;
+  pass.id = 2;
+  pass.lap = 5;
+  pass.timeStamp = 98765432100ULL;
+  pass.detectedTimeStamp = 98765500000ULL;
+  pass.rssiPeak = 380;
+  pass.channel = 6;
+  pass.synced = true;
+  char buffer[96];
+  EventWriter out(buffer, sizeof(buffer));
+  formatGatePass(out, pass);
+  TEST_ASSERT_EQUAL_STRING("2 5 98765432100 98765500000 380 6 1",
+                           out.c_str());
+}
+
+void test_heat_lap() {
+  LapStats stats;
+  stats.add(21000000);
+  stats.add(19000000);
+  stats.add(20000000);
+  char buffer[128];
+  EventWriter out(buffer, sizeof(buffer));
+  formatHeatLap(out, 4, 1, 3, 20000000, stats);
+  TEST_ASSERT_EQUAL_STRING(
+      "4 1 3 20000000 19000000 2 20000000 1000000 60000000", out.c_str());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_decimal_matches_printf);
+  RUN_TEST(test_fields_are_space_separated);
+  RUN_TEST(test_truncation_drops_whole_field);
+  RUN_TEST(test_one_byte_buffer_is_terminated);
+  RUN_TEST(test_pass_message);
+  RUN_TEST(test_longest_pass_message_fits);
+  RUN_TEST(test_pass_messages_match_snprintf);
+  RUN_TEST(test_gate_pass);
+  RUN_TEST(test_heat_lap);
+  return UNITY_END();
+}
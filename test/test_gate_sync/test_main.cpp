@@ -0,0 +1,427 @@
+#include <unity.h>
+
+#include <vector>
+
+#include "gate_sync.h"
+
+#define BROADCAST 0xFFFFFFFF
+
+struct Packet {
+  uint32_t from;
+  uint32_t to;
+  // Global micros it arrives at.
+  uint64_t at;
+  std::vector<uint8_t> data;
+};
+
+// Every timer's packets, delivered after a fixed one way delay.
+struct Network {
+  uint64_t now = 0;
+  uint32_t delayMicros = 1000;
+  std::vector<Packet> inFlight;
+
+  void send(uint32_t from, uint32_t to, const uint8_t *data, size_t len) {
+    Packet packet;
+    packet.from = from;
+    packet.to = to;
+    packet.at = now + delayMicros;
+    packet.data.assign(data, data + len);
+    inFlight.push_back(packet);
+  }
+};
+
+struct TestTransport {
+  Network *network;
+  uint32_t address;
+
+  void broadcast(const uint8_t *data, size_t len) {
+    network->send(address, BROADCAST, data, len);
+  }
+  void sendTo(uint32_t to, const uint8_t *data, size_t len) {
+    network->send(address, to, data, len);
+  }
+};
+
+// A timer with its own clock, clockOffset ahead of the network's.
+struct Timer {
+  Timer(Network &network, uint32_t address, int64_t clockOffset)
+      : transport{&network, address}, sync(transport),
+        clockOffset(clockOffset) {}
+
+  uint64_t local(const Network &network) const {
+    return network.now + clockOffset;
+  }
+
+  TestTransport transport;
+  GateSync<TestTransport> sync;
+  int64_t clockOffset;
+  std::vector<GatePass> passes;
+};
+
+// Runs the network and the timers in 1ms steps for micros.
+void run(Network &network, std::vector<Timer *> timers, uint64_t micros) {
+  uint64_t end = network.now + micros;
+  while (network.now < end) {
+    network.now += 1000;
+    std::vector<Packet> due;
+    for (size_t i = 0; i < network.inFlight.size();) {
+      if (network.inFlight[i].at <= network.now) {
+        due.push_back(network.inFlight[i]);
+        network.inFlight.erase(network.inFlight.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    for (const Packet &packet : due) {
+      for (Timer *timer : timers) {
+        uint32_t address = timer->transport.address;
+        if (address == packet.from ||
+            (packet.to != BROADCAST && packet.to != address)) {
+          continue;
+        }
+        GatePass pass;
+        if (timer->sync.receive(packet.data.data(), packet.data.size(),
+                                packet.from, timer->local(network), pass)) {
+          timer->passes.push_back(pass);
+        }
+      }
+    }
+    for (Timer *timer : timers) {
+      timer->sync.update(timer->local(network));
+    }
+  }
+}
+
+// Packets made by hand, for one GateSync alone.
+struct Recorder {
+  std::vector<std::vector<uint8_t>> sent;
+  std::vector<uint32_t> to;
+
+  void broadcast(const uint8_t *data, size_t len) {
+    sendTo(BROADCAST, data, len);
+  }
+  void sendTo(uint32_t address, const uint8_t *data, size_t len) {
+    sent.push_back(std::vector<uint8_t>(data, data + len));
+    to.push_back(address);
+  }
+};
+
+std::vector<uint8_t> announce(uint8_t id, uint32_t nonce) {
+  std::vector<uint8_t> packet(GATE_ANNOUNCE_SIZE);
+  packet[0] = GATE_SYNC_VERSION;
+  packet[1] = GATE_ANNOUNCE;
+  packet[2] = id;
+  gatePut(packet.data() + 3, nonce, 4);
+  return packet;
+}
+
+std::vector<uint8_t> passPacket(uint8_t id, uint32_t seq) {
+  GatePass pass;
+  pass.id = id;
+  pass.seq = seq;
+  pass.lap = seq;
+  std::vector<uint8_t> packet(GATE_PASS_SIZE);
+  encodeGatePass(packet.data(), pass);
+  return packet;
+}
+
+bool receive(GateSync<Recorder> &sync, const std::vector<uint8_t> &packet,
+             uint64_t now) {
+  GatePass pass;
+  return sync.receive(packet.data(), packet.size(), 100 + packet[2], now,
+                      pass);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_pass_round_trip() {
+  GatePass pass;
+  pass.id = 7;
+  pass.seq = 0x01020304;
+  pass.channel = 5;
+  pass.lap = 70000;
+  pass.synced = true;
+  pass.rssiPeak = 1800;
+  pass.timeStamp = 0x0123456789ABCDEFULL;
+  pass.detectedTimeStamp = 0x0123456789ABCDF0ULL;
+  pass.sentTimeStamp = 0x0123456789ABCDF1ULL;
+
+  uint8_t packet[GATE_SYNC_MAX_PACKET_SIZE];
+  TEST_ASSERT_EQUAL(GATE_PASS_SIZE, encodeGatePass(packet, pass));
+
+  GatePass decoded;
+  TEST_ASSERT_TRUE(decodeGatePass(packet, GATE_PASS_SIZE, decoded));
+  TEST_ASSERT_EQUAL(pass.id, decoded.id);
+  TEST_ASSERT_EQUAL_UINT32(pass.seq, decoded.seq);
+  TEST_ASSERT_EQUAL(pass.channel, decoded.channel);
+  TEST_ASSERT_EQUAL_UINT32(pass.lap, decoded.lap);
+  TEST_ASSERT_TRUE(decoded.synced);
+  TEST_ASSERT_EQUAL_UINT16(pass.rssiPeak, decoded.rssiPeak);
+  TEST_ASSERT_EQUAL_UINT64(pass.timeStamp, decoded.timeStamp);
+  TEST_ASSERT_EQUAL_UINT64(pass.detectedTimeStamp, decoded.detectedTimeStamp);
+  TEST_ASSERT_EQUAL_UINT64(pass.sentTimeStamp, decoded.sentTimeStamp);
+
+  TEST_ASSERT_FALSE(decodeGatePass(packet, GATE_PASS_SIZE - 1, decoded));
+  packet[2] = GATE_MAX_TIMERS;
+  TEST_ASSERT_FALSE(decodeGatePass(packet, GATE_PASS_SIZE, decoded));
+}
+
+// Symmetric delays give the offset exactly.
+void test_clock_offset_from_one_exchange() {
+  GateClock clock;
+  TEST_ASSERT_FALSE(clock.synced());
+
+  // The leader is 5s ahead, 1ms each way.
+  const int64_t offset = 5000000;
+  uint64_t t1 = 1000000;
+  uint64_t t2 = t1 + 1000 + offset;
+  uint64_t t4 = t1 + 2000;
+  clock.addExchange(t1, t2, t2, t4);
+
+  TEST_ASSERT_TRUE(clock.synced());
+  TEST_ASSERT_EQUAL_INT64(offset, clock.offsetAt(t4));
+  TEST_ASSERT_EQUAL_UINT64(t4 + 100 + offset, clock.toLeader(t4 + 100));
+  TEST_ASSERT_EQUAL(1000, clock.errorMicros());
+}
+
+// Of a window, the exchange with the lowest delay counts, one way delays
+// that differ throw the others off.
+void test_clock_keeps_lowest_delay_exchange() {
+  GateClock clock;
+  const int64_t offset = -2000000;
+
+  // 30ms out, 0 back: off by 15ms.
+  uint64_t t1 = 10000000;
+  clock.addExchange(t1, t1 + 30000 + offset, t1 + 30000 + offset, t1 + 30000);
+  TEST_ASSERT_EQUAL_INT64(offset + 15000, clock.offsetAt(t1));
+
+  t1 += 250000;
+  clock.addExchange(t1, t1 + 500 + offset, t1 + 500 + offset, t1 + 1000);
+  TEST_ASSERT_EQUAL_INT64(offset, clock.offsetAt(t1));
+
+  // Slower again, the better one stays.
+  t1 += 250000;
+  clock.addExchange(t1, t1 + 20000 + offset, t1 + 20000 + offset, t1 + 25000);
+  TEST_ASSERT_EQUAL_INT64(offset, clock.offsetAt(t1));
+  TEST_ASSERT_EQUAL(3, clock.exchanges());
+}
+
+void test_clock_drops_slow_and_impossible_exchanges() {
+  GateClock clock;
+  uint64_t t1 = 1000000;
+  clock.addExchange(t1, t1, t1, t1 + GATE_SYNC_MAX_DELAY_MICROS + 1);
+  // The leader took longer than the whole round trip.
+  clock.addExchange(t1, t1, t1 + 5000, t1 + 1000);
+  TEST_ASSERT_FALSE(clock.synced());
+  TEST_ASSERT_EQUAL(0, clock.exchanges());
+}
+
+// A leader 40ppm fast: the fit over the anchors finds the drift, and the
+// offset holds between exchanges.
+void test_clock_fits_drift() {
+  GateClock clock;
+  const double rate = 1 + 40e-6;
+  const uint64_t leaderStart = 3600000000ULL;
+  auto leader = [&](uint64_t local) {
+    return leaderStart + (uint64_t)(local * rate);
+  };
+
+  uint64_t t1 = 0;
+  for (int i = 0; i < GATE_SYNC_WINDOW * GATE_SYNC_ANCHORS; i++) {
+    t1 = 1000000 + (uint64_t)i * GATE_SYNC_INTERVAL_MICROS;
+    uint64_t t2 = leader(t1 + 1000);
+    clock.addExchange(t1, t2, t2, t1 + 2000);
+  }
+
+  TEST_ASSERT_INT32_WITHIN(500, 40000, clock.driftPpb());
+  // A minute on without exchanges, 2.4ms of drift, still within a few us.
+  uint64_t later = t1 + 60000000;
+  int64_t error = (int64_t)(clock.toLeader(later) - leader(later));
+  TEST_ASSERT_INT64_WITHIN(50, 0, error);
+
+  clock.reset();
+  TEST_ASSERT_FALSE(clock.synced());
+  TEST_ASSERT_EQUAL(0, clock.driftPpb());
+}
+
+// Two timers: the lower id leads, the other syncs to its clock.
+void test_follower_syncs_to_leader() {
+  Network network;
+  Timer leader(network, 100, 0);
+  Timer follower(network, 101, -7000000);
+  leader.sync.begin(0, leader.local(network), 11);
+  follower.sync.begin(1, follower.local(network), 22);
+  std::vector<Timer *> timers = {&leader, &follower};
+
+  run(network, timers, 3000000);
+  TEST_ASSERT_TRUE(leader.sync.leader());
+  TEST_ASSERT_FALSE(follower.sync.leader());
+  TEST_ASSERT_TRUE(follower.sync.synced());
+
+  GateSyncStatus status = follower.sync.status(follower.local(network));
+  TEST_ASSERT_EQUAL(0, status.leaderId);
+  TEST_ASSERT_EQUAL(1, status.peers);
+  TEST_ASSERT_INT64_WITHIN(10, 7000000, status.offsetMicros);
+  TEST_ASSERT_INT64_WITHIN(
+      10, 0,
+      (int64_t)(follower.sync.toShared(follower.local(network)) -
+                leader.local(network)));
+}
+
+// Passes go to every peer GATE_PASS_SENDS times, in the shared clock, and
+// the copies are dropped.
+void test_passes_reach_peers_once() {
+  Network network;
+  Timer leader(network, 100, 0);
+  Timer follower(network, 101, -7000000);
+  leader.sync.begin(0, leader.local(network), 11);
+  follower.sync.begin(1, follower.local(network), 22);
+  std::vector<Timer *> timers = {&leader, &follower};
+  run(network, timers, 3000000);
+
+  GatePass pass;
+  pass.channel = 2;
+  pass.lap = 4;
+  uint64_t local = follower.local(network);
+  pass.timeStamp = local - 200000;
+  pass.detectedTimeStamp = local;
+  GatePass sent = follower.sync.sendPass(pass, local);
+  TEST_ASSERT_EQUAL(1, sent.id);
+  TEST_ASSERT_EQUAL_UINT32(1, sent.seq);
+  TEST_ASSERT_TRUE(sent.synced);
+  TEST_ASSERT_INT64_WITHIN(
+      10, 0, (int64_t)(sent.detectedTimeStamp - leader.local(network)));
+
+  run(network, timers, 100000);
+  TEST_ASSERT_EQUAL(1, leader.passes.size());
+  TEST_ASSERT_EQUAL(4, leader.passes[0].lap);
+  TEST_ASSERT_EQUAL_UINT64(sent.timeStamp, leader.passes[0].timeStamp);
+  GateSyncStatus status = leader.sync.status(leader.local(network));
+  TEST_ASSERT_EQUAL(1, status.passesReceived);
+  TEST_ASSERT_EQUAL(0, status.passesLost);
+}
+
+void test_copies_dropped_and_gaps_counted_lost() {
+  Recorder recorder;
+  GateSync<Recorder> sync(recorder);
+  sync.begin(0, 0, 1);
+
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 1), 1000));
+  TEST_ASSERT_FALSE(receive(sync, passPacket(3, 1), 1100));
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 2), 2000));
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 5), 3000));
+  TEST_ASSERT_FALSE(receive(sync, passPacket(3, 5), 3100));
+  TEST_ASSERT_FALSE(receive(sync, passPacket(3, 4), 3200));
+
+  GateSyncStatus status = sync.status(4000);
+  TEST_ASSERT_EQUAL(3, status.passesReceived);
+  TEST_ASSERT_EQUAL(2, status.passesLost);
+}
+
+// A peer that rebooted starts over at seq 1; if that one is lost, its new
+// nonce still tells, and seq 2 on are not taken for copies.
+void test_new_nonce_restarts_sequence() {
+  Recorder recorder;
+  GateSync<Recorder> sync(recorder);
+  sync.begin(0, 0, 1);
+
+  receive(sync, announce(3, 1111), 1000);
+  for (uint32_t seq = 1; seq <= 5; seq++) {
+    TEST_ASSERT_TRUE(receive(sync, passPacket(3, seq), 1000 + seq * 1000));
+  }
+
+  // The same nonce again is no reboot.
+  receive(sync, announce(3, 1111), 10000);
+  TEST_ASSERT_FALSE(receive(sync, passPacket(3, 3), 11000));
+
+  // Rebooted, seq 1 lost.
+  receive(sync, announce(3, 2222), 20000);
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 2), 21000));
+  TEST_ASSERT_FALSE(receive(sync, passPacket(3, 2), 21100));
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 3), 22000));
+  TEST_ASSERT_EQUAL(7, sync.status(23000).passesReceived);
+}
+
+// Without an announce in between, seq 1 after others is a reboot too.
+void test_seq_one_restarts_sequence() {
+  Recorder recorder;
+  GateSync<Recorder> sync(recorder);
+  sync.begin(0, 0, 1);
+
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 1), 1000));
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 2), 2000));
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 1), 3000));
+  TEST_ASSERT_FALSE(receive(sync, passPacket(3, 1), 3100));
+  TEST_ASSERT_TRUE(receive(sync, passPacket(3, 2), 4000));
+}
+
+// The lowest id leads, until it goes quiet.
+void test_leader_elected_and_times_out() {
+  Recorder recorder;
+  GateSync<Recorder> sync(recorder);
+  sync.begin(4, 0, 1);
+  sync.update(0);
+  TEST_ASSERT_TRUE(sync.leader());
+
+  receive(sync, announce(6, 66), 1000);
+  TEST_ASSERT_TRUE(sync.leader());
+  receive(sync, announce(2, 22), 2000);
+  TEST_ASSERT_FALSE(sync.leader());
+  TEST_ASSERT_EQUAL(2, sync.status(2000).leaderId);
+  TEST_ASSERT_FALSE(sync.synced());
+
+  // Asks the leader for the time, by unicast.
+  recorder.sent.clear();
+  recorder.to.clear();
+  sync.update(3000);
+  TEST_ASSERT_EQUAL(1, recorder.sent.size());
+  TEST_ASSERT_EQUAL(GATE_SYNC_REQUEST, recorder.sent[0][1]);
+  TEST_ASSERT_EQUAL(102, recorder.to[0]);
+
+  // 6 is still around, 2 isn't.
+  uint64_t later = 2000 + GATE_PEER_TIMEOUT_MICROS + 1;
+  receive(sync, announce(6, 66), later - 1000);
+  sync.update(later);
+  TEST_ASSERT_TRUE(sync.leader());
+  TEST_ASSERT_EQUAL(1, sync.status(later).peers);
+}
+
+// Of two timers with one id, the lower nonce gives it up.
+void test_id_collision() {
+  Recorder recorder;
+  GateSync<Recorder> sync(recorder);
+  sync.begin(3, 0, 500);
+
+  receive(sync, announce(3, 400), 1000);
+  TEST_ASSERT_FALSE(sync.idCollision());
+  receive(sync, announce(3, 600), 2000);
+  TEST_ASSERT_TRUE(sync.idCollision());
+
+  receive(sync, announce(4, 44), 3000);
+  receive(sync, announce(5, 55), 3000);
+  TEST_ASSERT_EQUAL(6, sync.freeId(3));
+  TEST_ASSERT_EQUAL(0, sync.freeId(0));
+
+  // Without a nonce, never.
+  sync.begin(3, 0, 0);
+  receive(sync, announce(3, 600), 4000);
+  TEST_ASSERT_FALSE(sync.idCollision());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_pass_round_trip);
+  RUN_TEST(test_clock_offset_from_one_exchange);
+  RUN_TEST(test_clock_keeps_lowest_delay_exchange);
+  RUN_TEST(test_clock_drops_slow_and_impossible_exchanges);
+  RUN_TEST(test_clock_fits_drift);
+  RUN_TEST(test_follower_syncs_to_leader);
+  RUN_TEST(test_passes_reach_peers_once);
+  RUN_TEST(test_copies_dropped_and_gaps_counted_lost);
+  RUN_TEST(test_new_nonce_restarts_sequence);
+  RUN_TEST(test_seq_one_restarts_sequence);
+  RUN_TEST(test_leader_elected_and_times_out);
+  RUN_TEST(test_id_collision);
+  return UNITY_END();
+}
@@ -0,0 +1,177 @@
+#include <unity.h>
+
+#include <math.h>
+
+#include "heat_session.h"
+
+typedef HeatSession<4, 8> Session;
+
+static uint32_t noiseState;
+
+// 15s to 25s.
+static uint32_t randomLap() {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return 15000000 + (noiseState >> 8) % 10000000;
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+void test_stats_start_empty() {
+  LapStats stats;
+  TEST_ASSERT_EQUAL_UINT32(0, stats.count());
+  TEST_ASSERT_EQUAL_UINT32(0, stats.best());
+  TEST_ASSERT_EQUAL_UINT32(0, stats.mean());
+  TEST_ASSERT_EQUAL_UINT32(0, stats.stddev());
+  TEST_ASSERT_EQUAL_UINT32(0, stats.bestConsecutive());
+
+  stats.add(20000000);
+  TEST_ASSERT_EQUAL_UINT32(20000000, stats.mean());
+  // One lap has no deviation.
+  TEST_ASSERT_EQUAL_UINT32(0, stats.stddev());
+}
+
+void test_stats_of_known_laps() {
+  LapStats stats;
+  stats.add(30000000);
+  stats.add(10000000);
+  stats.add(20000000);
+  TEST_ASSERT_EQUAL_UINT32(3, stats.count());
+  TEST_ASSERT_EQUAL_UINT32(20000000, stats.last());
+  TEST_ASSERT_EQUAL_UINT32(10000000, stats.best());
+  TEST_ASSERT_EQUAL_UINT32(2, stats.bestLap());
+  TEST_ASSERT_EQUAL_UINT32(20000000, stats.mean());
+  TEST_ASSERT_EQUAL_UINT32(10000000, stats.stddev());
+}
+
+// The best run of HEAT_CONSECUTIVE_LAPS, not the first or the last.
+void test_best_consecutive_run() {
+  TEST_ASSERT_EQUAL(3, HEAT_CONSECUTIVE_LAPS);
+  LapStats stats;
+  const uint32_t laps[] = {30, 10, 12, 11, 40, 9, 9};
+  for (uint32_t lap : laps) {
+    stats.add(lap * 1000000);
+  }
+  TEST_ASSERT_EQUAL_UINT64(33000000, stats.bestConsecutive());
+  TEST_ASSERT_EQUAL_UINT32(2, stats.bestConsecutiveLap());
+
+  stats.add(10000000);
+  TEST_ASSERT_EQUAL_UINT64(28000000, stats.bestConsecutive());
+  TEST_ASSERT_EQUAL_UINT32(6, stats.bestConsecutiveLap());
+}
+
+// The running mean and deviation match the ones recomputed from every lap,
+// to the micro, over a long heat.
+void test_stats_match_recomputed() {
+  const int kLaps = 5000;
+  static uint32_t laps[kLaps];
+  LapStats stats;
+  double sum = 0;
+  for (int i = 0; i < kLaps; i++) {
+    laps[i] = randomLap();
+    stats.add(laps[i]);
+    sum += laps[i];
+  }
+  double mean = sum / kLaps;
+  double squares = 0;
+  for (int i = 0; i < kLaps; i++) {
+    squares += (laps[i] - mean) * (laps[i] - mean);
+  }
+  double stddev = sqrt(squares / (kLaps - 1));
+  TEST_ASSERT_FLOAT_WITHIN(1, mean, stats.mean());
+  TEST_ASSERT_FLOAT_WITHIN(1, stddev, stats.stddev());
+}
+
+void test_first_pass_is_holeshot() {
+  HeatPilot<8> pilot;
+  TEST_ASSERT_EQUAL_UINT32(0, pilot.addPass(1000000, 3500000));
+  TEST_ASSERT_EQUAL_UINT32(1, pilot.passes());
+  TEST_ASSERT_EQUAL_UINT32(2500000, pilot.holeshot());
+  TEST_ASSERT_EQUAL_UINT32(0, pilot.stats().count());
+
+  TEST_ASSERT_EQUAL_UINT32(1, pilot.addPass(1000000, 23500000));
+  TEST_ASSERT_EQUAL_UINT32(20000000, pilot.stats().last());
+  TEST_ASSERT_EQUAL_UINT64(23500000, pilot.lastPass());
+}
+
+// Only the last MaxLaps lap times are kept, the statistics cover all.
+void test_keeps_last_laps() {
+  HeatPilot<4> pilot;
+  uint64_t t = 0;
+  pilot.addPass(0, t);
+  for (uint32_t lap = 1; lap <= 10; lap++) {
+    t += lap * 1000000;
+    pilot.addPass(0, t);
+  }
+  TEST_ASSERT_EQUAL_UINT32(10, pilot.stats().count());
+  TEST_ASSERT_EQUAL_UINT32(7, pilot.firstKeptLap());
+  for (uint32_t lap = 7; lap <= 10; lap++) {
+    TEST_ASSERT_EQUAL_UINT32(lap * 1000000, pilot.lap(lap));
+  }
+  TEST_ASSERT_EQUAL_UINT32(1000000, pilot.stats().best());
+}
+
+void test_long_lap_is_clamped() {
+  HeatPilot<4> pilot;
+  pilot.addPass(0, 0);
+  pilot.addPass(0, 5000000000ULL);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, pilot.stats().last());
+}
+
+void test_passes_outside_heat_are_refused() {
+  Session session;
+  uint32_t lap = 99;
+  TEST_ASSERT_FALSE(session.addPass(0, 1000, lap));
+
+  session.start(5000000, 2);
+  TEST_ASSERT_TRUE(session.running());
+  TEST_ASSERT_EQUAL_UINT32(1, session.heat());
+  // Before the start, and not a pilot of the heat.
+  TEST_ASSERT_FALSE(session.addPass(0, 4000000, lap));
+  TEST_ASSERT_FALSE(session.addPass(2, 6000000, lap));
+  TEST_ASSERT_TRUE(session.addPass(1, 6000000, lap));
+  TEST_ASSERT_EQUAL_UINT32(0, lap);
+  TEST_ASSERT_TRUE(session.addPass(1, 26000000, lap));
+  TEST_ASSERT_EQUAL_UINT32(1, lap);
+
+  session.stop(30000000);
+  TEST_ASSERT_FALSE(session.running());
+  TEST_ASSERT_EQUAL_UINT64(30000000, session.stopTime());
+  TEST_ASSERT_FALSE(session.addPass(1, 46000000, lap));
+  // The results stay until the next start.
+  TEST_ASSERT_EQUAL_UINT32(1, session.pilot(1).stats().count());
+}
+
+void test_start_clamps_pilots_and_resets() {
+  Session session;
+  session.start(0, 0);
+  TEST_ASSERT_EQUAL(1, session.pilotCount());
+  session.start(0, 20);
+  TEST_ASSERT_EQUAL(4, session.pilotCount());
+
+  uint32_t lap;
+  session.addPass(3, 1000000, lap);
+  session.addPass(3, 21000000, lap);
+  TEST_ASSERT_EQUAL_UINT32(1, session.pilot(3).stats().count());
+
+  session.start(100000000, 4);
+  TEST_ASSERT_EQUAL_UINT32(3, session.heat());
+  TEST_ASSERT_EQUAL_UINT64(100000000, session.startTime());
+  TEST_ASSERT_EQUAL_UINT64(0, session.stopTime());
+  TEST_ASSERT_EQUAL_UINT32(0, session.pilot(3).passes());
+  TEST_ASSERT_EQUAL_UINT32(0, session.pilot(3).stats().best());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_stats_start_empty);
+  RUN_TEST(test_stats_of_known_laps);
+  RUN_TEST(test_best_consecutive_run);
+  RUN_TEST(test_stats_match_recomputed);
+  RUN_TEST(test_first_pass_is_holeshot);
+  RUN_TEST(test_keeps_last_laps);
+  RUN_TEST(test_long_lap_is_clamped);
+  RUN_TEST(test_passes_outside_heat_are_refused);
+  RUN_TEST(test_start_clamps_pilots_and_resets);
+  return UNITY_END();
+}
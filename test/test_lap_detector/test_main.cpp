@@ -0,0 +1,131 @@
+#include <math.h>
+#include <unity.h>
+
+#include "lap_detector.h"
+
+// Synthetic traces: a noisy floor with a gaussian bump per pass, sampled
+// every millisecond.
+
+static const uint64_t kSampleMicros = 1000;
+static const uint16_t kFloor = 100;
+static const uint16_t kPeak = 400;
+static const double kBumpSigmaMicros = 80000;
+
+static uint32_t noiseState;
+
+// Deterministic noise in [-amplitude, amplitude].
+static int noise(int amplitude) {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return (int)((noiseState >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static uint16_t traceAt(uint64_t t, const uint64_t *peaks, size_t peakCount,
+                        int noiseAmplitude) {
+  double value = kFloor;
+  for (size_t i = 0; i < peakCount; i++) {
+    double d = ((double)t - (double)peaks[i]) / kBumpSigmaMicros;
+    value += (kPeak - kFloor) * exp(-0.5 * d * d);
+  }
+  if (noiseAmplitude > 0) {
+    value += noise(noiseAmplitude);
+  }
+  return (uint16_t)value;
+}
+
+// Replays the trace from 0 to endMicros, returns the number of passes.
+static size_t replay(LapDetector &detector, uint64_t endMicros,
+                     const uint64_t *peaks, size_t peakCount,
+                     int noiseAmplitude, PassEvent *passes, size_t maxPasses) {
+  size_t count = 0;
+  for (uint64_t t = 0; t < endMicros; t += kSampleMicros) {
+    PassEvent pass;
+    if (detector.addSample(t, traceAt(t, peaks, peakCount, noiseAmplitude),
+                           pass) &&
+        count < maxPasses) {
+      passes[count++] = pass;
+    }
+  }
+  return count;
+}
+
+static LapDetector detector;
+
+void setUp() {
+  noiseState = 1;
+  LapDetectorConfig config;
+  config.enterRssiTrigger = 250;
+  config.leaveRssiTrigger = 200;
+  config.filterRatio = 30;
+  config.minLapTimeMicros = 4 * 1000 * 1000;
+  detector.setConfig(config);
+  detector.reset();
+}
+
+void tearDown() {}
+
+void test_flat_trace_has_no_passes() {
+  PassEvent passes[4];
+  TEST_ASSERT_EQUAL(0, replay(detector, 10 * 1000 * 1000, NULL, 0, 20,
+                              passes, 4));
+  TEST_ASSERT_FALSE(detector.crossing());
+  TEST_ASSERT_EQUAL(0, detector.lastPass().lap);
+}
+
+void test_one_pass_per_bump() {
+  const uint64_t peaks[] = {5000000, 11000000, 17500000};
+  PassEvent passes[8];
+  size_t count = replay(detector, 20 * 1000 * 1000, peaks, 3, 20, passes, 8);
+
+  TEST_ASSERT_EQUAL(3, count);
+  for (size_t i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL(i + 1, passes[i].lap);
+    // The filter lags, the pass time must not.
+    TEST_ASSERT_INT64_WITHIN(10000, peaks[i], passes[i].timeStamp);
+    TEST_ASSERT_GREATER_THAN(passes[i].timeStamp, passes[i].detectedTimeStamp);
+    TEST_ASSERT_GREATER_OR_EQUAL(250, passes[i].rssiPeak);
+    TEST_ASSERT_GREATER_OR_EQUAL(passes[i].rssiPeak, passes[i].rssiPeakRaw);
+  }
+  TEST_ASSERT_INT64_WITHIN(20000, 6000000, passes[1].interval);
+  TEST_ASSERT_INT64_WITHIN(20000, 6500000, passes[2].interval);
+}
+
+void test_clean_peak_is_interpolated_closely() {
+  const uint64_t peaks[] = {5000300};
+  PassEvent passes[2];
+  TEST_ASSERT_EQUAL(1, replay(detector, 8 * 1000 * 1000, peaks, 1, 0,
+                              passes, 2));
+  TEST_ASSERT_INT64_WITHIN(2000, peaks[0], passes[0].timeStamp);
+}
+
+void test_bump_within_min_lap_time_is_ignored() {
+  const uint64_t peaks[] = {5000000, 7000000, 12000000};
+  PassEvent passes[8];
+  size_t count = replay(detector, 15 * 1000 * 1000, peaks, 3, 20, passes, 8);
+
+  TEST_ASSERT_EQUAL(2, count);
+  TEST_ASSERT_INT64_WITHIN(10000, peaks[0], passes[0].timeStamp);
+  TEST_ASSERT_INT64_WITHIN(10000, peaks[2], passes[1].timeStamp);
+  TEST_ASSERT_EQUAL(2, passes[1].lap);
+}
+
+void test_reset_starts_counting_again() {
+  const uint64_t peaks[] = {5000000};
+  PassEvent passes[2];
+  TEST_ASSERT_EQUAL(1, replay(detector, 8 * 1000 * 1000, peaks, 1, 20,
+                              passes, 2));
+  detector.reset();
+  TEST_ASSERT_EQUAL(0, detector.lastPass().lap);
+  TEST_ASSERT_EQUAL(1, replay(detector, 8 * 1000 * 1000, peaks, 1, 20,
+                              passes, 2));
+  TEST_ASSERT_EQUAL(1, passes[0].lap);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_flat_trace_has_no_passes);
+  RUN_TEST(test_one_pass_per_bump);
+  RUN_TEST(test_clean_peak_is_interpolated_closely);
+  RUN_TEST(test_bump_within_min_lap_time_is_ignored);
+  RUN_TEST(test_reset_starts_counting_again);
+  return UNITY_END();
+}
@@ -0,0 +1,122 @@
+#include <thread>
+#include <unity.h>
+
+#include "metrics.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_counter() {
+  Counter counter;
+  TEST_ASSERT_EQUAL_UINT32(0, counter.value());
+  counter.add();
+  counter.add(41);
+  TEST_ASSERT_EQUAL_UINT32(42, counter.value());
+}
+
+void test_buckets_cover_every_value() {
+  TEST_ASSERT_LESS_THAN(Histogram::kBuckets,
+                        Histogram::bucketOf(0xFFFFFFFF));
+  TEST_ASSERT_EQUAL_UINT32(0xFFFFFFFF,
+                           Histogram::bucketUpper(Histogram::kBuckets - 1));
+
+  // Small values get a bucket each.
+  for (uint32_t v = 0; v < 2 * Histogram::kSubBuckets; v++) {
+    TEST_ASSERT_EQUAL(v, Histogram::bucketOf(v));
+    TEST_ASSERT_EQUAL_UINT32(v, Histogram::bucketUpper(v));
+  }
+
+  // Buckets are contiguous and bucketUpper() is the last value of each.
+  for (uint16_t b = 0; b + 1 < Histogram::kBuckets; b++) {
+    uint32_t upper = Histogram::bucketUpper(b);
+    TEST_ASSERT_EQUAL(b, Histogram::bucketOf(upper));
+    TEST_ASSERT_EQUAL(b + 1, Histogram::bucketOf(upper + 1));
+  }
+}
+
+void test_bucket_upper_is_within_an_eighth() {
+  for (uint64_t v = 1; v <= 0xFFFFFFFF; v = v * 3 / 2 + 1) {
+    uint32_t upper = Histogram::bucketUpper(Histogram::bucketOf((uint32_t)v));
+    TEST_ASSERT_TRUE(upper >= v);
+    TEST_ASSERT_TRUE(upper - v <= v / Histogram::kSubBuckets);
+  }
+}
+
+void test_empty_histogram() {
+  Histogram histogram;
+  TEST_ASSERT_EQUAL_UINT32(0, histogram.count());
+  TEST_ASSERT_EQUAL_UINT32(0, histogram.percentile(500));
+  TEST_ASSERT_EQUAL_UINT32(0, histogram.max());
+}
+
+void test_percentiles() {
+  Histogram histogram;
+  for (uint32_t v = 1; v <= 1000; v++) {
+    histogram.record(v);
+  }
+  TEST_ASSERT_EQUAL_UINT32(1000, histogram.count());
+  TEST_ASSERT_EQUAL_UINT32(500500, histogram.sum());
+  TEST_ASSERT_EQUAL_UINT32(1000, histogram.max());
+
+  const uint16_t perMilles[] = {1, 100, 500, 900, 990, 999};
+  for (size_t i = 0; i < 6; i++) {
+    uint32_t exact = perMilles[i];
+    uint32_t p = histogram.percentile(perMilles[i]);
+    TEST_ASSERT_TRUE(p >= exact);
+    TEST_ASSERT_TRUE(p <= exact + exact / Histogram::kSubBuckets);
+  }
+  // Never above what was recorded.
+  TEST_ASSERT_EQUAL_UINT32(1000, histogram.percentile(1000));
+}
+
+void test_percentile_of_one_outlier() {
+  Histogram histogram;
+  for (int i = 0; i < 999; i++) {
+    histogram.record(20);
+  }
+  histogram.record(5000000);
+  // The upper bound of the bucket 20 is in.
+  uint32_t upper = Histogram::bucketUpper(Histogram::bucketOf(20));
+  TEST_ASSERT_EQUAL_UINT32(21, upper);
+  TEST_ASSERT_EQUAL_UINT32(upper, histogram.percentile(500));
+  TEST_ASSERT_EQUAL_UINT32(upper, histogram.percentile(999));
+  TEST_ASSERT_EQUAL_UINT32(5000000, histogram.percentile(1000));
+  TEST_ASSERT_EQUAL_UINT32(5000000, histogram.max());
+}
+
+// The sampler, detection and loop() record from different contexts.
+void test_concurrent_records_all_count() {
+  static Histogram histogram;
+  static Counter counter;
+  static const uint32_t kPerThread = 100000;
+  std::thread threads[4];
+  for (uint32_t t = 0; t < 4; t++) {
+    threads[t] = std::thread([t] {
+      for (uint32_t i = 0; i < kPerThread; i++) {
+        histogram.record(t * kPerThread + i);
+        counter.add();
+      }
+    });
+  }
+  for (uint32_t t = 0; t < 4; t++) {
+    threads[t].join();
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(4 * kPerThread, counter.value());
+  TEST_ASSERT_EQUAL_UINT32(4 * kPerThread, histogram.count());
+  TEST_ASSERT_EQUAL_UINT32(4 * kPerThread - 1, histogram.max());
+  uint64_t n = 4 * kPerThread;
+  TEST_ASSERT_EQUAL_UINT32((uint32_t)(n * (n - 1) / 2), histogram.sum());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_counter);
+  RUN_TEST(test_buckets_cover_every_value);
+  RUN_TEST(test_bucket_upper_is_within_an_eighth);
+  RUN_TEST(test_empty_histogram);
+  RUN_TEST(test_percentiles);
+  RUN_TEST(test_percentile_of_one_outlier);
+  RUN_TEST(test_concurrent_records_all_count);
+  return UNITY_END();
+}
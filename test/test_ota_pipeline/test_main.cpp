@@ -0,0 +1,327 @@
+#include <unity.h>
+
+#include <vector>
+
+#include "ota_pipeline.h"
+
+// Flash that takes time and records what was done to it, in order.
+struct TestFlash {
+  uint32_t eraseMicros = 45000;
+  uint32_t writeMicros = 1000;
+  bool failWrites = false;
+
+  std::vector<uint8_t> data;
+  std::vector<bool> erased;
+  // Offsets of the writes, in order.
+  std::vector<uint32_t> writes;
+  int writesToUnerased = 0;
+  int writesAcrossSectors = 0;
+  size_t longestWrite = 0;
+  int finished = 0;
+  // Time the operations took since the caller last looked.
+  uint64_t pending = 0;
+
+  explicit TestFlash(size_t size)
+      : data(size, 0xFF), erased(size / OTA_SECTOR_SIZE + 1, false) {}
+
+  bool eraseSector(uint32_t index) {
+    if (index >= erased.size()) {
+      return false;
+    }
+    erased[index] = true;
+    pending += eraseMicros;
+    return true;
+  }
+
+  bool write(uint32_t offset, const uint8_t *bytes, size_t len) {
+    if (failWrites || offset + len > data.size()) {
+      return false;
+    }
+    writes.push_back(offset);
+    if (len > longestWrite) {
+      longestWrite = len;
+    }
+    if (offset / OTA_SECTOR_SIZE != (offset + len - 1) / OTA_SECTOR_SIZE) {
+      writesAcrossSectors++;
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (!erased[(offset + i) / OTA_SECTOR_SIZE]) {
+        writesToUnerased++;
+      }
+      data[offset + i] = bytes[i];
+    }
+    pending += (uint64_t)writeMicros * len / OTA_WRITE_SIZE;
+    return true;
+  }
+
+  bool finish(uint32_t size) {
+    finished++;
+    return size > 0;
+  }
+};
+
+typedef OtaPipeline<TestFlash, 4> Pipeline;
+
+static std::vector<uint8_t> makeImage(size_t size) {
+  std::vector<uint8_t> image(size);
+  uint32_t state = 1;
+  for (uint8_t &byte : image) {
+    state = state * 1664525 + 1013904223;
+    byte = state >> 24;
+  }
+  image[0] = 0xE9;
+  return image;
+}
+
+// Pushes the image as fast as the queue takes it and steps the writer in
+// between, unthrottled, until the writer is done or failed. Returns the
+// number of flash operations.
+static int upload(Pipeline &pipeline, const std::vector<uint8_t> &image,
+                  bool ok = true) {
+  int operations = 0;
+  size_t sent = 0;
+  while (sent < image.size() && pipeline.busy()) {
+    size_t len = image.size() - sent;
+    if (len > OTA_CHUNK_SIZE) {
+      len = OTA_CHUNK_SIZE;
+    }
+    if (pipeline.push(&image[sent], len)) {
+      sent += len;
+    } else if (pipeline.step()) {
+      operations++;
+    }
+  }
+  pipeline.end(ok);
+  while (pipeline.busy()) {
+    if (pipeline.step()) {
+      operations++;
+    }
+  }
+  return operations;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_upload_lands_in_flash() {
+  std::vector<uint8_t> image = makeImage(3 * OTA_SECTOR_SIZE + 1000);
+  TestFlash flash(4 * OTA_SECTOR_SIZE);
+  Pipeline pipeline(flash);
+  TEST_ASSERT_TRUE(pipeline.begin());
+  TEST_ASSERT_EQUAL(OTA_RECEIVING, pipeline.state());
+  upload(pipeline, image);
+
+  TEST_ASSERT_EQUAL(OTA_DONE, pipeline.state());
+  TEST_ASSERT_EQUAL(1, flash.finished);
+  TEST_ASSERT_EQUAL(0, flash.writesToUnerased);
+  TEST_ASSERT_EQUAL_UINT32(image.size(), pipeline.received());
+  TEST_ASSERT_EQUAL_UINT32(image.size(), pipeline.written());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(image.data(), flash.data.data(),
+                                image.size());
+}
+
+// The header, with the magic, is the last write: an upload that stops
+// halfway never looks like an image.
+void test_header_written_last() {
+  std::vector<uint8_t> image = makeImage(2 * OTA_SECTOR_SIZE);
+  TestFlash flash(2 * OTA_SECTOR_SIZE);
+  Pipeline pipeline(flash);
+  pipeline.begin();
+  upload(pipeline, image);
+
+  TEST_ASSERT_EQUAL(OTA_DONE, pipeline.state());
+  TEST_ASSERT_EQUAL_UINT32(0, flash.writes.back());
+  for (size_t i = 0; i + 1 < flash.writes.size(); i++) {
+    TEST_ASSERT_TRUE(flash.writes[i] >= OTA_HEADER_SIZE);
+  }
+}
+
+// No write is longer than OTA_WRITE_SIZE, none crosses a sector.
+void test_operations_are_short() {
+  std::vector<uint8_t> image = makeImage(3 * OTA_SECTOR_SIZE);
+  TestFlash flash(3 * OTA_SECTOR_SIZE);
+  flash.eraseMicros = 0;
+  Pipeline pipeline(flash);
+  pipeline.begin();
+  int operations = upload(pipeline, image);
+  // 3 erases, the image in OTA_WRITE_SIZE pieces, the header, and the
+  // finish.
+  int writes = (image.size() - OTA_HEADER_SIZE + OTA_WRITE_SIZE - 1) /
+               OTA_WRITE_SIZE;
+  TEST_ASSERT_EQUAL(OTA_DONE, pipeline.state());
+  TEST_ASSERT_EQUAL(3 + writes + 1 + 1, operations);
+  TEST_ASSERT_EQUAL(OTA_WRITE_SIZE, flash.longestWrite);
+  TEST_ASSERT_EQUAL(0, flash.writesAcrossSectors);
+}
+
+void test_failed_upload_is_not_finished() {
+  std::vector<uint8_t> image = makeImage(OTA_SECTOR_SIZE);
+  TestFlash flash(2 * OTA_SECTOR_SIZE);
+  Pipeline pipeline(flash);
+  pipeline.begin();
+  upload(pipeline, image, false);
+
+  TEST_ASSERT_EQUAL(OTA_FAILED, pipeline.state());
+  TEST_ASSERT_EQUAL(0, flash.finished);
+  // The magic never made it.
+  TEST_ASSERT_EQUAL_HEX8(0xFF, flash.data[0]);
+
+  // The next upload starts over.
+  TEST_ASSERT_TRUE(pipeline.begin());
+  upload(pipeline, image);
+  TEST_ASSERT_EQUAL(OTA_DONE, pipeline.state());
+}
+
+void test_flash_error_fails_upload() {
+  std::vector<uint8_t> image = makeImage(OTA_SECTOR_SIZE);
+  TestFlash flash(2 * OTA_SECTOR_SIZE);
+  flash.failWrites = true;
+  Pipeline pipeline(flash);
+  pipeline.begin();
+  upload(pipeline, image);
+  TEST_ASSERT_EQUAL(OTA_FAILED, pipeline.state());
+  TEST_ASSERT_EQUAL(0, flash.finished);
+}
+
+// Nothing past the header is no image.
+void test_short_upload_fails() {
+  std::vector<uint8_t> image = makeImage(OTA_HEADER_SIZE);
+  TestFlash flash(OTA_SECTOR_SIZE);
+  Pipeline pipeline(flash);
+  pipeline.begin();
+  upload(pipeline, image);
+  TEST_ASSERT_EQUAL(OTA_FAILED, pipeline.state());
+}
+
+void test_queue_is_bounded() {
+  TestFlash flash(OTA_SECTOR_SIZE);
+  Pipeline pipeline(flash);
+  uint8_t chunk[OTA_CHUNK_SIZE + 1] = {0};
+  pipeline.begin();
+  TEST_ASSERT_FALSE(pipeline.push(chunk, OTA_CHUNK_SIZE + 1));
+
+  int pushed = 0;
+  while (pipeline.push(chunk, OTA_CHUNK_SIZE)) {
+    pushed++;
+  }
+  TEST_ASSERT_TRUE(pushed > 0 && pushed <= 4);
+  TEST_ASSERT_EQUAL_UINT32(pushed * OTA_CHUNK_SIZE, pipeline.received());
+  // One upload at a time.
+  TEST_ASSERT_FALSE(pipeline.begin());
+}
+
+void test_throttle_keeps_duty() {
+  OtaThrottle throttle(25, 2000);
+  TEST_ASSERT_TRUE(throttle.due(0, false));
+
+  // 4ms busy at 25% leaves 12ms free.
+  throttle.ran(1000, 5000);
+  TEST_ASSERT_FALSE(throttle.due(16999, false));
+  TEST_ASSERT_TRUE(throttle.due(17000, false));
+
+  // However short, at least the minimum gap.
+  throttle.ran(17000, 17100);
+  TEST_ASSERT_FALSE(throttle.due(19099, false));
+  TEST_ASSERT_TRUE(throttle.due(19100, false));
+
+  TEST_ASSERT_EQUAL_UINT32(4000, throttle.longestMicros());
+  TEST_ASSERT_EQUAL_UINT64(4100, throttle.busyMicros());
+}
+
+// While detection is busy flash waits, but not forever.
+void test_throttle_holds_for_detection() {
+  OtaThrottle throttle(25, 2000, 500000);
+  TEST_ASSERT_FALSE(throttle.due(1000000, true));
+  TEST_ASSERT_FALSE(throttle.due(1499999, true));
+  TEST_ASSERT_TRUE(throttle.due(1500000, true));
+
+  // Detection done, flash goes at once, the next hold starts over.
+  throttle.ran(1500000, 1501000);
+  TEST_ASSERT_TRUE(throttle.due(1600000, false));
+  TEST_ASSERT_FALSE(throttle.due(1700000, true));
+  TEST_ASSERT_TRUE(throttle.due(2200000, true));
+}
+
+void test_throttle_clamps_duty() {
+  OtaThrottle throttle(0, 0);
+  throttle.ran(0, 1000);
+  // At 1%, 99 times as long free.
+  TEST_ASSERT_FALSE(throttle.due(99999, false));
+  TEST_ASSERT_TRUE(throttle.due(100000, false));
+}
+
+// A whole upload over a slow flash, with a sampler at 2 kHz that stalls
+// while flash is busy, as on the ESP32. The longest gap in the samples is
+// the longest flash operation, and flash is busy at most the duty.
+void test_sample_gap_bounded_by_slowest_operation() {
+  const uint64_t kSamplePeriod = 500;
+  const double kBytesPerPeriod = 100 * 1024.0 * kSamplePeriod / 1000000;
+  std::vector<uint8_t> image = makeImage(64 * 1024);
+  TestFlash flash(image.size() + OTA_SECTOR_SIZE);
+  flash.eraseMicros = 45000;
+  flash.writeMicros = 1000;
+  Pipeline pipeline(flash);
+  OtaThrottle throttle;
+  pipeline.begin();
+
+  uint64_t flashBusyUntil = 0;
+  uint64_t lastSample = 0;
+  uint64_t maxGap = 0;
+  size_t sent = 0;
+  double credit = 0;
+  uint64_t now = 0;
+  for (; pipeline.busy() && now < 60000000; now += kSamplePeriod) {
+    if (now >= flashBusyUntil) {
+      if (lastSample && now - lastSample > maxGap) {
+        maxGap = now - lastSample;
+      }
+      lastSample = now;
+    }
+
+    if (pipeline.state() == OTA_RECEIVING) {
+      credit += kBytesPerPeriod;
+      while (sent < image.size() && credit >= OTA_CHUNK_SIZE) {
+        if (!pipeline.push(&image[sent], OTA_CHUNK_SIZE)) {
+          break;
+        }
+        sent += OTA_CHUNK_SIZE;
+        credit -= OTA_CHUNK_SIZE;
+      }
+      if (sent == image.size()) {
+        pipeline.end(true);
+      }
+    }
+
+    if (now >= flashBusyUntil && throttle.due(now, false)) {
+      if (pipeline.step()) {
+        throttle.ran(now, now + flash.pending);
+        flashBusyUntil = now + flash.pending;
+      }
+      flash.pending = 0;
+    }
+  }
+
+  TEST_ASSERT_EQUAL(OTA_DONE, pipeline.state());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(image.data(), flash.data.data(),
+                                image.size());
+  TEST_ASSERT_EQUAL_UINT32(45000, throttle.longestMicros());
+  TEST_ASSERT_TRUE(maxGap <= throttle.longestMicros() + kSamplePeriod);
+  TEST_ASSERT_TRUE(throttle.busyMicros() * 100 <=
+                   now * OTA_DUTY_PERCENT + throttle.longestMicros() * 100);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_upload_lands_in_flash);
+  RUN_TEST(test_header_written_last);
+  RUN_TEST(test_operations_are_short);
+  RUN_TEST(test_failed_upload_is_not_finished);
+  RUN_TEST(test_flash_error_fails_upload);
+  RUN_TEST(test_short_upload_fails);
+  RUN_TEST(test_queue_is_bounded);
+  RUN_TEST(test_throttle_keeps_duty);
+  RUN_TEST(test_throttle_holds_for_detection);
+  RUN_TEST(test_throttle_clamps_duty);
+  RUN_TEST(test_sample_gap_bounded_by_slowest_operation);
+  return UNITY_END();
+}
@@ -0,0 +1,135 @@
+#include <atomic>
+#include <thread>
+#include <unity.h>
+
+#include "pass_history.h"
+
+// Every field derives from the id, so a torn or misplaced record shows.
+static PassRecord makeRecord(uint32_t id) {
+  PassRecord record;
+  record.id = id;
+  record.channel = id % 8;
+  record.channelCount = 8;
+  record.pass.lap = id * 3;
+  record.pass.timeStamp = (uint64_t)id * 1000003;
+  record.pass.interval = id * 7;
+  record.pass.rssiPeak = id & 0xFFFF;
+  record.pass.rssiPeakRaw = ~id & 0xFFFF;
+  record.pass.detectedTimeStamp = (uint64_t)id * 1000003 + 20000;
+  return record;
+}
+
+static bool intact(const PassRecord &record) {
+  PassRecord expected = makeRecord(record.id);
+  return record.channel == expected.channel &&
+         record.channelCount == expected.channelCount &&
+         record.pass.lap == expected.pass.lap &&
+         record.pass.timeStamp == expected.pass.timeStamp &&
+         record.pass.interval == expected.pass.interval &&
+         record.pass.rssiPeak == expected.pass.rssiPeak &&
+         record.pass.rssiPeakRaw == expected.pass.rssiPeakRaw &&
+         record.pass.detectedTimeStamp == expected.pass.detectedTimeStamp;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty() {
+  PassHistory<4> history;
+  PassRecord out[4];
+  TEST_ASSERT_EQUAL(0, history.since(0, out, 4));
+  TEST_ASSERT_EQUAL_UINT32(0, history.lastId());
+  TEST_ASSERT_EQUAL_UINT32(0, history.appended());
+}
+
+void test_since_returns_newer_records_oldest_first() {
+  PassHistory<8> history;
+  for (uint32_t id = 1; id <= 5; id++) {
+    history.append(makeRecord(id * 10));
+  }
+  TEST_ASSERT_EQUAL_UINT32(50, history.lastId());
+
+  PassRecord out[8];
+  TEST_ASSERT_EQUAL(5, history.since(0, out, 8));
+  TEST_ASSERT_EQUAL_UINT32(10, out[0].id);
+  TEST_ASSERT_TRUE(intact(out[0]));
+
+  // Ids in between count too.
+  TEST_ASSERT_EQUAL(3, history.since(25, out, 8));
+  TEST_ASSERT_EQUAL_UINT32(30, out[0].id);
+  TEST_ASSERT_EQUAL_UINT32(50, out[2].id);
+
+  TEST_ASSERT_EQUAL(0, history.since(50, out, 8));
+  // maxRecords keeps the oldest.
+  TEST_ASSERT_EQUAL(2, history.since(0, out, 2));
+  TEST_ASSERT_EQUAL_UINT32(20, out[1].id);
+}
+
+void test_wraparound_keeps_the_newest() {
+  PassHistory<4> history;
+  for (uint32_t id = 1; id <= 11; id++) {
+    history.append(makeRecord(id));
+  }
+  TEST_ASSERT_EQUAL_UINT32(11, history.appended());
+
+  PassRecord out[4];
+  TEST_ASSERT_EQUAL(4, history.since(0, out, 4));
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_UINT32(8 + i, out[i].id);
+    TEST_ASSERT_TRUE(intact(out[i]));
+  }
+  TEST_ASSERT_EQUAL(1, history.since(10, out, 4));
+  TEST_ASSERT_EQUAL_UINT32(11, out[0].id);
+}
+
+// loop() appends while request handlers on other threads read. Readers must
+// only ever see intact records, in increasing id order.
+void test_concurrent_readers() {
+  static PassHistory<8> history;
+  static const uint32_t kRecords = 200000;
+  std::atomic<bool> done{false};
+  std::atomic<uint32_t> failures{0};
+  std::atomic<uint32_t> reads{0};
+
+  auto reader = [&] {
+    PassRecord out[8];
+    while (!done.load()) {
+      uint32_t lastId = history.lastId();
+      uint32_t since = lastId > 6 ? lastId - 6 : 0;
+      size_t count = history.since(since, out, 8);
+      for (size_t i = 0; i < count; i++) {
+        if (!intact(out[i]) || out[i].id <= since ||
+            (i > 0 && out[i].id <= out[i - 1].id)) {
+          failures++;
+        }
+      }
+      reads++;
+      std::this_thread::yield();
+    }
+  };
+  std::thread first(reader);
+  std::thread second(reader);
+
+  for (uint32_t id = 1; id <= kRecords; id++) {
+    history.append(makeRecord(id));
+    if (id % 64 == 0) {
+      std::this_thread::yield();
+    }
+  }
+  done = true;
+  first.join();
+  second.join();
+
+  TEST_ASSERT_EQUAL_UINT32(0, failures.load());
+  TEST_ASSERT_GREATER_THAN(0, reads.load());
+  TEST_ASSERT_EQUAL_UINT32(kRecords, history.lastId());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty);
+  RUN_TEST(test_since_returns_newer_records_oldest_first);
+  RUN_TEST(test_wraparound_keeps_the_newest);
+  RUN_TEST(test_concurrent_readers);
+  return UNITY_END();
+}
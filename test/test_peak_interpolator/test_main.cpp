@@ -0,0 +1,116 @@
+#include <math.h>
+#include <unity.h>
+
+#include "peak_interpolator.h"
+
+static const uint64_t kStart = 10 * 1000 * 1000;
+
+static uint32_t noiseState;
+
+static int noise(int amplitude) {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return (int)((noiseState >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static uint16_t bump(uint64_t t, uint64_t peak, double sigmaMicros) {
+  double d = ((double)t - (double)peak) / sigmaMicros;
+  return (uint16_t)(100 + 300 * exp(-0.5 * d * d));
+}
+
+// Feeds a bump sampled every periodMicros, skipping samples for which skip
+// returns true, and returns what estimate() makes of it.
+static bool estimateBump(uint64_t peak, uint64_t periodMicros,
+                         int noiseAmplitude, bool (*skip)(uint64_t),
+                         uint64_t &estimate) {
+  PeakInterpolator interpolator;
+  interpolator.beginPass();
+  for (uint64_t t = kStart; t < peak + 500000; t += periodMicros) {
+    if (skip && skip(t)) {
+      continue;
+    }
+    interpolator.addSample(t, bump(t, peak, 60000) + noise(noiseAmplitude));
+  }
+  return interpolator.estimate(estimate);
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+void test_finds_the_peak_between_samples() {
+  // Peaks all over a bin and between samples.
+  for (uint64_t offset = 0; offset < PEAK_BIN_MICROS; offset += 1234) {
+    uint64_t peak = kStart + 400000 + offset;
+    uint64_t estimate = 0;
+    TEST_ASSERT_TRUE(estimateBump(peak, 1000, 0, NULL, estimate));
+    TEST_ASSERT_INT64_WITHIN(500, peak, estimate);
+  }
+}
+
+void test_beats_the_sample_period_with_noise() {
+  uint64_t peak = kStart + 400000 + 3700;
+  uint64_t estimate = 0;
+  TEST_ASSERT_TRUE(estimateBump(peak, 4000, 20, NULL, estimate));
+  TEST_ASSERT_INT64_WITHIN(4000, peak, estimate);
+}
+
+// As when hopping: 15ms on the channel, 30ms away.
+static bool offChannel(uint64_t t) { return (t / 15000) % 3 != 0; }
+
+void test_tolerates_gaps() {
+  uint64_t peak = kStart + 400000 + 5000;
+  uint64_t estimate = 0;
+  TEST_ASSERT_TRUE(estimateBump(peak, 1000, 0, offChannel, estimate));
+  TEST_ASSERT_INT64_WITHIN(8000, peak, estimate);
+}
+
+void test_too_few_bins() {
+  PeakInterpolator interpolator;
+  interpolator.beginPass();
+  uint64_t estimate = 0;
+  TEST_ASSERT_FALSE(interpolator.estimate(estimate));
+
+  interpolator.addSample(kStart, 300);
+  interpolator.addSample(kStart + PEAK_BIN_MICROS, 400);
+  interpolator.addSample(kStart + 2 * PEAK_BIN_MICROS, 300);
+  TEST_ASSERT_FALSE(interpolator.estimate(estimate));
+}
+
+void test_rejects_a_rising_edge() {
+  PeakInterpolator interpolator;
+  interpolator.beginPass();
+  for (uint64_t t = kStart; t < kStart + 200000; t += 1000) {
+    interpolator.addSample(t, (uint16_t)(100 + (t - kStart) / 1000));
+  }
+  uint64_t estimate = 0;
+  TEST_ASSERT_FALSE(interpolator.estimate(estimate));
+}
+
+void test_begin_pass_forgets_the_previous_peak() {
+  PeakInterpolator interpolator;
+  uint64_t first = kStart + 300000;
+  uint64_t second = kStart + 5000000 + 2500;
+  interpolator.beginPass();
+  for (uint64_t t = kStart; t < first + 500000; t += 1000) {
+    interpolator.addSample(t, bump(t, first, 60000));
+  }
+
+  // The second peak is lower, it still has to win.
+  interpolator.beginPass();
+  for (uint64_t t = first + 500000; t < second + 500000; t += 1000) {
+    interpolator.addSample(t, bump(t, second, 60000) - 50);
+  }
+  uint64_t estimate = 0;
+  TEST_ASSERT_TRUE(interpolator.estimate(estimate));
+  TEST_ASSERT_INT64_WITHIN(500, second, estimate);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_finds_the_peak_between_samples);
+  RUN_TEST(test_beats_the_sample_period_with_noise);
+  RUN_TEST(test_tolerates_gaps);
+  RUN_TEST(test_too_few_bins);
+  RUN_TEST(test_rejects_a_rising_edge);
+  RUN_TEST(test_begin_pass_forgets_the_previous_peak);
+  return UNITY_END();
+}
@@ -0,0 +1,128 @@
+#include <unity.h>
+
+#include <math.h>
+
+#include "rssi_decimator.h"
+
+static uint32_t noiseState;
+
+static double uniform() {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return (noiseState >> 8) / 16777216.0;
+}
+
+// Roughly gaussian, sigma 1: the sum of 12 uniforms, less 6.
+static double gaussian() {
+  double sum = 0;
+  for (int i = 0; i < 12; i++) {
+    sum += uniform();
+  }
+  return sum - 6;
+}
+
+static uint16_t noisyReading(double level, double sigma) {
+  double raw = level + gaussian() * sigma;
+  return raw < 0 ? 0 : raw > 4095 ? 4095 : (uint16_t)(raw + 0.5);
+}
+
+// RMS error of the samples the decimator gives, one every factor
+// readings as the firmware takes them, around a steady level.
+static double sampleNoise(uint8_t factor, double level, double sigma,
+                          int samples) {
+  RssiDecimator decimator(factor);
+  double sumSquares = 0;
+  for (int s = 0; s < samples; s++) {
+    for (int i = 0; i < factor; i++) {
+      decimator.add(noisyReading(level, sigma));
+    }
+    double error = decimator.value() - level;
+    sumSquares += error * error;
+  }
+  return sqrt(sumSquares / samples);
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+// Averaging N readings of uncorrelated noise cuts it by sqrt(N).
+void test_noise_falls_by_sqrt_factor() {
+  const double sigma = 40;
+  double raw = sampleNoise(1, 1000, sigma, 20000);
+  TEST_ASSERT_FLOAT_WITHIN(2, sigma, raw);
+
+  const uint8_t factors[] = {4, 16, 64};
+  for (uint8_t factor : factors) {
+    double noise = sampleNoise(factor, 1000, sigma, 20000);
+    double gain = raw / noise;
+    // Rounding to whole counts adds about 0.3 counts of noise, which only
+    // shows at 64, where the rest is down to 5.
+    TEST_ASSERT_FLOAT_WITHIN(0.1 * sqrt(factor), sqrt(factor), gain);
+  }
+}
+
+// As the default factor does it, RSSI_OVERSAMPLING 16 is 4x.
+void test_default_factor_gain() {
+  RssiDecimator decimator;
+  TEST_ASSERT_EQUAL(RSSI_OVERSAMPLING, decimator.factor());
+  double gain = sampleNoise(1, 2000, 30, 20000) /
+                sampleNoise(RSSI_OVERSAMPLING, 2000, 30, 20000);
+  TEST_ASSERT_FLOAT_WITHIN(0.4, sqrt(RSSI_OVERSAMPLING), gain);
+}
+
+// Only the newest factor readings count, a step is through after factor.
+void test_step_falls_out_of_window() {
+  RssiDecimator decimator(8);
+  TEST_ASSERT_EQUAL(0, decimator.value());
+  for (int i = 0; i < 8; i++) {
+    decimator.add(100);
+  }
+  TEST_ASSERT_EQUAL(100, decimator.value());
+
+  for (int i = 0; i < 4; i++) {
+    decimator.add(300);
+  }
+  TEST_ASSERT_EQUAL(200, decimator.value());
+  for (int i = 0; i < 4; i++) {
+    decimator.add(300);
+  }
+  TEST_ASSERT_EQUAL(300, decimator.value());
+  TEST_ASSERT_EQUAL(16, decimator.readings());
+}
+
+// Before the window is full, the mean of what there is, rounded.
+void test_partial_window_is_rounded_mean() {
+  RssiDecimator decimator(16);
+  decimator.add(10);
+  TEST_ASSERT_EQUAL(10, decimator.value());
+  decimator.add(13);
+  TEST_ASSERT_EQUAL(12, decimator.value());
+  decimator.add(13);
+  TEST_ASSERT_EQUAL(12, decimator.value());
+}
+
+void test_factor_is_clamped_and_resets() {
+  RssiDecimator decimator(0);
+  TEST_ASSERT_EQUAL(1, decimator.factor());
+  decimator.setFactor(200);
+  TEST_ASSERT_EQUAL(RSSI_DECIMATOR_MAX_FACTOR, decimator.factor());
+
+  // The full window of 4095s must not overflow the sum.
+  for (int i = 0; i < 3 * RSSI_DECIMATOR_MAX_FACTOR; i++) {
+    decimator.add(4095);
+  }
+  TEST_ASSERT_EQUAL(4095, decimator.value());
+
+  decimator.setFactor(4);
+  TEST_ASSERT_EQUAL(0, decimator.value());
+  TEST_ASSERT_EQUAL(0, decimator.readings());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_noise_falls_by_sqrt_factor);
+  RUN_TEST(test_default_factor_gain);
+  RUN_TEST(test_step_falls_out_of_window);
+  RUN_TEST(test_partial_window_is_rounded_mean);
+  RUN_TEST(test_factor_is_clamped_and_resets);
+  return UNITY_END();
+}
@@ -0,0 +1,111 @@
+#include <unity.h>
+
+#include "rssi_filter.h"
+
+static uint32_t noiseState;
+
+static uint16_t randomRssi() {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return (uint16_t)((noiseState >> 16) % 4096);
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+// The fixed-point EMA has to stay within one count of the float one it
+// replaced, for every ratio the settings allow.
+void test_ema_tracks_float_within_one_count() {
+  for (int ratio = 1; ratio <= 255; ratio += 7) {
+    EmaFilter filter;
+    filter.setFilterRatio((uint8_t)ratio);
+    float reference = 0;
+    for (int i = 0; i < 5000; i++) {
+      // Steps and noise, the 12 bit ADC range.
+      uint16_t in = (i / 500) % 2 ? 3000 + randomRssi() % 200
+                                  : randomRssi() % 400;
+      reference = (ratio / 1000.0f) * in + (1 - ratio / 1000.0f) * reference;
+      TEST_ASSERT_INT_WITHIN(1, (int)reference, (int)filter.update(in));
+    }
+  }
+}
+
+void test_ema_settles_on_a_constant() {
+  EmaFilter filter;
+  filter.setFilterRatio(30);
+  uint16_t out = 0;
+  for (int i = 0; i < 2000; i++) {
+    out = filter.update(2000);
+  }
+  TEST_ASSERT_INT_WITHIN(1, 2000, out);
+}
+
+void test_ema_handles_the_full_input_range() {
+  EmaFilter filter;
+  filter.setFilterRatio(255);
+  uint16_t out = 0;
+  for (int i = 0; i < 200; i++) {
+    out = filter.update(32767);
+  }
+  TEST_ASSERT_INT_WITHIN(1, 32767, out);
+  for (int i = 0; i < 200; i++) {
+    out = filter.update(0);
+  }
+  TEST_ASSERT_INT_WITHIN(1, 0, out);
+}
+
+void test_median_drops_single_spikes() {
+  MedianFilter<3> filter;
+  filter.update(100);
+  filter.update(100);
+  TEST_ASSERT_EQUAL(100, filter.update(4000));
+  TEST_ASSERT_EQUAL(100, filter.update(100));
+  TEST_ASSERT_EQUAL(100, filter.update(0));
+  // Two in a row are a real change.
+  filter.update(500);
+  TEST_ASSERT_EQUAL(500, filter.update(500));
+}
+
+void test_moving_average() {
+  MovingAverageFilter<4> filter;
+  TEST_ASSERT_EQUAL(25, filter.update(100));
+  TEST_ASSERT_EQUAL(50, filter.update(100));
+  filter.update(100);
+  TEST_ASSERT_EQUAL(100, filter.update(100));
+  TEST_ASSERT_EQUAL(200, filter.update(500));
+}
+
+void test_size_one_stages_pass_through() {
+  MedianFilter<1> median;
+  MovingAverageFilter<1> average;
+  FilterChain<> empty;
+  for (int i = 0; i < 100; i++) {
+    uint16_t in = randomRssi();
+    TEST_ASSERT_EQUAL(in, median.update(in));
+    TEST_ASSERT_EQUAL(in, average.update(in));
+    TEST_ASSERT_EQUAL(in, empty.update(in));
+  }
+}
+
+void test_chain_runs_stages_in_order() {
+  FilterChain<MedianFilter<3>, EmaFilter> chain;
+  MedianFilter<3> median;
+  EmaFilter ema;
+  chain.setFilterRatio(100);
+  ema.setFilterRatio(100);
+  for (int i = 0; i < 1000; i++) {
+    uint16_t in = randomRssi();
+    TEST_ASSERT_EQUAL(ema.update(median.update(in)), chain.update(in));
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_ema_tracks_float_within_one_count);
+  RUN_TEST(test_ema_settles_on_a_constant);
+  RUN_TEST(test_ema_handles_the_full_input_range);
+  RUN_TEST(test_median_drops_single_spikes);
+  RUN_TEST(test_moving_average);
+  RUN_TEST(test_size_one_stages_pass_through);
+  RUN_TEST(test_chain_runs_stages_in_order);
+  return UNITY_END();
+}
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <unity.h>
+
+#include "rssi_telemetry.h"
+
+static const size_t kLogSize = 64;
+
+static uint32_t noiseState;
+
+static uint16_t randomValue() {
+  noiseState = noiseState * 1664525 + 1013904223;
+  return (uint16_t)(noiseState >> 16);
+}
+
+// Encodes log, decodes it again and checks it came back unchanged.
+static void checkRoundTrip(const RssiLog<kLogSize> &log) {
+  uint8_t scratch[RSSI_BATCH_MAX_BINARY(kLogSize)];
+  char encoded[RSSI_BATCH_MAX_BASE64(kLogSize) + 1];
+  size_t len = encodeRssiBatch(log, scratch, encoded);
+  TEST_ASSERT_LESS_OR_EQUAL(RSSI_BATCH_MAX_BASE64(log.size()), len);
+  TEST_ASSERT_EQUAL(len, strlen(encoded));
+
+  uint8_t decodeScratch[RSSI_BATCH_MAX_BINARY(kLogSize)];
+  uint16_t values[kLogSize];
+  int count = decodeRssiBatch(encoded, len, decodeScratch,
+                              sizeof(decodeScratch), values, kLogSize);
+  TEST_ASSERT_EQUAL((int)log.size(), count);
+  for (size_t i = 0; i < log.size(); i++) {
+    TEST_ASSERT_EQUAL_UINT16(log.at(i), values[i]);
+  }
+}
+
+void setUp() { noiseState = 1; }
+void tearDown() {}
+
+void test_base64_rfc4648_vectors() {
+  static const char *kPlain[] = {"", "f", "fo", "foo", "foob", "fooba",
+                                 "foobar"};
+  static const char *kEncoded[] = {"",         "Zg==",     "Zm8=",
+                                   "Zm9v",     "Zm9vYg==", "Zm9vYmE=",
+                                   "Zm9vYmFy"};
+  for (size_t i = 0; i < 7; i++) {
+    char out[16];
+    size_t len = base64Encode((const uint8_t *)kPlain[i], strlen(kPlain[i]),
+                              out);
+    TEST_ASSERT_EQUAL_STRING(kEncoded[i], out);
+    TEST_ASSERT_EQUAL(strlen(kEncoded[i]), len);
+
+    uint8_t decoded[16];
+    TEST_ASSERT_EQUAL(strlen(kPlain[i]),
+                      base64Decode(out, len, decoded, sizeof(decoded)));
+    TEST_ASSERT_EQUAL_MEMORY(kPlain[i], decoded, strlen(kPlain[i]));
+  }
+}
+
+void test_base64_rejects_garbage() {
+  uint8_t out[16];
+  TEST_ASSERT_EQUAL(0, base64Decode("Zm9", 3, out, sizeof(out)));
+  TEST_ASSERT_EQUAL(0, base64Decode("Zm9*", 4, out, sizeof(out)));
+  TEST_ASSERT_EQUAL(0, base64Decode("Zg==Zm9v", 8, out, sizeof(out)));
+  // Doesn't write past outSize.
+  TEST_ASSERT_EQUAL(0, base64Decode("Zm9vYmFy", 8, out, 5));
+}
+
+void test_varint_and_zigzag() {
+  const uint32_t values[] = {0, 1, 127, 128, 300, 16383, 16384, 0xFFFFFFFF};
+  const size_t sizes[] = {1, 1, 1, 2, 2, 2, 3, 5};
+  for (size_t i = 0; i < 8; i++) {
+    uint8_t buffer[5];
+    TEST_ASSERT_EQUAL(sizes[i], writeVarint(buffer, values[i]));
+    uint32_t read;
+    TEST_ASSERT_EQUAL(sizes[i], readVarint(buffer, sizes[i], read));
+    TEST_ASSERT_EQUAL_UINT32(values[i], read);
+    if (sizes[i] > 1) {
+      TEST_ASSERT_EQUAL(0, readVarint(buffer, sizes[i] - 1, read));
+    }
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(0, zigzagEncode(0));
+  TEST_ASSERT_EQUAL_UINT32(1, zigzagEncode(-1));
+  TEST_ASSERT_EQUAL_UINT32(2, zigzagEncode(1));
+  TEST_ASSERT_EQUAL_UINT32(131069, zigzagEncode(-65535));
+  for (int32_t v = -70000; v <= 70000; v += 7) {
+    TEST_ASSERT_EQUAL_INT32(v, zigzagDecode(zigzagEncode(v)));
+  }
+}
+
+void test_round_trips() {
+  RssiLog<kLogSize> log;
+  checkRoundTrip(log);
+
+  // Extremes, every delta at its largest.
+  for (size_t i = 0; i < kLogSize; i++) {
+    log.add(i % 2 ? 0xFFFF : 0);
+  }
+  checkRoundTrip(log);
+
+  for (int round = 0; round < 100; round++) {
+    log.clear();
+    size_t count = randomValue() % (kLogSize + 1);
+    for (size_t i = 0; i < count; i++) {
+      log.add(randomValue() % 4096);
+    }
+    checkRoundTrip(log);
+  }
+}
+
+void test_slow_rssi_takes_a_byte_per_value() {
+  RssiLog<kLogSize> log;
+  uint16_t value = 1500;
+  for (size_t i = 0; i < kLogSize; i++) {
+    value += (uint16_t)(randomValue() % 61) - 30;
+    log.add(value);
+  }
+  uint8_t binary[RSSI_BATCH_MAX_BINARY(kLogSize)];
+  // Version, a two byte first value, then a byte each.
+  TEST_ASSERT_EQUAL(1 + 2 + (kLogSize - 1),
+                    encodeRssiBatchBinary(log, binary));
+  checkRoundTrip(log);
+}
+
+void test_log_keeps_the_newest() {
+  RssiLog<4> log;
+  for (uint16_t i = 1; i <= 6; i++) {
+    log.add(i);
+  }
+  TEST_ASSERT_EQUAL(4, log.size());
+  for (size_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_UINT16(i + 3, log.at(i));
+  }
+  log.clear();
+  TEST_ASSERT_EQUAL(0, log.size());
+}
+
+void test_malformed_batches() {
+  uint16_t values[4];
+  const uint8_t wrongVersion[] = {RSSI_BATCH_VERSION + 1, 1};
+  TEST_ASSERT_EQUAL(-1, decodeRssiBatchBinary(wrongVersion, 2, values, 4));
+  TEST_ASSERT_EQUAL(-1, decodeRssiBatchBinary(wrongVersion, 0, values, 4));
+
+  const uint8_t truncated[] = {RSSI_BATCH_VERSION, 0x80};
+  TEST_ASSERT_EQUAL(-1, decodeRssiBatchBinary(truncated, 2, values, 4));
+
+  const uint8_t tooMany[] = {RSSI_BATCH_VERSION, 1, 2, 2, 2, 2};
+  TEST_ASSERT_EQUAL(-1, decodeRssiBatchBinary(tooMany, 6, values, 4));
+  TEST_ASSERT_EQUAL(4, decodeRssiBatchBinary(tooMany, 5, values, 4));
+  TEST_ASSERT_EQUAL_UINT16(4, values[3]);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_base64_rfc4648_vectors);
+  RUN_TEST(test_base64_rejects_garbage);
+  RUN_TEST(test_varint_and_zigzag);
+  RUN_TEST(test_round_trips);
+  RUN_TEST(test_slow_rssi_takes_a_byte_per_value);
+  RUN_TEST(test_log_keeps_the_newest);
+  RUN_TEST(test_malformed_batches);
+  return UNITY_END();
+}
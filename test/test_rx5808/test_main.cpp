@@ -0,0 +1,158 @@
+#include <unity.h>
+
+#include "rx5808.h"
+
+// Keeps the frames instead of sending them.
+class RecordingBus : public Rx5808Bus {
+ public:
+  void begin() override { begun = true; }
+  void writeFrame(uint32_t frame) override {
+    if (count < 8) {
+      frames[count] = frame;
+    }
+    count++;
+  }
+
+  bool begun = false;
+  uint32_t frames[8];
+  size_t count = 0;
+};
+
+// Decodes what goes over the pins back into frames.
+class RecordingGpio {
+ public:
+  static const int kData = 1;
+  static const int kSelect = 2;
+  static const int kClock = 3;
+
+  void output(int pin) { outputs |= 1 << pin; }
+
+  void write(int pin, bool level) {
+    if (pin == kClock && level && !clock) {
+      TEST_ASSERT_FALSE(select);
+      if (bits < 32) {
+        frame |= (uint32_t)data << bits;
+      }
+      bits++;
+    }
+    if (pin == kSelect && level && !select) {
+      latched[latchedCount++] = frame;
+      latchedBits = bits;
+      frame = 0;
+      bits = 0;
+    }
+    if (pin == kData) {
+      data = level;
+    } else if (pin == kClock) {
+      clock = level;
+    } else if (pin == kSelect) {
+      select = level;
+    }
+  }
+
+  void delayMicros(uint32_t micros) { delayed += micros; }
+
+  int outputs = 0;
+  bool data = false;
+  bool clock = false;
+  bool select = true;
+  uint32_t frame = 0;
+  uint8_t bits = 0;
+  uint32_t latched[8];
+  size_t latchedCount = 0;
+  uint8_t latchedBits = 0;
+  uint32_t delayed = 0;
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_register_values_match_the_datasheet_table() {
+  // A1, A4, A8, R1 and R8 from the RTC6715 channel table.
+  TEST_ASSERT_EQUAL_UINT16(0x2A05, freqMhzToRegVal(5865));
+  TEST_ASSERT_EQUAL_UINT16(0x2987, freqMhzToRegVal(5805));
+  TEST_ASSERT_EQUAL_UINT16(0x289F, freqMhzToRegVal(5725));
+  TEST_ASSERT_EQUAL_UINT16(0x281D, freqMhzToRegVal(5658));
+  TEST_ASSERT_EQUAL_UINT16(0x2A1F, freqMhzToRegVal(5917));
+}
+
+void test_frame_layout() {
+  uint32_t frame = rx5808Frame(RX5808_REG_SYNTH_B, true, 0x2A05);
+  TEST_ASSERT_EQUAL_UINT32(0x1, frame & 0xF);
+  TEST_ASSERT_EQUAL_UINT32(1, (frame >> 4) & 0x1);
+  TEST_ASSERT_EQUAL_UINT32(0x2A05, frame >> 5);
+  TEST_ASSERT_EQUAL_UINT32(0, frame >> RX5808_FRAME_BITS);
+
+  // Out of range fields are masked rather than spilling over.
+  frame = rx5808Frame(0x1F, false, 0x1FFFFF);
+  TEST_ASSERT_EQUAL_UINT32(0xF, frame & 0xF);
+  TEST_ASSERT_EQUAL_UINT32(0, (frame >> 4) & 0x1);
+  TEST_ASSERT_EQUAL_UINT32(0, frame >> RX5808_FRAME_BITS);
+}
+
+void test_tune_writes_state_then_frequency() {
+  RecordingBus bus;
+  Rx5808 rx(bus);
+  rx.begin();
+  TEST_ASSERT_TRUE(bus.begun);
+
+  rx.tune(5740, 1000);
+  TEST_ASSERT_EQUAL(2, bus.count);
+  TEST_ASSERT_EQUAL_UINT32(rx5808Frame(RX5808_REG_STATE, false, 0),
+                           bus.frames[0]);
+  TEST_ASSERT_EQUAL_UINT32(
+      rx5808Frame(RX5808_REG_SYNTH_B, true, freqMhzToRegVal(5740)),
+      bus.frames[1]);
+  TEST_ASSERT_EQUAL_UINT16(5740, rx.frequency());
+}
+
+void test_tune_does_not_wait_for_the_settle_time() {
+  RecordingBus bus;
+  Rx5808 rx(bus, 30000);
+  rx.tune(5658, 1000000);
+
+  TEST_ASSERT_EQUAL_UINT64(1030000, rx.settledAt());
+  TEST_ASSERT_FALSE(rx.isSettled(1000000));
+  TEST_ASSERT_FALSE(rx.isSettled(1029999));
+  TEST_ASSERT_TRUE(rx.isSettled(1030000));
+
+  rx.setSettleMicros(5000);
+  rx.tune(5917, 2000000);
+  TEST_ASSERT_TRUE(rx.isSettled(2005000));
+}
+
+void test_bit_bang_bus_shifts_frames_lsb_first() {
+  RecordingGpio gpio;
+  Rx5808BitBangBus<RecordingGpio> bus(gpio, RecordingGpio::kData,
+                                      RecordingGpio::kSelect,
+                                      RecordingGpio::kClock);
+  Rx5808 rx(bus);
+  rx.begin();
+  TEST_ASSERT_EQUAL(
+      (1 << RecordingGpio::kData) | (1 << RecordingGpio::kSelect) |
+          (1 << RecordingGpio::kClock),
+      gpio.outputs);
+
+  rx.tune(5865, 0);
+  TEST_ASSERT_EQUAL(2, gpio.latchedCount);
+  TEST_ASSERT_EQUAL(RX5808_FRAME_BITS, gpio.latchedBits);
+  TEST_ASSERT_EQUAL_UINT32(rx5808Frame(RX5808_REG_STATE, false, 0),
+                           gpio.latched[0]);
+  TEST_ASSERT_EQUAL_UINT32(rx5808Frame(RX5808_REG_SYNTH_B, true, 0x2A05),
+                           gpio.latched[1]);
+  // Ends idle: select high, clock low.
+  TEST_ASSERT_TRUE(gpio.select);
+  TEST_ASSERT_FALSE(gpio.clock);
+  // A frame is ~2 bit delays per bit, so ~100us at the default 1us.
+  TEST_ASSERT_LESS_THAN(2 * 120, gpio.delayed);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_register_values_match_the_datasheet_table);
+  RUN_TEST(test_frame_layout);
+  RUN_TEST(test_tune_writes_state_then_frequency);
+  RUN_TEST(test_tune_does_not_wait_for_the_settle_time);
+  RUN_TEST(test_bit_bang_bus_shifts_frames_lsb_first);
+  return UNITY_END();
+}
@@ -0,0 +1,140 @@
+#include <atomic>
+#include <thread>
+#include <unity.h>
+
+#include "seqlock.h"
+
+// About the size of DetectionConfig, not a multiple of 4 bytes. Every field
+// derives from one counter, so a copy of two stores shows.
+struct Config {
+  uint32_t version;
+  uint16_t words[9];
+  uint8_t tail;
+};
+
+static Config makeConfig(uint32_t version) {
+  Config config;
+  memset(&config, 0, sizeof(config));
+  config.version = version;
+  for (uint16_t i = 0; i < 9; i++) {
+    config.words[i] = (uint16_t)(version * 7 + i);
+  }
+  config.tail = (uint8_t)version;
+  return config;
+}
+
+static bool intact(const Config &config) {
+  for (uint16_t i = 0; i < 9; i++) {
+    if (config.words[i] != (uint16_t)(config.version * 7 + i)) {
+      return false;
+    }
+  }
+  return config.tail == (uint8_t)config.version;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_starts_with_default_value() {
+  Seqlock<Config> lock;
+  Config config = makeConfig(5);
+  TEST_ASSERT_TRUE(lock.tryLoad(config));
+  TEST_ASSERT_EQUAL_UINT32(0, config.version);
+  TEST_ASSERT_EQUAL(0, config.words[8]);
+}
+
+void test_load_returns_last_store() {
+  Seqlock<Config> lock;
+  uint32_t version = lock.version();
+  lock.store(makeConfig(41));
+  lock.store(makeConfig(42));
+  TEST_ASSERT_EQUAL_UINT32(version + 2, lock.version());
+
+  Config config;
+  TEST_ASSERT_TRUE(lock.tryLoad(config));
+  TEST_ASSERT_EQUAL_UINT32(42, config.version);
+  TEST_ASSERT_TRUE(intact(config));
+}
+
+// Values smaller than a word round trip too.
+void test_small_value() {
+  Seqlock<uint8_t> lock;
+  lock.store(200);
+  uint8_t value = 0;
+  TEST_ASSERT_TRUE(lock.tryLoad(value));
+  TEST_ASSERT_EQUAL(200, value);
+}
+
+// A writer storing as fast as it can and readers copying meanwhile, on real
+// threads: every copy kept is one whole store, and versions never go back.
+// The writer goes on until every reader kept a good number of copies.
+void test_no_torn_reads_under_contention() {
+  static Seqlock<Config> lock;
+  static std::atomic<bool> done{false};
+  static const uint32_t kStores = 300000;
+  static const int kReaders = 3;
+
+  struct Reader {
+    std::atomic<uint32_t> kept{0};
+    uint32_t torn = 0;
+    uint32_t backwards = 0;
+  };
+  static Reader readers[kReaders];
+
+  lock.store(makeConfig(0));
+  std::thread threads[kReaders];
+  for (int r = 0; r < kReaders; r++) {
+    threads[r] = std::thread([r] {
+      Reader &reader = readers[r];
+      uint32_t last = 0;
+      Config config;
+      while (!done.load(std::memory_order_relaxed)) {
+        if (!lock.tryLoad(config)) {
+          continue;
+        }
+        reader.kept++;
+        if (!intact(config)) {
+          reader.torn++;
+        }
+        if (config.version < last) {
+          reader.backwards++;
+        }
+        last = config.version;
+      }
+    });
+  }
+
+  auto allKept = [] {
+    for (int r = 0; r < kReaders; r++) {
+      if (readers[r].kept.load(std::memory_order_relaxed) < 1000) {
+        return false;
+      }
+    }
+    return true;
+  };
+  uint32_t stores = 0;
+  while (stores < kStores || !allKept()) {
+    lock.store(makeConfig(++stores));
+  }
+  done = true;
+  for (int r = 0; r < kReaders; r++) {
+    threads[r].join();
+  }
+
+  for (int r = 0; r < kReaders; r++) {
+    TEST_ASSERT_EQUAL(0, readers[r].torn);
+    TEST_ASSERT_EQUAL(0, readers[r].backwards);
+  }
+  Config config;
+  TEST_ASSERT_TRUE(lock.tryLoad(config));
+  TEST_ASSERT_EQUAL_UINT32(stores, config.version);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_starts_with_default_value);
+  RUN_TEST(test_load_returns_last_store);
+  RUN_TEST(test_small_value);
+  RUN_TEST(test_no_torn_reads_under_contention);
+  return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include <sstream>
+#include <string>
+
+#include "settings_json.h"
+
+// As SettingsType in fpvsim_timer.h.
+struct Settings {
+  uint16_t vtxFreq = 5732;
+  uint8_t filterRatio = 30;
+  uint16_t rssiPeak = 270;
+  uint16_t enterRssiOffset = 6;
+  uint16_t leaveRssiOffset = 27;
+  bool logRssi = true;
+  char apIp[20] = "192.168.4.1";
+  char localIp[20] = "192.168.1.42";
+  char apSsid[30] = "fpvsim-timer-0";
+  char routerSsid[32] = "home";
+  char routerPwd[32] = "secret";
+  char apPwd[30] = "fpvsim123";
+  const char *adaptiveMode = "suggest";
+  bool gateSync = false;
+};
+
+const char *VERSION = "2.4.0";
+
+// The stringstream formatter the firmware had before, with the fields
+// added since in the same style. What formatSettingsJson() has to match.
+std::string settingsToJson(const Settings &settings) {
+  std::stringstream ss;
+  ss << "{" << std::endl;
+
+  ss << "\"vtxFreq\":" << settings.vtxFreq << "," << std::endl;
+
+  ss << "\"rssiPeak\":" << settings.rssiPeak << "," << std::endl;
+  ss << "\"enterRssiOffset\":" << settings.enterRssiOffset << "," << std::endl;
+  ss << "\"leaveRssiOffset\":" << settings.leaveRssiOffset << "," << std::endl;
+  // Convert to int so it won't be treated as ASCII code.
+  ss << "\"filterRatio\":" << (int) settings.filterRatio << "," << std::endl;
+  ss << "\"logRssi\":" << (settings.logRssi ? "true" : "false") << "," << std::endl;
+
+  ss << "\"apSsid\":\"" << settings.apSsid << "\"," << std::endl;
+  ss << "\"apPwd\":\"" << settings.apPwd << "\"," << std::endl;
+  ss << "\"apIp\":\"" << settings.apIp << "\"," << std::endl;
+
+  ss << "\"localIp\":\"" << settings.localIp << "\"," << std::endl;
+  ss << "\"routerSsid\":\"" << settings.routerSsid << "\"," << std::endl;
+  ss << "\"routerPwd\":\"" << settings.routerPwd << "\"," << std::endl;
+
+  ss << "\"adaptiveMode\":\"" << settings.adaptiveMode << "\"," << std::endl;
+  ss << "\"gateSync\":" << (settings.gateSync ? "true" : "false") << "," << std::endl;
+
+  ss << "\"version\":\"" << VERSION << "\"" << std::endl;
+
+  ss << "}";
+
+  return ss.str();
+}
+
+SettingsJsonFields fieldsOf(const Settings &settings) {
+  SettingsJsonFields fields;
+  fields.vtxFreq = settings.vtxFreq;
+  fields.rssiPeak = settings.rssiPeak;
+  fields.enterRssiOffset = settings.enterRssiOffset;
+  fields.leaveRssiOffset = settings.leaveRssiOffset;
+  fields.filterRatio = settings.filterRatio;
+  fields.logRssi = settings.logRssi;
+  fields.apSsid = settings.apSsid;
+  fields.apPwd = settings.apPwd;
+  fields.apIp = settings.apIp;
+  fields.localIp = settings.localIp;
+  fields.routerSsid = settings.routerSsid;
+  fields.routerPwd = settings.routerPwd;
+  fields.adaptiveMode = settings.adaptiveMode;
+  fields.gateSync = settings.gateSync;
+  fields.version = VERSION;
+  return fields;
+}
+
+void assertMatchesGolden(const Settings &settings) {
+  std::string expected = settingsToJson(settings);
+  char json[SETTINGS_JSON_SIZE];
+  size_t len = formatSettingsJson(json, sizeof(json), fieldsOf(settings));
+  TEST_ASSERT_EQUAL_STRING(expected.c_str(), json);
+  TEST_ASSERT_EQUAL(expected.size(), len);
+}
+
+void fill(char *field, size_t size, char c) {
+  memset(field, c, size - 1);
+  field[size - 1] = 0;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_defaults_match_golden() { assertMatchesGolden(Settings()); }
+
+void test_other_values_match_golden() {
+  Settings settings;
+  settings.vtxFreq = 5917;
+  settings.filterRatio = 100;
+  settings.rssiPeak = 0;
+  settings.logRssi = false;
+  settings.adaptiveMode = "auto";
+  settings.gateSync = true;
+  settings.routerSsid[0] = 0;
+  settings.routerPwd[0] = 0;
+  assertMatchesGolden(settings);
+}
+
+// Every number and string at its widest still fits SETTINGS_JSON_SIZE.
+void test_widest_settings_fit() {
+  Settings settings;
+  settings.vtxFreq = 65535;
+  settings.filterRatio = 255;
+  settings.rssiPeak = 65535;
+  settings.enterRssiOffset = 65535;
+  settings.leaveRssiOffset = 65535;
+  settings.logRssi = false;
+  settings.adaptiveMode = "suggest";
+  fill(settings.apIp, sizeof(settings.apIp), '1');
+  fill(settings.localIp, sizeof(settings.localIp), '2');
+  fill(settings.apSsid, sizeof(settings.apSsid), 'a');
+  fill(settings.routerSsid, sizeof(settings.routerSsid), 'r');
+  fill(settings.routerPwd, sizeof(settings.routerPwd), 'p');
+  fill(settings.apPwd, sizeof(settings.apPwd), 'w');
+  assertMatchesGolden(settings);
+  TEST_ASSERT_LESS_THAN(SETTINGS_JSON_SIZE, settingsToJson(settings).size());
+}
+
+// A string that fills its whole field has no terminator, the field size
+// bounds it.
+void test_unterminated_strings_are_bounded() {
+  Settings settings;
+  char apSsid[sizeof(settings.apSsid) + 8];
+  memset(apSsid, 'a', sizeof(apSsid));
+  apSsid[sizeof(apSsid) - 1] = 0;
+
+  SettingsJsonFields fields = fieldsOf(settings);
+  fields.apSsid = apSsid;
+  char json[SETTINGS_JSON_SIZE];
+  formatSettingsJson(json, sizeof(json), fields);
+
+  std::string expected = "\"apSsid\":\"" + std::string(30, 'a') + "\",\n";
+  TEST_ASSERT_NOT_NULL(strstr(json, expected.c_str()));
+}
+
+void test_cut_output_is_terminated() {
+  Settings settings;
+  std::string expected = settingsToJson(settings);
+  char json[32];
+  memset(json, 'x', sizeof(json));
+  size_t len = formatSettingsJson(json, sizeof(json), fieldsOf(settings));
+  TEST_ASSERT_EQUAL(expected.size(), len);
+  TEST_ASSERT_EQUAL(sizeof(json) - 1, strlen(json));
+  TEST_ASSERT_EQUAL(0, expected.compare(0, sizeof(json) - 1, json));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_defaults_match_golden);
+  RUN_TEST(test_other_values_match_golden);
+  RUN_TEST(test_widest_settings_fit);
+  RUN_TEST(test_unterminated_strings_are_bounded);
+  RUN_TEST(test_cut_output_is_terminated);
+  return UNITY_END();
+}
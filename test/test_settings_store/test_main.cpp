@@ -0,0 +1,258 @@
+#include <string.h>
+#include <unity.h>
+
+#include "settings_store.h"
+
+struct SettingsV1 {
+  uint16_t frequency = 5658;
+  uint8_t filterRatio = 30;
+};
+
+// V1 with a field appended.
+struct SettingsV2 {
+  uint16_t frequency = 5658;
+  uint8_t filterRatio = 30;
+  uint16_t minLapSeconds = 4;
+};
+
+// Slots in RAM, with failing and torn writes on request.
+class MemoryStorage {
+ public:
+  static const size_t kSlotSize = 64;
+
+  MemoryStorage() { memset(slots, 0xFF, sizeof(slots)); }
+
+  bool read(uint8_t slot, uint8_t *data, size_t len) {
+    if (slot >= 4 || len > kSlotSize) {
+      return false;
+    }
+    memcpy(data, slots[slot], len);
+    return true;
+  }
+
+  bool write(uint8_t slot, const uint8_t *data, size_t len) {
+    writes++;
+    if (failWrites) {
+      return false;
+    }
+    // A power cut halfway through.
+    memcpy(slots[slot], data, tearWrites ? len / 2 : len);
+    lastSlot = slot;
+    return true;
+  }
+
+  uint8_t slots[4][kSlotSize];
+  bool failWrites = false;
+  bool tearWrites = false;
+  uint8_t lastSlot = 0xFF;
+  uint32_t writes = 0;
+};
+
+typedef SettingsStore<SettingsV2, MemoryStorage> Store;
+
+void setUp() {}
+void tearDown() {}
+
+void test_crc32_check_value() {
+  TEST_ASSERT_EQUAL_UINT32(0xCBF43926,
+                           crc32((const uint8_t *)"123456789", 9));
+  // Incremental.
+  uint32_t crc = crc32((const uint8_t *)"1234", 4);
+  TEST_ASSERT_EQUAL_UINT32(0xCBF43926,
+                           crc32((const uint8_t *)"56789", 5, crc));
+}
+
+void test_empty_storage_keeps_defaults() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  SettingsV2 settings;
+  TEST_ASSERT_FALSE(store.load(settings));
+  TEST_ASSERT_EQUAL_UINT16(5658, settings.frequency);
+}
+
+void test_save_and_load() {
+  MemoryStorage storage;
+  SettingsV2 settings;
+  settings.frequency = 5917;
+  settings.minLapSeconds = 9;
+  {
+    Store store(storage, 2);
+    TEST_ASSERT_TRUE(store.save(settings));
+    TEST_ASSERT_EQUAL(1, store.writes());
+  }
+
+  Store store(storage, 2);
+  SettingsV2 loaded;
+  TEST_ASSERT_TRUE(store.load(loaded));
+  TEST_ASSERT_EQUAL_UINT16(5917, loaded.frequency);
+  TEST_ASSERT_EQUAL_UINT16(9, loaded.minLapSeconds);
+}
+
+void test_slots_alternate_and_newest_wins() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  SettingsV2 settings;
+  for (uint16_t i = 0; i < 5; i++) {
+    settings.frequency = 5600 + i;
+    TEST_ASSERT_TRUE(store.save(settings));
+    TEST_ASSERT_EQUAL(i % 2, storage.lastSlot);
+  }
+
+  // A fresh store picks the newest and carries on after it.
+  Store reloaded(storage, 2);
+  SettingsV2 loaded;
+  TEST_ASSERT_TRUE(reloaded.load(loaded));
+  TEST_ASSERT_EQUAL_UINT16(5604, loaded.frequency);
+  TEST_ASSERT_TRUE(reloaded.save(loaded));
+  TEST_ASSERT_EQUAL(1, storage.lastSlot);
+}
+
+void test_torn_write_falls_back_to_previous_record() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  SettingsV2 settings;
+  settings.frequency = 5740;
+  TEST_ASSERT_TRUE(store.save(settings));
+
+  storage.tearWrites = true;
+  settings.frequency = 5880;
+  store.save(settings);
+
+  Store reloaded(storage, 2);
+  SettingsV2 loaded;
+  TEST_ASSERT_TRUE(reloaded.load(loaded));
+  TEST_ASSERT_EQUAL_UINT16(5740, loaded.frequency);
+}
+
+void test_corrupted_record_is_skipped() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  SettingsV2 settings;
+  settings.frequency = 5740;
+  store.save(settings);
+  settings.frequency = 5880;
+  store.save(settings);
+
+  // Flip a payload bit of the newest record.
+  storage.slots[1][sizeof(SettingsRecordHeader)] ^= 0x01;
+  Store reloaded(storage, 2);
+  SettingsV2 loaded;
+  TEST_ASSERT_TRUE(reloaded.load(loaded));
+  TEST_ASSERT_EQUAL_UINT16(5740, loaded.frequency);
+}
+
+void test_failed_write_stays_dirty() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  store.markDirty(0);
+  storage.failWrites = true;
+  TEST_ASSERT_FALSE(store.save(SettingsV2()));
+  TEST_ASSERT_TRUE(store.dirty());
+  TEST_ASSERT_EQUAL(0, store.writes());
+}
+
+void test_older_schema_keeps_new_defaults() {
+  MemoryStorage storage;
+  SettingsV1 old;
+  old.frequency = 5806;
+  SettingsStore<SettingsV1, MemoryStorage> oldStore(storage, 1);
+  TEST_ASSERT_TRUE(oldStore.save(old));
+
+  Store store(storage, 2);
+  SettingsV2 loaded;
+  TEST_ASSERT_TRUE(store.load(loaded));
+  TEST_ASSERT_EQUAL_UINT16(5806, loaded.frequency);
+  TEST_ASSERT_EQUAL_UINT16(4, loaded.minLapSeconds);
+}
+
+void test_newer_schema_is_ignored() {
+  MemoryStorage storage;
+  Store newer(storage, 3);
+  SettingsV2 settings;
+  settings.frequency = 5806;
+  newer.save(settings);
+
+  Store store(storage, 2);
+  SettingsV2 loaded;
+  TEST_ASSERT_FALSE(store.load(loaded));
+  TEST_ASSERT_EQUAL_UINT16(5658, loaded.frequency);
+}
+
+void test_flush_waits_for_changes_to_stop() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  TEST_ASSERT_FALSE(store.flushDue(0));
+
+  store.markDirty(1000);
+  TEST_ASSERT_FALSE(store.flushDue(1000 + SETTINGS_FLUSH_DELAY_MILLIS - 1));
+  TEST_ASSERT_TRUE(store.flushDue(1000 + SETTINGS_FLUSH_DELAY_MILLIS));
+
+  TEST_ASSERT_TRUE(store.save(SettingsV2()));
+  TEST_ASSERT_FALSE(store.flushDue(1000 + SETTINGS_FLUSH_DELAY_MILLIS));
+}
+
+void test_flush_is_forced_after_max_delay() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  uint32_t now = 0;
+  // Keeps changing, as during calibration.
+  for (; now < SETTINGS_FLUSH_MAX_DELAY_MILLIS; now += 500) {
+    store.markDirty(now);
+    TEST_ASSERT_FALSE(store.flushDue(now));
+  }
+  store.markDirty(now);
+  TEST_ASSERT_TRUE(store.flushDue(now));
+}
+
+void test_flush_is_held_while_detection_is_busy() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  store.markDirty(0);
+  uint32_t due = SETTINGS_FLUSH_DELAY_MILLIS;
+
+  TEST_ASSERT_FALSE(store.flushDue(due, true));
+  TEST_ASSERT_FALSE(store.flushDue(due + SETTINGS_FLUSH_MAX_HOLD_MILLIS - 1,
+                                   true));
+  // A quad parked in the gate doesn't hold it forever.
+  TEST_ASSERT_TRUE(store.flushDue(due + SETTINGS_FLUSH_MAX_HOLD_MILLIS, true));
+
+  // Nor does it wait once detection is idle.
+  TEST_ASSERT_TRUE(store.save(SettingsV2()));
+  store.markDirty(10000);
+  due = 10000 + SETTINGS_FLUSH_DELAY_MILLIS;
+  TEST_ASSERT_FALSE(store.flushDue(due, true));
+  TEST_ASSERT_TRUE(store.flushDue(due + 1, false));
+}
+
+void test_hold_restarts_for_each_flush() {
+  MemoryStorage storage;
+  Store store(storage, 2);
+  store.markDirty(0);
+  uint32_t due = SETTINGS_FLUSH_DELAY_MILLIS;
+  TEST_ASSERT_FALSE(store.flushDue(due, true));
+  TEST_ASSERT_TRUE(store.flushDue(due + SETTINGS_FLUSH_MAX_HOLD_MILLIS, true));
+  TEST_ASSERT_TRUE(store.save(SettingsV2()));
+
+  // The next flush is held again, not saved straight away.
+  store.markDirty(20000);
+  due = 20000 + SETTINGS_FLUSH_DELAY_MILLIS;
+  TEST_ASSERT_FALSE(store.flushDue(due, true));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_crc32_check_value);
+  RUN_TEST(test_empty_storage_keeps_defaults);
+  RUN_TEST(test_save_and_load);
+  RUN_TEST(test_slots_alternate_and_newest_wins);
+  RUN_TEST(test_torn_write_falls_back_to_previous_record);
+  RUN_TEST(test_corrupted_record_is_skipped);
+  RUN_TEST(test_failed_write_stays_dirty);
+  RUN_TEST(test_older_schema_keeps_new_defaults);
+  RUN_TEST(test_newer_schema_is_ignored);
+  RUN_TEST(test_flush_waits_for_changes_to_stop);
+  RUN_TEST(test_flush_is_forced_after_max_delay);
+  RUN_TEST(test_flush_is_held_while_detection_is_busy);
+  RUN_TEST(test_hold_restarts_for_each_flush);
+  return UNITY_END();
+}
@@ -0,0 +1,215 @@
+#include <unity.h>
+
+#include <vector>
+
+#include "spectrum_scan.h"
+
+#define SAMPLE_PERIOD_MICROS 500
+
+// A receiver whose PLL takes pllMicros after a retune: until then it still
+// reports the frequency before. Quads are on the frequencies in vtx.
+struct SimRx {
+  uint32_t pllMicros = 3000;
+  std::vector<uint16_t> vtx;
+
+  uint16_t frequency = 5800;
+  uint16_t previous = 5800;
+  uint64_t tunedAt = 0;
+  uint32_t settleMicros = 0;
+  std::vector<uint32_t> settles;
+  int retunes = 0;
+
+  void tune(uint16_t freqMhz, uint64_t now) {
+    previous = frequency;
+    frequency = freqMhz;
+    tunedAt = now;
+    settles.push_back(settleMicros);
+    retunes++;
+  }
+  bool isSettled(uint64_t now) const { return now >= tunedAt + settleMicros; }
+  void setSettleMicros(uint32_t micros) { settleMicros = micros; }
+
+  uint16_t rssi(uint64_t now) const {
+    uint16_t tuned = now >= tunedAt + pllMicros ? frequency : previous;
+    for (uint16_t on : vtx) {
+      if (on == tuned) {
+        return 400;
+      }
+    }
+    return 100;
+  }
+};
+
+// Ticks the scan at the sample rate until it is done, returns when.
+static uint64_t sweep(SpectrumScan &scan, SimRx &rx, uint64_t now) {
+  while (scan.active()) {
+    now += SAMPLE_PERIOD_MICROS;
+    if (scan.tick(now, rx, [&] { return rx.rssi(now); })) {
+      break;
+    }
+  }
+  return now;
+}
+
+static uint16_t rssiAt(const SpectrumResult &result, uint16_t frequency) {
+  for (uint16_t i = 0; i < result.count; i++) {
+    if (result.points[i].frequency == frequency) {
+      return result.points[i].rssi;
+    }
+  }
+  TEST_FAIL_MESSAGE("frequency not swept");
+  return 0;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_band_mask() {
+  TEST_ASSERT_EQUAL(0x30, spectrumBandMask("RL"));
+  TEST_ASSERT_EQUAL(0x18, spectrumBandMask("rf"));
+  TEST_ASSERT_EQUAL(0, spectrumBandMask("RX"));
+  TEST_ASSERT_EQUAL(SPECTRUM_ALL_BANDS, spectrumBandMask("ABEFRL"));
+}
+
+// Shared channels once, ascending, so every retune is a small step.
+void test_all_bands_merged_ascending() {
+  SpectrumScanConfig config;
+  uint16_t frequencies[SPECTRUM_MAX_POINTS];
+  size_t count =
+      spectrumFrequencies(config, frequencies, SPECTRUM_MAX_POINTS);
+  TEST_ASSERT_EQUAL(47, count);
+  TEST_ASSERT_EQUAL(5362, frequencies[0]);
+  TEST_ASSERT_EQUAL(5945, frequencies[count - 1]);
+  for (size_t i = 1; i < count; i++) {
+    TEST_ASSERT_TRUE(frequencies[i - 1] < frequencies[i]);
+  }
+}
+
+void test_range_and_limit() {
+  SpectrumScanConfig config;
+  config.bands = 0;
+  config.minMhz = 5600;
+  config.maxMhz = 5650;
+  config.stepMhz = 25;
+  uint16_t frequencies[SPECTRUM_MAX_POINTS];
+  TEST_ASSERT_EQUAL(3, spectrumFrequencies(config, frequencies,
+                                           SPECTRUM_MAX_POINTS));
+  TEST_ASSERT_EQUAL(5650, frequencies[2]);
+
+  // At most max of them.
+  config.stepMhz = 1;
+  TEST_ASSERT_EQUAL(10, spectrumFrequencies(config, frequencies, 10));
+  TEST_ASSERT_EQUAL(5609, frequencies[9]);
+
+  config.stepMhz = 0;
+  TEST_ASSERT_EQUAL(0, spectrumFrequencies(config, frequencies,
+                                           SPECTRUM_MAX_POINTS));
+  SpectrumScan scan;
+  TEST_ASSERT_FALSE(scan.start(config, 0));
+  TEST_ASSERT_FALSE(scan.active());
+}
+
+// Once per frequency, the first retune with the long settle time, and the
+// quads found where they are.
+void test_sweep_finds_quads() {
+  SimRx rx;
+  rx.vtx = {5658, 5732, 5880};
+  SpectrumScanConfig config;
+  config.bands = spectrumBandMask("R");
+  SpectrumScan scan;
+  TEST_ASSERT_TRUE(scan.start(config, 1000000));
+  TEST_ASSERT_TRUE(scan.active());
+  sweep(scan, rx, 1000000);
+
+  const SpectrumResult &result = scan.result();
+  TEST_ASSERT_FALSE(scan.active());
+  TEST_ASSERT_EQUAL(8, result.count);
+  TEST_ASSERT_EQUAL(8, result.retunes);
+  TEST_ASSERT_EQUAL(8, rx.retunes);
+  TEST_ASSERT_EQUAL_UINT32(config.firstSettleMicros, rx.settles[0]);
+  TEST_ASSERT_EQUAL_UINT32(config.settleMicros, rx.settles[1]);
+  TEST_ASSERT_EQUAL(400, rssiAt(result, 5658));
+  TEST_ASSERT_EQUAL(100, rssiAt(result, 5695));
+  TEST_ASSERT_EQUAL(400, rssiAt(result, 5732));
+  TEST_ASSERT_EQUAL(100, rssiAt(result, 5843));
+  TEST_ASSERT_EQUAL(400, rssiAt(result, 5880));
+}
+
+// The sweep takes what estimateMicros() says, give or take a tick per
+// frequency for settling between ticks.
+void test_sweep_time_matches_estimate() {
+  SimRx rx;
+  SpectrumScanConfig config;
+  SpectrumScan scan;
+  scan.start(config, 0);
+  uint64_t end = sweep(scan, rx, 0);
+
+  const SpectrumResult &result = scan.result();
+  uint32_t estimate =
+      SpectrumScan::estimateMicros(config, result.count, SAMPLE_PERIOD_MICROS);
+  TEST_ASSERT_EQUAL_UINT32(end, result.sweepMicros);
+  TEST_ASSERT_EQUAL(47, result.retunes);
+  TEST_ASSERT_UINT32_WITHIN(result.count * SAMPLE_PERIOD_MICROS, estimate,
+                            result.sweepMicros);
+  // All bands well within a second, as the firmware promises.
+  TEST_ASSERT_TRUE(result.sweepMicros < 400000);
+}
+
+// A settle time shorter than the PLL's reads the frequency before: the
+// quad's peak shows one step late.
+void test_short_settle_misplaces_peak() {
+  SimRx rx;
+  rx.pllMicros = 3000;
+  rx.vtx = {5732};
+  SpectrumScanConfig config;
+  config.bands = spectrumBandMask("R");
+  config.samples = 1;
+  config.settleMicros = 1000;
+  SpectrumScan scan;
+  scan.start(config, 0);
+  sweep(scan, rx, 0);
+  TEST_ASSERT_EQUAL(100, rssiAt(scan.result(), 5732));
+  TEST_ASSERT_EQUAL(400, rssiAt(scan.result(), 5769));
+
+  config.settleMicros = 3000;
+  scan.start(config, 0);
+  sweep(scan, rx, 0);
+  TEST_ASSERT_EQUAL(400, rssiAt(scan.result(), 5732));
+  TEST_ASSERT_EQUAL(100, rssiAt(scan.result(), 5769));
+}
+
+// samples readings averaged, rounded.
+void test_samples_are_averaged() {
+  struct Rx {
+    void tune(uint16_t, uint64_t) {}
+    bool isSettled(uint64_t) const { return true; }
+    void setSettleMicros(uint32_t) {}
+  } rx;
+  SpectrumScanConfig config;
+  config.bands = 0;
+  config.minMhz = 5800;
+  config.maxMhz = 5800;
+  config.samples = 4;
+  SpectrumScan scan;
+  scan.start(config, 0);
+  const uint16_t readings[] = {100, 101, 101, 101};
+  size_t next = 0;
+  uint64_t now = 0;
+  while (!scan.tick(now += SAMPLE_PERIOD_MICROS, rx,
+                    [&] { return readings[next++]; })) {
+  }
+  TEST_ASSERT_EQUAL(4, next);
+  TEST_ASSERT_EQUAL(101, scan.result().points[0].rssi);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_band_mask);
+  RUN_TEST(test_all_bands_merged_ascending);
+  RUN_TEST(test_range_and_limit);
+  RUN_TEST(test_sweep_finds_quads);
+  RUN_TEST(test_sweep_time_matches_estimate);
+  RUN_TEST(test_short_settle_misplaces_peak);
+  RUN_TEST(test_samples_are_averaged);
+  return UNITY_END();
+}
@@ -0,0 +1,101 @@
+#include <unity.h>
+
+#include "spsc_ring_buffer.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_pops_in_push_order() {
+  SpscRingBuffer<uint32_t, 8> buffer;
+  for (uint32_t i = 0; i < 5; i++) {
+    TEST_ASSERT_TRUE(buffer.push(i));
+  }
+  TEST_ASSERT_EQUAL(5, buffer.size());
+
+  uint32_t item;
+  for (uint32_t i = 0; i < 5; i++) {
+    TEST_ASSERT_TRUE(buffer.pop(item));
+    TEST_ASSERT_EQUAL(i, item);
+  }
+  TEST_ASSERT_FALSE(buffer.pop(item));
+  TEST_ASSERT_EQUAL(0, buffer.size());
+}
+
+void test_full_buffer_drops_and_counts() {
+  SpscRingBuffer<uint16_t, 4> buffer;
+  for (uint16_t i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(buffer.push(i));
+  }
+  TEST_ASSERT_FALSE(buffer.push(100));
+  TEST_ASSERT_FALSE(buffer.push(101));
+  TEST_ASSERT_EQUAL(2, buffer.dropped());
+  TEST_ASSERT_EQUAL(4, buffer.size());
+
+  // The dropped items never show up, the queued ones are intact.
+  uint16_t item;
+  TEST_ASSERT_TRUE(buffer.pop(item));
+  TEST_ASSERT_EQUAL(0, item);
+  TEST_ASSERT_TRUE(buffer.push(4));
+  for (uint16_t i = 1; i <= 4; i++) {
+    TEST_ASSERT_TRUE(buffer.pop(item));
+    TEST_ASSERT_EQUAL(i, item);
+  }
+}
+
+void test_wraps_around_many_times() {
+  SpscRingBuffer<uint32_t, 4> buffer;
+  uint32_t next = 0;
+  uint32_t expected = 0;
+  uint32_t item;
+  for (int round = 0; round < 1000; round++) {
+    TEST_ASSERT_TRUE(buffer.push(next++));
+    TEST_ASSERT_TRUE(buffer.push(next++));
+    TEST_ASSERT_TRUE(buffer.pop(item));
+    TEST_ASSERT_EQUAL(expected++, item);
+    TEST_ASSERT_TRUE(buffer.pop(item));
+    TEST_ASSERT_EQUAL(expected++, item);
+  }
+  TEST_ASSERT_EQUAL(0, buffer.dropped());
+}
+
+void test_pop_batch_is_bounded_by_max_items() {
+  SpscRingBuffer<uint32_t, 16> buffer;
+  for (uint32_t i = 0; i < 10; i++) {
+    buffer.push(i);
+  }
+
+  uint32_t out[16];
+  TEST_ASSERT_EQUAL(4, buffer.popBatch(out, 4));
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL(i, out[i]);
+  }
+  TEST_ASSERT_EQUAL(6, buffer.popBatch(out, 16));
+  for (uint32_t i = 0; i < 6; i++) {
+    TEST_ASSERT_EQUAL(i + 4, out[i]);
+  }
+  TEST_ASSERT_EQUAL(0, buffer.popBatch(out, 16));
+}
+
+void test_clear_discards_queued_items() {
+  SpscRingBuffer<uint32_t, 8> buffer;
+  buffer.push(1);
+  buffer.push(2);
+  buffer.clear();
+  TEST_ASSERT_EQUAL(0, buffer.size());
+
+  uint32_t item;
+  TEST_ASSERT_FALSE(buffer.pop(item));
+  buffer.push(3);
+  TEST_ASSERT_TRUE(buffer.pop(item));
+  TEST_ASSERT_EQUAL(3, item);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_pops_in_push_order);
+  RUN_TEST(test_full_buffer_drops_and_counts);
+  RUN_TEST(test_wraps_around_many_times);
+  RUN_TEST(test_pop_batch_is_bounded_by_max_items);
+  RUN_TEST(test_clear_discards_queued_items);
+  return UNITY_END();
+}
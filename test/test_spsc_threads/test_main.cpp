@@ -0,0 +1,136 @@
+#include <thread>
+#include <unity.h>
+
+#include "spsc_ring_buffer.h"
+
+// Detection and loop() on two real threads, as on the dual core chips. Items
+// are the size of a detection event, with every word carrying the sequence
+// number so a torn copy shows.
+
+static const uint32_t kItems = 200000;
+
+struct Item {
+  uint32_t sequence;
+  uint32_t words[7];
+};
+
+static Item makeItem(uint32_t sequence) {
+  Item item;
+  item.sequence = sequence;
+  for (uint32_t i = 0; i < 7; i++) {
+    item.words[i] = sequence * 31 + i;
+  }
+  return item;
+}
+
+static bool intact(const Item &item) {
+  for (uint32_t i = 0; i < 7; i++) {
+    if (item.words[i] != item.sequence * 31 + i) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Retries when full, so nothing is lost and the order has to be exact.
+void test_every_item_arrives_in_order() {
+  static SpscRingBuffer<Item, 64> buffer;
+  std::thread producer([] {
+    for (uint32_t i = 0; i < kItems; i++) {
+      while (!buffer.push(makeItem(i))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  uint32_t expected = 0;
+  bool ok = true;
+  Item item;
+  while (expected < kItems && ok) {
+    if (!buffer.pop(item)) {
+      std::this_thread::yield();
+      continue;
+    }
+    ok = item.sequence == expected && intact(item);
+    expected++;
+  }
+  producer.join();
+
+  TEST_ASSERT_TRUE(ok);
+  TEST_ASSERT_EQUAL_UINT32(kItems, expected);
+  TEST_ASSERT_EQUAL(0, buffer.size());
+}
+
+// Drops when full, like the sampler. What arrives is intact, in order, and
+// with the drops it adds up to what was pushed.
+void test_drops_are_counted_and_never_torn() {
+  static SpscRingBuffer<Item, 16> buffer;
+  uint32_t pushed = 0;
+  std::thread producer([&pushed] {
+    for (uint32_t i = 0; i < kItems; i++) {
+      if (buffer.push(makeItem(i))) {
+        pushed++;
+      }
+    }
+  });
+
+  uint32_t received = 0;
+  int64_t last = -1;
+  bool ok = true;
+  Item batch[8];
+  // Until the producer is done and the buffer is drained.
+  while (received + buffer.dropped() < kItems && ok) {
+    size_t count = buffer.popBatch(batch, 8);
+    if (count == 0) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < count; i++) {
+      ok = ok && intact(batch[i]) && (int64_t)batch[i].sequence > last;
+      last = batch[i].sequence;
+    }
+    received += count;
+  }
+  producer.join();
+
+  TEST_ASSERT_TRUE(ok);
+  TEST_ASSERT_EQUAL_UINT32(pushed, received);
+  TEST_ASSERT_EQUAL_UINT32(kItems, received + buffer.dropped());
+}
+
+// clear() from the consumer while the producer keeps going.
+void test_clear_races_push() {
+  static SpscRingBuffer<Item, 32> buffer;
+  std::thread producer([] {
+    for (uint32_t i = 0; i < kItems; i++) {
+      buffer.push(makeItem(i));
+    }
+  });
+
+  int64_t last = -1;
+  bool ok = true;
+  Item item;
+  for (uint32_t round = 0; round < kItems / 4 && ok; round++) {
+    if (round % 16 == 0) {
+      buffer.clear();
+    }
+    if (buffer.pop(item)) {
+      ok = intact(item) && (int64_t)item.sequence > last;
+      last = item.sequence;
+    }
+  }
+  producer.join();
+
+  TEST_ASSERT_TRUE(ok);
+  TEST_ASSERT_LESS_OR_EQUAL(32, buffer.size());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_item_arrives_in_order);
+  RUN_TEST(test_drops_are_counted_and_never_torn);
+  RUN_TEST(test_clear_races_push);
+  return UNITY_END();
+}
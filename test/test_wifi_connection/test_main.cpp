@@ -0,0 +1,150 @@
+#include <unity.h>
+
+#include "wifi_connection.h"
+
+// Connects connectMillis after begin(), or never when the router is down.
+class FakeDriver {
+ public:
+  bool connected() {
+    return routerUp && begun && now - begunAt >= connectMillis;
+  }
+
+  void begin() {
+    begun = true;
+    begunAt = now;
+    begins++;
+  }
+
+  void disconnect() {
+    begun = false;
+    disconnects++;
+  }
+
+  uint32_t now = 0;
+  bool routerUp = true;
+  uint32_t connectMillis = 300;
+  bool begun = false;
+  uint32_t begunAt = 0;
+  uint32_t begins = 0;
+  uint32_t disconnects = 0;
+};
+
+static FakeDriver driver;
+
+// Polls as loop() would, every 10ms until untilMillis. Returns the last
+// event other than WIFI_EVENT_NONE, and when it happened.
+static WifiEvent runUntil(WifiConnection<FakeDriver> &wifi,
+                          uint32_t untilMillis, uint32_t *eventAt = NULL) {
+  WifiEvent last = WIFI_EVENT_NONE;
+  for (; driver.now != untilMillis; driver.now += 10) {
+    WifiEvent event = wifi.update(driver.now);
+    if (event != WIFI_EVENT_NONE) {
+      last = event;
+      if (eventAt) {
+        *eventAt = driver.now;
+      }
+    }
+  }
+  return last;
+}
+
+void setUp() { driver = FakeDriver(); }
+void tearDown() {}
+
+void test_idle_until_started() {
+  WifiConnection<FakeDriver> wifi(driver);
+  TEST_ASSERT_EQUAL(WIFI_EVENT_NONE, runUntil(wifi, 5000));
+  TEST_ASSERT_EQUAL(WIFI_IDLE, wifi.state());
+  TEST_ASSERT_EQUAL_UINT32(0, driver.begins);
+}
+
+void test_connects_in_the_background() {
+  WifiConnection<FakeDriver> wifi(driver);
+  wifi.start(driver.now);
+  TEST_ASSERT_EQUAL(WIFI_CONNECTING, wifi.state());
+
+  uint32_t at = 0;
+  TEST_ASSERT_EQUAL(WIFI_EVENT_CONNECTED, runUntil(wifi, 1000, &at));
+  TEST_ASSERT_EQUAL_UINT32(300, at);
+  TEST_ASSERT_EQUAL(WIFI_CONNECTED, wifi.state());
+  TEST_ASSERT_EQUAL_UINT32(1, wifi.attempts());
+}
+
+void test_backoff_doubles_up_to_the_max() {
+  driver.routerUp = false;
+  WifiConnection<FakeDriver> wifi(driver);
+  wifi.start(driver.now);
+
+  uint32_t expectedBackoff = WIFI_BACKOFF_MIN_MILLIS;
+  uint32_t attemptAt = 0;
+  for (int attempt = 1; attempt <= 10; attempt++) {
+    uint32_t at = 0;
+    TEST_ASSERT_EQUAL(WIFI_EVENT_FAILED,
+                      runUntil(wifi, attemptAt + WIFI_CONNECT_TIMEOUT_MILLIS +
+                                         10, &at));
+    TEST_ASSERT_EQUAL_UINT32(attemptAt + WIFI_CONNECT_TIMEOUT_MILLIS, at);
+    TEST_ASSERT_EQUAL(WIFI_BACKOFF, wifi.state());
+    TEST_ASSERT_EQUAL_UINT32(attempt, driver.disconnects);
+
+    // The next attempt starts once the backoff is over.
+    attemptAt = at + expectedBackoff;
+    runUntil(wifi, attemptAt);
+    TEST_ASSERT_EQUAL(WIFI_BACKOFF, wifi.state());
+    runUntil(wifi, attemptAt + 10);
+    TEST_ASSERT_EQUAL(WIFI_CONNECTING, wifi.state());
+    TEST_ASSERT_EQUAL_UINT32(attempt + 1, driver.begins);
+
+    expectedBackoff = expectedBackoff * 2 < WIFI_BACKOFF_MAX_MILLIS
+                          ? expectedBackoff * 2
+                          : WIFI_BACKOFF_MAX_MILLIS;
+    TEST_ASSERT_EQUAL_UINT32(expectedBackoff, wifi.backoffMillis());
+  }
+  TEST_ASSERT_EQUAL_UINT32(WIFI_BACKOFF_MAX_MILLIS, wifi.backoffMillis());
+}
+
+void test_lost_connection_retries_at_once_and_resets_backoff() {
+  driver.routerUp = false;
+  WifiConnection<FakeDriver> wifi(driver);
+  wifi.start(driver.now);
+  // Fail a few times to grow the backoff.
+  runUntil(wifi, 60000);
+  TEST_ASSERT_GREATER_THAN(WIFI_BACKOFF_MIN_MILLIS, wifi.backoffMillis());
+
+  driver.routerUp = true;
+  TEST_ASSERT_EQUAL(WIFI_EVENT_CONNECTED, runUntil(wifi, 120000));
+  TEST_ASSERT_EQUAL_UINT32(WIFI_BACKOFF_MIN_MILLIS, wifi.backoffMillis());
+
+  driver.routerUp = false;
+  uint32_t begins = driver.begins;
+  TEST_ASSERT_EQUAL(WIFI_EVENT_LOST, wifi.update(driver.now));
+  TEST_ASSERT_EQUAL(WIFI_CONNECTING, wifi.state());
+  TEST_ASSERT_EQUAL_UINT32(begins + 1, driver.begins);
+
+  driver.routerUp = true;
+  TEST_ASSERT_EQUAL(WIFI_EVENT_CONNECTED, runUntil(wifi, driver.now + 1000));
+}
+
+void test_survives_millis_wraparound() {
+  driver.now = 0xFFFFFFFF - 4999;
+  driver.routerUp = false;
+  WifiConnection<FakeDriver> wifi(driver);
+  wifi.start(driver.now);
+
+  // Times out 10s later, on the other side of the wrap, not at once.
+  uint32_t at = 0;
+  TEST_ASSERT_EQUAL(WIFI_EVENT_NONE, runUntil(wifi, driver.now + 1000));
+  TEST_ASSERT_EQUAL(WIFI_EVENT_FAILED,
+                    runUntil(wifi, driver.now + 10000, &at));
+  TEST_ASSERT_EQUAL_UINT32(0xFFFFFFFF - 4999 + WIFI_CONNECT_TIMEOUT_MILLIS,
+                           at);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_idle_until_started);
+  RUN_TEST(test_connects_in_the_background);
+  RUN_TEST(test_backoff_doubles_up_to_the_max);
+  RUN_TEST(test_lost_connection_retries_at_once_and_resets_backoff);
+  RUN_TEST(test_survives_millis_wraparound);
+  return UNITY_END();
+}
@@ -0,0 +1,134 @@
+#include <unity.h>
+
+#include "rssi_telemetry.h"
+#include "ws_protocol.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_pass_round_trip() {
+  WsPass pass;
+  pass.channel = 3;
+  // Past 16 bits, the lap is a full u32.
+  pass.lap = 70000;
+  pass.timeStamp = 0x0123456789ABCDEFULL;
+  pass.interval = 4500000;
+  pass.rssiPeak = 1800;
+  pass.rssiPeakRaw = 2100;
+  pass.detectedTimeStamp = 0xFEDCBA9876543210ULL;
+
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  size_t len = encodeWsPass(buffer, pass);
+  TEST_ASSERT_EQUAL(2 + 1 + 4 + 8 + 8 + 2 + 2 + 8, len);
+  TEST_ASSERT_EQUAL(WS_PROTOCOL_VERSION, buffer[0]);
+  TEST_ASSERT_EQUAL(WS_PASS, wsFrameType(buffer, len));
+
+  WsPass decoded;
+  TEST_ASSERT_TRUE(decodeWsPass(buffer, len, decoded));
+  TEST_ASSERT_EQUAL(pass.channel, decoded.channel);
+  TEST_ASSERT_EQUAL_UINT32(pass.lap, decoded.lap);
+  TEST_ASSERT_EQUAL_UINT64(pass.timeStamp, decoded.timeStamp);
+  TEST_ASSERT_EQUAL_UINT64(pass.interval, decoded.interval);
+  TEST_ASSERT_EQUAL_UINT16(pass.rssiPeak, decoded.rssiPeak);
+  TEST_ASSERT_EQUAL_UINT16(pass.rssiPeakRaw, decoded.rssiPeakRaw);
+  TEST_ASSERT_EQUAL_UINT64(pass.detectedTimeStamp, decoded.detectedTimeStamp);
+}
+
+void test_integers_are_little_endian() {
+  WsCalibration calibration;
+  calibration.calibrating = 1;
+  calibration.timeStamp = 0x0807060504030201ULL;
+
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  size_t len = encodeWsCalibration(buffer, calibration);
+  const uint8_t expected[] = {WS_PROTOCOL_VERSION, WS_CALIBRATION, 1, 1, 2,
+                              3, 4, 5, 6, 7, 8};
+  TEST_ASSERT_EQUAL(sizeof(expected), len);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, buffer, sizeof(expected));
+
+  WsCalibration decoded;
+  TEST_ASSERT_TRUE(decodeWsCalibration(buffer, len, decoded));
+  TEST_ASSERT_EQUAL(1, decoded.calibrating);
+  TEST_ASSERT_EQUAL_UINT64(calibration.timeStamp, decoded.timeStamp);
+}
+
+void test_settings_round_trip() {
+  WsSettings settings;
+  settings.vtxFreq = 5917;
+  settings.rssiPeak = 2400;
+  settings.enterRssiOffset = 300;
+  settings.leaveRssiOffset = 450;
+  settings.filterRatio = 30;
+  settings.logRssi = 1;
+  settings.id = 7;
+  settings.channelCount = 4;
+
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  size_t len = encodeWsSettings(buffer, settings);
+  TEST_ASSERT_LESS_OR_EQUAL(WS_MAX_FIXED_FRAME_SIZE, len);
+
+  WsSettings decoded;
+  TEST_ASSERT_TRUE(decodeWsSettings(buffer, len, decoded));
+  TEST_ASSERT_EQUAL_UINT16(5917, decoded.vtxFreq);
+  TEST_ASSERT_EQUAL_UINT16(2400, decoded.rssiPeak);
+  TEST_ASSERT_EQUAL_UINT16(300, decoded.enterRssiOffset);
+  TEST_ASSERT_EQUAL_UINT16(450, decoded.leaveRssiOffset);
+  TEST_ASSERT_EQUAL(30, decoded.filterRatio);
+  TEST_ASSERT_EQUAL(1, decoded.logRssi);
+  TEST_ASSERT_EQUAL(7, decoded.id);
+  TEST_ASSERT_EQUAL(4, decoded.channelCount);
+}
+
+void test_rssi_carries_a_batch() {
+  RssiLog<8> log;
+  for (uint16_t i = 0; i < 8; i++) {
+    log.add(1000 + 10 * i);
+  }
+
+  uint8_t buffer[WS_RSSI_HEADER_SIZE + RSSI_BATCH_MAX_BINARY(8)];
+  size_t len = encodeWsRssiHeader(buffer, 123456789, 20000, 1070);
+  TEST_ASSERT_EQUAL(WS_RSSI_HEADER_SIZE, len);
+  len += encodeRssiBatchBinary(log, buffer + len);
+
+  WsRssi rssi;
+  TEST_ASSERT_TRUE(decodeWsRssi(buffer, len, rssi));
+  TEST_ASSERT_EQUAL_UINT64(123456789, rssi.timeStamp);
+  TEST_ASSERT_EQUAL_UINT32(20000, rssi.logIntervalMicros);
+  TEST_ASSERT_EQUAL_UINT16(1070, rssi.rssi);
+  TEST_ASSERT_EQUAL(len - WS_RSSI_HEADER_SIZE, rssi.batchSize);
+
+  uint16_t values[8];
+  TEST_ASSERT_EQUAL(8, decodeRssiBatchBinary(rssi.batch, rssi.batchSize,
+                                             values, 8));
+  TEST_ASSERT_EQUAL_UINT16(1070, values[7]);
+}
+
+void test_rejects_truncated_and_foreign_frames() {
+  WsPass pass = WsPass();
+  uint8_t buffer[WS_MAX_FIXED_FRAME_SIZE];
+  size_t len = encodeWsPass(buffer, pass);
+
+  WsPass decoded;
+  for (size_t i = 0; i < len; i++) {
+    TEST_ASSERT_FALSE(decodeWsPass(buffer, i, decoded));
+  }
+
+  // Wrong type.
+  WsSettings settings;
+  TEST_ASSERT_FALSE(decodeWsSettings(buffer, len, settings));
+
+  // Newer version.
+  buffer[0] = WS_PROTOCOL_VERSION + 1;
+  TEST_ASSERT_EQUAL(0, wsFrameType(buffer, len));
+  TEST_ASSERT_FALSE(decodeWsPass(buffer, len, decoded));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_pass_round_trip);
+  RUN_TEST(test_integers_are_little_endian);
+  RUN_TEST(test_settings_round_trip);
+  RUN_TEST(test_rssi_carries_a_batch);
+  RUN_TEST(test_rejects_truncated_and_foreign_frames);
+  return UNITY_END();
+}
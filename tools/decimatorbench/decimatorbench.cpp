@@ -0,0 +1,144 @@
+// Feeds RssiDecimator (see rssi_decimator.h) ADC frames the way
+// rssiDrain() does on the C3, at a continuous ADC rate, and measures
+// whether it keeps up in real time and with how much to spare.
+//
+// Build, from tools/:
+//   make decimatorbench/decimatorbench
+//
+// Usage:
+//   decimatorbench [options]
+//
+//   --rate N      ADC readings per second, default 40000
+//   --factor N    readings per rssi sample, default RSSI_OVERSAMPLING
+//   --seconds N   of input, default 60
+//   --seed N      default 1
+//
+// The input is a noisy rssi with quads flying over, packed into the 4 byte
+// TYPE2 words of the C3's DMA, one frame of factor words per rssi sample.
+// Per frame the driver's words are unpacked, filtered by unit and channel,
+// added, and the sample read with value(), as rssiDrain() and rssiRead()
+// do.
+//
+// Prints the cost per reading against its real time budget of 1/rate.
+// The host is many times faster than the chip; the headroom tells how
+// much of that the chip may lack. Exits 1 if the host doesn't keep up.
+
+#include <time.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "rssi_decimator.h"
+
+// The rssi pin's channel on the C3, RSSI_ADC_CHANNEL.
+#define ADC_CHANNEL 3
+
+// adc_digi_output_data_t's type2 as ESP-IDF 4.4 lays it out on the C3.
+struct AdcWord {
+  uint32_t data : 12;
+  uint32_t reserved12 : 1;
+  uint32_t channel : 3;
+  uint32_t unit : 1;
+  uint32_t reserved17_31 : 15;
+};
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "decimatorbench: %s\n", message);
+  exit(1);
+}
+
+int64_t cpuNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping the samples.
+volatile uint32_t sink;
+
+int main(int argc, char **argv) {
+  int rate = 40000;
+  int factor = RSSI_OVERSAMPLING;
+  int seconds = 60;
+  int seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--rate" && hasValue) {
+      rate = atoi(argv[++i]);
+    } else if (arg == "--factor" && hasValue) {
+      factor = atoi(argv[++i]);
+    } else if (arg == "--seconds" && hasValue) {
+      seconds = atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      seed = atoi(argv[++i]);
+    } else {
+      fail("usage: decimatorbench [options], see decimatorbench.cpp");
+    }
+  }
+  if (rate < 1 || seconds < 1) {
+    fail("--rate and --seconds have to be at least 1");
+  }
+  if (factor < 1 || factor > RSSI_DECIMATOR_MAX_FACTOR) {
+    fail("--factor has to be 1 to RSSI_DECIMATOR_MAX_FACTOR");
+  }
+
+  // A quad every 5s, sigma 40 counts of noise on top.
+  size_t readings = (size_t)rate * seconds / factor * factor;
+  std::vector<AdcWord> words(readings);
+  std::mt19937 rng(seed);
+  std::normal_distribution<double> noise(0, 40);
+  for (size_t i = 0; i < readings; i++) {
+    double t = fmod((double)i / rate, 5.0) - 2.5;
+    double rssi = 1200 + 1400 * exp(-t * t / (2 * 0.15 * 0.15)) + noise(rng);
+    AdcWord &word = words[i];
+    word = AdcWord();
+    word.data = rssi < 0 ? 0 : rssi > 4095 ? 4095 : (uint32_t)rssi;
+    word.channel = ADC_CHANNEL;
+    word.unit = 0;
+  }
+
+  RssiDecimator decimator(factor);
+  uint32_t sum = 0;
+  size_t samples = 0;
+  int64_t start = cpuNanos();
+  for (size_t frame = 0; frame < readings; frame += factor) {
+    for (size_t i = frame; i < frame + factor; i++) {
+      const AdcWord &word = words[i];
+      if (word.unit == 0 && word.channel == ADC_CHANNEL) {
+        decimator.add(word.data);
+      }
+    }
+    sum += decimator.value();
+    samples++;
+  }
+  int64_t nanos = cpuNanos() - start;
+  sink = sum;
+
+  double perReading = (double)nanos / readings;
+  double budget = 1e9 / rate;
+  double inputSeconds = (double)readings / rate;
+  printf("%d readings/s, factor %d, %.0f samples/s, %.0f s of input\n", rate,
+         factor, (double)rate / factor, inputSeconds);
+  printf("%-28s %10.2f ns\n", "per reading", perReading);
+  printf("%-28s %10.2f ns\n", "per sample", (double)nanos / samples);
+  printf("%-28s %10.0f ns\n", "budget per reading", budget);
+  printf("%-28s %10.3f %%\n", "of one core", 100 * perReading / budget);
+  printf("%-28s %10.0fx\n", "headroom", budget / perReading);
+
+  if (decimator.readings() != readings) {
+    printf("\nFAILED: %u of %zu readings added\n",
+           (unsigned)decimator.readings(), readings);
+    return 1;
+  }
+  if (perReading > budget) {
+    printf("\nFAILED: slower than real time\n");
+    return 1;
+  }
+  printf("\nkeeps up in real time\n");
+  return 0;
+}
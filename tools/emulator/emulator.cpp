@@ -0,0 +1,1335 @@
+// Runs the firmware, fpvsim_timer.cpp as it is, on the host: against the
+// stand-ins in hal/ for the Arduino core, WiFi, flash and the web server,
+// on a virtual clock. Scenario scripts fly quads over the gate, make
+// requests, connect and drop /events and /ws clients, take the router away and
+// reboot the timer, and check what comes out. Each scenario is an
+// integration test of the whole firmware, and how long its loop()s took on
+// the host a benchmark of them.
+//
+// Build, and run every scenario, from this directory:
+//   make
+//   make check
+//
+// Usage:
+//   emulator [options] SCENARIO...
+//   emulator [options] --serve PORT [SCENARIO]
+//
+//   --seed N          noise and the timer id, default 1
+//   --verbose         prints serial output, responses and events
+//   --serve PORT      serves HTTP and /events on PORT in real time, so a
+//                     client can be pointed at the emulated timer
+//   --speed X         with --serve, X times real time, default 1
+//
+// The build is the single core one (see CONFIG_FREERTOS_UNICORE in
+// hal/Arduino.h): the sampler runs from its esp_timer, detection from
+// loop(). Time only moves in delay() and delayMicroseconds(), and the
+// sampler ticks fire in there at their deadlines, so a loop() takes its
+// delay(1) and nothing for the work it does. That is as if the chip were
+// infinitely fast; how fast the host is shows up in the benchmark only.
+//
+// A boot is a process of its own, forked by a supervisor, so the firmware
+// starts from fresh globals every time. Flash, the scenario's progress and
+// what the /events clients received are in memory shared with the
+// supervisor. ESP.restart() ends the process and the supervisor forks the
+// next boot, EMU_BOOT_MILLIS later on the scenario's clock; the timer's
+// clock starts over at 0. LittleFS is not kept.
+//
+// The rssi: a noise floor, steady carriers, and quads flying over, each a
+// gaussian bump in time, as strong as the receiver is tuned close to
+// their frequency. The receiver's frequency is decoded from the frames
+// the firmware bit-bangs out.
+//
+// Scenarios, one command per line, # starts a comment. Durations like
+// 500ms, 2s, 1m. Times of passes and flyovers are on the scenario's clock,
+// which runs on across reboots.
+//
+//   wait D                   runs the timer for D
+//   get URL [QUERY]          a request, e.g. get /api/v1/passes since=3
+//   post URL [QUERY]
+//   connect C [ws]           /events client C connects, a new EventSource,
+//                            or with ws a /ws WebSocket client
+//   disconnect C             C closes the connection
+//   drop C [D]               C's connection is lost, for D, it reconnects
+//                            with its last id after that or the retry
+//                            delay, as after a reboot
+//   router up|down
+//   reboot                   power cycle
+//   noise FLOOR [SIGMA]      default 100 3
+//   carrier MHZ RSSI|off     a quad sitting on its channel
+//   flyover MHZ [peak RSSI] [in D] [width D] [every D count N]
+//                            a quad crossing the gate in D, default 1s,
+//                            rssi peak default 320, width the sigma of
+//                            the bump, default 150ms
+//
+//   expect status N          of the last request
+//   expect body TEXT         the last response contains TEXT
+//   expect events C TYPE [>=] N
+//   expect event C TYPE TEXT the last TYPE event C received contains TEXT
+//   expect passes C N        distinct newtime events C received
+//   expect passes C within D every one within D of a flyover
+//   expect latency C within D
+//                            every pass C received within D of its
+//                            detection, those detected before C connected
+//                            left out
+//   expect serial TEXT       a serial line since the last expect serial
+//   expect frequency MHZ     the receiver is tuned to MHZ
+//   expect boots N
+//
+// A /ws client counts the frames it gets by type (pass, rssi, settings,
+// calibration) as events. Its passes are the WS_PASS frames, decoded.
+//
+// Prints how the scenarios went and how fast, and for every client that
+// received passes how long they took from detection to it, on the virtual
+// clock. That is the time a pass waits in the sampler's queue and for
+// loop() to send it; what sending costs on the chip comes on top. Exits 1
+// if an expectation failed or the firmware crashed.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "emulator.h"
+#include "ws_protocol.h"
+
+// fpvsim_timer.cpp
+void setup();
+void loop();
+
+// Wall time a reboot takes until setup() runs.
+#ifndef EMU_BOOT_MILLIS
+#define EMU_BOOT_MILLIS 500
+#endif
+
+// Exit code of a boot that ended in ESP.restart().
+#define EXIT_RESTART 75
+
+#define MAX_CLIENTS 8
+#define MAX_EVENT_TYPES 16
+#define MAX_PASSES 512
+#define MAX_FLYOVERS 4096
+#define MAX_CARRIERS 8
+#define SERIAL_LINES 256
+
+// What EventSource waits before reconnecting if the server doesn't say.
+#define DEFAULT_RETRY_MILLIS 3000
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "emulator: %s\n", message);
+  exit(1);
+}
+
+uint64_t hostNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Flyover {
+  // Micros on the scenario's clock.
+  uint64_t center;
+  uint64_t width;
+  uint16_t frequency;
+  uint16_t peak;
+};
+
+struct Carrier {
+  uint16_t frequency;
+  uint16_t rssi;
+};
+
+struct EventCount {
+  char type[16];
+  uint32_t count;
+  char last[512];
+};
+
+struct PassSeen {
+  uint32_t id;
+  // Its ts us, on the scenario's clock.
+  uint64_t timeStamp;
+  char data[128];
+};
+
+// An /events or /ws client, as the scenario sees it.
+struct ClientLog {
+  char name[16];
+  bool ws;
+  // Wants to be connected, reconnects after a reboot or drop.
+  bool open;
+  uint32_t lastId;
+  uint32_t retryMillis;
+  // Scenario clock, 0 if not waiting to reconnect.
+  uint64_t reconnectAt;
+  uint32_t connects;
+  // Scenario clock, when the last connect went through.
+  uint64_t connectedAt;
+  EventCount types[MAX_EVENT_TYPES];
+  uint32_t typeCount;
+  PassSeen passes[MAX_PASSES];
+  uint32_t passCount;
+  uint32_t duplicates;
+  // From detection to the client, of passes detected while connected.
+  uint32_t latencyCount;
+  uint64_t latencyTotal;
+  uint64_t latencyWorst;
+};
+
+// Outlives a boot, shared with the supervisor.
+struct Shared {
+  emu::Flash flash;
+
+  // The next step, and when the one waiting is done.
+  uint32_t step;
+  uint64_t waitUntil;
+
+  // Micros on the scenario's clock: now, and when this boot started.
+  uint64_t wall;
+  uint64_t bootWall;
+  uint32_t boots;
+
+  bool routerUp;
+  uint16_t noiseFloor;
+  uint16_t noiseSigma;
+  Carrier carriers[MAX_CARRIERS];
+  uint32_t carrierCount;
+  Flyover flyovers[MAX_FLYOVERS];
+  uint32_t flyoverCount;
+
+  ClientLog clients[MAX_CLIENTS];
+  uint32_t clientCount;
+
+  int lastStatus;
+  char lastBody[16384];
+
+  char serial[SERIAL_LINES][128];
+  uint64_t serialLines;
+  uint64_t serialChecked;
+
+  uint64_t loops;
+  uint64_t loopNanos;
+  uint32_t failures;
+};
+
+Shared *shared = NULL;
+
+struct Step {
+  int line;
+  std::string text;
+  std::vector<std::string> args;
+};
+
+struct Options {
+  int seed = 1;
+  bool verbose = false;
+  int servePort = 0;
+  double speed = 1;
+};
+
+Options options;
+std::string scenarioName;
+std::vector<Step> steps;
+
+// Serving, see serve().
+int listenFd = -1;
+
+uint64_t wallNow() { return shared->bootWall + emu::now(); }
+
+// Fails the step, the scenario goes on.
+void expectFailed(const Step &step, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void expectFailed(const Step &step, const char *format, ...) {
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  printf("%s:%d: %s: FAILED: %s\n", scenarioName.c_str(), step.line,
+         step.text.c_str(), message);
+  shared->failures++;
+}
+
+// The step's text after its first n arguments.
+std::string rest(const Step &step, size_t n) {
+  std::istringstream in(step.text);
+  std::string word;
+  for (size_t i = 0; i < n; i++) {
+    in >> word;
+  }
+  std::string text;
+  std::getline(in, text);
+  size_t start = text.find_first_not_of(" \t");
+  return start == std::string::npos ? "" : text.substr(start);
+}
+
+// 500ms, 2s, 1m, or micros if no unit. Returns false if it isn't one.
+bool parseDuration(const std::string &s, uint64_t &micros) {
+  char *end;
+  double value = strtod(s.c_str(), &end);
+  std::string unit = end;
+  if (end == s.c_str() || value < 0) {
+    return false;
+  }
+  double scale = unit == "us" || unit.empty() ? 1
+                 : unit == "ms"               ? 1e3
+                 : unit == "s"                ? 1e6
+                 : unit == "m"                ? 60e6
+                                              : -1;
+  if (scale < 0) {
+    return false;
+  }
+  micros = (uint64_t)(value * scale);
+  return true;
+}
+
+uint64_t durationArg(const Step &step, size_t i) {
+  uint64_t micros = 0;
+  if (i >= step.args.size() || !parseDuration(step.args[i], micros)) {
+    printf("%s:%d: not a duration: %s\n", scenarioName.c_str(), step.line,
+           step.text.c_str());
+    exit(1);
+  }
+  return micros;
+}
+
+// Rssi.
+
+std::mt19937 noiseRng;
+std::normal_distribution<double> noise(0, 1);
+// Flyovers before this one are over, see rssiAt().
+uint32_t firstFlyover = 0;
+
+// How much of a signal on vtx gets through when tuned to frequency.
+double channelGain(uint16_t frequency, uint16_t vtx) {
+  double df = ((double)frequency - vtx) / 9.0;
+  return exp(-df * df / 2);
+}
+
+uint16_t rssiAt(uint64_t now, uint16_t frequency) {
+  uint64_t wall = shared->bootWall + now;
+  double rssi = shared->noiseFloor;
+
+  for (uint32_t i = 0; i < shared->carrierCount; i++) {
+    const Carrier &carrier = shared->carriers[i];
+    rssi += (carrier.rssi - (double)shared->noiseFloor) *
+            channelGain(frequency, carrier.frequency);
+  }
+
+  // Sorted by center, see addFlyover().
+  while (firstFlyover < shared->flyoverCount &&
+         shared->flyovers[firstFlyover].center +
+                 4 * shared->flyovers[firstFlyover].width <
+             wall) {
+    firstFlyover++;
+  }
+  for (uint32_t i = firstFlyover; i < shared->flyoverCount; i++) {
+    const Flyover &flyover = shared->flyovers[i];
+    if (flyover.center > wall + 4 * flyover.width) {
+      break;
+    }
+    double dt = ((double)wall - flyover.center) / flyover.width;
+    rssi += (flyover.peak - (double)shared->noiseFloor) * exp(-dt * dt / 2) *
+            channelGain(frequency, flyover.frequency);
+  }
+
+  rssi += noise(noiseRng) * shared->noiseSigma;
+  return rssi < 0 ? 0 : rssi > 4095 ? 4095 : (uint16_t)rssi;
+}
+
+bool addFlyover(const Flyover &flyover) {
+  if (shared->flyoverCount == MAX_FLYOVERS) {
+    return false;
+  }
+  uint32_t i = shared->flyoverCount++;
+  while (i > 0 && shared->flyovers[i - 1].center > flyover.center) {
+    shared->flyovers[i] = shared->flyovers[i - 1];
+    i--;
+  }
+  shared->flyovers[i] = flyover;
+  if (i < firstFlyover) {
+    firstFlyover = i;
+  }
+  return true;
+}
+
+// /events and /ws clients.
+
+struct Connection {
+  AsyncEventSourceClient *client = NULL;
+  AsyncWebSocketClient *wsClient = NULL;
+  std::string pending;
+  // The event being received.
+  std::string id;
+  std::string type;
+  std::string data;
+  bool hasData = false;
+};
+
+Connection connections[MAX_CLIENTS];
+
+ClientLog *findClient(const std::string &name, bool create) {
+  for (uint32_t i = 0; i < shared->clientCount; i++) {
+    if (name == shared->clients[i].name) {
+      return &shared->clients[i];
+    }
+  }
+  if (!create || shared->clientCount == MAX_CLIENTS ||
+      name.size() >= sizeof(shared->clients[0].name)) {
+    return NULL;
+  }
+  ClientLog *log = &shared->clients[shared->clientCount++];
+  strcpy(log->name, name.c_str());
+  log->retryMillis = DEFAULT_RETRY_MILLIS;
+  return log;
+}
+
+void countEvent(ClientLog &log, const std::string &type, const char *data) {
+  uint32_t t = 0;
+  while (t < log.typeCount && type != log.types[t].type) {
+    t++;
+  }
+  if (t == log.typeCount && t < MAX_EVENT_TYPES &&
+      type.size() < sizeof(log.types[t].type)) {
+    strcpy(log.types[log.typeCount++].type, type.c_str());
+  }
+  if (t < log.typeCount) {
+    EventCount &count = log.types[t];
+    count.count++;
+    snprintf(count.last, sizeof(count.last), "%s", data);
+  }
+}
+
+// A pass as the client got it, ts and detected ts on the timer's clock.
+void receivePass(ClientLog &log, uint32_t id, uint64_t ts, uint64_t detected,
+                 const char *data) {
+  for (uint32_t i = 0; i < log.passCount; i++) {
+    if (log.passes[i].id == id && strcmp(data, log.passes[i].data) == 0) {
+      log.duplicates++;
+      return;
+    }
+  }
+
+  // Replayed passes are old news, they tell nothing about the latency.
+  uint64_t now = wallNow();
+  uint64_t detectedWall = shared->bootWall + detected;
+  if (detectedWall >= log.connectedAt && detectedWall <= now) {
+    uint64_t latency = now - detectedWall;
+    log.latencyCount++;
+    log.latencyTotal += latency;
+    log.latencyWorst = std::max(log.latencyWorst, latency);
+  }
+
+  if (log.passCount == MAX_PASSES) {
+    return;
+  }
+  PassSeen &pass = log.passes[log.passCount++];
+  pass.id = id;
+  pass.timeStamp = shared->bootWall + ts;
+  snprintf(pass.data, sizeof(pass.data), "%s", data);
+}
+
+void receiveEvent(ClientLog &log, Connection &connection) {
+  if (!connection.id.empty()) {
+    log.lastId = strtoul(connection.id.c_str(), NULL, 10);
+  }
+  std::string type = connection.type.empty() ? "message" : connection.type;
+  if (options.verbose) {
+    printf("[%10.6f] %s <- %s %s\n", wallNow() / 1e6, log.name, type.c_str(),
+           connection.data.c_str());
+  }
+
+  countEvent(log, type, connection.data.c_str());
+  if (type != "newtime") {
+    return;
+  }
+  // "<lap> <interval ms> <peak> <ts ms> <detected ts us> <ts us> [channel]"
+  unsigned long long detected = 0;
+  unsigned long long ts = 0;
+  sscanf(connection.data.c_str(), "%*u %*u %*u %*u %llu %llu", &detected, &ts);
+  receivePass(log, log.lastId, ts, detected, connection.data.c_str());
+}
+
+const char *wsFrameName(uint8_t type) {
+  switch (type) {
+    case WS_PASS:
+      return "pass";
+    case WS_RSSI:
+      return "rssi";
+    case WS_SETTINGS:
+      return "settings";
+    case WS_CALIBRATION:
+      return "calibration";
+  }
+  return "unknown";
+}
+
+void receiveFrame(uint32_t index, const uint8_t *data, size_t len) {
+  ClientLog &log = shared->clients[index];
+  if (len < 2 || data[0] != WS_PROTOCOL_VERSION) {
+    countEvent(log, "invalid", "");
+    return;
+  }
+
+  WsPass frame;
+  bool isPass = data[1] == WS_PASS && decodeWsPass(data, len, frame);
+  char text[128] = "";
+  if (isPass) {
+    // As in a newtime event, the channel last.
+    snprintf(text, sizeof(text), "%u %llu %u %llu %llu %llu %u",
+             (unsigned)frame.lap,
+             (unsigned long long)frame.interval / 1000,
+             (unsigned)frame.rssiPeak,
+             (unsigned long long)frame.timeStamp / 1000,
+             (unsigned long long)frame.detectedTimeStamp,
+             (unsigned long long)frame.timeStamp, (unsigned)frame.channel);
+  }
+  if (options.verbose) {
+    printf("[%10.6f] %s <- ws %s %s\n", wallNow() / 1e6, log.name,
+           wsFrameName(data[1]), text);
+  }
+  countEvent(log, wsFrameName(data[1]), text);
+  if (isPass) {
+    // Frames have no ids, and are never sent twice.
+    receivePass(log, 0, frame.timeStamp, frame.detectedTimeStamp, text);
+  }
+}
+
+// Parses the event stream as EventSource does.
+void receive(uint32_t index, const char *data, size_t len) {
+  ClientLog &log = shared->clients[index];
+  Connection &connection = connections[index];
+  connection.pending.append(data, len);
+
+  size_t end;
+  while ((end = connection.pending.find('\n')) != std::string::npos) {
+    std::string line = connection.pending.substr(0, end);
+    connection.pending.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+
+    if (line.empty()) {
+      if (connection.hasData) {
+        receiveEvent(log, connection);
+      }
+      connection.type.clear();
+      connection.data.clear();
+      connection.id.clear();
+      connection.hasData = false;
+      continue;
+    }
+
+    size_t colon = line.find(':');
+    std::string field = line.substr(0, colon);
+    std::string value =
+        colon == std::string::npos ? "" : line.substr(colon + 1);
+    if (!value.empty() && value[0] == ' ') {
+      value.erase(0, 1);
+    }
+    if (field == "data") {
+      connection.data += connection.hasData ? "\n" + value : value;
+      connection.hasData = true;
+    } else if (field == "event") {
+      connection.type = value;
+    } else if (field == "id") {
+      connection.id = value;
+    } else if (field == "retry") {
+      log.retryMillis = atoi(value.c_str());
+    }
+  }
+}
+
+void connectClient(ClientLog &log, uint32_t lastId) {
+  uint32_t index = &log - shared->clients;
+  Connection &connection = connections[index];
+  connection = Connection();
+  log.open = true;
+  log.reconnectAt = 0;
+  log.connects++;
+  log.connectedAt = wallNow();
+  bool connected;
+  if (log.ws) {
+    connection.wsClient = emu::connectWebSocket(
+        "/ws", [index](const uint8_t *data, size_t len) {
+          receiveFrame(index, data, len);
+        });
+    connected = connection.wsClient != NULL;
+  } else {
+    connection.client = emu::connectEvents(
+        "/events", lastId, [index](const char *data, size_t len) {
+          receive(index, data, len);
+        });
+    connected = connection.client != NULL;
+  }
+  if (!connected) {
+    log.reconnectAt = wallNow() + log.retryMillis * 1000ULL;
+  }
+}
+
+void disconnectClient(ClientLog &log) {
+  Connection &connection = connections[&log - shared->clients];
+  if (connection.client) {
+    emu::disconnectEvents("/events", connection.client);
+    connection.client = NULL;
+  }
+  if (connection.wsClient) {
+    emu::disconnectWebSocket("/ws", connection.wsClient);
+    connection.wsClient = NULL;
+  }
+}
+
+// Clients waiting to reconnect, see reconnectDue().
+uint64_t nextReconnect = UINT64_MAX;
+
+void scheduleReconnects() {
+  nextReconnect = UINT64_MAX;
+  for (uint32_t i = 0; i < shared->clientCount; i++) {
+    uint64_t at = shared->clients[i].reconnectAt;
+    if (shared->clients[i].open && at && at < nextReconnect) {
+      nextReconnect = at;
+    }
+  }
+}
+
+void reconnectDue() {
+  uint64_t now = wallNow();
+  for (uint32_t i = 0; i < shared->clientCount; i++) {
+    ClientLog &log = shared->clients[i];
+    if (log.open && log.reconnectAt && log.reconnectAt <= now) {
+      connectClient(log, log.lastId);
+    }
+  }
+  scheduleReconnects();
+}
+
+// Serving.
+
+struct HttpConnection {
+  int fd;
+  std::string in;
+  AsyncEventSourceClient *events = NULL;
+  bool closed = false;
+};
+
+std::vector<HttpConnection *> httpConnections;
+
+void sendAll(HttpConnection *connection, const char *data, size_t len) {
+  while (len > 0 && !connection->closed) {
+    ssize_t n = send(connection->fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      connection->closed = true;
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+std::string header(const std::string &request, const char *name) {
+  std::string lower = request;
+  std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  std::string key = std::string("\r\n") + name + ":";
+  std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+  size_t at = lower.find(key);
+  if (at == std::string::npos) {
+    return "";
+  }
+  size_t start = request.find_first_not_of(' ', at + key.size());
+  return request.substr(start, request.find("\r\n", start) - start);
+}
+
+std::string queryParam(const std::string &query, const std::string &name) {
+  std::istringstream in(query);
+  std::string pair;
+  while (std::getline(in, pair, '&')) {
+    if (pair.compare(0, name.size() + 1, name + "=") == 0) {
+      return pair.substr(name.size() + 1);
+    }
+  }
+  return "";
+}
+
+[[noreturn]] void restart();
+
+// Requests to the emulator itself, to drive it from outside.
+emu::Response emulatorRequest(const std::string &path,
+                              const std::string &query) {
+  emu::Response response;
+  response.status = 200;
+  response.contentType = "text/plain";
+  if (path == "/emu/flyover") {
+    Flyover flyover;
+    std::string frequency = queryParam(query, "frequency");
+    std::string peak = queryParam(query, "peak");
+    flyover.frequency = frequency.empty() ? 5732 : atoi(frequency.c_str());
+    flyover.peak = peak.empty() ? 320 : atoi(peak.c_str());
+    flyover.width = 150000;
+    flyover.center = wallNow() + 1000000;
+    addFlyover(flyover);
+    response.body = "Flyover in 1s";
+  } else if (path == "/emu/router") {
+    shared->routerUp = queryParam(query, "up") != "0";
+    emu::setRouter(shared->routerUp);
+    response.body = shared->routerUp ? "Router up" : "Router down";
+  } else if (path == "/emu/reboot") {
+    restart();
+  } else {
+    response.status = 404;
+    response.body = "Not found";
+  }
+  return response;
+}
+
+void handleHttp(HttpConnection *connection, size_t headerEnd) {
+  std::string request = connection->in.substr(0, headerEnd);
+  connection->in.clear();
+
+  std::istringstream line(request);
+  std::string method, target;
+  line >> method >> target;
+  size_t q = target.find('?');
+  std::string path = target.substr(0, q);
+  std::string query = q == std::string::npos ? "" : target.substr(q + 1);
+
+  if (method == "GET" && path == "/events") {
+    uint32_t lastId = strtoul(header(request, "Last-Event-ID").c_str(), NULL, 10);
+    std::string head =
+        "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\nConnection: keep-alive\r\n";
+    for (auto &h : DefaultHeaders::Instance().headers()) {
+      head += h.first + ": " + h.second + "\r\n";
+    }
+    head += "\r\n";
+    sendAll(connection, head.data(), head.size());
+    connection->events = emu::connectEvents(
+        "/events", lastId, [connection](const char *data, size_t len) {
+          sendAll(connection, data, len);
+        });
+    if (!connection->events) {
+      connection->closed = true;
+    }
+    return;
+  }
+
+  WebRequestMethod webMethod = method == "GET"    ? HTTP_GET
+                               : method == "POST" ? HTTP_POST
+                               : method == "PUT"  ? HTTP_PUT
+                               : method == "DELETE" ? HTTP_DELETE
+                                                    : HTTP_OPTIONS;
+  emu::Response response = path.compare(0, 5, "/emu/") == 0
+                               ? emulatorRequest(path, query)
+                               : emu::request(webMethod, path, query);
+  if (options.verbose) {
+    printf("[%10.6f] %s %s -> %d\n", wallNow() / 1e6, method.c_str(),
+           target.c_str(), response.status);
+  }
+
+  std::string head = "HTTP/1.1 " + std::to_string(response.status) +
+                     (response.status == 200 ? " OK" : " Error") +
+                     "\r\nContent-Type: " + response.contentType +
+                     "\r\nContent-Length: " +
+                     std::to_string(response.body.size()) +
+                     "\r\nConnection: close\r\n";
+  for (auto &h : response.headers) {
+    head += h.first + ": " + h.second + "\r\n";
+  }
+  head += "\r\n";
+  sendAll(connection, head.data(), head.size());
+  sendAll(connection, response.body.data(), response.body.size());
+  connection->closed = true;
+}
+
+// Accepts, reads and answers what has come in, waiting up to timeoutMillis
+// for something to.
+void serve(int timeoutMillis) {
+  std::vector<pollfd> fds;
+  fds.push_back({listenFd, POLLIN, 0});
+  for (HttpConnection *connection : httpConnections) {
+    fds.push_back({connection->fd, POLLIN, 0});
+  }
+  if (poll(fds.data(), fds.size(), timeoutMillis) > 0) {
+    for (size_t i = 1; i < fds.size(); i++) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      HttpConnection *connection = httpConnections[i - 1];
+      char buffer[2048];
+      ssize_t n = recv(connection->fd, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        connection->closed = true;
+        continue;
+      }
+      if (connection->events) {
+        continue;
+      }
+      connection->in.append(buffer, n);
+      // The body isn't read, parameters only come from the query.
+      size_t headerEnd = connection->in.find("\r\n\r\n");
+      if (headerEnd != std::string::npos) {
+        handleHttp(connection, headerEnd + 2);
+      } else if (connection->in.size() > 8192) {
+        connection->closed = true;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listenFd, NULL, NULL);
+      if (fd >= 0) {
+        HttpConnection *connection = new HttpConnection();
+        connection->fd = fd;
+        httpConnections.push_back(connection);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < httpConnections.size();) {
+    HttpConnection *connection = httpConnections[i];
+    if (!connection->closed) {
+      i++;
+      continue;
+    }
+    if (connection->events) {
+      emu::disconnectEvents("/events", connection->events);
+    }
+    close(connection->fd);
+    delete connection;
+    httpConnections.erase(httpConnections.begin() + i);
+  }
+}
+
+// Running the timer.
+
+// Host time and scenario time this boot started serving at, see runUntil().
+uint64_t serveHostStart = 0;
+uint64_t serveWallStart = 0;
+
+void runLoop() {
+  if (wallNow() >= nextReconnect) {
+    reconnectDue();
+  }
+  loop();
+  shared->loops++;
+}
+
+void runUntil(uint64_t until) {
+  uint64_t start = hostNanos();
+  if (options.servePort) {
+    while (wallNow() < until) {
+      uint64_t paced = serveWallStart + (uint64_t)((hostNanos() - serveHostStart) /
+                                                   1000 * options.speed);
+      if (wallNow() < paced) {
+        runLoop();
+        if (shared->loops % 16 == 0) {
+          serve(0);
+        }
+      } else {
+        serve(1);
+      }
+      shared->wall = wallNow();
+    }
+    return;
+  }
+
+  while (wallNow() < until) {
+    runLoop();
+  }
+  shared->wall = wallNow();
+  shared->loopNanos += hostNanos() - start;
+}
+
+[[noreturn]] void restart() {
+  shared->wall = wallNow();
+  fflush(stdout);
+  _exit(EXIT_RESTART);
+}
+
+// Steps.
+
+void request(const Step &step, WebRequestMethod method) {
+  if (step.args.size() < 2) {
+    expectFailed(step, "needs a url");
+    return;
+  }
+  emu::Response response = emu::request(
+      method, step.args[1], step.args.size() > 2 ? step.args[2] : "");
+  shared->lastStatus = response.status;
+  snprintf(shared->lastBody, sizeof(shared->lastBody), "%s",
+           response.body.c_str());
+  if (options.verbose) {
+    printf("[%10.6f] %s -> %d %s\n", wallNow() / 1e6, step.text.c_str(),
+           response.status, response.body.c_str());
+  }
+}
+
+ClientLog *clientArg(const Step &step, bool create) {
+  ClientLog *log =
+      step.args.size() > 1 ? findClient(step.args[1], create) : NULL;
+  if (!log) {
+    expectFailed(step, "no such client");
+  }
+  return log;
+}
+
+const EventCount *eventCount(const ClientLog &log, const std::string &type) {
+  for (uint32_t i = 0; i < log.typeCount; i++) {
+    if (type == log.types[i].type) {
+      return &log.types[i];
+    }
+  }
+  return NULL;
+}
+
+void expectPassesWithin(const Step &step, const ClientLog &log,
+                        uint64_t tolerance) {
+  uint64_t worst = 0;
+  for (uint32_t i = 0; i < log.passCount; i++) {
+    const PassSeen &pass = log.passes[i];
+    uint64_t nearest = UINT64_MAX;
+    for (uint32_t f = 0; f < shared->flyoverCount; f++) {
+      uint64_t center = shared->flyovers[f].center;
+      uint64_t error =
+          center > pass.timeStamp ? center - pass.timeStamp : pass.timeStamp - center;
+      nearest = std::min(nearest, error);
+    }
+    if (nearest > tolerance) {
+      expectFailed(step, "pass %u \"%s\" is %.1fms from the nearest flyover",
+                   (unsigned)pass.id, pass.data, nearest / 1e3);
+    }
+    worst = std::max(worst, nearest);
+  }
+  if (options.verbose) {
+    printf("[%10.6f] %u passes, worst %.2fms off\n", wallNow() / 1e6,
+           (unsigned)log.passCount, worst / 1e3);
+  }
+}
+
+void expect(const Step &step) {
+  const std::vector<std::string> &args = step.args;
+  std::string what = args.size() > 1 ? args[1] : "";
+
+  if (what == "status" && args.size() == 3) {
+    if (shared->lastStatus != atoi(args[2].c_str())) {
+      expectFailed(step, "got %d, %s", shared->lastStatus, shared->lastBody);
+    }
+  } else if (what == "body") {
+    if (!strstr(shared->lastBody, rest(step, 2).c_str())) {
+      expectFailed(step, "got %s", shared->lastBody);
+    }
+  } else if (what == "latency" && args.size() == 5 && args[3] == "within") {
+    ClientLog *log = findClient(args[2], false);
+    if (!log) {
+      expectFailed(step, "no such client");
+      return;
+    }
+    uint64_t tolerance = durationArg(step, 4);
+    if (log->latencyCount == 0) {
+      expectFailed(step, "no passes detected while connected");
+    } else if (log->latencyWorst > tolerance) {
+      expectFailed(step, "worst %.2fms", log->latencyWorst / 1e3);
+    }
+  } else if ((what == "events" || what == "event" || what == "passes") &&
+             args.size() >= 4) {
+    ClientLog *log = findClient(args[2], false);
+    if (!log) {
+      expectFailed(step, "no such client");
+      return;
+    }
+    if (what == "events") {
+      const EventCount *count = eventCount(*log, args[3]);
+      bool atLeast = args.size() == 6 && args[4] == ">=";
+      uint32_t expected = atoi(args.back().c_str());
+      uint32_t got = count ? count->count : 0;
+      if (atLeast ? got < expected : got != expected) {
+        expectFailed(step, "got %u", (unsigned)got);
+      }
+    } else if (what == "event") {
+      const EventCount *count = eventCount(*log, args[3]);
+      if (!count || !strstr(count->last, rest(step, 4).c_str())) {
+        expectFailed(step, "got %s", count ? count->last : "none");
+      }
+    } else if (args[3] == "within" && args.size() == 5) {
+      expectPassesWithin(step, *log, durationArg(step, 4));
+    } else {
+      if (log->passCount != (uint32_t)atoi(args[3].c_str()) ||
+          log->duplicates) {
+        expectFailed(step, "got %u, %u duplicates", (unsigned)log->passCount,
+                     (unsigned)log->duplicates);
+      }
+    }
+  } else if (what == "serial") {
+    std::string text = rest(step, 2);
+    uint64_t first = std::max(shared->serialChecked,
+                              shared->serialLines > SERIAL_LINES
+                                  ? shared->serialLines - SERIAL_LINES
+                                  : 0);
+    bool found = false;
+    for (uint64_t i = first; i < shared->serialLines && !found; i++) {
+      found = strstr(shared->serial[i % SERIAL_LINES], text.c_str()) != NULL;
+    }
+    shared->serialChecked = shared->serialLines;
+    if (!found) {
+      expectFailed(step, "not printed");
+    }
+  } else if (what == "frequency" && args.size() == 3) {
+    // The RX5808 tunes in 2MHz steps.
+    int expected = atoi(args[2].c_str());
+    if (abs((int)emu::tunedFrequency() - expected) > 1) {
+      expectFailed(step, "tuned to %u", (unsigned)emu::tunedFrequency());
+    }
+  } else if (what == "boots" && args.size() == 3) {
+    if (shared->boots != (uint32_t)atoi(args[2].c_str())) {
+      expectFailed(step, "got %u", (unsigned)shared->boots);
+    }
+  } else {
+    expectFailed(step, "unknown expectation");
+  }
+}
+
+void flyover(const Step &step) {
+  const std::vector<std::string> &args = step.args;
+  Flyover flyover;
+  flyover.frequency = args.size() > 1 ? atoi(args[1].c_str()) : 0;
+  flyover.peak = 320;
+  flyover.width = 150000;
+  uint64_t in = 1000000;
+  uint64_t every = 0;
+  uint32_t count = 1;
+  for (size_t i = 2; i + 1 < args.size(); i += 2) {
+    if (args[i] == "peak") {
+      flyover.peak = atoi(args[i + 1].c_str());
+    } else if (args[i] == "in") {
+      in = durationArg(step, i + 1);
+    } else if (args[i] == "width") {
+      flyover.width = std::max<uint64_t>(durationArg(step, i + 1), 1);
+    } else if (args[i] == "every") {
+      every = durationArg(step, i + 1);
+    } else if (args[i] == "count") {
+      count = atoi(args[i + 1].c_str());
+    } else {
+      expectFailed(step, "unknown option %s", args[i].c_str());
+      return;
+    }
+  }
+  if (flyover.frequency == 0 || (args.size() % 2) != 0) {
+    expectFailed(step, "flyover MHZ [name value]...");
+    return;
+  }
+
+  uint64_t now = wallNow();
+  for (uint32_t i = 0; i < count; i++) {
+    flyover.center = now + in + i * every;
+    if (!addFlyover(flyover)) {
+      expectFailed(step, "more than %d flyovers", MAX_FLYOVERS);
+      return;
+    }
+  }
+}
+
+void carrier(const Step &step) {
+  if (step.args.size() != 3) {
+    expectFailed(step, "carrier MHZ RSSI|off");
+    return;
+  }
+  uint16_t frequency = atoi(step.args[1].c_str());
+  uint32_t i = 0;
+  while (i < shared->carrierCount &&
+         shared->carriers[i].frequency != frequency) {
+    i++;
+  }
+  if (step.args[2] == "off") {
+    if (i < shared->carrierCount) {
+      shared->carriers[i] = shared->carriers[--shared->carrierCount];
+    }
+    return;
+  }
+  if (i == shared->carrierCount) {
+    if (i == MAX_CARRIERS) {
+      expectFailed(step, "more than %d carriers", MAX_CARRIERS);
+      return;
+    }
+    shared->carrierCount++;
+  }
+  shared->carriers[i].frequency = frequency;
+  shared->carriers[i].rssi = atoi(step.args[2].c_str());
+}
+
+void runStep(const Step &step) {
+  const std::string &command = step.args[0];
+  if (command == "wait") {
+    if (!shared->waitUntil) {
+      shared->waitUntil = wallNow() + durationArg(step, 1);
+    }
+    runUntil(shared->waitUntil);
+    shared->waitUntil = 0;
+  } else if (command == "get") {
+    request(step, HTTP_GET);
+  } else if (command == "post") {
+    request(step, HTTP_POST);
+  } else if (command == "connect") {
+    ClientLog *log = clientArg(step, true);
+    if (log) {
+      disconnectClient(*log);
+      log->ws = step.args.size() > 2 && step.args[2] == "ws";
+      connectClient(*log, 0);
+    }
+  } else if (command == "disconnect" || command == "drop") {
+    ClientLog *log = clientArg(step, false);
+    if (log) {
+      disconnectClient(*log);
+      log->open = command == "drop";
+      // Out of reach for a while, it keeps trying.
+      uint64_t gone = step.args.size() > 2 ? durationArg(step, 2) : 0;
+      log->reconnectAt =
+          wallNow() + std::max<uint64_t>(gone, log->retryMillis * 1000ULL);
+      scheduleReconnects();
+    }
+  } else if (command == "router" && step.args.size() == 2) {
+    shared->routerUp = step.args[1] == "up";
+    emu::setRouter(shared->routerUp);
+  } else if (command == "reboot") {
+    shared->step++;
+    restart();
+  } else if (command == "noise" && step.args.size() >= 2) {
+    shared->noiseFloor = atoi(step.args[1].c_str());
+    if (step.args.size() > 2) {
+      shared->noiseSigma = atoi(step.args[2].c_str());
+    }
+  } else if (command == "carrier") {
+    carrier(step);
+  } else if (command == "flyover") {
+    flyover(step);
+  } else if (command == "expect") {
+    expect(step);
+  } else {
+    expectFailed(step, "unknown command");
+  }
+}
+
+// One boot, in the forked process. Returns when the scenario is done.
+void boot() {
+  emu::setFlash(&shared->flash);
+  emu::setRouter(shared->routerUp);
+  emu::setRestartHandler(restart);
+  emu::setRssiSource(rssiAt);
+  emu::setSerialHandler([](const char *line) {
+    snprintf(shared->serial[shared->serialLines % SERIAL_LINES],
+             sizeof(shared->serial[0]), "%s", line);
+    shared->serialLines++;
+    if (options.verbose || options.servePort) {
+      printf("[%10.6f] %s\n", wallNow() / 1e6, line);
+    }
+  });
+
+  shared->boots++;
+  shared->bootWall =
+      shared->boots == 1 ? 0 : shared->wall + EMU_BOOT_MILLIS * 1000ULL;
+  noiseRng.seed(options.seed * 1000 + shared->boots);
+  randomSeed(options.seed);
+
+  setup();
+
+  // The clients that were connected try again, as EventSource does.
+  for (uint32_t i = 0; i < shared->clientCount; i++) {
+    ClientLog &log = shared->clients[i];
+    if (log.open && !log.reconnectAt) {
+      log.reconnectAt = std::max<uint64_t>(wallNow(),
+                                           shared->wall + log.retryMillis * 1000ULL);
+    }
+  }
+  scheduleReconnects();
+
+  serveHostStart = hostNanos();
+  serveWallStart = wallNow();
+
+  while (shared->step < steps.size()) {
+    runStep(steps[shared->step]);
+    shared->step++;
+  }
+  // Serving goes on until stopped.
+  if (options.servePort) {
+    runUntil(UINT64_MAX);
+  }
+}
+
+bool loadScenario(const char *path) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  steps.clear();
+  std::string text;
+  for (int line = 1; std::getline(in, text); line++) {
+    size_t comment = text.find('#');
+    if (comment != std::string::npos) {
+      text.erase(comment);
+    }
+    Step step;
+    step.line = line;
+    size_t start = text.find_first_not_of(" \t");
+    size_t end = text.find_last_not_of(" \t\r");
+    if (start != std::string::npos) {
+      step.text = text.substr(start, end - start + 1);
+    }
+    std::istringstream words(text);
+    std::string word;
+    while (words >> word) {
+      step.args.push_back(word);
+    }
+    if (step.args.empty()) {
+      continue;
+    }
+    steps.push_back(step);
+  }
+  return true;
+}
+
+// Runs a scenario boot after boot until it is done, returns false if it
+// failed.
+bool runScenario() {
+  memset(shared, 0, sizeof(Shared));
+  shared->routerUp = true;
+  shared->noiseFloor = 100;
+  shared->noiseSigma = 3;
+
+  uint64_t start = hostNanos();
+  for (;;) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      fail("fork failed");
+    }
+    if (pid == 0) {
+      boot();
+      fflush(stdout);
+      _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_RESTART) {
+      continue;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      const char *step = shared->step < steps.size()
+                             ? steps[shared->step].text.c_str()
+                             : "";
+      printf("%s:%d: %s: FAILED: the firmware crashed, %s %d\n",
+             scenarioName.c_str(),
+             shared->step < steps.size() ? steps[shared->step].line : 0, step,
+             WIFSIGNALED(status) ? "signal" : "exit",
+             WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+      shared->failures++;
+    }
+    break;
+  }
+  double hostSeconds = (hostNanos() - start) / 1e9;
+
+  double virtualSeconds = shared->wall / 1e6;
+  printf("%-32s %s, %u boots, %.1f s in %.2f s, %.0fx real time, %llu loops, "
+         "%.2f us per loop\n",
+         scenarioName.c_str(), shared->failures ? "FAILED" : "ok",
+         (unsigned)shared->boots, virtualSeconds, hostSeconds,
+         hostSeconds > 0 ? virtualSeconds / hostSeconds : 0,
+         (unsigned long long)shared->loops,
+         shared->loops ? shared->loopNanos / 1e3 / shared->loops : 0.0);
+  for (uint32_t i = 0; i < shared->clientCount; i++) {
+    const ClientLog &log = shared->clients[i];
+    if (log.latencyCount) {
+      printf("  %-12s %-7s %4u passes, detection to client %.2f ms mean, "
+             "%.2f ms worst\n",
+             log.name, log.ws ? "/ws" : "/events", (unsigned)log.latencyCount,
+             log.latencyTotal / 1e3 / log.latencyCount,
+             log.latencyWorst / 1e3);
+    }
+  }
+  return shared->failures == 0;
+}
+
+int main(int argc, char **argv) {
+  std::vector<const char *> scenarios;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--seed" && hasValue) {
+      options.seed = atoi(argv[++i]);
+    } else if (arg == "--verbose") {
+      options.verbose = true;
+    } else if (arg == "--serve" && hasValue) {
+      options.servePort = atoi(argv[++i]);
+    } else if (arg == "--speed" && hasValue) {
+      options.speed = atof(argv[++i]);
+    } else if (arg[0] != '-') {
+      scenarios.push_back(argv[i]);
+    } else {
+      fail("usage: emulator [options] SCENARIO..., see emulator.cpp");
+    }
+  }
+  if (options.servePort ? scenarios.size() > 1 : scenarios.empty()) {
+    fail("usage: emulator [options] SCENARIO..., see emulator.cpp");
+  }
+  if (options.speed <= 0) {
+    fail("--speed has to be above 0");
+  }
+
+  shared = (Shared *)mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    fail("no shared memory");
+  }
+
+  if (options.servePort) {
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(options.servePort);
+    if (bind(listenFd, (sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listenFd, 16) != 0) {
+      fail("can't listen on the port");
+    }
+    scenarioName = scenarios.empty() ? "serve" : scenarios[0];
+    if (!scenarios.empty() && !loadScenario(scenarios[0])) {
+      fail("can't read the scenario");
+    }
+    printf("serving on port %d\n", options.servePort);
+    return runScenario() ? 0 : 1;
+  }
+
+  int failed = 0;
+  for (const char *scenario : scenarios) {
+    scenarioName = scenario;
+    if (!loadScenario(scenario)) {
+      printf("%s: can't read it\n", scenario);
+      failed++;
+      continue;
+    }
+    if (!runScenario()) {
+      failed++;
+    }
+  }
+
+  if (failed) {
+    printf("\n%d of %u scenarios FAILED\n", failed, (unsigned)scenarios.size());
+    return 1;
+  }
+  printf("\nall %u scenarios ok\n", (unsigned)scenarios.size());
+  return 0;
+}
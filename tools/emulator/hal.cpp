@@ -0,0 +1,735 @@
+// The stand-ins in hal/, see emulator.h for the emulator's side of them.
+
+#include <map>
+#include <random>
+
+#include "Arduino.h"
+#include "AsyncElegantOTA.h"
+#include "EEPROM.h"
+#include "ESPAsyncWebServer.h"
+#include "LittleFS.h"
+#include "Preferences.h"
+#include "SPI.h"
+#include "WiFi.h"
+#include "emulator.h"
+#include "esp_timer.h"
+
+// How long the RX5808 keeps giving the rssi of the frequency before after
+// a retune, the firmware has to wait it out.
+#ifndef EMU_RX5808_PLL_MICROS
+#define EMU_RX5808_PLL_MICROS 3000
+#endif
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+SPIClass SPI;
+EEPROMClass EEPROM;
+LittleFSFS LittleFS;
+AsyncElegantOtaClass AsyncElegantOTA;
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void *arg;
+  uint64_t period;
+  uint64_t deadline;
+  bool armed;
+};
+
+namespace {
+
+uint64_t clockMicros = 0;
+std::vector<esp_timer *> timers;
+// Set while a callback runs, the clock just moves then.
+bool firing = false;
+
+std::mt19937 rng(1);
+
+emu::RssiSource rssiSource;
+std::function<void()> restartHandler;
+std::function<void(const char *)> serialHandler;
+
+emu::Flash defaultFlash;
+emu::Flash *flash = &defaultFlash;
+
+std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+
+// The RX5808's SPI as it sees the pins: bits shift in on the rising clock
+// while select is low, the frame is taken when select goes high.
+struct {
+  uint8_t select = HIGH;
+  uint8_t clock = LOW;
+  uint8_t data = LOW;
+  uint32_t frame = 0;
+  uint8_t bits = 0;
+  uint32_t frames = 0;
+
+  uint16_t frequency = 0;
+  uint16_t previousFrequency = 0;
+  uint64_t tunedAt = 0;
+} rx5808;
+
+void rx5808Frame(uint32_t frame, uint8_t bits) {
+  rx5808.frames++;
+  // 4 address bits, the write bit, 20 data bits.
+  if (bits != 25 || (frame & 0xF) != 0x1 || !(frame & 0x10)) {
+    return;
+  }
+  uint32_t value = (frame >> 5) & 0xFFFFF;
+  uint32_t n = value >> 7;
+  uint32_t a = value & 0x7F;
+  rx5808.previousFrequency = rx5808.frequency;
+  rx5808.frequency = 2 * (n * 32 + a) + 479;
+  rx5808.tunedAt = clockMicros;
+}
+
+struct {
+  bool routerUp = true;
+  bool joining = false;
+  bool joined = false;
+  uint64_t joinAt = 0;
+} station;
+
+AsyncWebServer *webServer = NULL;
+
+std::string urlDecode(const std::string &s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '+') {
+      out += ' ';
+    } else if (s[i] == '%' && i + 2 < s.size()) {
+      out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+std::vector<AsyncWebParameter> parseQuery(const std::string &query) {
+  std::vector<AsyncWebParameter> params;
+  size_t start = 0;
+  while (start < query.size()) {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    std::string pair = query.substr(start, end - start);
+    size_t eq = pair.find('=');
+    if (!pair.empty()) {
+      params.push_back(AsyncWebParameter(
+          urlDecode(pair.substr(0, eq)).c_str(),
+          eq == std::string::npos ? "" : urlDecode(pair.substr(eq + 1)).c_str()));
+    }
+    start = end + 1;
+  }
+  return params;
+}
+
+// As AsyncEventSource puts an event on the wire.
+std::string eventMessage(const char *message, const char *event, uint32_t id,
+                         uint32_t reconnect) {
+  std::string out;
+  if (reconnect) {
+    out += "retry: " + std::to_string(reconnect) + "\r\n";
+  }
+  if (id) {
+    out += "id: " + std::to_string(id) + "\r\n";
+  }
+  if (event) {
+    out += std::string("event: ") + event + "\r\n";
+  }
+  if (message) {
+    const char *line = message;
+    for (;;) {
+      const char *end = strchr(line, '\n');
+      size_t len = end ? end - line : strlen(line);
+      out += "data: ";
+      out.append(line, len);
+      out += "\r\n";
+      if (!end) {
+        break;
+      }
+      line = end + 1;
+    }
+  }
+  out += "\r\n";
+  return out;
+}
+
+}  // namespace
+
+// Clock.
+
+uint64_t emu::now() { return clockMicros; }
+
+void emu::advance(uint64_t micros) {
+  uint64_t end = clockMicros + micros;
+  if (firing) {
+    clockMicros = end;
+    return;
+  }
+
+  firing = true;
+  for (;;) {
+    esp_timer *due = NULL;
+    for (esp_timer *timer : timers) {
+      if (timer->armed && timer->deadline <= end &&
+          (!due || timer->deadline < due->deadline)) {
+        due = timer;
+      }
+    }
+    if (!due) {
+      break;
+    }
+
+    if (due->deadline > clockMicros) {
+      clockMicros = due->deadline;
+    }
+    if (due->period) {
+      due->deadline += due->period;
+    } else {
+      due->armed = false;
+    }
+    due->callback(due->arg);
+  }
+  firing = false;
+
+  if (clockMicros < end) {
+    clockMicros = end;
+  }
+}
+
+// 32 bits, as on the chip.
+unsigned long millis() { return (uint32_t)(clockMicros / 1000); }
+unsigned long micros() { return (uint32_t)clockMicros; }
+void delay(uint32_t ms) { emu::advance((uint64_t)ms * 1000); }
+void delayMicroseconds(uint32_t us) { emu::advance(us); }
+void yield() {}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *out) {
+  esp_timer *timer = new esp_timer();
+  timer->callback = args->callback;
+  timer->arg = args->arg;
+  timers.push_back(timer);
+  *out = timer;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+  if (timer->armed || period == 0) {
+    return ESP_FAIL;
+  }
+  timer->period = period;
+  timer->deadline = clockMicros + period;
+  timer->armed = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout) {
+  if (timer->armed) {
+    return ESP_FAIL;
+  }
+  timer->period = 0;
+  timer->deadline = clockMicros + timeout;
+  timer->armed = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  if (!timer->armed) {
+    return ESP_FAIL;
+  }
+  timer->armed = false;
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time() { return clockMicros; }
+
+// GPIO and ADC, only the RX5808 is wired up.
+
+void pinMode(uint8_t /*pin*/, uint8_t /*mode*/) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  value = value ? HIGH : LOW;
+  if (pin == SS) {
+    if (value == LOW && rx5808.select == HIGH) {
+      rx5808.frame = 0;
+      rx5808.bits = 0;
+    } else if (value == HIGH && rx5808.select == LOW) {
+      rx5808Frame(rx5808.frame, rx5808.bits);
+    }
+    rx5808.select = value;
+  } else if (pin == SCK) {
+    if (value == HIGH && rx5808.clock == LOW && rx5808.select == LOW) {
+      if (rx5808.bits < 32) {
+        rx5808.frame |= (uint32_t)rx5808.data << rx5808.bits;
+      }
+      rx5808.bits++;
+    }
+    rx5808.clock = value;
+  } else if (pin == MOSI) {
+    rx5808.data = value;
+  }
+}
+
+int digitalRead(uint8_t /*pin*/) { return LOW; }
+
+uint16_t analogRead(uint8_t /*pin*/) {
+  uint16_t frequency = clockMicros - rx5808.tunedAt < EMU_RX5808_PLL_MICROS
+                           ? rx5808.previousFrequency
+                           : rx5808.frequency;
+  if (!rssiSource || frequency == 0) {
+    return 0;
+  }
+  return rssiSource(clockMicros, frequency);
+}
+
+uint16_t emu::tunedFrequency() { return rx5808.frequency; }
+uint32_t emu::rx5808Frames() { return rx5808.frames; }
+void emu::setRssiSource(RssiSource source) { rssiSource = source; }
+
+long random(long max) { return max > 0 ? rng() % max : 0; }
+long random(long min, long max) { return min < max ? min + random(max - min) : min; }
+void randomSeed(unsigned long seed) { rng.seed(seed); }
+
+// Serial and ESP.
+
+size_t HardwareSerial::write(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if (c == '\n') {
+      if (serialHandler) {
+        serialHandler(line_.c_str());
+      }
+      line_.clear();
+    } else if (c != '\r') {
+      line_ += c;
+    }
+  }
+  return len;
+}
+
+void emu::setSerialHandler(std::function<void(const char *line)> handler) {
+  serialHandler = handler;
+}
+
+void EspClass::restart() {
+  if (restartHandler) {
+    restartHandler();
+  }
+  abort();
+}
+
+uint32_t EspClass::getFreeHeap() { return 200 * 1024; }
+uint32_t EspClass::getMinFreeHeap() { return 180 * 1024; }
+
+void emu::setRestartHandler(std::function<void()> handler) {
+  restartHandler = handler;
+}
+
+// WiFi.
+
+wl_status_t WiFiClass::begin(const char * /*ssid*/,
+                             const char * /*password*/) {
+  station.joined = false;
+  station.joining = station.routerUp;
+  station.joinAt = clockMicros + EMU_WIFI_JOIN_MILLIS * 1000ULL;
+  return WL_DISCONNECTED;
+}
+
+wl_status_t WiFiClass::status() {
+  if (station.joining && clockMicros >= station.joinAt) {
+    station.joining = false;
+    station.joined = true;
+  }
+  return station.joined ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect(bool /*wifiOff*/) {
+  station.joining = false;
+  station.joined = false;
+  return true;
+}
+
+bool WiFiClass::reconnect() {
+  begin(NULL);
+  return true;
+}
+
+IPAddress WiFiClass::localIP() {
+  return station.joined ? IPAddress(192, 168, 1, 50) : IPAddress();
+}
+
+void emu::setRouter(bool up) {
+  station.routerUp = up;
+  if (!up) {
+    station.joining = false;
+    station.joined = false;
+  }
+}
+
+// Flash.
+
+void emu::setFlash(Flash *f) { flash = f; }
+
+bool EEPROMClass::begin(size_t size) { return size <= sizeof(flash->eeprom); }
+
+uint8_t *EEPROMClass::getDataPtr() { return flash->eeprom; }
+
+bool Preferences::begin(const char *name, bool /*readOnly*/) {
+  namespace_ = name;
+  return true;
+}
+
+namespace {
+
+emu::Flash::Entry *nvsEntry(const std::string &key) {
+  for (uint32_t i = 0; i < flash->nvsCount; i++) {
+    if (key == flash->nvs[i].key) {
+      return &flash->nvs[i];
+    }
+  }
+  return NULL;
+}
+
+}  // namespace
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen) {
+  emu::Flash::Entry *entry = nvsEntry(namespace_ + "/" + key);
+  if (!entry || entry->length > maxLen) {
+    return 0;
+  }
+  memcpy(buf, entry->data, entry->length);
+  return entry->length;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+  std::string name = namespace_ + "/" + key;
+  emu::Flash::Entry *entry = nvsEntry(name);
+  if (!entry) {
+    if (flash->nvsCount == sizeof(flash->nvs) / sizeof(flash->nvs[0]) ||
+        name.size() >= sizeof(entry->key)) {
+      return 0;
+    }
+    entry = &flash->nvs[flash->nvsCount++];
+    strcpy(entry->key, name.c_str());
+  }
+  if (len > sizeof(entry->data)) {
+    return 0;
+  }
+  memcpy(entry->data, value, len);
+  entry->length = len;
+  return len;
+}
+
+bool Preferences::remove(const char *key) {
+  emu::Flash::Entry *entry = nvsEntry(namespace_ + "/" + key);
+  if (!entry) {
+    return false;
+  }
+  *entry = flash->nvs[--flash->nvsCount];
+  return true;
+}
+
+File LittleFSFS::open(const char *path, const char *mode) {
+  auto it = files.find(path);
+  if (mode[0] == 'r' && mode[1] != '+') {
+    return it == files.end() ? File() : File(it->second);
+  }
+  if (it == files.end()) {
+    it = files.insert({path, std::make_shared<std::vector<uint8_t>>()}).first;
+  }
+  if (mode[0] == 'w') {
+    it->second->clear();
+  }
+  File file(it->second);
+  if (mode[0] == 'a') {
+    file.seek(file.size());
+  }
+  return file;
+}
+
+bool LittleFSFS::exists(const char *path) { return files.count(path) > 0; }
+
+bool LittleFSFS::remove(const char *path) { return files.erase(path) > 0; }
+
+bool File::seek(uint32_t pos) {
+  if (!data_ || pos > data_->size()) {
+    return false;
+  }
+  position_ = pos;
+  return true;
+}
+
+size_t File::write(const uint8_t *buf, size_t len) {
+  if (!data_) {
+    return 0;
+  }
+  if (position_ + len > data_->size()) {
+    data_->resize(position_ + len);
+  }
+  memcpy(data_->data() + position_, buf, len);
+  position_ += len;
+  return len;
+}
+
+size_t File::read(uint8_t *buf, size_t len) {
+  if (!data_) {
+    return 0;
+  }
+  len = std::min(len, data_->size() - position_);
+  memcpy(buf, data_->data() + position_, len);
+  position_ += len;
+  return len;
+}
+
+// Web server.
+
+std::string AsyncChunkedResponse::body() {
+  std::string out;
+  uint8_t buffer[1460];
+  for (;;) {
+    size_t n = filler_(buffer, sizeof(buffer), out.size());
+    if (n == 0 || n > sizeof(buffer)) {
+      break;
+    }
+    out.append((const char *)buffer, n);
+  }
+  return out;
+}
+
+bool AsyncWebServerRequest::hasParam(const String &name, bool post,
+                                     bool file) {
+  return getParam(name, post, file) != NULL;
+}
+
+AsyncWebParameter *AsyncWebServerRequest::getParam(const String &name,
+                                                   bool post, bool file) {
+  // Only the query string, see parseQuery().
+  if (post || file) {
+    return NULL;
+  }
+  for (AsyncWebParameter &param : params_) {
+    if (param.name() == name) {
+      return &param;
+    }
+  }
+  return NULL;
+}
+
+void AsyncWebServerRequest::send(int code, const String &contentType,
+                                 const String &content) {
+  send(beginResponse(code, contentType, content));
+}
+
+void AsyncWebServerRequest::send(AsyncWebServerResponse *response) {
+  // The first one goes out, as with the library.
+  if (response_) {
+    delete response;
+    return;
+  }
+  response_ = response;
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(
+    int code, const String &contentType, const String &content) {
+  return new AsyncBasicResponse(code, contentType, content);
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse(
+    const String &contentType, AwsResponseFiller filler) {
+  return new AsyncChunkedResponse(contentType, filler);
+}
+
+AsyncResponseStream *AsyncWebServerRequest::beginResponseStream(
+    const String &contentType, size_t /*bufferSize*/) {
+  return new AsyncResponseStream(contentType);
+}
+
+void AsyncEventSourceClient::send(const char *message, const char *event,
+                                  uint32_t id, uint32_t reconnect) {
+  std::string out = eventMessage(message, event, id, reconnect);
+  write(out.data(), out.size());
+}
+
+void AsyncEventSourceClient::write(const char *message, size_t len) {
+  if (sink_) {
+    sink_(message, len);
+  }
+}
+
+void AsyncEventSourceClient::close() { sink_ = nullptr; }
+
+void AsyncEventSource::send(const char *message, const char *event,
+                            uint32_t id, uint32_t reconnect) {
+  if (clients_.empty()) {
+    return;
+  }
+  std::string out = eventMessage(message, event, id, reconnect);
+  for (auto &client : clients_) {
+    client->write(out.data(), out.size());
+  }
+}
+
+AsyncEventSourceClient *AsyncEventSource::connect(
+    uint32_t lastId, AsyncEventSourceClient::Sink sink) {
+  clients_.emplace_back(new AsyncEventSourceClient(this, lastId, sink));
+  AsyncEventSourceClient *client = clients_.back().get();
+  if (onConnect_) {
+    onConnect_(client);
+  }
+  return client;
+}
+
+void AsyncEventSource::disconnect(AsyncEventSourceClient *client) {
+  for (size_t i = 0; i < clients_.size(); i++) {
+    if (clients_[i].get() == client) {
+      clients_.erase(clients_.begin() + i);
+      return;
+    }
+  }
+}
+
+void AsyncWebSocket::binaryAll(AsyncWebSocketMessageBuffer *buffer) {
+  for (auto &client : clients_) {
+    client->binary(buffer->get(), buffer->length());
+  }
+  delete buffer;
+}
+
+AsyncWebSocketClient *AsyncWebSocket::connect(
+    AsyncWebSocketClient::Sink sink) {
+  clients_.emplace_back(new AsyncWebSocketClient(nextId_++, sink));
+  AsyncWebSocketClient *client = clients_.back().get();
+  if (handler_) {
+    handler_(this, client, WS_EVT_CONNECT, NULL, NULL, 0);
+  }
+  return client;
+}
+
+void AsyncWebSocket::disconnect(AsyncWebSocketClient *client) {
+  for (size_t i = 0; i < clients_.size(); i++) {
+    if (clients_[i].get() == client) {
+      if (handler_) {
+        handler_(this, client, WS_EVT_DISCONNECT, NULL, NULL, 0);
+      }
+      clients_.erase(clients_.begin() + i);
+      return;
+    }
+  }
+}
+
+AsyncWebServer::AsyncWebServer(uint16_t /*port*/) { webServer = this; }
+
+AsyncCallbackWebHandler &AsyncWebServer::on(const char *uri,
+                                            WebRequestMethodComposite method,
+                                            ArRequestHandlerFunction onRequest,
+                                            ArUploadHandlerFunction onUpload) {
+  callbacks_.emplace_back(
+      new AsyncCallbackWebHandler(uri, method, onRequest, onUpload));
+  return *callbacks_.back();
+}
+
+AsyncWebHandler &AsyncWebServer::addHandler(AsyncWebHandler *handler) {
+  handlers_.push_back(handler);
+  return *handler;
+}
+
+bool AsyncWebServer::handle(AsyncWebServerRequest *request) {
+  for (auto &callback : callbacks_) {
+    if (callback->canHandle(request->method(), request->url())) {
+      callback->handleRequest(request);
+      return true;
+    }
+  }
+  return false;
+}
+
+AsyncEventSource *AsyncWebServer::eventSource(const String &url) {
+  for (AsyncWebHandler *handler : handlers_) {
+    AsyncEventSource *source = dynamic_cast<AsyncEventSource *>(handler);
+    if (source && source->url() == url) {
+      return source;
+    }
+  }
+  return NULL;
+}
+
+AsyncWebSocket *AsyncWebServer::webSocket(const String &url) {
+  for (AsyncWebHandler *handler : handlers_) {
+    AsyncWebSocket *socket = dynamic_cast<AsyncWebSocket *>(handler);
+    if (socket && socket->url() == url) {
+      return socket;
+    }
+  }
+  return NULL;
+}
+
+emu::Response emu::request(WebRequestMethod method, const std::string &url,
+                           const std::string &query) {
+  Response response;
+  // Not listening yet, the connection is refused.
+  if (!webServer || !webServer->begun()) {
+    return response;
+  }
+
+  AsyncWebServerRequest request(method, url.c_str(), parseQuery(query));
+  if (!webServer->handle(&request)) {
+    response.status = 404;
+    response.contentType = "text/plain";
+    response.body = "Not found";
+    return response;
+  }
+  AsyncWebServerResponse *sent = request.response();
+  if (!sent) {
+    response.status = 500;
+    response.contentType = "text/plain";
+    response.body = "No response sent";
+    return response;
+  }
+
+  response.status = sent->code();
+  response.contentType = sent->contentType().c_str();
+  response.headers = DefaultHeaders::Instance().headers();
+  response.headers.insert(response.headers.end(), sent->headers().begin(),
+                          sent->headers().end());
+  response.body = sent->body();
+  return response;
+}
+
+AsyncEventSourceClient *emu::connectEvents(const std::string &url,
+                                           uint32_t lastId,
+                                           AsyncEventSourceClient::Sink sink) {
+  AsyncEventSource *source =
+      webServer && webServer->begun() ? webServer->eventSource(url.c_str())
+                                      : NULL;
+  return source ? source->connect(lastId, sink) : NULL;
+}
+
+void emu::disconnectEvents(const std::string &url,
+                           AsyncEventSourceClient *client) {
+  AsyncEventSource *source =
+      webServer ? webServer->eventSource(url.c_str()) : NULL;
+  if (source) {
+    source->disconnect(client);
+  }
+}
+
+AsyncWebSocketClient *emu::connectWebSocket(const std::string &url,
+                                            AsyncWebSocketClient::Sink sink) {
+  AsyncWebSocket *socket =
+      webServer && webServer->begun() ? webServer->webSocket(url.c_str())
+                                      : NULL;
+  return socket ? socket->connect(sink) : NULL;
+}
+
+void emu::disconnectWebSocket(const std::string &url,
+                              AsyncWebSocketClient *client) {
+  AsyncWebSocket *socket = webServer ? webServer->webSocket(url.c_str()) : NULL;
+  if (socket) {
+    socket->disconnect(client);
+  }
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+// Stand-in for the arduino-esp32 core, as much of it as fpvsim_timer.cpp
+// uses, see hal.cpp. Time is virtual, see emulator.h.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+using std::max;
+using std::min;
+
+// One core, as the ESP32-C3: the sampler runs from an esp_timer, detection
+// from loop(). See DETECTION_TASK.
+#define CONFIG_FREERTOS_UNICORE 1
+
+#define IRAM_ATTR
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+// Default VSPI pins of the classic ESP32.
+#define SS 5
+#define MOSI 23
+#define SCK 18
+
+#define DEC 10
+
+// As the core's pgmspace.h, flash strings are plain strings.
+#define PROGMEM
+#define F(s) (s)
+#define printf_P printf
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class String {
+ public:
+  String() {}
+  String(const char *s) : s_(s ? s : "") {}
+  String(const std::string &s) : s_(s) {}
+  explicit String(char c) : s_(1, c) {}
+  explicit String(int value) : s_(std::to_string(value)) {}
+  explicit String(unsigned value) : s_(std::to_string(value)) {}
+  explicit String(long value) : s_(std::to_string(value)) {}
+  explicit String(unsigned long value) : s_(std::to_string(value)) {}
+
+  const char *c_str() const { return s_.c_str(); }
+  unsigned int length() const { return s_.size(); }
+  long toInt() const { return atol(s_.c_str()); }
+
+  bool equals(const String &other) const { return s_ == other.s_; }
+  bool operator==(const String &other) const { return s_ == other.s_; }
+  bool operator==(const char *other) const { return s_ == other; }
+  bool operator!=(const String &other) const { return s_ != other.s_; }
+  bool operator!=(const char *other) const { return s_ != other; }
+
+  String &operator+=(const String &other) {
+    s_ += other.s_;
+    return *this;
+  }
+  String &operator+=(const char *other) {
+    s_ += other;
+    return *this;
+  }
+  friend String operator+(String a, const String &b) { return a += b; }
+  friend String operator+(String a, const char *b) { return a += b; }
+  friend String operator+(const char *a, const String &b) {
+    return String(a) += b;
+  }
+
+ private:
+  std::string s_;
+};
+
+class IPAddress {
+ public:
+  IPAddress() : address_(0) {}
+  IPAddress(uint32_t address) : address_(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : address_(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+
+  operator uint32_t() const { return address_; }
+  uint8_t operator[](int i) const { return address_ >> (8 * i); }
+
+  String toString() const {
+    char s[16];
+    snprintf(s, sizeof(s), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2],
+             (*this)[3]);
+    return String(s);
+  }
+
+ private:
+  // First octet in the low byte, as lwIP keeps it.
+  uint32_t address_;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t *data, size_t len) = 0;
+
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const String &s) { return write(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int value) { return printf("%d", value); }
+  size_t print(unsigned value) { return printf("%u", value); }
+  size_t print(long value) { return printf("%ld", value); }
+  size_t print(unsigned long value) { return printf("%lu", value); }
+  size_t print(long long value) { return printf("%lld", value); }
+  size_t print(unsigned long long value) { return printf("%llu", value); }
+  size_t print(unsigned char value) { return print((unsigned)value); }
+  size_t print(unsigned short value) { return print((unsigned)value); }
+  size_t print(short value) { return print((int)value); }
+  size_t print(double value) { return printf("%.2f", value); }
+  size_t print(const IPAddress &ip) { return print(ip.toString()); }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T &value) {
+    size_t n = print(value);
+    return n + println();
+  }
+
+  size_t printf(const char *format, ...)
+      __attribute__((format(printf, 2, 3))) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (len < 0) {
+      return 0;
+    }
+    if ((size_t)len < sizeof(buffer)) {
+      return write((const uint8_t *)buffer, len);
+    }
+
+    // As the core does, the heap for long lines.
+    std::string line(len + 1, 0);
+    va_start(args, format);
+    vsnprintf(&line[0], line.size(), format, args);
+    va_end(args);
+    return write((const uint8_t *)line.data(), len);
+  }
+};
+
+// Lines go to the handler set with emu::setSerialHandler().
+class HardwareSerial : public Print {
+ public:
+  void begin(unsigned long /*baud*/) {}
+  explicit operator bool() const { return true; }
+  size_t write(const uint8_t *data, size_t len) override;
+  using Print::write;
+
+ private:
+  std::string line_;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  // Ends this boot, see emu::setRestartHandler().
+  [[noreturn]] void restart();
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+};
+
+extern EspClass ESP;
@@ -0,0 +1,15 @@
+#pragma once
+
+// Stand-in for AsyncElegantOTA, no update page. Uploads aren't emulated,
+// the emulator builds with OTA_THROTTLED=0.
+
+#include "ESPAsyncWebServer.h"
+
+class AsyncElegantOtaClass {
+ public:
+  void begin(AsyncWebServer * /*server*/, const char * /*username*/ = "",
+             const char * /*password*/ = "") {}
+  void loop() {}
+};
+
+extern AsyncElegantOtaClass AsyncElegantOTA;
@@ -0,0 +1,26 @@
+#pragma once
+
+// Stand-in for EEPROM, kept in emu::Flash so it outlives a reboot.
+
+#include "Arduino.h"
+
+class EEPROMClass {
+ public:
+  bool begin(size_t size);
+  bool commit() { return true; }
+  uint8_t *getDataPtr();
+
+  template <typename T>
+  T &get(int address, T &value) {
+    memcpy((void *)&value, getDataPtr() + address, sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  const T &put(int address, const T &value) {
+    memcpy(getDataPtr() + address, (const void *)&value, sizeof(T));
+    return value;
+  }
+};
+
+extern EEPROMClass EEPROM;
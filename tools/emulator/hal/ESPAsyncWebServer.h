@@ -0,0 +1,350 @@
+#pragma once
+
+// Stand-in for ESPAsyncWebServer. No TCP: requests come from
+// emu::request(), /events clients from emu::connectEvents(), /ws clients
+// from emu::connectWebSocket(), and all run on the caller's thread between
+// two loop()s. What the firmware sends is captured, in the format the
+// library would have put on the wire, binary /ws messages as they are.
+//
+// Parameters are the query string only, as hasParam(name) without post
+// sees them.
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "Arduino.h"
+
+typedef enum {
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111,
+} WebRequestMethod;
+
+typedef uint8_t WebRequestMethodComposite;
+
+class AsyncWebServerRequest;
+class AsyncEventSourceClient;
+
+typedef std::function<void(AsyncWebServerRequest *request)>
+    ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request,
+                           const String &filename, size_t index,
+                           uint8_t *data, size_t len, bool final)>
+    ArUploadHandlerFunction;
+typedef std::function<void(AsyncEventSourceClient *client)>
+    ArEventHandlerFunction;
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)>
+    AwsResponseFiller;
+
+typedef std::vector<std::pair<std::string, std::string>> AsyncHeaders;
+
+class AsyncWebParameter {
+ public:
+  AsyncWebParameter(const String &name, const String &value)
+      : name_(name), value_(value) {}
+
+  const String &name() const { return name_; }
+  const String &value() const { return value_; }
+
+ private:
+  String name_;
+  String value_;
+};
+
+class AsyncWebServerResponse {
+ public:
+  AsyncWebServerResponse(int code, const String &contentType)
+      : code_(code), contentType_(contentType) {}
+  virtual ~AsyncWebServerResponse() {}
+
+  void addHeader(const String &name, const String &value) {
+    headers_.push_back({name.c_str(), value.c_str()});
+  }
+
+  int code() const { return code_; }
+  const String &contentType() const { return contentType_; }
+  const AsyncHeaders &headers() const { return headers_; }
+
+  // All of it, a chunked response is pulled until its filler is done.
+  virtual std::string body() = 0;
+
+ private:
+  int code_;
+  String contentType_;
+  AsyncHeaders headers_;
+};
+
+class AsyncBasicResponse : public AsyncWebServerResponse {
+ public:
+  AsyncBasicResponse(int code, const String &contentType,
+                     const String &content)
+      : AsyncWebServerResponse(code, contentType), content_(content.c_str()) {}
+
+  std::string body() override { return content_; }
+
+ private:
+  std::string content_;
+};
+
+class AsyncChunkedResponse : public AsyncWebServerResponse {
+ public:
+  AsyncChunkedResponse(const String &contentType, AwsResponseFiller filler)
+      : AsyncWebServerResponse(200, contentType), filler_(filler) {}
+
+  std::string body() override;
+
+ private:
+  AwsResponseFiller filler_;
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+ public:
+  explicit AsyncResponseStream(const String &contentType)
+      : AsyncWebServerResponse(200, contentType) {}
+
+  size_t write(const uint8_t *data, size_t len) override {
+    content_.append((const char *)data, len);
+    return len;
+  }
+  using Print::write;
+
+  std::string body() override { return content_; }
+
+ private:
+  std::string content_;
+};
+
+class AsyncWebServerRequest {
+ public:
+  AsyncWebServerRequest(WebRequestMethod method, const String &url,
+                        const std::vector<AsyncWebParameter> &params)
+      : method_(method), url_(url), params_(params) {}
+  ~AsyncWebServerRequest() { delete response_; }
+
+  WebRequestMethod method() const { return method_; }
+  const String &url() const { return url_; }
+  size_t contentLength() const { return 0; }
+
+  size_t params() const { return params_.size(); }
+  bool hasParam(const String &name, bool post = false, bool file = false);
+  AsyncWebParameter *getParam(const String &name, bool post = false,
+                              bool file = false);
+
+  void send(int code, const String &contentType = String(),
+            const String &content = String());
+  void send(AsyncWebServerResponse *response);
+
+  AsyncWebServerResponse *beginResponse(int code,
+                                        const String &contentType = String(),
+                                        const String &content = String());
+  AsyncWebServerResponse *beginChunkedResponse(const String &contentType,
+                                               AwsResponseFiller filler);
+  AsyncResponseStream *beginResponseStream(const String &contentType,
+                                           size_t bufferSize = 1460);
+
+  // What the handler sent, NULL if nothing.
+  AsyncWebServerResponse *response() const { return response_; }
+
+ private:
+  WebRequestMethod method_;
+  String url_;
+  std::vector<AsyncWebParameter> params_;
+  AsyncWebServerResponse *response_ = NULL;
+};
+
+class AsyncWebHandler {
+ public:
+  virtual ~AsyncWebHandler() {}
+};
+
+class AsyncCallbackWebHandler : public AsyncWebHandler {
+ public:
+  AsyncCallbackWebHandler(const String &uri, WebRequestMethodComposite method,
+                          ArRequestHandlerFunction onRequest,
+                          ArUploadHandlerFunction onUpload)
+      : uri_(uri), method_(method), onRequest_(onRequest),
+        onUpload_(onUpload) {}
+
+  bool canHandle(WebRequestMethod method, const String &url) const {
+    return (method_ & method) && uri_ == url;
+  }
+  void handleRequest(AsyncWebServerRequest *request) {
+    if (onRequest_) {
+      onRequest_(request);
+    }
+  }
+
+ private:
+  String uri_;
+  WebRequestMethodComposite method_;
+  ArRequestHandlerFunction onRequest_;
+  ArUploadHandlerFunction onUpload_;
+};
+
+class AsyncEventSource;
+
+class AsyncEventSourceClient {
+ public:
+  typedef std::function<void(const char *data, size_t len)> Sink;
+
+  AsyncEventSourceClient(AsyncEventSource *server, uint32_t lastId, Sink sink)
+      : server_(server), lastId_(lastId), sink_(sink) {}
+
+  uint32_t lastId() const { return lastId_; }
+  bool connected() const { return (bool)sink_; }
+  size_t packetsWaiting() const { return 0; }
+
+  void send(const char *message, const char *event = NULL, uint32_t id = 0,
+            uint32_t reconnect = 0);
+  // Raw, already in the event stream format.
+  void write(const char *message, size_t len);
+  void close();
+
+ private:
+  AsyncEventSource *server_;
+  uint32_t lastId_;
+  Sink sink_;
+};
+
+class AsyncEventSource : public AsyncWebHandler {
+ public:
+  explicit AsyncEventSource(const String &url) : url_(url) {}
+
+  const String &url() const { return url_; }
+  void onConnect(ArEventHandlerFunction handler) { onConnect_ = handler; }
+  void send(const char *message, const char *event = NULL, uint32_t id = 0,
+            uint32_t reconnect = 0);
+  size_t count() const { return clients_.size(); }
+  size_t avgPacketsWaiting() const { return 0; }
+
+  // A client connects, lastId from its Last-Event-ID header, 0 if none.
+  AsyncEventSourceClient *connect(uint32_t lastId,
+                                  AsyncEventSourceClient::Sink sink);
+  void disconnect(AsyncEventSourceClient *client);
+
+ private:
+  String url_;
+  ArEventHandlerFunction onConnect_;
+  std::vector<std::unique_ptr<AsyncEventSourceClient>> clients_;
+};
+
+typedef enum {
+  WS_EVT_CONNECT,
+  WS_EVT_DISCONNECT,
+  WS_EVT_PONG,
+  WS_EVT_ERROR,
+  WS_EVT_DATA,
+} AwsEventType;
+
+class AsyncWebSocket;
+
+class AsyncWebSocketMessageBuffer {
+ public:
+  explicit AsyncWebSocketMessageBuffer(size_t len) : data_(len) {}
+
+  uint8_t *get() { return data_.data(); }
+  size_t length() const { return data_.size(); }
+
+ private:
+  std::vector<uint8_t> data_;
+};
+
+class AsyncWebSocketClient {
+ public:
+  // Gets every binary message, whole.
+  typedef std::function<void(const uint8_t *data, size_t len)> Sink;
+
+  AsyncWebSocketClient(uint32_t id, Sink sink) : id_(id), sink_(sink) {}
+
+  uint32_t id() const { return id_; }
+  void binary(const uint8_t *data, size_t len) {
+    if (sink_) {
+      sink_(data, len);
+    }
+  }
+  void binary(AsyncWebSocketMessageBuffer *buffer) {
+    binary(buffer->get(), buffer->length());
+    delete buffer;
+  }
+
+ private:
+  uint32_t id_;
+  Sink sink_;
+};
+
+typedef std::function<void(AsyncWebSocket *server,
+                           AsyncWebSocketClient *client, AwsEventType type,
+                           void *arg, uint8_t *data, size_t len)>
+    AwsEventHandler;
+
+class AsyncWebSocket : public AsyncWebHandler {
+ public:
+  explicit AsyncWebSocket(const String &url) : url_(url) {}
+
+  const String &url() const { return url_; }
+  void onEvent(AwsEventHandler handler) { handler_ = handler; }
+  size_t count() const { return clients_.size(); }
+  AsyncWebSocketMessageBuffer *makeBuffer(size_t len) {
+    return new AsyncWebSocketMessageBuffer(len);
+  }
+  // Every client gets the buffer, which is deleted after.
+  void binaryAll(AsyncWebSocketMessageBuffer *buffer);
+  void cleanupClients(uint16_t /*maxClients*/ = 8) {}
+
+  // A client connects, the handler sees WS_EVT_CONNECT.
+  AsyncWebSocketClient *connect(AsyncWebSocketClient::Sink sink);
+  void disconnect(AsyncWebSocketClient *client);
+
+ private:
+  String url_;
+  AwsEventHandler handler_;
+  std::vector<std::unique_ptr<AsyncWebSocketClient>> clients_;
+  uint32_t nextId_ = 1;
+};
+
+class AsyncWebServer {
+ public:
+  explicit AsyncWebServer(uint16_t port);
+
+  AsyncCallbackWebHandler &on(const char *uri,
+                              WebRequestMethodComposite method,
+                              ArRequestHandlerFunction onRequest,
+                              ArUploadHandlerFunction onUpload = nullptr);
+  AsyncWebHandler &addHandler(AsyncWebHandler *handler);
+  void begin() { begun_ = true; }
+
+  bool begun() const { return begun_; }
+  // Runs the first handler registered for the request, false if none.
+  bool handle(AsyncWebServerRequest *request);
+  // The event source added for url, NULL if none.
+  AsyncEventSource *eventSource(const String &url);
+  // The WebSocket added for url, NULL if none.
+  AsyncWebSocket *webSocket(const String &url);
+
+ private:
+  std::vector<std::unique_ptr<AsyncCallbackWebHandler>> callbacks_;
+  std::vector<AsyncWebHandler *> handlers_;
+  bool begun_ = false;
+};
+
+class DefaultHeaders {
+ public:
+  static DefaultHeaders &Instance() {
+    static DefaultHeaders instance;
+    return instance;
+  }
+
+  void addHeader(const String &name, const String &value) {
+    headers_.push_back({name.c_str(), value.c_str()});
+  }
+  const AsyncHeaders &headers() const { return headers_; }
+
+ private:
+  AsyncHeaders headers_;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+// Stand-in for LittleFS, files in memory. Gone after a reboot, which only
+// costs the raw trace.
+
+#include <memory>
+#include <vector>
+
+#include "Arduino.h"
+
+class File {
+ public:
+  File() {}
+  File(std::shared_ptr<std::vector<uint8_t>> data) : data_(data) {}
+
+  explicit operator bool() const { return (bool)data_; }
+
+  bool seek(uint32_t pos);
+  size_t position() const { return position_; }
+  size_t size() const { return data_ ? data_->size() : 0; }
+  size_t write(const uint8_t *buf, size_t len);
+  size_t read(uint8_t *buf, size_t len);
+  void flush() {}
+  void close() { data_.reset(); }
+
+ private:
+  std::shared_ptr<std::vector<uint8_t>> data_;
+  size_t position_ = 0;
+};
+
+class LittleFSFS {
+ public:
+  bool begin(bool /*formatOnFail*/ = false) { return true; }
+  File open(const char *path, const char *mode = "r");
+  bool exists(const char *path);
+  bool remove(const char *path);
+};
+
+extern LittleFSFS LittleFS;
@@ -0,0 +1,18 @@
+#pragma once
+
+// Stand-in for Preferences, NVS entries kept in emu::Flash so they outlive a
+// reboot. Bytes only.
+
+#include "Arduino.h"
+
+class Preferences {
+ public:
+  bool begin(const char *name, bool readOnly = false);
+  void end() {}
+  size_t getBytes(const char *key, void *buf, size_t maxLen);
+  size_t putBytes(const char *key, const void *value, size_t len);
+  bool remove(const char *key);
+
+ private:
+  std::string namespace_;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+// Stand-in for SPI. The RX5808 is bit-banged, see RX5808_HW_SPI, so only
+// the types are needed.
+
+#include "Arduino.h"
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+class SPISettings {
+ public:
+  SPISettings(uint32_t /*clock*/, uint8_t /*bitOrder*/, uint8_t /*dataMode*/) {}
+};
+
+class SPIClass {
+ public:
+  void begin() {}
+  void beginTransaction(SPISettings /*settings*/) {}
+  void endTransaction() {}
+  void transferBits(uint32_t /*data*/, uint32_t * /*out*/,
+                    uint8_t /*bits*/) {}
+};
+
+extern SPIClass SPI;
@@ -0,0 +1,39 @@
+#pragma once
+
+// Stand-in for the WiFi library. The access point is always up, the router
+// comes and goes with emu::setRouter().
+
+#include "Arduino.h"
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+typedef enum {
+  WIFI_OFF = 0,
+  WIFI_STA = 1,
+  WIFI_AP = 2,
+  WIFI_AP_STA = 3,
+} wifi_mode_t;
+
+class WiFiClass {
+ public:
+  bool mode(wifi_mode_t /*mode*/) { return true; }
+  bool softAP(const char * /*ssid*/, const char * /*password*/ = NULL) {
+    return true;
+  }
+  wl_status_t begin(const char *ssid, const char *password = NULL);
+  wl_status_t status();
+  bool disconnect(bool wifiOff = false);
+  bool reconnect();
+  bool setSleep(bool /*enabled*/) { return true; }
+  IPAddress localIP();
+  IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+};
+
+extern WiFiClass WiFi;
@@ -0,0 +1,19 @@
+#pragma once
+
+// Stand-in for WiFiUDP. One timer on its own, nothing is ever received and
+// what is sent goes nowhere.
+
+#include "Arduino.h"
+
+class WiFiUDP {
+ public:
+  uint8_t begin(uint16_t /*port*/) { return 1; }
+  void stop() {}
+  int beginPacket(IPAddress /*ip*/, uint16_t /*port*/) { return 1; }
+  size_t write(const uint8_t * /*data*/, size_t len) { return len; }
+  int endPacket() { return 1; }
+  int parsePacket() { return 0; }
+  int read(uint8_t * /*data*/, size_t /*len*/) { return 0; }
+  IPAddress remoteIP() { return IPAddress(); }
+  uint16_t remotePort() { return 0; }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+// What emulator.cpp drives the stand-ins with, implemented in hal.cpp.
+//
+// One boot of the firmware per process: its globals are never
+// reinitialized, so a reboot is a new process, see emulator.cpp. What has
+// to outlive one, flash, lives in memory the supervisor hands over.
+
+#include <functional>
+#include <string>
+
+#include "Arduino.h"
+#include "ESPAsyncWebServer.h"
+
+// How long the station takes to join the router after WiFi.begin().
+#ifndef EMU_WIFI_JOIN_MILLIS
+#define EMU_WIFI_JOIN_MILLIS 1500
+#endif
+
+namespace emu {
+
+// Micros since boot on the virtual clock.
+uint64_t now();
+
+// Moves the clock on by micros. The esp_timers that fall due fire on the
+// way, each with the clock at its deadline, as the esp_timer task would
+// have run them. delay() and delayMicroseconds() come here too.
+void advance(uint64_t micros);
+
+// The RX5808's rssi output at now for the frequency it is tuned to, 0 if
+// it was never tuned.
+typedef std::function<uint16_t(uint64_t now, uint16_t frequency)> RssiSource;
+void setRssiSource(RssiSource source);
+
+// What the firmware tuned the RX5808 to, decoded from the frames it
+// clocked out on the pins, and how many it wrote.
+uint16_t tunedFrequency();
+uint32_t rx5808Frames();
+
+// NVS and EEPROM.
+struct Flash {
+  struct Entry {
+    char key[48];
+    uint16_t length;
+    uint8_t data[512];
+  };
+
+  uint8_t eeprom[4096];
+  Entry nvs[16];
+  uint32_t nvsCount;
+};
+
+void setFlash(Flash *flash);
+
+// Called by ESP.restart(), must not return.
+void setRestartHandler(std::function<void()> handler);
+
+// Every line the firmware writes to Serial, without the line ending.
+void setSerialHandler(std::function<void(const char *line)> handler);
+
+// Whether the router is in range. The station drops off when it goes,
+// and only joins again on the next WiFi.begin().
+void setRouter(bool up);
+
+struct Response {
+  int status = 0;
+  std::string contentType;
+  AsyncHeaders headers;
+  std::string body;
+};
+
+// A request as it would come in through AsyncWebServer, query without the
+// '?' and url-encoded. 404 if nothing handles it, 500 if the handler sent
+// nothing.
+Response request(WebRequestMethod method, const std::string &url,
+                 const std::string &query);
+
+// Connects to an event source of the server, e.g. "/events", NULL if there
+// is none. Everything sent to the client goes to sink, in the event stream
+// format. lastId as in the Last-Event-ID header, 0 for none.
+AsyncEventSourceClient *connectEvents(const std::string &url, uint32_t lastId,
+                                      AsyncEventSourceClient::Sink sink);
+void disconnectEvents(const std::string &url, AsyncEventSourceClient *client);
+
+// Connects to a WebSocket of the server, e.g. "/ws", NULL if there is none.
+// Every binary message sent to the client goes to sink.
+AsyncWebSocketClient *connectWebSocket(const std::string &url,
+                                       AsyncWebSocketClient::Sink sink);
+void disconnectWebSocket(const std::string &url, AsyncWebSocketClient *client);
+
+}  // namespace emu
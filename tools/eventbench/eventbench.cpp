@@ -0,0 +1,331 @@
+// Formats the per pass events (newtime, gatepass, heatlap) the way the
+// firmware does, with EventWriter (see event_formatter.h), and the ways it
+// used to, counts heap allocations per pass and measures what a pass costs.
+//
+// Build, from tools/ (glibc, malloc is counted by wrapping it):
+//   make eventbench/eventbench
+//
+// Usage:
+//   eventbench [options]
+//
+//   --passes N    default 1000000
+//   --seed N      default 1
+//
+// Three ways to build the same messages:
+//
+//   String        the newtime message as the original firmware built it,
+//                 String(lap) + " " + int64String(...) + ..., with a string
+//                 that allocates like Arduino's WString: every number a new
+//                 buffer, every concatenation a realloc
+//   snprintf      into a stack buffer, newtime as String did it
+//   EventWriter   formatPassMessage(), formatGatePass(), formatHeatLap()
+//
+// Every EventWriter message is checked against snprintf. Exits 1 if they
+// differ, or EventWriter allocated at all.
+
+#include <time.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "event_formatter.h"
+
+#ifndef __GLIBC__
+#error "eventbench counts allocations by wrapping glibc's malloc"
+#endif
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+// Allocations since the last reset, operator new goes through malloc.
+static uint64_t allocations = 0;
+
+extern "C" {
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+void free(void *ptr) { __libc_free(ptr); }
+}
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "eventbench: %s\n", message);
+  exit(1);
+}
+
+int64_t cpuNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Allocates as WString does: a buffer of exactly the length, grown by
+// realloc on every concatenation.
+class HeapString {
+ public:
+  explicit HeapString(uint64_t value) {
+    char digits[20];
+    assign(digits, writeDecimal(digits, value));
+  }
+  ~HeapString() { free(buffer_); }
+
+  HeapString &operator+=(const char *s) {
+    append(s, strlen(s));
+    return *this;
+  }
+  HeapString &operator+=(const HeapString &s) {
+    append(s.buffer_, s.length_);
+    return *this;
+  }
+
+  const char *c_str() const { return buffer_; }
+
+ private:
+  void assign(const char *s, size_t len) {
+    buffer_ = (char *)malloc(len + 1);
+    memcpy(buffer_, s, len);
+    buffer_[len] = 0;
+    length_ = len;
+  }
+  void append(const char *s, size_t len) {
+    buffer_ = (char *)realloc(buffer_, length_ + len + 1);
+    memcpy(buffer_ + length_, s, len);
+    length_ += len;
+    buffer_[length_] = 0;
+  }
+
+  char *buffer_ = nullptr;
+  size_t length_ = 0;
+};
+
+// Keeps the compiler from dropping a message nobody reads.
+static volatile uint32_t sink = 0;
+
+void consume(const char *message) { sink = sink + (uint8_t)message[0]; }
+
+struct Input {
+  PassRecord record;
+  GatePass gatePass;
+  uint32_t heat;
+  uint32_t lapTime;
+  LapStats stats;
+};
+
+void formatString(const Input &in) {
+  const PassEvent &pass = in.record.pass;
+  HeapString msg(pass.lap);
+  msg += " ";
+  msg += HeapString(pass.interval / 1000);
+  msg += " ";
+  msg += HeapString(pass.rssiPeak);
+  msg += " ";
+  msg += HeapString(pass.timeStamp / 1000);
+  msg += " ";
+  msg += HeapString(pass.detectedTimeStamp);
+  msg += " ";
+  msg += HeapString(pass.timeStamp);
+  consume(msg.c_str());
+}
+
+// Returns the newtime message in out.
+void formatSnprintf(const Input &in, char *newtime, char *gatePass,
+                    char *heatLap) {
+  const PassEvent &pass = in.record.pass;
+  snprintf(newtime, PASS_MESSAGE_SIZE + 1,
+           "%u %" PRIu64 " %u %" PRIu64 " %" PRIu64 " %" PRIu64,
+           (unsigned)pass.lap, pass.interval / 1000, (unsigned)pass.rssiPeak,
+           pass.timeStamp / 1000, pass.detectedTimeStamp, pass.timeStamp);
+  if (in.record.channelCount > 1) {
+    size_t n = strlen(newtime);
+    snprintf(newtime + n, PASS_MESSAGE_SIZE + 1 - n, " %u",
+             (unsigned)in.record.channel);
+  }
+
+  const GatePass &gate = in.gatePass;
+  snprintf(gatePass, 96, "%u %u %" PRIu64 " %" PRIu64 " %u %u %u",
+           (unsigned)gate.id, (unsigned)gate.lap, gate.timeStamp,
+           gate.detectedTimeStamp, (unsigned)gate.rssiPeak,
+           (unsigned)gate.channel, (unsigned)gate.synced);
+
+  const LapStats &stats = in.stats;
+  snprintf(heatLap, 128, "%u %u %u %u %u %u %u %u %" PRIu64,
+           (unsigned)in.heat, (unsigned)in.record.channel,
+           (unsigned)stats.count(), (unsigned)in.lapTime,
+           (unsigned)stats.best(), (unsigned)stats.bestLap(),
+           (unsigned)stats.mean(), (unsigned)stats.stddev(),
+           stats.bestConsecutive());
+  consume(newtime);
+  consume(gatePass);
+  consume(heatLap);
+}
+
+// Sized as in fpvsim_timer.cpp.
+void formatEventWriter(const Input &in, char *newtime, char *gatePass,
+                       char *heatLap) {
+  EventWriter pass(newtime, PASS_MESSAGE_SIZE + 1);
+  formatPassMessage(pass, in.record);
+  EventWriter gate(gatePass, 96);
+  formatGatePass(gate, in.gatePass);
+  EventWriter lap(heatLap, 128);
+  formatHeatLap(lap, in.heat, in.record.channel, in.stats.count(),
+                in.lapTime, in.stats);
+  consume(newtime);
+  consume(gatePass);
+  consume(heatLap);
+}
+
+struct Result {
+  double nanosPerPass;
+  double allocationsPerPass;
+};
+
+template <typename Format>
+Result run(const std::vector<Input> &inputs, Format format) {
+  allocations = 0;
+  int64_t start = cpuNanos();
+  for (const Input &in : inputs) {
+    format(in);
+  }
+  int64_t nanos = cpuNanos() - start;
+  Result result;
+  result.nanosPerPass = (double)nanos / inputs.size();
+  result.allocationsPerPass = (double)allocations / inputs.size();
+  return result;
+}
+
+// What doesn't fit is dropped at a field, never in the middle of one.
+int checkTruncation() {
+  int errors = 0;
+  char buffer[12];
+  EventWriter msg(buffer, sizeof(buffer));
+  msg.field(12345).field(67890);
+  if (strcmp(buffer, "12345 67890") != 0 || msg.truncated()) {
+    printf("fitted exactly: \"%s\"\n", buffer);
+    errors++;
+  }
+  msg.field(1).text("");
+  if (strcmp(buffer, "12345 67890") != 0 || !msg.truncated()) {
+    printf("full: \"%s\"\n", buffer);
+    errors++;
+  }
+
+  EventWriter cut(buffer, sizeof(buffer));
+  cut.field(123456).field(12345678901ULL).text("x");
+  if (strcmp(buffer, "123456") != 0 || !cut.truncated()) {
+    printf("cut: \"%s\"\n", buffer);
+    errors++;
+  }
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  int passes = 1000000;
+  int seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--passes" && hasValue) {
+      passes = atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      seed = atoi(argv[++i]);
+    } else {
+      fail("usage: eventbench [options], see eventbench.cpp");
+    }
+  }
+  if (passes < 1) {
+    fail("--passes has to be at least 1");
+  }
+
+  // Passes of a long day, several pilots, the heat statistics as they grow.
+  std::mt19937_64 rng(seed);
+  std::vector<Input> inputs(passes);
+  std::vector<LapStats> stats(8);
+  uint64_t now = 3600000000ULL;
+  for (int i = 0; i < passes; i++) {
+    Input &in = inputs[i];
+    uint8_t channel = rng() % 8;
+    uint32_t lapTime = 4000000 + rng() % 30000000;
+    now += rng() % 5000000;
+    stats[channel].add(lapTime);
+
+    in.record.id = i + 1;
+    in.record.channel = channel;
+    in.record.channelCount = i % 2 ? 8 : 1;
+    in.record.pass.lap = stats[channel].count();
+    in.record.pass.interval = lapTime;
+    in.record.pass.rssiPeak = rng() % 1024;
+    in.record.pass.timeStamp = now;
+    in.record.pass.detectedTimeStamp = now + rng() % 200000;
+
+    in.gatePass.id = rng() % 256;
+    in.gatePass.channel = channel;
+    in.gatePass.lap = in.record.pass.lap;
+    in.gatePass.synced = rng() % 2;
+    in.gatePass.rssiPeak = in.record.pass.rssiPeak;
+    in.gatePass.timeStamp = now;
+    in.gatePass.detectedTimeStamp = in.record.pass.detectedTimeStamp;
+
+    in.heat = 1 + i / 10000;
+    in.lapTime = lapTime;
+    in.stats = stats[channel];
+  }
+
+  int errors = 0;
+  char expected[3][128];
+  char actual[3][128];
+  for (const Input &in : inputs) {
+    formatSnprintf(in, expected[0], expected[1], expected[2]);
+    formatEventWriter(in, actual[0], actual[1], actual[2]);
+    for (int m = 0; m < 3; m++) {
+      if (strcmp(expected[m], actual[m]) != 0 && errors++ < 5) {
+        printf("\"%s\", expected \"%s\"\n", actual[m], expected[m]);
+      }
+    }
+  }
+  errors += checkTruncation();
+
+  Result string = run(inputs, formatString);
+  Result printf_ = run(inputs, [&](const Input &in) {
+    formatSnprintf(in, expected[0], expected[1], expected[2]);
+  });
+  Result writer = run(inputs, [&](const Input &in) {
+    formatEventWriter(in, actual[0], actual[1], actual[2]);
+  });
+
+  printf("%d passes\n", passes);
+  printf("%-32s %10s %14s\n", "", "ns/pass", "allocs/pass");
+  printf("%-32s %10.1f %14.1f\n", "String, newtime only", string.nanosPerPass,
+         string.allocationsPerPass);
+  printf("%-32s %10.1f %14.1f\n", "snprintf, all three",
+         printf_.nanosPerPass, printf_.allocationsPerPass);
+  printf("%-32s %10.1f %14.1f\n", "EventWriter, all three",
+         writer.nanosPerPass, writer.allocationsPerPass);
+
+  if (errors) {
+    printf("\nFAILED: %d messages differ from snprintf\n", errors);
+    return 1;
+  }
+  if (writer.allocationsPerPass > 0) {
+    printf("\nFAILED: EventWriter allocated\n");
+    return 1;
+  }
+  printf("\nall messages match, no allocations from EventWriter\n");
+  return 0;
+}
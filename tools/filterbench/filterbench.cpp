@@ -0,0 +1,150 @@
+// Runs a synthetic rssi trace through the float EMA the firmware used to
+// smooth with and through the fixed-point filters of rssi_filter.h, and
+// measures what a sample costs.
+//
+// Build, from tools/:
+//   make filterbench/filterbench
+//
+// Usage:
+//   filterbench [options]
+//
+//   --samples N   trace length, default 10000000
+//   --ratio N     filterRatio in 1/1000, default 30
+//   --seed N      default 1
+//
+// Four filters over the same trace:
+//
+//   volatile float  the EMA as loop() had it, on volatile floats
+//   float           the EMA as LapDetector had it
+//   EmaFilter       the fixed-point EMA alone
+//   RssiFilter      the chain LapDetector runs, median and EMA by default
+//
+// The host has an FPU, so float looks cheap here; the ESP32-C3 emulates it
+// in software. Exits 1 if EmaFilter is ever more than one count away from
+// the float EMA.
+
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "rssi_filter.h"
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "filterbench: %s\n", message);
+  exit(1);
+}
+
+int64_t cpuNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping the filters' work.
+volatile uint32_t sink;
+
+template <typename Filter>
+double nanosPerSample(const std::vector<uint16_t> &trace, Filter filter) {
+  uint32_t sum = 0;
+  int64_t start = cpuNanos();
+  for (uint16_t value : trace) {
+    sum += filter(value);
+  }
+  int64_t nanos = cpuNanos() - start;
+  sink = sum;
+  return (double)nanos / trace.size();
+}
+
+int main(int argc, char **argv) {
+  int samples = 10000000;
+  int ratio = 30;
+  int seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--samples" && hasValue) {
+      samples = atoi(argv[++i]);
+    } else if (arg == "--ratio" && hasValue) {
+      ratio = atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      seed = atoi(argv[++i]);
+    } else {
+      fail("usage: filterbench [options], see filterbench.cpp");
+    }
+  }
+  if (samples < 1) {
+    fail("--samples has to be at least 1");
+  }
+  if (ratio < 1 || ratio > 255) {
+    fail("--ratio has to be 1 to 255");
+  }
+
+  // A noisy floor with a pass every 5000 samples, 12 bit like the ADC.
+  std::mt19937 rng(seed);
+  std::normal_distribution<double> noise(0, 15);
+  std::vector<uint16_t> trace(samples);
+  for (int i = 0; i < samples; i++) {
+    double t = (i % 5000 - 2500) / 300.0;
+    double value = 400 + 1800 / (1 + t * t) + noise(rng);
+    trace[i] = value < 0 ? 0 : value > 4095 ? 4095 : (uint16_t)value;
+  }
+
+  float alpha = ratio / 1000.0f;
+
+  // Accuracy first: the fixed-point EMA against the float one.
+  int worst = 0;
+  {
+    float smoothed = 0;
+    EmaFilter ema;
+    ema.setFilterRatio(ratio);
+    for (uint16_t value : trace) {
+      smoothed = alpha * value + (1.0f - alpha) * smoothed;
+      int diff = (int)(uint16_t)smoothed - (int)ema.update(value);
+      diff = diff < 0 ? -diff : diff;
+      worst = diff > worst ? diff : worst;
+    }
+  }
+
+  volatile float volatileSmoothed = 0;
+  volatile float volatileAlpha = alpha;
+  double volatileFloat = nanosPerSample(trace, [&](uint16_t value) {
+    volatileSmoothed = (volatileAlpha * (float)value) +
+                       ((1.0f - volatileAlpha) * volatileSmoothed);
+    return (uint16_t)volatileSmoothed;
+  });
+
+  float smoothed = 0;
+  double plainFloat = nanosPerSample(trace, [&](uint16_t value) {
+    smoothed = (alpha * (float)value) + ((1.0f - alpha) * smoothed);
+    return (uint16_t)smoothed;
+  });
+
+  EmaFilter ema;
+  ema.setFilterRatio(ratio);
+  double fixed = nanosPerSample(
+      trace, [&](uint16_t value) { return ema.update(value); });
+
+  RssiFilter chain;
+  chain.setFilterRatio(ratio);
+  double chained = nanosPerSample(
+      trace, [&](uint16_t value) { return chain.update(value); });
+
+  printf("%d samples, ratio %d\n", samples, ratio);
+  printf("%-16s %10s\n", "", "ns/sample");
+  printf("%-16s %10.2f\n", "volatile float", volatileFloat);
+  printf("%-16s %10.2f\n", "float", plainFloat);
+  printf("%-16s %10.2f\n", "EmaFilter", fixed);
+  printf("%-16s %10.2f\n", "RssiFilter", chained);
+
+  if (worst > 1) {
+    printf("\nFAILED: EmaFilter is up to %d counts off the float EMA\n",
+           worst);
+    return 1;
+  }
+  printf("\nEmaFilter within %d count of the float EMA\n", worst);
+  return 0;
+}
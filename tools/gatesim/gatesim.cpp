@@ -0,0 +1,341 @@
+// Runs several timers' gate sync (see gate_sync.h) against each other over
+// UDP on loopback, and reports how well their clocks line up and how late
+// passes arrive.
+//
+// Build, from tools/:
+//   make gatesim/gatesim
+//
+// Usage:
+//   gatesim [options]
+//
+//   --timers N        timers, ids 0 to N-1, default 3
+//   --seconds S       how long to run, default 60
+//   --delay US        mean one way network delay, exponential, default 2000
+//   --loss PERCENT    packets dropped, default 5
+//   --drift PPM       clocks run up to this fast or slow, default 40
+//   --kill-leader S   stop timer 0 after S seconds, 0 never, default 0
+//   --port N          first UDP port, timer i uses N + i, default 15808
+//   --seed N          default 1
+//
+// Every timer gets its own clock, offset by up to an hour and off by up to
+// --drift. Delay and loss are added on the sending side, the loopback itself
+// is close to instant. Sync error is a follower's shared clock minus the
+// leader's clock at the same moment, sampled every second once warmed up.
+// Latency is from a pass being sent to it being received, as measured in the
+// shared clock and as it really was.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gate_sync.h"
+
+struct Options {
+  int timers = 3;
+  int seconds = 60;
+  int delayMicros = 2000;
+  int lossPercent = 5;
+  int driftPpm = 40;
+  int killLeaderSeconds = 0;
+  int port = 15808;
+  int seed = 1;
+};
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "gatesim: %s\n", message);
+  exit(1);
+}
+
+int64_t realMicros() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+std::mt19937 rng;
+
+struct Packet {
+  int64_t due;
+  int fromSocket;
+  uint16_t toPort;
+  std::vector<uint8_t> data;
+};
+
+// Packets held back to simulate the network.
+std::vector<Packet> inFlight;
+Options options;
+
+struct SimTransport {
+  int socket;
+  uint16_t port;
+
+  void broadcast(const uint8_t *data, size_t len) {
+    for (int i = 0; i < options.timers; i++) {
+      if (options.port + i != port) {
+        sendTo(options.port + i, data, len);
+      }
+    }
+  }
+
+  void sendTo(uint32_t address, const uint8_t *data, size_t len) {
+    if ((int)(rng() % 100) < options.lossPercent) {
+      return;
+    }
+    std::exponential_distribution<double> delay(1.0 / options.delayMicros);
+    Packet packet;
+    packet.due = realMicros() + (int64_t)delay(rng);
+    packet.fromSocket = socket;
+    packet.toPort = address;
+    packet.data.assign(data, data + len);
+    inFlight.push_back(packet);
+  }
+};
+
+struct Timer {
+  uint8_t id;
+  bool alive = true;
+  // Local clock = offset + real * (1 + ppm / 1e6).
+  int64_t offset;
+  int64_t ppm;
+  SimTransport transport;
+  GateSync<SimTransport> *sync;
+  int64_t nextPass;
+  uint8_t lap = 0;
+  // When each pass was sent, by seq.
+  std::vector<int64_t> sentReal = std::vector<int64_t>(1);
+
+  uint64_t local(int64_t real) const {
+    return offset + real + real * ppm / 1000000;
+  }
+};
+
+struct Stats {
+  std::vector<double> values;
+
+  void add(double value) { values.push_back(value); }
+
+  double percentile(double p) {
+    if (values.empty()) {
+      return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p * (values.size() - 1))];
+  }
+
+  double maxAbs() const {
+    double max = 0;
+    for (double v : values) {
+      max = std::max(max, std::fabs(v));
+    }
+    return max;
+  }
+};
+
+int openSocket(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    fail("can't bind, try another --port");
+  }
+  return fd;
+}
+
+void deliverDue(int64_t now) {
+  for (size_t i = 0; i < inFlight.size();) {
+    if (inFlight[i].due > now) {
+      i++;
+      continue;
+    }
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(inFlight[i].toPort);
+    sendto(inFlight[i].fromSocket, inFlight[i].data.data(),
+           inFlight[i].data.size(), 0, (sockaddr *)&addr, sizeof(addr));
+    inFlight[i] = inFlight.back();
+    inFlight.pop_back();
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--timers" && hasValue) {
+      options.timers = atoi(argv[++i]);
+    } else if (arg == "--seconds" && hasValue) {
+      options.seconds = atoi(argv[++i]);
+    } else if (arg == "--delay" && hasValue) {
+      options.delayMicros = atoi(argv[++i]);
+    } else if (arg == "--loss" && hasValue) {
+      options.lossPercent = atoi(argv[++i]);
+    } else if (arg == "--drift" && hasValue) {
+      options.driftPpm = atoi(argv[++i]);
+    } else if (arg == "--kill-leader" && hasValue) {
+      options.killLeaderSeconds = atoi(argv[++i]);
+    } else if (arg == "--port" && hasValue) {
+      options.port = atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      options.seed = atoi(argv[++i]);
+    } else {
+      fail("usage: gatesim [options], see gatesim.cpp");
+    }
+  }
+  if (options.timers < 2 || options.timers > GATE_MAX_TIMERS) {
+    fail("--timers has to be 2 to 26");
+  }
+  if (options.delayMicros < 1) {
+    options.delayMicros = 1;
+  }
+  rng.seed(options.seed);
+
+  int64_t start = realMicros();
+  std::vector<Timer> timers(options.timers);
+  for (int i = 0; i < options.timers; i++) {
+    Timer &timer = timers[i];
+    timer.id = i;
+    timer.offset = rng() % 3600000000ULL;
+    timer.ppm = options.driftPpm
+                    ? (int64_t)(rng() % (2 * options.driftPpm + 1)) -
+                          options.driftPpm
+                    : 0;
+    timer.transport.port = options.port + i;
+    timer.transport.socket = openSocket(timer.transport.port);
+    timer.sync = new GateSync<SimTransport>(timer.transport);
+    timer.sync->begin(timer.id, timer.local(realMicros() - start));
+    timer.nextPass = 2000000 + rng() % 3000000;
+    printf("timer %d: drift %+d ppm\n", i, (int)timer.ppm);
+  }
+
+  // Warmed up once the drift has been fitted over a few anchors.
+  const int64_t warmup = 4 * GATE_SYNC_WINDOW * GATE_SYNC_INTERVAL_MICROS;
+  Stats syncError, latency, latencyError;
+  int64_t nextSample = warmup;
+  int64_t nextReport = 5000000;
+  int passesSent = 0;
+
+  for (;;) {
+    int64_t real = realMicros() - start;
+    if (real > options.seconds * 1000000LL) {
+      break;
+    }
+    if (options.killLeaderSeconds &&
+        real > options.killLeaderSeconds * 1000000LL && timers[0].alive) {
+      timers[0].alive = false;
+      printf("%5.1fs timer 0 stopped\n", real / 1e6);
+      // Let the others elect and resync before measuring again.
+      nextSample = real + GATE_PEER_TIMEOUT_MICROS + warmup;
+    }
+
+    deliverDue(realMicros());
+
+    for (Timer &timer : timers) {
+      uint8_t data[GATE_SYNC_MAX_PACKET_SIZE];
+      sockaddr_in from;
+      socklen_t fromLen = sizeof(from);
+      ssize_t n;
+      while ((n = recvfrom(timer.transport.socket, data, sizeof(data), 0,
+                           (sockaddr *)&from, &fromLen)) > 0) {
+        if (!timer.alive) {
+          continue;
+        }
+        int64_t now = realMicros() - start;
+        GatePass pass;
+        if (timer.sync->receive(data, n, ntohs(from.sin_port), timer.local(now),
+                                pass) &&
+            pass.synced && timer.sync->synced() && real > warmup) {
+          int64_t shared = timer.sync->toShared(timer.local(now));
+          int64_t measured = shared - (int64_t)pass.sentTimeStamp;
+          int64_t actual = now - timers[pass.id].sentReal[pass.seq];
+          latency.add((double)measured);
+          latencyError.add((double)(measured - actual));
+        }
+      }
+
+      if (!timer.alive) {
+        continue;
+      }
+      uint64_t local = timer.local(real);
+      timer.sync->update(local);
+
+      if (real >= timer.nextPass) {
+        timer.nextPass = real + 2000000 + rng() % 3000000;
+        GatePass pass;
+        pass.lap = ++timer.lap;
+        pass.rssiPeak = 250;
+        pass.timeStamp = local;
+        pass.detectedTimeStamp = local;
+        timer.sentReal.push_back(real);
+        timer.sync->sendPass(pass, local);
+        passesSent++;
+      }
+    }
+
+    // The leader's clock at this moment, versus what followers make of it.
+    if (real >= nextSample) {
+      nextSample = real + 1000000;
+      const Timer *leader = nullptr;
+      for (const Timer &timer : timers) {
+        if (timer.alive && timer.sync->leader()) {
+          leader = &timer;
+          break;
+        }
+      }
+      for (const Timer &timer : timers) {
+        if (leader && timer.alive && &timer != leader &&
+            timer.sync->synced()) {
+          syncError.add((double)((int64_t)timer.sync->toShared(
+                                     timer.local(real)) -
+                                 (int64_t)leader->local(real)));
+        }
+      }
+    }
+
+    if (real >= nextReport) {
+      nextReport = real + 5000000;
+      for (const Timer &timer : timers) {
+        if (!timer.alive) {
+          continue;
+        }
+        GateSyncStatus status = timer.sync->status(timer.local(real));
+        printf("%5.1fs timer %d: leader %d synced %d drift %+6.2f ppm "
+               "(true %+d) error bound %u us exchanges %u peers %u "
+               "passes %u lost %u\n",
+               real / 1e6, timer.id, status.leaderId, status.synced,
+               status.driftPpb / 1000.0,
+               (int)(timers[status.leaderId].ppm - timer.ppm),
+               (unsigned)status.errorMicros,
+               (unsigned)status.exchanges, (unsigned)status.peers,
+               (unsigned)status.passesReceived, (unsigned)status.passesLost);
+      }
+    }
+
+    usleep(100);
+  }
+
+  printf("\npasses sent: %d\n", passesSent);
+  printf("sync error us: p50 %.0f p99 %.0f max |%.0f| over %zu samples\n",
+         syncError.percentile(0.5), syncError.percentile(0.99),
+         syncError.maxAbs(), syncError.values.size());
+  printf("latency us: p50 %.0f p99 %.0f over %zu passes\n",
+         latency.percentile(0.5), latency.percentile(0.99),
+         latency.values.size());
+  printf("latency error us: p50 %.0f p99 %.0f max |%.0f|\n",
+         latencyError.percentile(0.5), latencyError.percentile(0.99),
+         latencyError.maxAbs());
+  return 0;
+}
@@ -0,0 +1,232 @@
+// Runs simulated heats through HeatSession (see heat_session.h), checks its
+// incremental statistics against ones recomputed from every lap, and
+// measures what a pass costs.
+//
+// Build, from tools/:
+//   make heatbench/heatbench
+//
+// Usage:
+//   heatbench [options]
+//
+//   --heats N     default 100
+//   --pilots N    pilots per heat, 1 to 8, default 8
+//   --laps N      laps per pilot and heat, default 1000
+//   --seed N      default 1
+//
+// Lap times are around 20s with some spread, now and then a pilot crashes
+// and takes a minute. Every pilot's statistics are checked after every heat.
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "heat_session.h"
+
+#define MAX_PILOTS 8
+#define MAX_LAPS 64
+
+typedef HeatSession<MAX_PILOTS, MAX_LAPS> Session;
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "heatbench: %s\n", message);
+  exit(1);
+}
+
+int64_t cpuNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Pass {
+  uint8_t pilot;
+  uint64_t timeStamp;
+};
+
+// Statistics the slow way, from all lap times.
+struct Expected {
+  uint32_t best = 0;
+  uint32_t bestLap = 0;
+  double mean = 0;
+  double stddev = 0;
+  uint64_t bestConsecutive = 0;
+  uint32_t bestConsecutiveLap = 0;
+};
+
+Expected recompute(const std::vector<uint32_t> &laps) {
+  Expected expected;
+  double sum = 0;
+  for (size_t i = 0; i < laps.size(); i++) {
+    if (expected.best == 0 || laps[i] < expected.best) {
+      expected.best = laps[i];
+      expected.bestLap = i + 1;
+    }
+    sum += laps[i];
+  }
+  if (laps.empty()) {
+    return expected;
+  }
+  expected.mean = sum / laps.size();
+
+  double squares = 0;
+  for (uint32_t lap : laps) {
+    squares += (lap - expected.mean) * (lap - expected.mean);
+  }
+  expected.stddev = laps.size() < 2 ? 0 : sqrt(squares / (laps.size() - 1));
+
+  for (size_t i = 0; i + HEAT_CONSECUTIVE_LAPS <= laps.size(); i++) {
+    uint64_t run = 0;
+    for (size_t j = 0; j < HEAT_CONSECUTIVE_LAPS; j++) {
+      run += laps[i + j];
+    }
+    if (expected.bestConsecutive == 0 || run < expected.bestConsecutive) {
+      expected.bestConsecutive = run;
+      expected.bestConsecutiveLap = i + 1;
+    }
+  }
+  return expected;
+}
+
+// Returns the number of mismatches, printing the first few.
+int check(const Session &session, uint8_t pilot,
+          const std::vector<uint32_t> &laps, uint32_t holeshot) {
+  const Session::Pilot &p = session.pilot(pilot);
+  const LapStats &stats = p.stats();
+  Expected expected = recompute(laps);
+
+  int errors = 0;
+  auto expect = [&](const char *name, double actual, double wanted,
+                    double tolerance) {
+    if (std::fabs(actual - wanted) > tolerance) {
+      if (errors++ < 5) {
+        printf("heat %u pilot %u %s: %.1f, expected %.1f\n",
+               (unsigned)session.heat(), (unsigned)pilot, name, actual,
+               wanted);
+      }
+    }
+  };
+  expect("laps", stats.count(), laps.size(), 0);
+  expect("holeshot", p.holeshot(), holeshot, 0);
+  expect("last", stats.last(), laps.empty() ? 0 : laps.back(), 0);
+  expect("best", stats.best(), expected.best, 0);
+  expect("bestLap", stats.bestLap(), expected.bestLap, 0);
+  // Rounded to micros.
+  expect("mean", stats.mean(), expected.mean, 1);
+  expect("stddev", stats.stddev(), expected.stddev, 1);
+  expect("bestConsecutive", stats.bestConsecutive(), expected.bestConsecutive,
+         0);
+  expect("bestConsecutiveLap", stats.bestConsecutiveLap(),
+         expected.bestConsecutiveLap, 0);
+  for (uint32_t lap = p.firstKeptLap(); lap <= stats.count(); lap++) {
+    expect("kept lap", p.lap(lap), laps[lap - 1], 0);
+  }
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  int heats = 100;
+  int pilots = MAX_PILOTS;
+  int lapsPerPilot = 1000;
+  int seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--heats" && hasValue) {
+      heats = atoi(argv[++i]);
+    } else if (arg == "--pilots" && hasValue) {
+      pilots = atoi(argv[++i]);
+    } else if (arg == "--laps" && hasValue) {
+      lapsPerPilot = atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      seed = atoi(argv[++i]);
+    } else {
+      fail("usage: heatbench [options], see heatbench.cpp");
+    }
+  }
+  if (heats < 1 || pilots < 1 || pilots > MAX_PILOTS || lapsPerPilot < 0) {
+    fail("--heats has to be at least 1, --pilots 1 to 8");
+  }
+
+  std::mt19937 rng(seed);
+  std::normal_distribution<double> lapTime(20e6, 1.5e6);
+  std::uniform_int_distribution<int> crash(0, 99);
+  std::uniform_int_distribution<int> holeshotTime(1000000, 3000000);
+
+  Session session;
+  uint64_t now = 1000000;
+  int64_t addNanos = 0;
+  uint64_t passesAdded = 0;
+  int errors = 0;
+
+  for (int heat = 0; heat < heats; heat++) {
+    session.start(now, pilots);
+    uint64_t start = now;
+
+    // Every pilot's passes, merged in time order as the detector would
+    // report them.
+    std::vector<Pass> passes;
+    std::vector<std::vector<uint32_t>> laps(pilots);
+    std::vector<uint32_t> holeshots(pilots);
+    uint64_t end = start;
+    for (int pilot = 0; pilot < pilots; pilot++) {
+      uint64_t t = start + holeshotTime(rng);
+      holeshots[pilot] = t - start;
+      passes.push_back({(uint8_t)pilot, t});
+      for (int lap = 0; lap < lapsPerPilot; lap++) {
+        uint32_t time = crash(rng) == 0
+                            ? 60000000
+                            : (uint32_t)std::max(4e6, lapTime(rng));
+        t += time;
+        laps[pilot].push_back(time);
+        passes.push_back({(uint8_t)pilot, t});
+      }
+      end = std::max(end, t);
+    }
+    std::sort(passes.begin(), passes.end(),
+              [](const Pass &a, const Pass &b) {
+                return a.timeStamp < b.timeStamp;
+              });
+
+    int64_t before = cpuNanos();
+    for (const Pass &pass : passes) {
+      uint32_t lap;
+      session.addPass(pass.pilot, pass.timeStamp, lap);
+    }
+    addNanos += cpuNanos() - before;
+    passesAdded += passes.size();
+
+    session.stop(end + 1);
+    // A pass after the stop doesn't count.
+    uint32_t lap;
+    if (session.addPass(0, end + 2, lap)) {
+      printf("heat %d: pass after the stop was counted\n", heat + 1);
+      errors++;
+    }
+
+    for (int pilot = 0; pilot < pilots; pilot++) {
+      errors += check(session, pilot, laps[pilot], holeshots[pilot]);
+    }
+    now = end + 60000000;
+  }
+
+  printf("%d heats, %d pilots, %d laps each: %llu passes\n", heats, pilots,
+         lapsPerPilot, (unsigned long long)passesAdded);
+  printf("%.1f ns per pass\n",
+         passesAdded ? (double)addNanos / passesAdded : 0.0);
+  printf("sizeof(HeatSession<%d, %d>): %u bytes\n", MAX_PILOTS, MAX_LAPS,
+         (unsigned)sizeof(Session));
+
+  if (errors) {
+    printf("\nFAILED: %d statistics differ from the recomputed ones\n",
+           errors);
+    return 1;
+  }
+  printf("\nall statistics match the recomputed ones\n");
+  return 0;
+}
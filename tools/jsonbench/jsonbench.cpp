@@ -0,0 +1,185 @@
+// Builds the settings JSON the way the firmware does, with
+// formatSettingsJson() (see settings_json.h), and the way it used to, with
+// a stringstream, and measures what a build costs.
+//
+// Build, from tools/:
+//   make jsonbench/jsonbench
+//
+// Usage:
+//   jsonbench [options]
+//
+//   --builds N    default 1000000
+//
+// Three ways to answer /api/v1/settings:
+//
+//   stringstream        settingsToJson() as the firmware had it, a new
+//                       std::string every time
+//   formatSettingsJson  one snprintf into a static buffer, what a change
+//                       of the settings costs now
+//   cached copy         the buffer copied out, what every other request
+//                       costs now
+//
+// Exits 1 if formatSettingsJson() differs from the stringstream.
+
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include "settings_json.h"
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "jsonbench: %s\n", message);
+  exit(1);
+}
+
+int64_t cpuNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping a JSON nobody reads.
+volatile uint32_t sink = 0;
+
+// Defaults of SettingsType in fpvsim_timer.h, with a router.
+struct Settings {
+  uint16_t vtxFreq = 5732;
+  uint8_t filterRatio = 30;
+  uint16_t rssiPeak = 270;
+  uint16_t enterRssiOffset = 6;
+  uint16_t leaveRssiOffset = 27;
+  bool logRssi = true;
+  char apIp[20] = "192.168.4.1";
+  char localIp[20] = "192.168.1.42";
+  char apSsid[30] = "fpvsim-timer-0";
+  char routerSsid[32] = "home";
+  char routerPwd[32] = "secret";
+  char apPwd[30] = "fpvsim123";
+  const char *adaptiveMode = "suggest";
+  bool gateSync = false;
+};
+
+const char *VERSION = "2.4.0";
+
+std::string settingsToJson(const Settings &settings) {
+  std::stringstream ss;
+  ss << "{" << std::endl;
+
+  ss << "\"vtxFreq\":" << settings.vtxFreq << "," << std::endl;
+
+  ss << "\"rssiPeak\":" << settings.rssiPeak << "," << std::endl;
+  ss << "\"enterRssiOffset\":" << settings.enterRssiOffset << "," << std::endl;
+  ss << "\"leaveRssiOffset\":" << settings.leaveRssiOffset << "," << std::endl;
+  ss << "\"filterRatio\":" << (int) settings.filterRatio << "," << std::endl;
+  ss << "\"logRssi\":" << (settings.logRssi ? "true" : "false") << "," << std::endl;
+
+  ss << "\"apSsid\":\"" << settings.apSsid << "\"," << std::endl;
+  ss << "\"apPwd\":\"" << settings.apPwd << "\"," << std::endl;
+  ss << "\"apIp\":\"" << settings.apIp << "\"," << std::endl;
+
+  ss << "\"localIp\":\"" << settings.localIp << "\"," << std::endl;
+  ss << "\"routerSsid\":\"" << settings.routerSsid << "\"," << std::endl;
+  ss << "\"routerPwd\":\"" << settings.routerPwd << "\"," << std::endl;
+
+  ss << "\"adaptiveMode\":\"" << settings.adaptiveMode << "\"," << std::endl;
+  ss << "\"gateSync\":" << (settings.gateSync ? "true" : "false") << "," << std::endl;
+
+  ss << "\"version\":\"" << VERSION << "\"" << std::endl;
+
+  ss << "}";
+
+  return ss.str();
+}
+
+SettingsJsonFields fieldsOf(const Settings &settings) {
+  SettingsJsonFields fields;
+  fields.vtxFreq = settings.vtxFreq;
+  fields.rssiPeak = settings.rssiPeak;
+  fields.enterRssiOffset = settings.enterRssiOffset;
+  fields.leaveRssiOffset = settings.leaveRssiOffset;
+  fields.filterRatio = settings.filterRatio;
+  fields.logRssi = settings.logRssi;
+  fields.apSsid = settings.apSsid;
+  fields.apPwd = settings.apPwd;
+  fields.apIp = settings.apIp;
+  fields.localIp = settings.localIp;
+  fields.routerSsid = settings.routerSsid;
+  fields.routerPwd = settings.routerPwd;
+  fields.adaptiveMode = settings.adaptiveMode;
+  fields.gateSync = settings.gateSync;
+  fields.version = VERSION;
+  return fields;
+}
+
+template <typename Build>
+double nanosPerBuild(int builds, Build build) {
+  int64_t start = cpuNanos();
+  for (int i = 0; i < builds; i++) {
+    build(i);
+  }
+  return (double)(cpuNanos() - start) / builds;
+}
+
+int main(int argc, char **argv) {
+  int builds = 1000000;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--builds" && hasValue) {
+      builds = atoi(argv[++i]);
+    } else {
+      fail("usage: jsonbench [options], see jsonbench.cpp");
+    }
+  }
+  if (builds < 1) {
+    fail("--builds has to be at least 1");
+  }
+
+  // The frequency changes, so nothing can be hoisted out of the loop.
+  Settings settings;
+  static char json[SETTINGS_JSON_SIZE];
+  static char copy[SETTINGS_JSON_SIZE];
+
+  int errors = 0;
+  for (int i = 0; i < 64; i++) {
+    settings.vtxFreq = 5650 + i;
+    settings.logRssi = i % 2;
+    formatSettingsJson(json, sizeof(json), fieldsOf(settings));
+    if (settingsToJson(settings) != json && errors++ < 5) {
+      printf("differs from the stringstream:\n%s\n", json);
+    }
+  }
+
+  double stream = nanosPerBuild(builds, [&](int i) {
+    settings.vtxFreq = 5650 + i % 64;
+    std::string s = settingsToJson(settings);
+    sink = sink + (uint8_t)s[1];
+  });
+  double format = nanosPerBuild(builds, [&](int i) {
+    settings.vtxFreq = 5650 + i % 64;
+    formatSettingsJson(json, sizeof(json), fieldsOf(settings));
+    sink = sink + (uint8_t)json[1];
+  });
+  double cached = nanosPerBuild(builds, [&](int i) {
+    json[1] = (char)i;
+    memcpy(copy, json, sizeof(copy));
+    sink = sink + (uint8_t)copy[1];
+  });
+
+  printf("%d builds, %u bytes\n", builds, (unsigned)strlen(json));
+  printf("%-24s %10s\n", "", "ns/build");
+  printf("%-24s %10.1f\n", "stringstream", stream);
+  printf("%-24s %10.1f\n", "formatSettingsJson", format);
+  printf("%-24s %10.1f\n", "cached copy", cached);
+
+  if (errors) {
+    printf("\nFAILED: %d differ from the stringstream\n", errors);
+    return 1;
+  }
+  printf("\nformatSettingsJson matches the stringstream\n");
+  return 0;
+}
@@ -0,0 +1,154 @@
+// Measures what recording into the counters and histograms of metrics.h
+// costs per call, alone and with other threads recording into the same
+// ones, as the sampler, detection and loop() do on the dual core chips.
+//
+// Build, from tools/:
+//   make metricsbench/metricsbench
+//
+// Usage:
+//   metricsbench [options]
+//
+//   --calls N     per thread, default 10000000
+//   --threads N   for the shared runs, default 2
+//
+// Per call:
+//
+//   plain increment      a volatile uint32_t, what it costs without atomics
+//   Counter::add         alone, then every thread on the same counter
+//   Histogram::record    sample intervals around 500us, alone, then every
+//                        thread on the same histogram
+//   percentile           what a /api/v1/metrics reading pays per histogram
+//
+// Times are wall clock per call on one thread, so the shared runs show
+// what contention adds. Exits 1 if a count came out wrong.
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "metricsbench: %s\n", message);
+  exit(1);
+}
+
+int64_t wallNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs work(thread) on threads threads at once, returns ns per call of
+// one thread.
+template <typename Work>
+double nanosPerCall(int threads, int calls, Work work) {
+  std::vector<std::thread> running;
+  int64_t start = wallNanos();
+  for (int t = 0; t < threads; t++) {
+    running.emplace_back(work, t);
+  }
+  for (std::thread &thread : running) {
+    thread.join();
+  }
+  return (double)(wallNanos() - start) / calls;
+}
+
+int main(int argc, char **argv) {
+  int calls = 10000000;
+  int threads = 2;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--calls" && hasValue) {
+      calls = atoi(argv[++i]);
+    } else if (arg == "--threads" && hasValue) {
+      threads = atoi(argv[++i]);
+    } else {
+      fail("usage: metricsbench [options], see metricsbench.cpp");
+    }
+  }
+  if (calls < 1 || threads < 1) {
+    fail("--calls and --threads have to be at least 1");
+  }
+
+  // Sample intervals as the sampler sees them: 500us, some jitter, now and
+  // then a late one.
+  std::vector<uint32_t> intervals(4096);
+  std::mt19937 rng(1);
+  for (uint32_t &interval : intervals) {
+    interval = 490 + rng() % 20 + (rng() % 100 == 0 ? rng() % 5000 : 0);
+  }
+
+  int errors = 0;
+
+  volatile uint32_t plain = 0;
+  double plainNanos = nanosPerCall(1, calls, [&](int) {
+    for (int i = 0; i < calls; i++) {
+      plain = plain + 1;
+    }
+  });
+
+  Counter counter;
+  double counterNanos = nanosPerCall(1, calls, [&](int) {
+    for (int i = 0; i < calls; i++) {
+      counter.add();
+    }
+  });
+  Counter sharedCounter;
+  double sharedCounterNanos = nanosPerCall(threads, calls, [&](int) {
+    for (int i = 0; i < calls; i++) {
+      sharedCounter.add();
+    }
+  });
+  errors += counter.value() != (uint32_t)calls;
+  errors += sharedCounter.value() != (uint32_t)calls * threads;
+
+  Histogram histogram;
+  double histogramNanos = nanosPerCall(1, calls, [&](int) {
+    for (int i = 0; i < calls; i++) {
+      histogram.record(intervals[i & 4095]);
+    }
+  });
+  Histogram sharedHistogram;
+  double sharedHistogramNanos = nanosPerCall(threads, calls, [&](int t) {
+    for (int i = 0; i < calls; i++) {
+      sharedHistogram.record(intervals[(i + t * 1024) & 4095]);
+    }
+  });
+  errors += histogram.count() != (uint32_t)calls;
+  errors += sharedHistogram.count() != (uint32_t)calls * threads;
+
+  int readings = std::max(calls / 1000, 1);
+  volatile uint32_t sink = 0;
+  double percentileNanos = nanosPerCall(1, readings, [&](int) {
+    for (int i = 0; i < readings; i++) {
+      sink = sink + histogram.percentile(i % 2 ? 500 : 990);
+    }
+  });
+
+  printf("%d calls per thread, %d threads sharing\n", calls, threads);
+  printf("%-28s %10s\n", "", "ns/call");
+  printf("%-28s %10.2f\n", "plain increment", plainNanos);
+  printf("%-28s %10.2f\n", "Counter::add", counterNanos);
+  printf("%-28s %10.2f\n", "Counter::add, shared", sharedCounterNanos);
+  printf("%-28s %10.2f\n", "Histogram::record", histogramNanos);
+  printf("%-28s %10.2f\n", "Histogram::record, shared", sharedHistogramNanos);
+  printf("%-28s %10.2f\n", "percentile", percentileNanos);
+  printf("\np50 %u us, p99 %u us, max %u us\n",
+         (unsigned)histogram.percentile(500),
+         (unsigned)histogram.percentile(990), (unsigned)histogram.max());
+
+  if (errors) {
+    printf("\nFAILED: %d counts came out wrong\n", errors);
+    return 1;
+  }
+  printf("\nevery call counted\n");
+  return 0;
+}
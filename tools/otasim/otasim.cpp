@@ -0,0 +1,310 @@
+// Simulates a firmware upload through OtaPipeline and OtaThrottle (see
+// ota_pipeline.h) on a slow flash while quads keep passing the gate, and
+// reports the longest gap in the samples and what happened to the passes.
+//
+// Build, from tools/:
+//   make otasim/otasim
+//
+// Usage:
+//   otasim [options]
+//
+//   --image KB        image size, default 1200
+//   --rate KB/S       upload speed over WiFi, default 200
+//   --erase MS        sector erase time, default 45
+//   --write US        time per OTA_WRITE_SIZE bytes written, default 1000
+//   --duty PERCENT    OtaThrottle duty, default OTA_DUTY_PERCENT
+//   --lap S           seconds between passes, +-0.5, at least 5, default 5
+//   --unthrottled     write as data comes in, as AsyncElegantOTA does
+//   --seed N          default 1
+//
+// Time is simulated. The sampler runs at RSSI_SAMPLE_RATE_HZ and is stalled
+// for as long as flash is busy, as on the ESP32 where flash operations
+// disable the cache of both cores. Every pass is a bump in the rssi, the
+// samples go through the firmware's LapDetector. A pass is lost if the
+// detector doesn't report it within a second, mistimed if it is off by more
+// than 10ms.
+//
+// Exits 1 if the flash doesn't hold the image afterwards, or, throttled, a
+// sample gap was longer than the longest flash operation allows.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lap_detector.h"
+#include "ota_pipeline.h"
+
+#define RSSI_SAMPLE_RATE_HZ 2000
+#define SAMPLE_PERIOD_MICROS (1000000 / RSSI_SAMPLE_RATE_HZ)
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "otasim: %s\n", message);
+  exit(1);
+}
+
+// Flash that takes time, checks that sectors are erased before they are
+// written, and keeps what was written.
+struct SimFlash {
+  uint32_t eraseMicros = 45000;
+  uint32_t writeMicros = 1000;
+
+  std::vector<uint8_t> data;
+  std::vector<bool> erased;
+  // Time taken by the operations since the caller last looked.
+  uint64_t pending = 0;
+  bool finished = false;
+  int errors = 0;
+
+  explicit SimFlash(size_t size)
+      : data(size, 0xFF), erased(size / OTA_SECTOR_SIZE + 1, false) {}
+
+  bool eraseSector(uint32_t index) {
+    if (index >= erased.size()) {
+      return false;
+    }
+    erased[index] = true;
+    std::fill(data.begin() + index * OTA_SECTOR_SIZE,
+              data.begin() +
+                  std::min(data.size(), (size_t)(index + 1) * OTA_SECTOR_SIZE),
+              0xFF);
+    pending += eraseMicros;
+    return true;
+  }
+
+  bool write(uint32_t offset, const uint8_t *bytes, size_t len) {
+    if (offset + len > data.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (!erased[(offset + i) / OTA_SECTOR_SIZE]) {
+        errors++;
+      }
+      data[offset + i] &= bytes[i];
+    }
+    pending += (uint64_t)writeMicros * len / OTA_WRITE_SIZE + 50;
+    return true;
+  }
+
+  bool finish(uint32_t size) {
+    finished = true;
+    // Verifying reads the image back, no erase or write.
+    pending += size / 1000;
+    return true;
+  }
+};
+
+struct Pass {
+  uint64_t timeStamp;
+  bool detected = false;
+  int64_t error = 0;
+};
+
+int main(int argc, char **argv) {
+  int imageKb = 1200;
+  int rateKbps = 200;
+  int eraseMillis = 45;
+  int writeMicros = 1000;
+  int duty = OTA_DUTY_PERCENT;
+  int lapSeconds = 5;
+  bool unthrottled = false;
+  int seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--image" && hasValue) {
+      imageKb = atoi(argv[++i]);
+    } else if (arg == "--rate" && hasValue) {
+      rateKbps = atoi(argv[++i]);
+    } else if (arg == "--erase" && hasValue) {
+      eraseMillis = atoi(argv[++i]);
+    } else if (arg == "--write" && hasValue) {
+      writeMicros = atoi(argv[++i]);
+    } else if (arg == "--duty" && hasValue) {
+      duty = atoi(argv[++i]);
+    } else if (arg == "--lap" && hasValue) {
+      lapSeconds = atoi(argv[++i]);
+    } else if (arg == "--unthrottled") {
+      unthrottled = true;
+    } else if (arg == "--seed" && hasValue) {
+      seed = atoi(argv[++i]);
+    } else {
+      fail("usage: otasim [options], see otasim.cpp");
+    }
+  }
+  // Passes are half a second early at worst, laps are at least 4s.
+  if (imageKb < 1 || rateKbps < 1 || lapSeconds < 5) {
+    fail("--image and --rate have to be at least 1, --lap at least 5");
+  }
+
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> image(imageKb * 1024);
+  for (uint8_t &byte : image) {
+    byte = rng();
+  }
+  // Looks like an ESP32 image.
+  image[0] = 0xE9;
+
+  SimFlash flash(image.size() + OTA_SECTOR_SIZE);
+  flash.eraseMicros = eraseMillis * 1000;
+  flash.writeMicros = writeMicros;
+  OtaPipeline<SimFlash> pipeline(flash);
+  OtaThrottle throttle(duty);
+  pipeline.begin();
+
+  LapDetectorConfig config;
+  config.enterRssiTrigger = 282;
+  config.leaveRssiTrigger = 219;
+  config.filterRatio = 30;
+  LapDetector detector;
+  detector.setConfig(config);
+
+  // Passes from the first minimum lap time on, for longer than any upload
+  // takes.
+  std::vector<Pass> passes;
+  std::normal_distribution<double> noise(0, 4);
+  std::uniform_int_distribution<int> jitter(-500000, 500000);
+  for (uint64_t t = 5000000; t < 3600000000ULL;
+       t += lapSeconds * 1000000ULL + jitter(rng)) {
+    Pass pass;
+    pass.timeStamp = t;
+    passes.push_back(pass);
+  }
+
+  uint64_t flashBusyUntil = 0;
+  uint64_t lastSample = 0;
+  uint64_t maxGap = 0;
+  uint64_t maxGapAt = 0;
+  uint64_t sent = 0;
+  uint64_t done = 0;
+  double credit = 0;
+  size_t nextPass = 0;
+
+  // Until a pass after the upload is through.
+  uint64_t now = 0;
+  for (; !done || now < done + lapSeconds * 1000000ULL;
+       now += SAMPLE_PERIOD_MICROS) {
+    // The sampler, unless flash has the cores.
+    if (now >= flashBusyUntil) {
+      if (lastSample && now - lastSample > maxGap) {
+        maxGap = now - lastSample;
+        maxGapAt = now;
+      }
+      lastSample = now;
+
+      // A bump of about 300ms around each pass.
+      double rssi = 100 + noise(rng);
+      for (size_t i = nextPass > 0 ? nextPass - 1 : 0;
+           i < passes.size() && i <= nextPass + 1; i++) {
+        double dt = ((double)now - (double)passes[i].timeStamp) / 80000.0;
+        rssi += 230 * exp(-dt * dt / 2);
+      }
+      PassEvent event;
+      if (detector.addSample(now, std::max(0.0, rssi), event)) {
+        // Matched to the nearest expected pass.
+        for (Pass &pass : passes) {
+          int64_t error = (int64_t)event.timeStamp - (int64_t)pass.timeStamp;
+          if (!pass.detected && std::llabs(error) < 1000000) {
+            pass.detected = true;
+            pass.error = error;
+            break;
+          }
+        }
+      }
+      while (nextPass < passes.size() &&
+             passes[nextPass].timeStamp + 1000000 < now) {
+        nextPass++;
+      }
+    }
+
+    // The upload, held back by TCP while the queue is full.
+    if (pipeline.state() == OTA_RECEIVING) {
+      credit += rateKbps * 1024.0 * SAMPLE_PERIOD_MICROS / 1000000;
+      while (credit >= OTA_CHUNK_SIZE || sent + (uint64_t)credit >= image.size()) {
+        size_t len = std::min((size_t)OTA_CHUNK_SIZE, image.size() - sent);
+        if (len == 0) {
+          pipeline.end(true);
+          break;
+        }
+        if (!pipeline.push(&image[sent], len)) {
+          break;
+        }
+        sent += len;
+        credit -= len;
+      }
+    }
+
+    // loop(), when flash is free.
+    if (now < flashBusyUntil || !pipeline.busy()) {
+      if (!done && !pipeline.busy()) {
+        done = now;
+      }
+      continue;
+    }
+    if (unthrottled) {
+      // Everything there is, back to back.
+      while (pipeline.step()) {
+      }
+      flashBusyUntil = now + flash.pending;
+      flash.pending = 0;
+    } else if (throttle.due(now, detector.crossing() ||
+                                     detector.rssi() >
+                                         config.leaveRssiTrigger)) {
+      if (pipeline.step()) {
+        throttle.ran(now, now + flash.pending);
+        flashBusyUntil = now + flash.pending;
+      }
+      flash.pending = 0;
+    }
+  }
+
+  bool intact = pipeline.state() == OTA_DONE && flash.finished &&
+                flash.errors == 0 &&
+                std::equal(image.begin(), image.end(), flash.data.begin());
+
+  int lost = 0;
+  int mistimed = 0;
+  int64_t maxError = 0;
+  // The last one may not be through yet.
+  passes.resize(nextPass);
+  for (const Pass &pass : passes) {
+    if (!pass.detected) {
+      lost++;
+    } else {
+      maxError = std::max(maxError, (int64_t)std::llabs(pass.error));
+      if (std::llabs(pass.error) > 10000) {
+        mistimed++;
+      }
+    }
+  }
+
+  printf("%s, %d KB at %d KB/s, erase %d ms, %d us per %d bytes\n",
+         unthrottled ? "unthrottled" : "throttled", imageKb, rateKbps,
+         eraseMillis, writeMicros, OTA_WRITE_SIZE);
+  printf("upload written in %.1f s, flash %s\n", done / 1e6,
+         intact ? "holds the image" : "DOES NOT hold the image");
+  printf("longest sample gap: %.1f ms at %.1f s\n", maxGap / 1000.0,
+         maxGapAt / 1e6);
+  if (!unthrottled) {
+    printf("longest flash operation: %.1f ms, flash busy %.0f%% of the "
+           "upload\n",
+           throttle.longestMicros() / 1000.0,
+           done ? 100.0 * throttle.busyMicros() / done : 0.0);
+  }
+  printf("passes: %zu, lost %d, mistimed %d, worst error %.1f ms\n",
+         passes.size(), lost, mistimed, maxError / 1000.0);
+
+  if (!intact) {
+    return 1;
+  }
+  if (!unthrottled &&
+      maxGap > throttle.longestMicros() + SAMPLE_PERIOD_MICROS) {
+    printf("\nFAILED: a sample gap is longer than the longest flash "
+           "operation\n");
+    return 1;
+  }
+  return 0;
+}
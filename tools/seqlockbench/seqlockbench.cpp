@@ -0,0 +1,262 @@
+// Hammers Seqlock (see seqlock.h) from several threads, checks that no
+// reader ever gets half of one store and half of another, and measures what
+// a read costs.
+//
+// Build, from tools/:
+//   make seqlockbench/seqlockbench
+//
+// Usage:
+//   seqlockbench [options]
+//
+//   --seconds S     how long each run lasts, default 2
+//   --readers N     reader threads, default 3
+//   --interval US   writer pause between stores, 0 never, default 0
+//
+// Every stored value is derived from one counter, a reader checks that all
+// fields agree and that the counter never goes back. Four runs:
+//
+//   seqlock, idle writer   the read cost detection pays per batch
+//   seqlock, busy writer   torn copies have to be 0, some reads are retried
+//   mutex, busy writer     the same with a std::mutex around the copy
+//   unguarded, busy writer the same words without the sequence check, shows
+//                          that the check catches tearing
+//
+// ns/read is reader cpu time per read that was kept, retries included.
+
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "seqlock.h"
+
+// About the size of DetectionConfig.
+struct Payload {
+  uint64_t counter;
+  uint16_t low;
+  uint16_t inverted;
+  uint32_t hash;
+  uint64_t tripled;
+  uint8_t bytes[8];
+};
+
+Payload makePayload(uint64_t counter) {
+  Payload payload;
+  payload.counter = counter;
+  payload.low = counter;
+  payload.inverted = ~counter;
+  payload.hash = counter * 2654435761u;
+  payload.tripled = counter * 3;
+  for (int i = 0; i < 8; i++) {
+    payload.bytes[i] = counter + i;
+  }
+  return payload;
+}
+
+bool consistent(const Payload &payload) {
+  Payload expected = makePayload(payload.counter);
+  return memcmp(&payload, &expected, sizeof(Payload)) == 0;
+}
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "seqlockbench: %s\n", message);
+  exit(1);
+}
+
+// The same word storage as Seqlock, without the sequence number.
+class Unguarded {
+ public:
+  void store(const Payload &value) {
+    uint32_t words[kWords];
+    memcpy(words, &value, sizeof(Payload));
+    for (size_t i = 0; i < kWords; i++) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+  }
+
+  bool tryLoad(Payload &out) const {
+    uint32_t words[kWords];
+    for (size_t i = 0; i < kWords; i++) {
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    }
+    memcpy(&out, words, sizeof(Payload));
+    return true;
+  }
+
+ private:
+  static constexpr size_t kWords = (sizeof(Payload) + 3) / 4;
+  std::atomic<uint32_t> words_[kWords] = {};
+};
+
+class Locked {
+ public:
+  void store(const Payload &value) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    value_ = value;
+  }
+
+  bool tryLoad(Payload &out) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    out = value_;
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  Payload value_ = makePayload(0);
+};
+
+int64_t threadCpuNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ReaderResult {
+  int64_t cpuNanos = 0;
+  uint64_t reads = 0;
+  uint64_t retries = 0;
+  uint64_t torn = 0;
+  uint64_t backwards = 0;
+};
+
+struct RunResult {
+  uint64_t stores = 0;
+  ReaderResult readers;
+  double nanosPerRead = 0;
+};
+
+template <typename Store>
+RunResult run(Store &store, int seconds, int readers, bool busyWriter,
+              int intervalMicros) {
+  store.store(makePayload(0));
+
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> stores(0);
+  std::thread writer([&] {
+    uint64_t counter = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      if (!busyWriter) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      store.store(makePayload(++counter));
+      if (intervalMicros > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(intervalMicros));
+      }
+    }
+    stores = counter;
+  });
+
+  std::vector<ReaderResult> results(readers);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < readers; i++) {
+    threads.emplace_back([&, i] {
+      ReaderResult result;
+      int64_t cpuStart = threadCpuNanos();
+      uint64_t last = 0;
+      Payload payload;
+      while (!stop.load(std::memory_order_relaxed)) {
+        if (!store.tryLoad(payload)) {
+          result.retries++;
+          continue;
+        }
+        result.reads++;
+        if (!consistent(payload)) {
+          result.torn++;
+        } else if (payload.counter < last) {
+          result.backwards++;
+        } else {
+          last = payload.counter;
+        }
+      }
+      result.cpuNanos = threadCpuNanos() - cpuStart;
+      results[i] = result;
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  writer.join();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  RunResult run;
+  run.stores = stores;
+  for (const ReaderResult &result : results) {
+    run.readers.cpuNanos += result.cpuNanos;
+    run.readers.reads += result.reads;
+    run.readers.retries += result.retries;
+    run.readers.torn += result.torn;
+    run.readers.backwards += result.backwards;
+  }
+  run.nanosPerRead =
+      run.readers.reads ? (double)run.readers.cpuNanos / run.readers.reads : 0;
+  return run;
+}
+
+void print(const char *name, const RunResult &run) {
+  printf("%-24s %10.1f %12llu %10llu %8llu %6llu %10llu\n", name,
+         run.nanosPerRead, (unsigned long long)run.readers.reads,
+         (unsigned long long)run.readers.retries,
+         (unsigned long long)run.readers.torn,
+         (unsigned long long)run.readers.backwards,
+         (unsigned long long)run.stores);
+}
+
+int main(int argc, char **argv) {
+  int seconds = 2;
+  int readers = 3;
+  int intervalMicros = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--seconds" && hasValue) {
+      seconds = atoi(argv[++i]);
+    } else if (arg == "--readers" && hasValue) {
+      readers = atoi(argv[++i]);
+    } else if (arg == "--interval" && hasValue) {
+      intervalMicros = atoi(argv[++i]);
+    } else {
+      fail("usage: seqlockbench [options], see seqlockbench.cpp");
+    }
+  }
+  if (seconds < 1 || readers < 1) {
+    fail("--seconds and --readers have to be at least 1");
+  }
+
+  printf("%d readers, %u bytes, %d s per run, %u cores\n", readers,
+         (unsigned)sizeof(Payload), seconds,
+         std::thread::hardware_concurrency());
+  printf("%-24s %10s %12s %10s %8s %6s %10s\n", "", "ns/read", "reads",
+         "retries", "torn", "back", "stores");
+
+  Seqlock<Payload> seqlock;
+  print("seqlock, idle writer",
+        run(seqlock, seconds, readers, false, intervalMicros));
+  RunResult busy = run(seqlock, seconds, readers, true, intervalMicros);
+  print("seqlock, busy writer", busy);
+
+  Locked locked;
+  print("mutex, busy writer",
+        run(locked, seconds, readers, true, intervalMicros));
+
+  Unguarded unguarded;
+  print("unguarded, busy writer",
+        run(unguarded, seconds, readers, true, intervalMicros));
+
+  if (busy.readers.torn || busy.readers.backwards) {
+    printf("\nFAILED: the seqlock handed out torn or stale copies\n");
+    return 1;
+  }
+  printf("\nno torn copies from the seqlock\n");
+  return 0;
+}
@@ -0,0 +1,303 @@
+// Sweeps a simulated RX5808 with SpectrumScan (see spectrum_scan.h) while a
+// few quads sit on their channels, and checks what the sweep costs and what
+// it finds.
+//
+// Build, from tools/:
+//   make spectrumsim/spectrumsim
+//
+// Usage:
+//   spectrumsim [options]
+//
+//   --bands NAMES     e.g. RF, default all of ABEFRL
+//   --range MIN,MAX,STEP
+//                     MHz, sweeps the range instead of bands
+//   --samples N       averaged per frequency, default SPECTRUM_SAMPLES
+//   --settle US       settle time per step, default SPECTRUM_SETTLE_MICROS
+//   --pll US          how long the simulated module really takes to settle
+//                     after a step, default 3000
+//   --vtx LIST        MHz of the quads, default 5658,5740,5800,5880
+//   --seed N          default 1
+//
+// Time is simulated, the sampler ticks at RSSI_SAMPLE_RATE_HZ and does what
+// sampleRssi() does: the scan takes the ticks while active, then the hopper
+// tunes back to the timing channel. Until the module has settled it still
+// reports the rssi of the frequency before, so a settle time shorter than
+// --pll shows up as misplaced peaks.
+//
+// Exits 1 if the sweep takes a second or more, retunes other than once per
+// frequency, doesn't tune back, or a quad isn't the peak of its
+// neighbourhood.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "channel_hopper.h"
+#include "rx5808.h"
+#include "spectrum_scan.h"
+
+#define RSSI_SAMPLE_RATE_HZ 2000
+#define SAMPLE_PERIOD_MICROS (1000000 / RSSI_SAMPLE_RATE_HZ)
+
+// Timing channel before and after the sweep.
+#define TIMING_MHZ 5732
+
+[[noreturn]] void fail(const char *message) {
+  fprintf(stderr, "spectrumsim: %s\n", message);
+  exit(1);
+}
+
+// Counts frames and keeps the last frequency written.
+class RecordingBus : public Rx5808Bus {
+ public:
+  void begin() override {}
+  void writeFrame(uint32_t frame) override {
+    frames++;
+    if ((frame & 0xF) == RX5808_REG_SYNTH_B) {
+      synthB = (frame >> 5) & 0xFFFFF;
+    }
+  }
+
+  uint32_t frames = 0;
+  uint32_t synthB = 0;
+};
+
+// The module's rssi output: the quads as bumps over the noise floor, as the
+// IF filter sees them, lagging by pllMicros after a retune.
+struct SimModule {
+  std::vector<uint16_t> vtx;
+  uint32_t pllMicros = 3000;
+  std::mt19937 rng;
+  std::normal_distribution<double> noise{0, 3};
+
+  uint16_t previous = 0;
+  uint16_t current = 0;
+  uint64_t tunedAt = 0;
+
+  void tuned(uint16_t frequency, uint64_t now) {
+    previous = current;
+    current = frequency;
+    tunedAt = now;
+  }
+
+  double level(uint16_t frequency) const {
+    double rssi = 110;
+    for (uint16_t f : vtx) {
+      double df = ((double)frequency - f) / 9.0;
+      rssi += 180 * exp(-df * df / 2);
+    }
+    return rssi;
+  }
+
+  uint16_t read(uint64_t now) {
+    uint16_t frequency = now - tunedAt < pllMicros ? previous : current;
+    double rssi = level(frequency) + noise(rng);
+    return rssi < 0 ? 0 : rssi > 1023 ? 1023 : (uint16_t)rssi;
+  }
+};
+
+// Rx5808 that tells the module when it retunes.
+struct SimRx {
+  Rx5808 &rx;
+  SimModule &module;
+
+  void tune(uint16_t frequency, uint64_t now) {
+    rx.tune(frequency, now);
+    module.tuned(frequency, now);
+  }
+  bool isSettled(uint64_t now) const { return rx.isSettled(now); }
+  void setSettleMicros(uint32_t micros) { rx.setSettleMicros(micros); }
+};
+
+std::vector<uint16_t> parseList(const char *s) {
+  std::vector<uint16_t> list;
+  while (*s) {
+    list.push_back(atoi(s));
+    const char *comma = strchr(s, ',');
+    if (!comma) {
+      break;
+    }
+    s = comma + 1;
+  }
+  return list;
+}
+
+int main(int argc, char **argv) {
+  SpectrumScanConfig config;
+  SimModule module;
+  module.vtx = {5658, 5740, 5800, 5880};
+  int seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--bands" && hasValue) {
+      config.bands = spectrumBandMask(argv[++i]);
+      if (config.bands == 0) {
+        fail("unknown band, see spectrumBands");
+      }
+    } else if (arg == "--range" && hasValue) {
+      std::vector<uint16_t> range = parseList(argv[++i]);
+      if (range.size() != 3 || range[2] == 0 || range[0] > range[1]) {
+        fail("--range is MIN,MAX,STEP");
+      }
+      if ((range[1] - range[0]) / range[2] + 1 > SPECTRUM_MAX_POINTS) {
+        fail("--range has more than SPECTRUM_MAX_POINTS points");
+      }
+      config.bands = 0;
+      config.minMhz = range[0];
+      config.maxMhz = range[1];
+      config.stepMhz = range[2];
+    } else if (arg == "--samples" && hasValue) {
+      config.samples = atoi(argv[++i]);
+    } else if (arg == "--settle" && hasValue) {
+      config.settleMicros = atoi(argv[++i]);
+    } else if (arg == "--pll" && hasValue) {
+      module.pllMicros = atoi(argv[++i]);
+    } else if (arg == "--vtx" && hasValue) {
+      module.vtx = parseList(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      seed = atoi(argv[++i]);
+    } else {
+      fail("usage: spectrumsim [options], see spectrumsim.cpp");
+    }
+  }
+  module.rng.seed(seed);
+
+  RecordingBus bus;
+  Rx5808 rx5808(bus);
+  SimRx rx = {rx5808, module};
+
+  ChannelHopper hopper;
+  ChannelConfig timing;
+  timing.frequencies[0] = TIMING_MHZ;
+  timing.count = 1;
+  timing.settleMicros = RX5808_SETTLE_MICROS;
+  hopper.configure(timing);
+  rx5808.setSettleMicros(timing.settleMicros);
+
+  SpectrumScan scan;
+  uint16_t frequencies[SPECTRUM_MAX_POINTS];
+  size_t count = spectrumFrequencies(config, frequencies, SPECTRUM_MAX_POINTS);
+  uint32_t estimate =
+      SpectrumScan::estimateMicros(config, count, SAMPLE_PERIOD_MICROS);
+
+  // Timing first, the sweep starts at 1s, timing again after it.
+  const uint64_t scanAt = 1000000;
+  bool scanned = false;
+  uint32_t framesBefore = 0;
+  uint32_t framesAfter = 0;
+  uint64_t doneAt = 0;
+  uint64_t timingSampleAt = 0;
+  for (uint64_t now = SAMPLE_PERIOD_MICROS; now < 10000000;
+       now += SAMPLE_PERIOD_MICROS) {
+    if (now >= scanAt && !scanned) {
+      scanned = true;
+      framesBefore = bus.frames;
+      if (!scan.start(config, now)) {
+        fail("no frequencies to sweep");
+      }
+    }
+
+    if (scan.active()) {
+      if (scan.tick(now, rx, [&] { return module.read(now); })) {
+        doneAt = now;
+        framesAfter = bus.frames;
+        hopper.configure(hopper.config());
+        rx5808.setSettleMicros(hopper.config().settleMicros);
+      }
+      continue;
+    }
+
+    if (hopper.due(now)) {
+      rx.tune(hopper.advance(now), now);
+      continue;
+    }
+    if (rx5808.isSettled(now)) {
+      module.read(now);
+      if (doneAt && !timingSampleAt) {
+        timingSampleAt = now;
+        break;
+      }
+    }
+  }
+
+  const SpectrumResult &result = scan.result();
+  int errors = 0;
+
+  printf("%u frequencies, %u samples each, settle %u us (module %u us)\n",
+         (unsigned)result.count, (unsigned)config.samples,
+         (unsigned)config.settleMicros, (unsigned)module.pllMicros);
+  printf("sweep: %.1f ms, estimated %.1f ms, %u retunes, %u frames\n",
+         result.sweepMicros / 1000.0, estimate / 1000.0,
+         (unsigned)result.retunes, (unsigned)(framesAfter - framesBefore));
+  printf("back on %u MHz, first timing sample %.1f ms after the sweep\n",
+         (unsigned)rx5808.frequency(),
+         timingSampleAt ? (timingSampleAt - doneAt) / 1000.0 : 0.0);
+
+  if (!doneAt || result.sweepMicros >= 1000000) {
+    printf("FAILED: the sweep took a second or more\n");
+    errors++;
+  }
+  if (result.retunes != result.count ||
+      framesAfter - framesBefore != 2u * result.count) {
+    printf("FAILED: expected one retune, two frames, per frequency\n");
+    errors++;
+  }
+  if (rx5808.frequency() != TIMING_MHZ || !timingSampleAt ||
+      bus.synthB != freqMhzToRegVal(TIMING_MHZ)) {
+    printf("FAILED: not back on the timing channel\n");
+    errors++;
+  }
+  for (size_t i = 1; i < result.count; i++) {
+    if (result.points[i].frequency <= result.points[i - 1].frequency) {
+      printf("FAILED: frequencies not ascending at %u\n", (unsigned)i);
+      errors++;
+      break;
+    }
+  }
+
+  // The strongest point within 15MHz of each quad has to be the nearest
+  // frequency swept.
+  printf("\n%8s %8s %8s\n", "quad", "peak at", "rssi");
+  for (uint16_t vtx : module.vtx) {
+    int nearest = -1;
+    int strongest = -1;
+    for (size_t i = 0; i < result.count; i++) {
+      int df = abs((int)result.points[i].frequency - vtx);
+      if (df > 15) {
+        continue;
+      }
+      if (nearest < 0 ||
+          df < abs((int)result.points[nearest].frequency - vtx)) {
+        nearest = i;
+      }
+      if (strongest < 0 ||
+          result.points[i].rssi > result.points[strongest].rssi) {
+        strongest = i;
+      }
+    }
+    if (strongest < 0) {
+      printf("%8u %8s\n", (unsigned)vtx, "-");
+      continue;
+    }
+    printf("%8u %8u %8u\n", (unsigned)vtx,
+           (unsigned)result.points[strongest].frequency,
+           (unsigned)result.points[strongest].rssi);
+    if (result.points[strongest].frequency !=
+        result.points[nearest].frequency) {
+      printf("FAILED: the quad on %u MHz peaks at %u MHz\n", (unsigned)vtx,
+             (unsigned)result.points[strongest].frequency);
+      errors++;
+    }
+  }
+
+  if (errors) {
+    return 1;
+  }
+  printf("\nsweep ok\n");
+  return 0;
+}
@@ -0,0 +1,406 @@
+// Finds the detector settings that best match known lap times, by replaying
+// recorded rssi traces through the firmware's LapDetector.
+//
+// Build, from tools/:
+//   make tuner/tuner
+//
+// Usage:
+//   tuner [options] trace:laps [trace:laps ...]
+//
+//   trace  a raw trace from GET /api/v1/trace (see raw_trace.h), or text
+//          with one "<timestamp micros> <raw rssi> [channel]" per line
+//   laps   the real pass times, one per line, micros on the trace clock
+//
+//   --channel N          channel to replay when hopping, default 0
+//   --peak MIN:MAX:STEP  rssiPeak, default 150:450:5
+//   --enter MIN:MAX:STEP enterRssiOffset, default 2:20:1
+//   --leave MIN:MAX:STEP leaveRssiOffset, default 10:50:2
+//   --filter MIN:MAX:STEP filterRatio, default 10:100:10
+//   --window MS          a pass this close to a lap matches it, default 1000
+//   --tolerance MS       a matched pass further off is mistimed, default 50
+//   --min-lap MS         minimum lap time, default 4000
+//   --threads N          default all cores
+//
+// Every combination is scored by missed + doubled + mistimed laps, ties go
+// to the smaller mean timing error. The score and the curl command that
+// applies the best settings go to stderr: POST /api/v1/settings only reads
+// query parameters, so that line is what to run. The same settings go to
+// stdout as JSON with the names of /api/v1/settings, for scripts and the
+// record; the timer doesn't take it as a body.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lap_detector.h"
+#include "raw_trace.h"
+
+struct Range {
+  int min, max, step;
+
+  int count() const { return step > 0 && max >= min ? (max - min) / step + 1 : 0; }
+  int at(int i) const { return min + i * step; }
+};
+
+struct Trace {
+  std::string name;
+  std::vector<RawTraceSample> samples;
+  std::vector<uint64_t> laps;
+};
+
+struct Score {
+  int missed = 0;
+  int doubled = 0;
+  int mistimed = 0;
+  double errorSumMs = 0;
+  int matched = 0;
+
+  int errors() const { return missed + doubled + mistimed; }
+  double meanErrorMs() const { return matched ? errorSumMs / matched : 0; }
+
+  bool betterThan(const Score &other) const {
+    if (errors() != other.errors()) {
+      return errors() < other.errors();
+    }
+    return meanErrorMs() < other.meanErrorMs();
+  }
+};
+
+struct Settings {
+  int rssiPeak, enterRssiOffset, leaveRssiOffset, filterRatio;
+};
+
+struct Options {
+  int channel = 0;
+  Range peak = {150, 450, 5};
+  Range enter = {2, 20, 1};
+  Range leave = {10, 50, 2};
+  Range filter = {10, 100, 10};
+  uint64_t windowMicros = 1000 * 1000;
+  uint64_t toleranceMicros = 50 * 1000;
+  uint32_t minLapTimeMicros = 4 * 1000 * 1000;
+  unsigned threads = 0;
+};
+
+static void fail(const char *message, const char *detail = "") {
+  fprintf(stderr, "tuner: %s%s\n", message, detail);
+  exit(1);
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(file);
+  return true;
+}
+
+// Samples of channel, from a raw trace or text.
+static void loadSamples(const std::string &path, int channel,
+                        std::vector<RawTraceSample> &samples) {
+  std::vector<uint8_t> data;
+  if (!readFile(path, data)) {
+    fail("can't read ", path.c_str());
+  }
+
+  RawTraceFileHeader header;
+  if (decodeRawTraceHeader(data.data(), data.size(), header)) {
+    std::vector<RawTraceSample> block(header.blockSize);
+    for (uint32_t i = 0; i < header.blockCount; i++) {
+      size_t offset = RAW_TRACE_HEADER_SIZE + (size_t)i * header.blockSize;
+      if (offset + header.blockSize > data.size()) {
+        fail("truncated trace ", path.c_str());
+      }
+      int count = decodeRawTraceBlock(data.data() + offset, header.blockSize,
+                                      block.data(), block.size());
+      if (count < 0) {
+        fail("malformed block in ", path.c_str());
+      }
+      for (int j = 0; j < count; j++) {
+        if (block[j].channel == channel) {
+          samples.push_back(block[j]);
+        }
+      }
+    }
+    return;
+  }
+
+  data.push_back(0);
+  char *p = (char *)data.data();
+  while (*p) {
+    char *line = p;
+    p = strchr(p, '\n');
+    if (p) {
+      *p++ = 0;
+    } else {
+      p = line + strlen(line);
+    }
+
+    unsigned long long timeStamp;
+    unsigned rssiRaw, sampleChannel = 0;
+    if (line[0] == '#' || sscanf(line, "%llu %u %u", &timeStamp, &rssiRaw,
+                                 &sampleChannel) < 2) {
+      continue;
+    }
+    if ((int)sampleChannel == channel) {
+      RawTraceSample sample;
+      sample.timeStamp = timeStamp;
+      sample.rssiRaw = rssiRaw;
+      sample.channel = sampleChannel;
+      samples.push_back(sample);
+    }
+  }
+}
+
+static void loadLaps(const std::string &path, std::vector<uint64_t> &laps) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file) {
+    fail("can't read ", path.c_str());
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), file)) {
+    unsigned long long timeStamp;
+    if (line[0] != '#' && sscanf(line, "%llu", &timeStamp) == 1) {
+      laps.push_back(timeStamp);
+    }
+  }
+  fclose(file);
+  std::sort(laps.begin(), laps.end());
+}
+
+static Range parseRange(const char *text) {
+  Range range;
+  if (sscanf(text, "%d:%d:%d", &range.min, &range.max, &range.step) != 3 ||
+      range.count() == 0) {
+    fail("invalid range ", text);
+  }
+  return range;
+}
+
+// Same triggers as updateRssiTrigger() in the firmware.
+static LapDetectorConfig detectorConfig(const Settings &settings,
+                                        const Options &options) {
+  LapDetectorConfig config;
+  config.enterRssiTrigger =
+      settings.rssiPeak * (1.0 - settings.enterRssiOffset / 100.0);
+  config.leaveRssiTrigger =
+      settings.rssiPeak * (1.0 - settings.leaveRssiOffset / 100.0);
+  config.filterRatio = settings.filterRatio;
+  config.minLapTimeMicros = options.minLapTimeMicros;
+  return config;
+}
+
+// Replays the trace and matches the passes against its laps. Returns false
+// early once the passes alone make more than maxErrors errors.
+static bool scoreTrace(const Trace &trace, const LapDetectorConfig &config,
+                       const Options &options, int maxErrors, Score &score,
+                       std::vector<uint64_t> &passes) {
+  if (score.errors() > maxErrors) {
+    return false;
+  }
+
+  LapDetector detector;
+  detector.setConfig(config);
+
+  // Every pass beyond the number of laps is a doubled one.
+  size_t maxPasses = trace.laps.size() + (maxErrors - score.errors());
+
+  passes.clear();
+  PassEvent pass;
+  for (size_t i = 0; i < trace.samples.size(); i++) {
+    if (detector.addSample(trace.samples[i].timeStamp,
+                           trace.samples[i].rssiRaw, pass)) {
+      passes.push_back(pass.timeStamp);
+      if (passes.size() > maxPasses) {
+        return false;
+      }
+    }
+  }
+
+  // Both are sorted and laps are seconds apart, so the nearest unused pass
+  // within the window is the match.
+  size_t next = 0;
+  int matched = 0;
+  for (size_t i = 0; i < trace.laps.size(); i++) {
+    uint64_t lap = trace.laps[i];
+    while (next < passes.size() && passes[next] + options.windowMicros < lap) {
+      next++;
+    }
+    if (next < passes.size() && passes[next] <= lap + options.windowMicros) {
+      uint64_t error =
+          passes[next] > lap ? passes[next] - lap : lap - passes[next];
+      if (error > options.toleranceMicros) {
+        score.mistimed++;
+      }
+      score.errorSumMs += error / 1000.0;
+      score.matched++;
+      matched++;
+      next++;
+    } else {
+      score.missed++;
+    }
+  }
+  score.doubled += passes.size() - matched;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  std::vector<Trace> traces;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--channel" && hasValue) {
+      options.channel = atoi(argv[++i]);
+    } else if (arg == "--peak" && hasValue) {
+      options.peak = parseRange(argv[++i]);
+    } else if (arg == "--enter" && hasValue) {
+      options.enter = parseRange(argv[++i]);
+    } else if (arg == "--leave" && hasValue) {
+      options.leave = parseRange(argv[++i]);
+    } else if (arg == "--filter" && hasValue) {
+      options.filter = parseRange(argv[++i]);
+    } else if (arg == "--window" && hasValue) {
+      options.windowMicros = atoi(argv[++i]) * 1000ULL;
+    } else if (arg == "--tolerance" && hasValue) {
+      options.toleranceMicros = atoi(argv[++i]) * 1000ULL;
+    } else if (arg == "--min-lap" && hasValue) {
+      options.minLapTimeMicros = atoi(argv[++i]) * 1000U;
+    } else if (arg == "--threads" && hasValue) {
+      options.threads = atoi(argv[++i]);
+    } else if (arg.compare(0, 2, "--") != 0 &&
+               arg.find(':') != std::string::npos) {
+      Trace trace;
+      trace.name = arg.substr(0, arg.rfind(':'));
+      traces.push_back(trace);
+      loadSamples(trace.name, options.channel, traces.back().samples);
+      loadLaps(arg.substr(arg.rfind(':') + 1), traces.back().laps);
+    } else {
+      fail("usage: tuner [options] trace:laps [trace:laps ...], "
+           "see tuner.cpp");
+    }
+  }
+  if (traces.empty()) {
+    fail("no traces given");
+  }
+
+  size_t samples = 0;
+  for (size_t i = 0; i < traces.size(); i++) {
+    fprintf(stderr, "%s: %zu samples, %zu laps\n", traces[i].name.c_str(),
+            traces[i].samples.size(), traces[i].laps.size());
+    samples += traces[i].samples.size();
+  }
+
+  const uint32_t combinations = (uint32_t)options.peak.count() *
+                                options.enter.count() * options.leave.count() *
+                                options.filter.count();
+  unsigned threads = options.threads ? options.threads
+                                     : std::thread::hardware_concurrency();
+  if (threads == 0) {
+    threads = 1;
+  }
+  fprintf(stderr, "%u combinations over %zu samples on %u threads\n",
+          combinations, samples, threads);
+
+  // Workers take combinations off a shared counter, and keep their best.
+  // The fewest errors so far lets them give up on hopeless ones early.
+  std::atomic<uint32_t> nextCombination(0);
+  std::atomic<int> fewestErrors(1 << 30);
+  std::vector<Score> bestScores(threads);
+  std::vector<Settings> bestSettings(threads);
+  std::vector<bool> found(threads, false);
+  std::vector<std::thread> workers;
+
+  for (unsigned t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&, t]() {
+      std::vector<uint64_t> passes;
+      uint32_t c;
+      while ((c = nextCombination.fetch_add(1)) < combinations) {
+        Settings settings;
+        uint32_t rest = c;
+        settings.filterRatio = options.filter.at(rest % options.filter.count());
+        rest /= options.filter.count();
+        settings.leaveRssiOffset = options.leave.at(rest % options.leave.count());
+        rest /= options.leave.count();
+        settings.enterRssiOffset = options.enter.at(rest % options.enter.count());
+        rest /= options.enter.count();
+        settings.rssiPeak = options.peak.at(rest);
+
+        // Leaving above the enter trigger makes no sense.
+        if (settings.leaveRssiOffset <= settings.enterRssiOffset) {
+          continue;
+        }
+
+        LapDetectorConfig config = detectorConfig(settings, options);
+        int maxErrors = fewestErrors.load();
+        Score score;
+        bool complete = true;
+        for (size_t i = 0; i < traces.size() && complete; i++) {
+          complete =
+              scoreTrace(traces[i], config, options, maxErrors, score, passes);
+        }
+        if (!complete) {
+          continue;
+        }
+
+        if (!found[t] || score.betterThan(bestScores[t])) {
+          found[t] = true;
+          bestScores[t] = score;
+          bestSettings[t] = settings;
+
+          int errors = score.errors();
+          while (errors < maxErrors &&
+                 !fewestErrors.compare_exchange_weak(maxErrors, errors)) {
+          }
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+
+  int best = -1;
+  for (unsigned t = 0; t < threads; t++) {
+    if (found[t] && (best < 0 || bestScores[t].betterThan(bestScores[best]))) {
+      best = t;
+    }
+  }
+  if (best < 0) {
+    fail("no valid combination, leave has to be above enter");
+  }
+
+  const Score &score = bestScores[best];
+  const Settings &settings = bestSettings[best];
+  fprintf(stderr,
+          "best: %d missed, %d doubled, %d mistimed, mean error %.1fms\n",
+          score.missed, score.doubled, score.mistimed, score.meanErrorMs());
+  // What applies them, the JSON below is informational.
+  fprintf(stderr,
+          "curl -X POST 'http://<timer>/api/v1/settings?rssiPeak=%d"
+          "&enterRssiOffset=%d&leaveRssiOffset=%d&filterRatio=%d'\n",
+          settings.rssiPeak, settings.enterRssiOffset,
+          settings.leaveRssiOffset, settings.filterRatio);
+
+  printf("{\n"
+         "\"rssiPeak\":%d,\n"
+         "\"enterRssiOffset\":%d,\n"
+         "\"leaveRssiOffset\":%d,\n"
+         "\"filterRatio\":%d\n"
+         "}\n",
+         settings.rssiPeak, settings.enterRssiOffset, settings.leaveRssiOffset,
+         settings.filterRatio);
+  return 0;
+}